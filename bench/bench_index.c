@@ -0,0 +1,159 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "shrub.h"
+
+// Time turning parent ids into commit indices on synthetic histories:
+// the hash index against the old linear scan over hex hashes, plus the
+// --date-order sort and the streaming layout that resolves parents as
+// rows arrive.
+//
+// Usage: bench_index [commits...]   (default: 10000 100000 1000000)
+
+// Above this the linear scan would take minutes
+#define NAIVE_LIMIT 20000
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Deterministic, well spread fake object ids
+static void synthetic_oid(int n, unsigned char *oid) {
+    uint64_t x = (uint64_t)n + 1;
+    for (int i = 0; i < OID_RAWSZ; i += 8) {
+        x += 0x9e3779b97f4a7c15ULL;
+        uint64_t z = x;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        z ^= z >> 31;
+        memcpy(oid + i, &z, OID_RAWSZ - i < 8 ? OID_RAWSZ - i : 8);
+    }
+}
+
+// Newest first, like git log: a main line with a merge every 50 commits
+static void fill_store(CommitStore *store, int count) {
+    unsigned char parents[2 * OID_RAWSZ];
+    char subject[32];
+
+    for (int i = 0; i < count; i++) {
+        Commit commit;
+        memset(&commit, 0, sizeof(commit));
+        synthetic_oid(i, commit.oid);
+        snprintf(subject, sizeof(subject), "Commit %d", i);
+        commit.subject = subject;
+        commit.message = subject;
+        commit.author = i % 2 ? "Alice" : "Bob";
+        commit.refs = "";
+        commit.author_time = 1700000000 - i;
+        commit.commit_time = commit.author_time;
+
+        if (i + 1 < count) {
+            synthetic_oid(i + 1, parents);
+            commit.parent_count = 1;
+        }
+        if (i % 50 == 0 && i + 7 < count) {
+            synthetic_oid(i + 7, parents + OID_RAWSZ);
+            commit.parent_count = 2;
+            commit.is_merge = 1;
+        }
+        commit.parents = parents;
+        if (store_add(store, &commit) < 0) {
+            fprintf(stderr, "Error: Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// What the tree view used to do: strcmp each parent against every hash
+static double time_naive(const CommitStore *store) {
+    char (*hashes)[OID_HEXSZ + 1] = malloc(store->count * sizeof(*hashes));
+    for (int i = 0; i < store->count; i++) {
+        oid_to_hex(store_oid(store, i), hashes[i]);
+    }
+
+    double start = now_ms();
+    long resolved = 0;
+    for (int i = 0; i < store->count; i++) {
+        for (int j = 0; j < store_parent_count(store, i); j++) {
+            char parent[OID_HEXSZ + 1];
+            oid_to_hex(store_parent_oid(store, i, j), parent);
+            for (int k = 0; k < store->count; k++) {
+                if (strcmp(hashes[k], parent) == 0) {
+                    resolved++;
+                    break;
+                }
+            }
+        }
+    }
+    double elapsed = now_ms() - start;
+
+    free(hashes);
+    return resolved > 0 ? elapsed : -1;
+}
+
+int main(int argc, char *argv[]) {
+    int default_sizes[] = {10000, 100000, 1000000};
+    int size_count = argc > 1 ? argc - 1 : 3;
+
+    printf("commits    index       naive        sort      layout     per row\n");
+    for (int n = 0; n < size_count; n++) {
+        int count = argc > 1 ? atoi(argv[n + 1]) : default_sizes[n];
+
+        if (store_init(&commit_store) != 0) {
+            fprintf(stderr, "Error: Out of memory\n");
+            return EXIT_FAILURE;
+        }
+        fill_store(&commit_store, count);
+
+        double start = now_ms();
+        store_resolve_parents(&commit_store);
+        double index_ms = now_ms() - start;
+
+        double naive_ms = count <= NAIVE_LIMIT ? time_naive(&commit_store) : -1;
+
+        int *permutation = malloc(count * sizeof(int));
+        start = now_ms();
+        if (permutation == NULL ||
+            sort_commits(&commit_store, ORDER_DATE, permutation) != 0) {
+            fprintf(stderr, "Error: Out of memory\n");
+            return EXIT_FAILURE;
+        }
+        double sort_ms = now_ms() - start;
+        free(permutation);
+
+        // Reset the indices so layout resolves them again as rows stream in
+        for (int i = 0; i < count; i++) {
+            for (int j = 0; j < store_parent_count(&commit_store, i); j++) {
+                store_parent_index(&commit_store, i)[j] = -1;
+            }
+        }
+        layout_reset();
+        Row row;
+        start = now_ms();
+        for (int i = 0; i < count; i++) {
+            layout_commit(i, &row);
+            row_free(&row);
+        }
+        double layout_ms = now_ms() - start;
+
+        if (count > 1 && store_parent_index(&commit_store, 0)[0] != 1) {
+            fprintf(stderr, "Error: layout did not resolve parents\n");
+            return EXIT_FAILURE;
+        }
+
+        char naive[32];
+        if (naive_ms >= 0) {
+            snprintf(naive, sizeof(naive), "%8.1f ms", naive_ms);
+        } else {
+            snprintf(naive, sizeof(naive), "%11s", "-");
+        }
+        printf("%7d  %8.1f ms  %s  %8.1f ms  %8.1f ms  %6.0f ns\n", count,
+               index_ms, naive, sort_ms, layout_ms, layout_ms * 1e6 / count);
+        store_free(&commit_store);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "shrub.h"
+
+// Compare the `git log --graph` scraper with the native object reader on
+// the repository in the current directory. The lazy row walks the same
+// history from the commit-graph file, as the tree view does, leaving the
+// commit text unread; the cached row also uses .git/shrub-cache, which its
+// first iteration writes.
+//
+// Usage: bench_reader [iterations]
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+#define READER_LAZY -1
+#define READER_CACHED -2
+
+static int load_commits_lazy(const char *git_dir, int flags, CommitStore *store) {
+    CommitWalk *walk = walk_open(git_dir, flags);
+    if (walk == NULL) {
+        return -1;
+    }
+    RawCommit raw;
+    while (walk_next(walk, &raw)) {
+        int index = walk_fill_commit(walk, &raw, store);
+        free(raw.data);
+        if (index < 0) {
+            break;
+        }
+    }
+    walk_close(walk);
+    return store_resolve_parents(store);
+}
+
+static double time_reader(int mode, int iterations, int *count,
+                          size_t *memory) {
+    char *git_dir = strdup(execute_command("git rev-parse --git-dir"));
+    git_dir[strcspn(git_dir, "\n")] = '\0';
+
+    double best = -1;
+    for (int i = 0; i < iterations; i++) {
+        CommitStore store;
+        if (store_init(&store) != 0) {
+            fprintf(stderr, "Error: Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        double start = now_ms();
+        if (mode == READER_LOG) {
+            parse_git_log(&store);
+        } else if (mode == READER_LAZY || mode == READER_CACHED) {
+            int flags = WALK_LAZY_TEXT | (mode == READER_CACHED ? WALK_CACHE : 0);
+            if (load_commits_lazy(git_dir, flags, &store) != 0) {
+                fprintf(stderr, "Error: native reader failed\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if (load_commits_native(git_dir, &store) != 0) {
+            fprintf(stderr, "Error: native reader failed\n");
+            exit(EXIT_FAILURE);
+        }
+        double elapsed = now_ms() - start;
+        if (best < 0 || elapsed < best) {
+            best = elapsed;
+        }
+        *count = store.count;
+        *memory = store_memory(&store);
+        store_free(&store);
+    }
+    free(git_dir);
+    return best;
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 5;
+    int log_count, native_count, lazy_count, cached_count;
+    size_t log_memory, native_memory, lazy_memory, cached_memory;
+
+    double log_ms = time_reader(READER_LOG, iterations, &log_count, &log_memory);
+    double native_ms = time_reader(READER_NATIVE, iterations, &native_count,
+                                   &native_memory);
+    double lazy_ms = time_reader(READER_LAZY, iterations, &lazy_count,
+                                 &lazy_memory);
+    double cached_ms = time_reader(READER_CACHED, iterations, &cached_count,
+                                   &cached_memory);
+
+    printf("reader   commits   best of %d   store\n", iterations);
+    printf("log      %7d   %8.2f ms   %6.1f MB\n", log_count, log_ms,
+           log_memory / 1e6);
+    printf("native   %7d   %8.2f ms   %6.1f MB\n", native_count, native_ms,
+           native_memory / 1e6);
+    printf("lazy     %7d   %8.2f ms   %6.1f MB\n", lazy_count, lazy_ms,
+           lazy_memory / 1e6);
+    printf("cached   %7d   %8.2f ms   %6.1f MB\n", cached_count, cached_ms,
+           cached_memory / 1e6);
+    if (native_ms > 0) {
+        printf("speedup  %.1fx\n", log_ms / native_ms);
+    }
+    return log_count == native_count && native_count == lazy_count &&
+           lazy_count == cached_count ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,532 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "shrub.h"
+#include "filelog.h"
+#include "pool.h"
+#include "reach.h"
+#include "stats.h"
+#include "strbuf.h"
+
+// Time every stage of the tree view, -stats and -files on synthetic
+// repositories of each shape and size. The repositories are made by
+// gen_repo on first use and kept, so later runs time the same objects.
+//
+// Each run prints a table and appends one JSON object per measurement to
+// the results file:
+//
+//   {"run":"2024-05-01T10:00:00Z","revision":"1a2b3c4","shape":"merges",
+//    "commits":100000,"refs":2000,"phase":"layout","ms":41.20,"items":100000}
+//
+// and compares each time with the same measurement of the previous run
+// in that file.
+//
+// "lookup" finds every commit by id in the pack indexes without reading
+// it, and "abbrev" resolves a 12-digit abbreviation of each. "reach" counts
+// how far every ref is ahead of every other, as -branches does, and
+// "files-batch" follows BATCH_FILES files spread over the tree in one walk.
+//
+// Reading every commit's text (what --export and --author-date-order do)
+// and -stats are also timed on each number of threads given with -t, as
+// "decode-4t" and "stats-4t"; by default 1, 2, 4 ... up to one per core.
+//
+// Usage: bench_suite [-o results] [-d repos] [-r refs] [-i iterations]
+//                    [-s shape,...] [-t threads,...] [commits...]
+
+#define MAX_SHAPES 8
+#define MAX_THREAD_COUNTS 8
+#define MAX_PHASES (10 + 2 * MAX_THREAD_COUNTS)
+// Hex digits of the abbreviations resolved by the abbrev phase
+#define ABBREV_DIGITS 12
+// A file that gen_repo changes often, so -files has history to show
+#define BENCH_FILE "d00/e00/f0000.txt"
+#define BATCH_FILES 64
+
+typedef struct {
+    char name[16];
+    double ms;              // best of the iterations
+    long items;             // commits, rows or lines handled
+} Phase;
+
+typedef struct {
+    char *results;
+    char *repos;
+    char *gen_repo;
+    int refs;
+    int iterations;
+    char *shapes[MAX_SHAPES];
+    int shape_count;
+    int threads[MAX_THREAD_COUNTS];
+    int thread_count;
+    char run[32];
+    char revision[64];
+} Suite;
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void keep_best(Phase *phase, double ms, long items) {
+    if (phase->ms < 0 || ms < phase->ms) {
+        phase->ms = ms;
+    }
+    phase->items = items;
+}
+
+// Walk the history into the global store, as the tree view's reader does
+static void read_history(Phase *phase) {
+    store_free(&commit_store);
+    if (store_init(&commit_store) != 0) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    double start = now_ms();
+    CommitWalk *walk = walk_open(".git", WALK_LAZY_TEXT);
+    if (walk == NULL) {
+        fprintf(stderr, "Error: native reader failed\n");
+        exit(EXIT_FAILURE);
+    }
+    RawCommit raw;
+    while (walk_next(walk, &raw)) {
+        int index = walk_fill_commit(walk, &raw, &commit_store);
+        free(raw.data);
+        if (index < 0) {
+            break;
+        }
+    }
+    walk_close(walk);
+    store_resolve_parents(&commit_store);
+    keep_best(phase, now_ms() - start, commit_store.count);
+}
+
+// Walk the history with the text of every commit, read on `threads`
+// threads
+static void decode_history(Phase *phase, int threads) {
+    pool_default_threads = threads;
+    double start = now_ms();
+    CommitWalk *walk = walk_open(".git", 0);
+    if (walk == NULL) {
+        fprintf(stderr, "Error: native reader failed\n");
+        exit(EXIT_FAILURE);
+    }
+    RawCommit raw;
+    long count = 0;
+    while (walk_next(walk, &raw)) {
+        count += raw.data != NULL;
+        free(raw.data);
+    }
+    walk_close(walk);
+    keep_best(phase, now_ms() - start, count);
+    pool_default_threads = 0;
+}
+
+// Look up every commit of the store by full and by abbreviated id
+static void lookup_objects(Phase *lookup, Phase *abbrev) {
+    Odb *odb = odb_open(".git");
+    if (odb == NULL) {
+        fprintf(stderr, "Error: Cannot open the object database\n");
+        exit(EXIT_FAILURE);
+    }
+    long found = 0;
+    double start = now_ms();
+    for (int i = 0; i < commit_store.count; i++) {
+        found += odb_has_object(odb, store_oid(&commit_store, i));
+    }
+    keep_best(lookup, now_ms() - start, found);
+
+    found = 0;
+    start = now_ms();
+    for (int i = 0; i < commit_store.count; i++) {
+        char hex[OID_HEXSZ + 1];
+        unsigned char oid[OID_RAWSZ];
+        oid_to_hex(store_oid(&commit_store, i), hex);
+        found += odb_resolve_prefix(odb, hex, ABBREV_DIGITS, oid) == 0;
+    }
+    keep_best(abbrev, now_ms() - start, found);
+    odb_close(odb);
+}
+
+// Ahead/behind counts between every pair of ref tips
+static void reach_refs(Phase *phase) {
+    CommitWalk *walk = walk_open(".git", WALK_LAZY_TEXT);
+    if (walk == NULL) {
+        fprintf(stderr, "Error: native reader failed\n");
+        exit(EXIT_FAILURE);
+    }
+    int tip_count, count = 0;
+    const RefTip *tips = walk_ref_tips(walk, &tip_count);
+    int *indices = malloc((tip_count + 1) * sizeof(int));
+    int *counts = malloc(((size_t)tip_count * tip_count + 1) * sizeof(int));
+    if (indices == NULL || counts == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < tip_count; i++) {
+        int index = store_find(&commit_store, tips[i].oid);
+        if (index >= 0) {
+            indices[count++] = index;
+        }
+    }
+    walk_close(walk);
+
+    ReachStats stats;
+    double start = now_ms();
+    if (reach_counts(&commit_store, indices, count, counts, &stats) != 0) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    keep_best(phase, now_ms() - start, count);
+    free(indices);
+    free(counts);
+}
+
+static void sort_history(Phase *phase) {
+    int *permutation = malloc((commit_store.count + 1) * sizeof(int));
+    double start = now_ms();
+    if (permutation == NULL ||
+        sort_commits(&commit_store, ORDER_TOPO, permutation) != 0) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    keep_best(phase, now_ms() - start, commit_store.count);
+    free(permutation);
+}
+
+// Lay out every row, then render them all with the commit text read on
+// demand, the way the pager is fed
+static void layout_and_render(Phase *layout, Phase *render) {
+    int count = commit_store.count;
+    Row *rows = malloc((count + 1) * sizeof(Row));
+    if (rows == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    layout_reset();
+    double start = now_ms();
+    for (int i = 0; i < count; i++) {
+        layout_commit(i, &rows[i]);
+    }
+    keep_best(layout, now_ms() - start, count);
+
+    CommitText *text = commit_text_open(".git", READER_NATIVE);
+    StrBuf out;
+    sb_init(&out);
+    start = now_ms();
+    for (int i = 0; i < count; i++) {
+        render_row(&rows[i], text, &out);
+        sb_reset(&out);
+    }
+    keep_best(render, now_ms() - start, count);
+
+    sb_free(&out);
+    commit_text_close(text);
+    for (int i = 0; i < count; i++) {
+        row_free(&rows[i]);
+    }
+    free(rows);
+}
+
+static void collect_stats(Phase *phase, int threads) {
+    RepoStats stats;
+    double start = now_ms();
+    if (stats_collect(".git", threads, &stats) != 0) {
+        fprintf(stderr, "Error: stats failed\n");
+        exit(EXIT_FAILURE);
+    }
+    keep_best(phase, now_ms() - start, stats.total_commits);
+    stats_free(&stats);
+}
+
+static void file_history(Phase *phase) {
+    StrBuf out;
+    FileLogStats stats;
+    sb_init(&out);
+    double start = now_ms();
+    if (file_log(".git", BENCH_FILE, &out, &stats) != 0) {
+        fprintf(stderr, "Error: file history failed\n");
+        exit(EXIT_FAILURE);
+    }
+    keep_best(phase, now_ms() - start, stats.shown);
+    sb_free(&out);
+}
+
+static void file_histories(Phase *phase) {
+    // Every so many of the files HEAD has, for BATCH_FILES of them
+    char *listing = strdup(execute_command("git ls-files"));
+    const char *paths[BATCH_FILES];
+    int total = 0, count = 0;
+    for (const char *p = listing; p && *p; p++) {
+        total += *p == '\n';
+    }
+    int step = total > BATCH_FILES ? total / BATCH_FILES : 1;
+    int line = 0;
+    for (char *p = strtok(listing, "\n"); p && count < BATCH_FILES;
+         p = strtok(NULL, "\n")) {
+        if (line++ % step == 0) {
+            paths[count++] = p;
+        }
+    }
+
+    FILE *out = fopen("/dev/null", "w");
+    FileLogStats stats;
+    double start = now_ms();
+    if (out == NULL || file_log_batch(".git", paths, count, out, &stats) != 0) {
+        fprintf(stderr, "Error: file histories failed\n");
+        exit(EXIT_FAILURE);
+    }
+    keep_best(phase, now_ms() - start, stats.shown);
+    fclose(out);
+    free(listing);
+}
+
+// Value of a field in one of our own result lines
+static int json_field(const char *line, const char *name, char *value, size_t size) {
+    char key[64];
+    snprintf(key, sizeof(key), "\"%s\":", name);
+    const char *p = strstr(line, key);
+    if (p == NULL) {
+        return -1;
+    }
+    p += strlen(key);
+    if (*p == '"') {
+        p++;
+    }
+    size_t len = strcspn(p, "\",}");
+    if (len >= size) {
+        return -1;
+    }
+    memcpy(value, p, len);
+    value[len] = '\0';
+    return 0;
+}
+
+// Time of the same measurement in the latest earlier run, -1 if none
+static double previous_ms(const Suite *suite, const char *shape, int commits,
+                          const char *phase) {
+    FILE *fp = fopen(suite->results, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    double found = -1;
+    char line[1024], value[64];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (json_field(line, "run", value, sizeof(value)) != 0 ||
+            strcmp(value, suite->run) == 0 ||
+            json_field(line, "shape", value, sizeof(value)) != 0 ||
+            strcmp(value, shape) != 0 ||
+            json_field(line, "commits", value, sizeof(value)) != 0 ||
+            atoi(value) != commits ||
+            json_field(line, "refs", value, sizeof(value)) != 0 ||
+            atoi(value) != suite->refs ||
+            json_field(line, "phase", value, sizeof(value)) != 0 ||
+            strcmp(value, phase) != 0 ||
+            json_field(line, "ms", value, sizeof(value)) != 0) {
+            continue;
+        }
+        found = atof(value);
+    }
+    fclose(fp);
+    return found;
+}
+
+static void report(const Suite *suite, const char *shape, int commits,
+                   const Phase *phases, int phase_count) {
+    FILE *fp = fopen(suite->results, "a");
+    if (fp == NULL) {
+        fprintf(stderr, "Error: Cannot write %s: %s\n", suite->results,
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < phase_count; i++) {
+        const Phase *phase = &phases[i];
+        double before = previous_ms(suite, shape, commits, phase->name);
+        char change[32] = "";
+        if (before > 0) {
+            snprintf(change, sizeof(change), "%+7.1f%%",
+                     (phase->ms - before) * 100.0 / before);
+        }
+        printf("%-9s %8d  %-10s %10.1f ms %9ld  %s\n", shape, commits, phase->name,
+               phase->ms, phase->items, change);
+        fprintf(fp, "{\"run\":\"%s\",\"revision\":\"%s\",\"shape\":\"%s\","
+                "\"commits\":%d,\"refs\":%d,\"phase\":\"%s\",\"ms\":%.2f,"
+                "\"items\":%ld}\n", suite->run, suite->revision, shape, commits,
+                suite->refs, phase->name, phase->ms, phase->items);
+    }
+    fclose(fp);
+}
+
+static void bench_repo(const Suite *suite, const char *shape, int commits) {
+    char dir[MAX_COMMAND_LENGTH];
+    snprintf(dir, sizeof(dir), "%s/%s-%d-r%d", suite->repos, shape, commits,
+             suite->refs);
+    struct stat st;
+    if (stat(dir, &st) != 0) {
+        char command[MAX_COMMAND_LENGTH * 2];
+        snprintf(command, sizeof(command), "'%s' -r %d %s %d '%s'", suite->gen_repo,
+                 suite->refs, shape, commits, dir);
+        fprintf(stderr, "Generating %s\n", dir);
+        if (system(command) != 0) {
+            snprintf(command, sizeof(command), "rm -rf '%s'", dir);
+            system(command);
+            fprintf(stderr, "Error: Cannot generate %s\n", dir);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    char cwd[MAX_COMMAND_LENGTH];
+    if (getcwd(cwd, sizeof(cwd)) == NULL || chdir(dir) != 0) {
+        fprintf(stderr, "Error: Cannot enter %s\n", dir);
+        exit(EXIT_FAILURE);
+    }
+
+    Phase phases[MAX_PHASES] = {
+        { "read", -1, 0 }, { "sort", -1, 0 }, { "layout", -1, 0 },
+        { "render", -1, 0 }, { "stats", -1, 0 }, { "files", -1, 0 },
+        { "lookup", -1, 0 }, { "abbrev", -1, 0 }, { "reach", -1, 0 },
+        { "files-batch", -1, 0 },
+    };
+    int phase_count = 10;
+    for (int t = 0; t < suite->thread_count; t++) {
+        Phase *decode = &phases[phase_count++];
+        Phase *stats = &phases[phase_count++];
+        snprintf(decode->name, sizeof(decode->name), "decode-%dt", suite->threads[t]);
+        snprintf(stats->name, sizeof(stats->name), "stats-%dt", suite->threads[t]);
+        decode->ms = stats->ms = -1;
+    }
+    for (int i = 0; i < suite->iterations; i++) {
+        read_history(&phases[0]);
+        sort_history(&phases[1]);
+        layout_and_render(&phases[2], &phases[3]);
+        collect_stats(&phases[4], 0);
+        file_history(&phases[5]);
+        lookup_objects(&phases[6], &phases[7]);
+        reach_refs(&phases[8]);
+        file_histories(&phases[9]);
+        for (int t = 0; t < suite->thread_count; t++) {
+            decode_history(&phases[10 + 2 * t], suite->threads[t]);
+            collect_stats(&phases[11 + 2 * t], suite->threads[t]);
+        }
+    }
+    store_free(&commit_store);
+    report(suite, shape, commits, phases, phase_count);
+
+    if (chdir(cwd) != 0) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+// The suite changes directory into each repository
+static char *absolute_path(const char *path) {
+    char *resolved = realpath(path, NULL);
+    if (resolved || path[0] == '/') {
+        return resolved ? resolved : strdup(path);
+    }
+    char cwd[MAX_COMMAND_LENGTH];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        return strdup(path);
+    }
+    size_t size = strlen(cwd) + strlen(path) + 2;
+    char *joined = malloc(size);
+    snprintf(joined, size, "%s/%s", cwd, path);
+    return joined;
+}
+
+int main(int argc, char *argv[]) {
+    Suite suite;
+    memset(&suite, 0, sizeof(suite));
+    const char *results = "bench-results.ndjson";
+    const char *repos = "bench-repos";
+    char *shapes = NULL;
+    char *threads = NULL;
+    suite.iterations = 3;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "o:d:r:i:s:t:")) != -1) {
+        switch (opt) {
+        case 'o': results = optarg; break;
+        case 'd': repos = optarg; break;
+        case 'r': suite.refs = atoi(optarg); break;
+        case 'i': suite.iterations = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+        case 's': shapes = optarg; break;
+        case 't': threads = optarg; break;
+        default:
+            fprintf(stderr, "Usage: bench_suite [-o results] [-d repos] [-r refs]"
+                    " [-i iterations] [-s shape,...] [-t threads,...]"
+                    " [commits...]\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    mkdir(repos, 0755);
+    suite.repos = absolute_path(repos);
+    suite.results = absolute_path(results);
+
+    // gen_repo is built next to this program
+    char *self = absolute_path(argv[0]);
+    char *slash = strrchr(self, '/');
+    size_t size = strlen(self) + 16;
+    suite.gen_repo = malloc(size);
+    snprintf(suite.gen_repo, size, "%.*s/gen_repo",
+             slash ? (int)(slash - self) : 1, slash ? self : ".");
+    free(self);
+
+    char *shape_list = strdup(shapes ? shapes : "linear,branches,merges,octopus");
+    for (char *shape = strtok(shape_list, ","); shape && suite.shape_count < MAX_SHAPES;
+         shape = strtok(NULL, ",")) {
+        suite.shapes[suite.shape_count++] = shape;
+    }
+
+    if (threads && *threads) {
+        for (char *count = strtok(threads, ","); count && suite.thread_count < MAX_THREAD_COUNTS;
+             count = strtok(NULL, ",")) {
+            if (atoi(count) > 0) {
+                suite.threads[suite.thread_count++] = atoi(count);
+            }
+        }
+    } else {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (cpus < 1) {
+            cpus = 1;
+        }
+        for (int count = 1; suite.thread_count < MAX_THREAD_COUNTS; count *= 2) {
+            suite.threads[suite.thread_count++] = count < cpus ? count : (int)cpus;
+            if (count >= cpus) {
+                break;
+            }
+        }
+    }
+
+    time_t now = time(NULL);
+    strftime(suite.run, sizeof(suite.run), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    char *revision = execute_command("git describe --always --dirty 2>/dev/null");
+    revision[strcspn(revision, "\n")] = '\0';
+    snprintf(suite.revision, sizeof(suite.revision), "%s",
+             revision[0] ? revision : "unknown");
+
+    int default_sizes[] = {10000, 100000};
+    int size_count = optind < argc ? argc - optind : 2;
+    printf("shape      commits  phase        best of %d     items  vs last run\n",
+           suite.iterations);
+    for (int s = 0; s < suite.shape_count; s++) {
+        for (int n = 0; n < size_count; n++) {
+            int commits = optind < argc ? atoi(argv[optind + n]) : default_sizes[n];
+            if (commits > 0) {
+                bench_repo(&suite, suite.shapes[s], commits);
+            }
+        }
+    }
+    printf("Results appended to %s\n", suite.results);
+
+    free(shape_list);
+    free(suite.gen_repo);
+    free(suite.repos);
+    free(suite.results);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,225 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Build a synthetic repository of a chosen shape by feeding a stream to
+// `git fast-import`. The same arguments always give the same objects:
+// names, dates and file contents come from a seeded generator, and every
+// commit is one minute after the one before it.
+//
+// Shapes:
+//   linear     one line of history
+//   branches   32 long-lived branches, merged into main every 100 commits
+//   merges     every commit on main merges a topic of 1 to 4 commits
+//   octopus    main merges 3 to 7 short topics at once
+//
+// Every commit changes one or two of FILE_COUNT files spread over two
+// levels of directories. `-r N` adds N lightweight tags spread evenly
+// over the history. The repository ends up with one pack and a
+// commit-graph file with changed-path Bloom filters.
+//
+// Usage: gen_repo [-r refs] <shape> <commits> <directory>
+
+#define FILE_COUNT 4096
+#define LONG_BRANCHES 32
+#define BRANCH_MERGE_EVERY 100
+#define BASE_TIME 1600000000L
+
+static const char *authors[] = {
+    "Alice Example <alice@example.com>",
+    "Bob Example <bob@example.com>",
+    "Carol Example <carol@example.com>",
+    "Dave Example <dave@example.com>",
+    "Erin Example <erin@example.com>",
+    "Frank Example <frank@example.com>",
+};
+
+typedef struct {
+    FILE *out;
+    uint64_t seed;
+    int marks;              // commits written, also the last mark
+    int target;             // commits wanted
+    unsigned *file_revs;    // times each file was written
+} Generator;
+
+static uint64_t next_random(Generator *gen) {
+    uint64_t z = (gen->seed += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static int random_below(Generator *gen, int n) {
+    return (int)(next_random(gen) % (uint64_t)n);
+}
+
+// Path of a file: 16 top directories of 16 subdirectories each
+static void file_path(int file, char *path, size_t size) {
+    snprintf(path, size, "d%02d/e%02d/f%04d.txt", file % 16, (file / 16) % 16, file);
+}
+
+static void write_data(FILE *out, const char *data) {
+    fprintf(out, "data %zu\n%s\n", strlen(data), data);
+}
+
+// One commit on `ref` with parents `from` and `merges`, changing a file
+// or two; returns its mark
+static int write_commit(Generator *gen, const char *ref, int from,
+                        const int *merges, int merge_count, const char *subject) {
+    int mark = ++gen->marks;
+    const char *author = authors[random_below(gen, sizeof(authors) / sizeof(authors[0]))];
+    long when = BASE_TIME + mark * 60L;
+
+    fprintf(gen->out, "commit %s\nmark :%d\n", ref, mark);
+    fprintf(gen->out, "author %s %ld +0000\n", author, when);
+    fprintf(gen->out, "committer %s %ld +0000\n", author, when);
+    char message[128];
+    snprintf(message, sizeof(message), "%s %d", subject, mark);
+    write_data(gen->out, message);
+    if (from > 0) {
+        fprintf(gen->out, "from :%d\n", from);
+    }
+    for (int i = 0; i < merge_count; i++) {
+        fprintf(gen->out, "merge :%d\n", merges[i]);
+    }
+
+    // A few hot files change far more often than the rest, like a
+    // changelog or a build file
+    int changes = 1 + random_below(gen, 2);
+    for (int i = 0; i < changes; i++) {
+        int file = random_below(gen, 8) == 0 ? random_below(gen, 16)
+                                             : random_below(gen, FILE_COUNT);
+        char path[64], content[128];
+        file_path(file, path, sizeof(path));
+        snprintf(content, sizeof(content), "%s\nrevision %u\n", path,
+                 ++gen->file_revs[file]);
+        fprintf(gen->out, "M 100644 inline %s\n", path);
+        write_data(gen->out, content);
+    }
+    fputc('\n', gen->out);
+    return mark;
+}
+
+static int remaining(const Generator *gen) {
+    return gen->target - gen->marks;
+}
+
+static void gen_linear(Generator *gen) {
+    int tip = 0;
+    while (remaining(gen) > 0) {
+        tip = write_commit(gen, "refs/heads/main", tip, NULL, 0, "Change");
+    }
+}
+
+static void gen_branches(Generator *gen) {
+    int main_tip = write_commit(gen, "refs/heads/main", 0, NULL, 0, "Start");
+    int tips[LONG_BRANCHES];
+    for (int b = 0; b < LONG_BRANCHES; b++) {
+        tips[b] = main_tip;
+    }
+
+    char ref[64];
+    while (remaining(gen) > 0) {
+        if (gen->marks % BRANCH_MERGE_EVERY == 0) {
+            int b = random_below(gen, LONG_BRANCHES);
+            main_tip = write_commit(gen, "refs/heads/main", main_tip, &tips[b], 1,
+                                    "Merge branch");
+            continue;
+        }
+        int b = random_below(gen, LONG_BRANCHES);
+        snprintf(ref, sizeof(ref), "refs/heads/branch%02d", b);
+        tips[b] = write_commit(gen, ref, tips[b], NULL, 0, "Work");
+    }
+}
+
+// Topics forked from main, merged back `width` at a time
+static void gen_topics(Generator *gen, int min_width, int max_width,
+                       int max_length) {
+    int main_tip = write_commit(gen, "refs/heads/main", 0, NULL, 0, "Start");
+    int tips[8];
+    while (remaining(gen) > 0) {
+        int width = min_width + random_below(gen, max_width - min_width + 1);
+        int topics = 0;
+        for (int t = 0; t < width && remaining(gen) > 1; t++) {
+            int length = 1 + random_below(gen, max_length);
+            tips[topics] = main_tip;
+            for (int i = 0; i < length && remaining(gen) > 1; i++) {
+                tips[topics] = write_commit(gen, "refs/heads/topic", tips[topics],
+                                            NULL, 0, "Topic");
+            }
+            topics++;
+        }
+        main_tip = write_commit(gen, "refs/heads/main", main_tip, tips, topics,
+                                topics > 1 ? "Octopus merge"
+                                : topics ? "Merge topic" : "Change");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int refs = 0;
+    int arg = 1;
+    if (argc > 2 && strcmp(argv[1], "-r") == 0) {
+        refs = atoi(argv[2]);
+        arg = 3;
+    }
+    if (argc - arg != 3 || atoi(argv[arg + 1]) <= 0) {
+        fprintf(stderr, "Usage: gen_repo [-r refs] <linear|branches|merges|octopus>"
+                " <commits> <directory>\n");
+        return EXIT_FAILURE;
+    }
+    const char *shape = argv[arg];
+    const char *dir = argv[arg + 2];
+
+    Generator gen;
+    memset(&gen, 0, sizeof(gen));
+    gen.target = atoi(argv[arg + 1]);
+    gen.file_revs = calloc(FILE_COUNT, sizeof(unsigned));
+    if (gen.file_revs == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    for (const char *p = shape; *p; p++) {
+        gen.seed = gen.seed * 31 + (unsigned char)*p;
+    }
+
+    char command[4096];
+    snprintf(command, sizeof(command), "git init -q -b main '%s' && cd '%s'"
+             " && git fast-import --quiet", dir, dir);
+    gen.out = popen(command, "w");
+    if (gen.out == NULL) {
+        fprintf(stderr, "Failed to execute command: %s\n", command);
+        return EXIT_FAILURE;
+    }
+
+    if (strcmp(shape, "linear") == 0) {
+        gen_linear(&gen);
+    } else if (strcmp(shape, "branches") == 0) {
+        gen_branches(&gen);
+    } else if (strcmp(shape, "merges") == 0) {
+        gen_topics(&gen, 1, 1, 4);
+    } else if (strcmp(shape, "octopus") == 0) {
+        gen_topics(&gen, 3, 7, 2);
+    } else {
+        fprintf(stderr, "Error: Unknown shape '%s'\n", shape);
+        pclose(gen.out);
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < refs; i++) {
+        fprintf(gen.out, "reset refs/tags/v%d\nfrom :%d\n\n", i,
+                1 + (int)((long)i * gen.marks / refs));
+    }
+
+    free(gen.file_revs);
+    if (pclose(gen.out) != 0) {
+        fprintf(stderr, "Error: git fast-import failed in %s\n", dir);
+        return EXIT_FAILURE;
+    }
+    // Check out main for an index and a clean work tree, and write the
+    // commit-graph with changed-path filters as `git gc` would
+    snprintf(command, sizeof(command), "cd '%s' && git checkout -q -f main"
+             " && git commit-graph write --reachable --changed-paths 2>/dev/null",
+             dir);
+    return system(command) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,163 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "profile.h"
+
+struct CatFileBatch {
+    pid_t pid;
+    FILE *in;           // requests, one id per line
+    FILE *out;          // "<id> <type> <size>\n<contents>\n" per request
+    size_t bytes_read;
+    int broken;         // the child answered out of step or exited
+};
+
+CatFileBatch *batch_open() {
+    // Other children (the pager, git log) must not inherit our ends, or
+    // the child would never see end of input
+    int to_child[2], from_child[2];
+    if (pipe2(to_child, O_CLOEXEC) != 0) {
+        return NULL;
+    }
+    if (pipe2(from_child, O_CLOEXEC) != 0) {
+        close(to_child[0]);
+        close(to_child[1]);
+        return NULL;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(to_child[0]);
+        close(to_child[1]);
+        close(from_child[0]);
+        close(from_child[1]);
+        return NULL;
+    }
+    if (pid == 0) {
+        dup2(to_child[0], STDIN_FILENO);
+        dup2(from_child[1], STDOUT_FILENO);
+        close(to_child[0]);
+        close(to_child[1]);
+        close(from_child[0]);
+        close(from_child[1]);
+        execlp("git", "git", "cat-file", "--batch", (char *)NULL);
+        _exit(127);
+    }
+
+    close(to_child[0]);
+    close(from_child[1]);
+    CatFileBatch *batch = calloc(1, sizeof(CatFileBatch));
+    if (batch != NULL) {
+        batch->in = fdopen(to_child[1], "w");
+        batch->out = fdopen(from_child[0], "r");
+    }
+    if (batch == NULL || batch->in == NULL || batch->out == NULL) {
+        if (batch && batch->in) {
+            fclose(batch->in);
+        } else {
+            close(to_child[1]);
+        }
+        if (batch && batch->out) {
+            fclose(batch->out);
+        } else {
+            close(from_child[0]);
+        }
+        free(batch);
+        waitpid(pid, NULL, 0);
+        return NULL;
+    }
+    batch->pid = pid;
+    return batch;
+}
+
+void batch_close(CatFileBatch *batch) {
+    if (batch == NULL) {
+        return;
+    }
+    // End of input makes the child exit
+    fclose(batch->in);
+    fclose(batch->out);
+    waitpid(batch->pid, NULL, 0);
+    free(batch);
+}
+
+static ObjectType parse_type(const char *name) {
+    if (strcmp(name, "commit") == 0) {
+        return OBJ_COMMIT;
+    } else if (strcmp(name, "tree") == 0) {
+        return OBJ_TREE;
+    } else if (strcmp(name, "blob") == 0) {
+        return OBJ_BLOB;
+    } else if (strcmp(name, "tag") == 0) {
+        return OBJ_TAG;
+    }
+    return OBJ_BAD;
+}
+
+int batch_read(CatFileBatch *batch, const unsigned char *oid, ObjectType *type,
+               unsigned char **data, size_t *size) {
+    if (batch->broken) {
+        return -1;
+    }
+
+    char hex[OID_HEXSZ + 1];
+    oid_to_hex(oid, hex);
+    if (fprintf(batch->in, "%s\n", hex) < 0 || fflush(batch->in) != 0) {
+        batch->broken = 1;
+        return -1;
+    }
+
+    // "<id> missing" for unknown objects, which has no contents to skip.
+    // The id must be the one asked for and end there: a longer one means
+    // the repository does not use SHA-1 and the rest is not a header.
+    char header[OID_HEXSZ + 64];
+    if (fgets(header, sizeof(header), batch->out) == NULL ||
+        strncmp(header, hex, OID_HEXSZ) != 0 || header[OID_HEXSZ] != ' ') {
+        batch->broken = 1;
+        return -1;
+    }
+    batch->bytes_read += strlen(header);
+    profile_add_bytes(strlen(header));
+
+    char type_name[16];
+    unsigned long long length;
+    if (sscanf(header + OID_HEXSZ, " %15s %llu", type_name, &length) != 2) {
+        return -1;
+    }
+    // Only a known type is followed by a body of that length
+    ObjectType object_type = parse_type(type_name);
+    if (object_type == OBJ_BAD) {
+        batch->broken = 1;
+        return -1;
+    }
+
+    unsigned char *contents = malloc(length + 1);
+    if (contents == NULL) {
+        batch->broken = 1;
+        return -1;
+    }
+    if (fread(contents, 1, length, batch->out) != length ||
+        fgetc(batch->out) != '\n') {
+        free(contents);
+        batch->broken = 1;
+        return -1;
+    }
+    batch->bytes_read += length + 1;
+    profile_add_bytes(length + 1);
+    contents[length] = '\0';
+
+    *type = object_type;
+    *data = contents;
+    *size = length;
+    return 0;
+}
+
+size_t batch_bytes_read(const CatFileBatch *batch) {
+    return batch->bytes_read;
+}
@@ -0,0 +1,29 @@
+#ifndef SHRUB_BATCH_H
+#define SHRUB_BATCH_H
+
+#include <stddef.h>
+
+#include "odb.h"
+
+// A long-lived `git cat-file --batch` child. Objects are requested by id
+// one at a time over its stdin, so reading many of them costs one process
+// instead of one per object. Used where the native object reader cannot
+// be.
+
+typedef struct CatFileBatch CatFileBatch;
+
+// Start the child in the current repository. Returns NULL if it cannot be
+// started.
+CatFileBatch *batch_open();
+void batch_close(CatFileBatch *batch);
+
+// Read an object by binary id. On success returns 0 and stores a malloc'd,
+// NUL-terminated copy of the object contents in *data. Returns -1 if the
+// object is missing or the child has gone away.
+int batch_read(CatFileBatch *batch, const unsigned char *oid, ObjectType *type,
+               unsigned char **data, size_t *size);
+
+// Bytes received from the child, headers included
+size_t batch_bytes_read(const CatFileBatch *batch);
+
+#endif
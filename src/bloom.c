@@ -0,0 +1,418 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bloom.h"
+
+#define BLOOM_SEED_0 0x293ae76f
+#define BLOOM_SEED_1 0x7e646e2c
+
+#define BLOOM_SIGNATURE "SHBL"
+#define BLOOM_VERSION 1
+#define BLOOM_FILE_HEADER_SIZE 16
+#define BLOOM_FANOUT_SIZE (256 * 4)
+#define BLOOM_TRAILER_SIZE 8
+
+static uint32_t rotate_left(uint32_t value, int count) {
+    return (value << count) | (value >> (32 - count));
+}
+
+// Path bytes as murmur3 reads them: sign-extended in hash version 1
+static uint32_t path_byte(const char *data, size_t i, int hash_version) {
+    return hash_version == 1 ? (uint32_t)(int32_t)(signed char)data[i]
+                             : (uint32_t)(unsigned char)data[i];
+}
+
+static uint32_t murmur3(uint32_t seed, const char *data, size_t len,
+                        int hash_version) {
+    const uint32_t c1 = 0xcc9e2d51;
+    const uint32_t c2 = 0x1b873593;
+    uint32_t hash = seed;
+
+    size_t blocks = len / 4;
+    for (size_t i = 0; i < blocks; i++) {
+        uint32_t k = path_byte(data, 4 * i, hash_version) |
+                     path_byte(data, 4 * i + 1, hash_version) << 8 |
+                     path_byte(data, 4 * i + 2, hash_version) << 16 |
+                     path_byte(data, 4 * i + 3, hash_version) << 24;
+        k *= c1;
+        k = rotate_left(k, 15);
+        k *= c2;
+        hash ^= k;
+        hash = rotate_left(hash, 13) * 5 + 0xe6546b64;
+    }
+
+    size_t tail = blocks * 4;
+    uint32_t k = 0;
+    switch (len & 3) {
+    case 3:
+        k ^= path_byte(data, tail + 2, hash_version) << 16;
+        // fall through
+    case 2:
+        k ^= path_byte(data, tail + 1, hash_version) << 8;
+        // fall through
+    case 1:
+        k ^= path_byte(data, tail, hash_version);
+        k *= c1;
+        k = rotate_left(k, 15);
+        k *= c2;
+        hash ^= k;
+    }
+
+    hash ^= (uint32_t)len;
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+void bloom_key_init(BloomKey *key, const char *path, size_t len,
+                    int hash_version, int num_hashes) {
+    uint32_t hash0 = murmur3(BLOOM_SEED_0, path, len, hash_version);
+    uint32_t hash1 = murmur3(BLOOM_SEED_1, path, len, hash_version);
+    if (num_hashes > BLOOM_MAX_HASHES) {
+        num_hashes = BLOOM_MAX_HASHES;
+    }
+    for (int i = 0; i < num_hashes; i++) {
+        key->hashes[i] = hash0 + i * hash1;
+    }
+    key->num_hashes = num_hashes;
+    key->hash_version = hash_version;
+}
+
+int bloom_contains(const BloomFilter *filter, const BloomKey *key) {
+    uint64_t bits = (uint64_t)filter->len * 8;
+    if (bits == 0) {
+        return 1;
+    }
+    for (int i = 0; i < key->num_hashes; i++) {
+        uint64_t bit = key->hashes[i] % bits;
+        if (!(filter->data[bit / 8] & (1 << (bit % 8)))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+unsigned char *bloom_build(const BloomKey *keys, int count, size_t *len) {
+    if (count > BLOOM_MAX_CHANGED_PATHS) {
+        unsigned char *all = malloc(1);
+        if (all) {
+            all[0] = 0xff;
+            *len = 1;
+        }
+        return all;
+    }
+
+    // An empty filter still takes a byte: no bits means "nothing changed",
+    // while no bytes means "not computed"
+    size_t size = ((size_t)count * BLOOM_BITS_PER_ENTRY + 7) / 8;
+    if (size == 0) {
+        size = 1;
+    }
+    unsigned char *data = calloc(1, size);
+    if (data == NULL) {
+        return NULL;
+    }
+    uint64_t bits = (uint64_t)size * 8;
+    for (int k = 0; k < count; k++) {
+        for (int i = 0; i < keys[k].num_hashes; i++) {
+            uint64_t bit = keys[k].hashes[i] % bits;
+            data[bit / 8] |= 1 << (bit % 8);
+        }
+    }
+    *len = size;
+    return data;
+}
+
+struct BloomIndex {
+    unsigned char *map;
+    size_t size;
+    uint32_t count;
+    const unsigned char *fanout;
+    const unsigned char *oids;
+    const unsigned char *ends;      // end of each commit's filter
+    const unsigned char *data;
+    size_t data_size;
+};
+
+typedef struct {
+    unsigned char oid[OID_RAWSZ];
+    size_t start;
+    size_t len;
+} BloomRecord;
+
+struct BloomWriter {
+    BloomRecord *records;
+    uint32_t count;
+    uint32_t capacity;
+    unsigned char *data;
+    size_t data_size;
+    size_t data_capacity;
+};
+
+static uint32_t get_be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t get_be64(const unsigned char *p) {
+    return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+static void put_be32(unsigned char *p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static void put_be64(unsigned char *p, uint64_t value) {
+    put_be32(p, value >> 32);
+    put_be32(p + 4, (uint32_t)value);
+}
+
+// Same word-wise FNV-1a as the history cache
+static uint64_t checksum(const unsigned char *data, size_t size) {
+    uint64_t h = 1469598103934665603ULL;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        h = (h ^ word) * 1099511628211ULL;
+    }
+    for (; i < size; i++) {
+        h = (h ^ data[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static char *bloom_path(const char *git_dir, const char *suffix) {
+    size_t len = strlen(git_dir) + strlen(BLOOM_FILE) + strlen(suffix) + 2;
+    char *path = malloc(len);
+    if (path) {
+        snprintf(path, len, "%s/%s%s", git_dir, BLOOM_FILE, suffix);
+    }
+    return path;
+}
+
+BloomIndex *bloom_index_open(const char *git_dir) {
+    char *path = bloom_path(git_dir, "");
+    int fd = path ? open(path, O_RDONLY) : -1;
+    free(path);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    BloomIndex *index = calloc(1, sizeof(BloomIndex));
+    if (index == NULL || fstat(fd, &st) != 0 ||
+        st.st_size < BLOOM_FILE_HEADER_SIZE + BLOOM_FANOUT_SIZE + BLOOM_TRAILER_SIZE) {
+        close(fd);
+        free(index);
+        return NULL;
+    }
+    index->size = st.st_size;
+    index->map = mmap(NULL, index->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (index->map == MAP_FAILED) {
+        free(index);
+        return NULL;
+    }
+
+    const unsigned char *map = index->map;
+    index->count = get_be32(map + 8);
+    index->data_size = get_be32(map + 12);
+    index->fanout = map + BLOOM_FILE_HEADER_SIZE;
+    index->oids = index->fanout + BLOOM_FANOUT_SIZE;
+    index->ends = index->oids + (size_t)index->count * OID_RAWSZ;
+    index->data = index->ends + (size_t)index->count * 4;
+    size_t expected = BLOOM_FILE_HEADER_SIZE + BLOOM_FANOUT_SIZE +
+                      (size_t)index->count * (OID_RAWSZ + 4) +
+                      index->data_size + BLOOM_TRAILER_SIZE;
+    if (memcmp(map, BLOOM_SIGNATURE, 4) != 0 ||
+        get_be32(map + 4) != BLOOM_VERSION ||
+        expected != index->size ||
+        get_be32(index->fanout + 255 * 4) != index->count ||
+        get_be64(map + index->size - BLOOM_TRAILER_SIZE) !=
+            checksum(map, index->size - BLOOM_TRAILER_SIZE)) {
+        bloom_index_close(index);
+        return NULL;
+    }
+    return index;
+}
+
+void bloom_index_close(BloomIndex *index) {
+    if (index == NULL) {
+        return;
+    }
+    munmap(index->map, index->size);
+    free(index);
+}
+
+uint32_t bloom_index_count(const BloomIndex *index) {
+    return index->count;
+}
+
+void bloom_index_entry(const BloomIndex *index, uint32_t pos,
+                       const unsigned char **oid, BloomFilter *filter) {
+    uint32_t start = pos ? get_be32(index->ends + (size_t)(pos - 1) * 4) : 0;
+    uint32_t end = get_be32(index->ends + (size_t)pos * 4);
+    // Checked here rather than for every entry when the index is opened
+    if (start > end || end > index->data_size) {
+        start = end = 0;
+    }
+    *oid = index->oids + (size_t)pos * OID_RAWSZ;
+    filter->data = index->data + start;
+    filter->len = end - start;
+    filter->hash_version = BLOOM_HASH_VERSION;
+    filter->num_hashes = BLOOM_NUM_HASHES;
+}
+
+int bloom_index_find(const BloomIndex *index, const unsigned char *oid,
+                     BloomFilter *filter) {
+    uint32_t lo = oid[0] ? get_be32(index->fanout + (oid[0] - 1) * 4) : 0;
+    uint32_t hi = get_be32(index->fanout + oid[0] * 4);
+    if (hi > index->count) {
+        return -1;
+    }
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = memcmp(index->oids + (size_t)mid * OID_RAWSZ, oid, OID_RAWSZ);
+        if (cmp == 0) {
+            const unsigned char *found;
+            bloom_index_entry(index, mid, &found, filter);
+            return 0;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return -1;
+}
+
+BloomWriter *bloom_writer_new() {
+    return calloc(1, sizeof(BloomWriter));
+}
+
+int bloom_writer_add(BloomWriter *writer, const unsigned char *oid,
+                     const unsigned char *filter, size_t len) {
+    if (writer->count == writer->capacity) {
+        uint32_t capacity = writer->capacity ? writer->capacity * 2 : 1024;
+        BloomRecord *grown = realloc(writer->records, capacity * sizeof(BloomRecord));
+        if (grown == NULL) {
+            return -1;
+        }
+        writer->records = grown;
+        writer->capacity = capacity;
+    }
+    if (writer->data_size + len > writer->data_capacity) {
+        size_t capacity = writer->data_capacity ? writer->data_capacity : 65536;
+        while (capacity < writer->data_size + len) {
+            capacity *= 2;
+        }
+        unsigned char *grown = realloc(writer->data, capacity);
+        if (grown == NULL) {
+            return -1;
+        }
+        writer->data = grown;
+        writer->data_capacity = capacity;
+    }
+
+    BloomRecord *record = &writer->records[writer->count++];
+    memcpy(record->oid, oid, OID_RAWSZ);
+    record->start = writer->data_size;
+    record->len = len;
+    memcpy(writer->data + writer->data_size, filter, len);
+    writer->data_size += len;
+    return 0;
+}
+
+uint32_t bloom_writer_count(const BloomWriter *writer) {
+    return writer->count;
+}
+
+static int compare_records(const void *a, const void *b) {
+    return memcmp(((const BloomRecord *)a)->oid, ((const BloomRecord *)b)->oid,
+                  OID_RAWSZ);
+}
+
+int bloom_writer_commit(BloomWriter *writer, const char *git_dir) {
+    if (writer->data_size > UINT32_MAX) {
+        return -1;
+    }
+    qsort(writer->records, writer->count, sizeof(BloomRecord), compare_records);
+
+    size_t size = BLOOM_FILE_HEADER_SIZE + BLOOM_FANOUT_SIZE +
+                  (size_t)writer->count * (OID_RAWSZ + 4) +
+                  writer->data_size + BLOOM_TRAILER_SIZE;
+    unsigned char *buf = calloc(1, size);
+    if (buf == NULL) {
+        return -1;
+    }
+
+    memcpy(buf, BLOOM_SIGNATURE, 4);
+    put_be32(buf + 4, BLOOM_VERSION);
+    put_be32(buf + 8, writer->count);
+    put_be32(buf + 12, (uint32_t)writer->data_size);
+
+    unsigned char *fanout = buf + BLOOM_FILE_HEADER_SIZE;
+    unsigned char *oids = fanout + BLOOM_FANOUT_SIZE;
+    unsigned char *ends = oids + (size_t)writer->count * OID_RAWSZ;
+    unsigned char *data = ends + (size_t)writer->count * 4;
+    uint32_t counts[256] = {0};
+    size_t end = 0;
+    for (uint32_t i = 0; i < writer->count; i++) {
+        const BloomRecord *r = &writer->records[i];
+        counts[r->oid[0]]++;
+        memcpy(oids + (size_t)i * OID_RAWSZ, r->oid, OID_RAWSZ);
+        memcpy(data + end, writer->data + r->start, r->len);
+        end += r->len;
+        put_be32(ends + (size_t)i * 4, (uint32_t)end);
+    }
+    for (uint32_t i = 0, total = 0; i < 256; i++) {
+        total += counts[i];
+        put_be32(fanout + i * 4, total);
+    }
+    put_be64(buf + size - BLOOM_TRAILER_SIZE,
+             checksum(buf, size - BLOOM_TRAILER_SIZE));
+
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".tmp.%ld", (long)getpid());
+    char *tmp_path = bloom_path(git_dir, suffix);
+    char *path = bloom_path(git_dir, "");
+    FILE *fp = tmp_path && path ? fopen(tmp_path, "wb") : NULL;
+    int ok = fp != NULL && fwrite(buf, 1, size, fp) == size;
+    if (fp != NULL && fclose(fp) != 0) {
+        ok = 0;
+    }
+    if (ok) {
+        ok = rename(tmp_path, path) == 0;
+    }
+    if (!ok && fp != NULL) {
+        unlink(tmp_path);
+    }
+
+    free(buf);
+    free(tmp_path);
+    free(path);
+    return ok ? 0 : -1;
+}
+
+void bloom_writer_free(BloomWriter *writer) {
+    if (writer == NULL) {
+        return;
+    }
+    free(writer->records);
+    free(writer->data);
+    free(writer);
+}
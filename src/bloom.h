@@ -0,0 +1,82 @@
+#ifndef SHRUB_BLOOM_H
+#define SHRUB_BLOOM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "odb.h"
+
+// Changed-path Bloom filters, as `git commit-graph write --changed-paths`
+// stores them: one filter per commit holding every path that differs from
+// its first parent, and every directory above one. A path whose key is
+// missing from a commit's filter certainly did not change there, so the
+// commit needs no tree diff.
+//
+// Keys are two seeded murmur3 hashes of the path, combined into
+// `num_hashes` bit positions. Hash version 1 is git's original murmur3,
+// which reads path bytes as signed chars; version 2 reads them unsigned.
+// The two only differ for paths with bytes above 0x7f.
+
+#define BLOOM_MAX_HASHES 16
+#define BLOOM_HASH_VERSION 2
+#define BLOOM_NUM_HASHES 7
+#define BLOOM_BITS_PER_ENTRY 10
+#define BLOOM_MAX_CHANGED_PATHS 512
+
+typedef struct {
+    const unsigned char *data;
+    size_t len;             // bytes; 0 if the filter was never computed
+    int hash_version;
+    int num_hashes;
+} BloomFilter;
+
+typedef struct {
+    uint32_t hashes[BLOOM_MAX_HASHES];
+    int num_hashes;
+    int hash_version;
+} BloomKey;
+
+void bloom_key_init(BloomKey *key, const char *path, size_t len,
+                    int hash_version, int num_hashes);
+
+// 0 if the key is certainly not in the filter, 1 if it may be
+int bloom_contains(const BloomFilter *filter, const BloomKey *key);
+
+// Build a filter from the keys of every changed path; too many changes
+// give a filter that matches everything. Returns a malloc'd buffer and
+// its length in *len, or NULL when out of memory.
+unsigned char *bloom_build(const BloomKey *keys, int count, size_t *len);
+
+// Filters shrub computed itself for commits the commit-graph has none
+// for, kept in .git/shrub-bloom. Same hashing and sizes as git's, with
+// hash version 2.
+#define BLOOM_FILE "shrub-bloom"
+
+typedef struct BloomIndex BloomIndex;
+
+// Map the index of a repository; NULL if there is none or it is damaged
+BloomIndex *bloom_index_open(const char *git_dir);
+void bloom_index_close(BloomIndex *index);
+
+uint32_t bloom_index_count(const BloomIndex *index);
+
+// Filter of a commit; returns -1 if the index does not have it
+int bloom_index_find(const BloomIndex *index, const unsigned char *oid,
+                     BloomFilter *filter);
+
+// Entry at a position, for carrying the old index into a new one
+void bloom_index_entry(const BloomIndex *index, uint32_t pos,
+                       const unsigned char **oid, BloomFilter *filter);
+
+typedef struct BloomWriter BloomWriter;
+
+BloomWriter *bloom_writer_new();
+int bloom_writer_add(BloomWriter *writer, const unsigned char *oid,
+                     const unsigned char *filter, size_t len);
+uint32_t bloom_writer_count(const BloomWriter *writer);
+
+// Replace the repository's index through a temporary file
+int bloom_writer_commit(BloomWriter *writer, const char *git_dir);
+void bloom_writer_free(BloomWriter *writer);
+
+#endif
@@ -0,0 +1,376 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+
+#define CACHE_SIGNATURE "SHRB"
+#define CACHE_VERSION 3
+#define CACHE_HEADER_SIZE 32
+#define CACHE_FANOUT_SIZE (256 * 4)
+#define CACHE_RECORD_SIZE (OID_RAWSZ + 20)
+#define CACHE_TRAILER_SIZE 8
+
+struct HistoryCache {
+    unsigned char *map;
+    size_t size;
+    uint32_t count;
+    const unsigned char *fanout;
+    const unsigned char *records;   // id, date, generation, parent slice
+    const unsigned char *parents;
+    uint32_t parent_total;
+};
+
+typedef struct {
+    unsigned char oid[OID_RAWSZ];
+    int64_t commit_time;
+    uint32_t generation;
+    uint32_t parent_start;
+    uint32_t parent_count;
+} CacheRecord;
+
+struct CacheWriter {
+    CacheRecord *records;
+    uint32_t count;
+    uint32_t capacity;
+    unsigned char *parents;
+    uint32_t parent_total;
+    uint32_t parent_capacity;
+};
+
+static uint32_t get_be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t get_be64(const unsigned char *p) {
+    return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+static void put_be32(unsigned char *p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static void put_be64(unsigned char *p, uint64_t value) {
+    put_be32(p, value >> 32);
+    put_be32(p + 4, (uint32_t)value);
+}
+
+// FNV-1a over 64-bit words, so checking a large cache stays cheap next
+// to walking it
+static uint64_t checksum(const unsigned char *data, size_t size) {
+    uint64_t h = 1469598103934665603ULL;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        h = (h ^ word) * 1099511628211ULL;
+    }
+    for (; i < size; i++) {
+        h = (h ^ data[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static char *cache_path(const char *git_dir, const char *suffix) {
+    size_t len = strlen(git_dir) + strlen(CACHE_FILE) + strlen(suffix) + 2;
+    char *path = malloc(len);
+    if (path) {
+        snprintf(path, len, "%s/%s%s", git_dir, CACHE_FILE, suffix);
+    }
+    return path;
+}
+
+HistoryCache *cache_open(const char *git_dir) {
+    char *path = cache_path(git_dir, "");
+    int fd = path ? open(path, O_RDONLY) : -1;
+    free(path);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    HistoryCache *cache = calloc(1, sizeof(HistoryCache));
+    if (cache == NULL || fstat(fd, &st) != 0 ||
+        st.st_size < CACHE_HEADER_SIZE + CACHE_FANOUT_SIZE + CACHE_TRAILER_SIZE) {
+        close(fd);
+        free(cache);
+        return NULL;
+    }
+    cache->size = st.st_size;
+    cache->map = mmap(NULL, cache->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (cache->map == MAP_FAILED) {
+        free(cache);
+        return NULL;
+    }
+
+    // Anything unexpected means a rebuild, never a wrong graph
+    const unsigned char *map = cache->map;
+    cache->count = get_be32(map + 8);
+    cache->parent_total = get_be32(map + 12);
+    cache->fanout = map + CACHE_HEADER_SIZE;
+    cache->records = cache->fanout + CACHE_FANOUT_SIZE;
+    cache->parents = cache->records + (size_t)cache->count * CACHE_RECORD_SIZE;
+    size_t expected = CACHE_HEADER_SIZE + CACHE_FANOUT_SIZE +
+                      (size_t)cache->count * CACHE_RECORD_SIZE +
+                      (size_t)cache->parent_total * OID_RAWSZ + CACHE_TRAILER_SIZE;
+    if (memcmp(map, CACHE_SIGNATURE, 4) != 0 ||
+        get_be32(map + 4) != CACHE_VERSION ||
+        expected != cache->size ||
+        get_be32(cache->fanout + 255 * 4) != cache->count ||
+        get_be64(map + cache->size - CACHE_TRAILER_SIZE) !=
+            checksum(map, cache->size - CACHE_TRAILER_SIZE)) {
+        cache_close(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void cache_close(HistoryCache *cache) {
+    if (cache == NULL) {
+        return;
+    }
+    munmap(cache->map, cache->size);
+    free(cache);
+}
+
+uint32_t cache_count(const HistoryCache *cache) {
+    return cache->count;
+}
+
+int cache_find(const HistoryCache *cache, const unsigned char *oid,
+               uint32_t *pos) {
+    uint32_t lo = oid[0] ? get_be32(cache->fanout + (oid[0] - 1) * 4) : 0;
+    uint32_t hi = get_be32(cache->fanout + oid[0] * 4);
+    if (hi > cache->count) {
+        return -1;
+    }
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = memcmp(cache->records + (size_t)mid * CACHE_RECORD_SIZE, oid,
+                         OID_RAWSZ);
+        if (cmp == 0) {
+            *pos = mid;
+            return 0;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return -1;
+}
+
+static const unsigned char *record_at(const HistoryCache *cache, uint32_t pos) {
+    return cache->records + (size_t)pos * CACHE_RECORD_SIZE + OID_RAWSZ;
+}
+
+time_t cache_commit_time(const HistoryCache *cache, uint32_t pos) {
+    return (time_t)(int64_t)get_be64(record_at(cache, pos));
+}
+
+uint32_t cache_generation(const HistoryCache *cache, uint32_t pos) {
+    return get_be32(record_at(cache, pos) + 8);
+}
+
+int cache_parents(const HistoryCache *cache, uint32_t pos,
+                  const unsigned char **parents) {
+    const unsigned char *record = record_at(cache, pos);
+    uint32_t start = get_be32(record + 12);
+    uint32_t count = get_be32(record + 16);
+    *parents = cache->parents + (size_t)start * OID_RAWSZ;
+    // Checked here rather than for every record when the cache is opened
+    if ((uint64_t)start + count > cache->parent_total) {
+        return 0;
+    }
+    return (int)count;
+}
+
+CacheWriter *cache_writer_new() {
+    return calloc(1, sizeof(CacheWriter));
+}
+
+int cache_writer_add(CacheWriter *writer, const unsigned char *oid,
+                     time_t commit_time, uint32_t generation,
+                     const unsigned char *parents, int parent_count) {
+    if (writer->count == writer->capacity) {
+        uint32_t capacity = writer->capacity ? writer->capacity * 2 : 1024;
+        CacheRecord *grown = realloc(writer->records, capacity * sizeof(CacheRecord));
+        if (grown == NULL) {
+            return -1;
+        }
+        writer->records = grown;
+        writer->capacity = capacity;
+    }
+    while (writer->parent_total + parent_count > writer->parent_capacity) {
+        uint32_t capacity = writer->parent_capacity ? writer->parent_capacity * 2 : 1024;
+        unsigned char *grown = realloc(writer->parents, (size_t)capacity * OID_RAWSZ);
+        if (grown == NULL) {
+            return -1;
+        }
+        writer->parents = grown;
+        writer->parent_capacity = capacity;
+    }
+
+    CacheRecord *record = &writer->records[writer->count++];
+    memcpy(record->oid, oid, OID_RAWSZ);
+    record->commit_time = commit_time;
+    record->generation = generation;
+    record->parent_start = writer->parent_total;
+    record->parent_count = parent_count;
+    if (parent_count > 0) {
+        memcpy(writer->parents + (size_t)writer->parent_total * OID_RAWSZ, parents,
+               (size_t)parent_count * OID_RAWSZ);
+        writer->parent_total += parent_count;
+    }
+    return 0;
+}
+
+uint32_t cache_writer_count(const CacheWriter *writer) {
+    return writer->count;
+}
+
+static int compare_records(const void *a, const void *b) {
+    return memcmp(((const CacheRecord *)a)->oid, ((const CacheRecord *)b)->oid,
+                  OID_RAWSZ);
+}
+
+static int compare_record_oid(const void *key, const void *record) {
+    return memcmp(key, ((const CacheRecord *)record)->oid, OID_RAWSZ);
+}
+
+// Give the commits that came without a generation number their
+// topological level, one more than their highest parent's, so the next
+// walk has one for every commit even without a commit-graph. Records must
+// be sorted by id. A commit with a parent outside the cache keeps 0.
+static void fill_generations(CacheWriter *writer) {
+    uint32_t count = writer->count;
+    uint32_t *next = calloc(count ? count : 1, sizeof(uint32_t));    // parent cursor
+    uint32_t *highest = calloc(count ? count : 1, sizeof(uint32_t)); // parent level
+    unsigned char *lost = calloc(count ? count : 1, 1);  // a parent has none
+    uint32_t *stack = malloc((count ? count : 1) * sizeof(uint32_t));
+    if (next == NULL || highest == NULL || lost == NULL || stack == NULL) {
+        count = 0;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (writer->records[i].generation != 0 || lost[i]) {
+            continue;
+        }
+        // Depth-first; a commit is never on the stack twice, as history
+        // has no cycles
+        size_t depth = 0;
+        stack[depth++] = i;
+        while (depth > 0) {
+            uint32_t r = stack[depth - 1];
+            const CacheRecord *record = &writer->records[r];
+            if (next[r] < record->parent_count) {
+                const unsigned char *oid = writer->parents +
+                    (size_t)(record->parent_start + next[r]) * OID_RAWSZ;
+                const CacheRecord *parent = bsearch(oid, writer->records, count,
+                                                    sizeof(CacheRecord), compare_record_oid);
+                uint32_t p = parent ? (uint32_t)(parent - writer->records) : 0;
+                if (parent != NULL && parent->generation == 0 && !lost[p]) {
+                    stack[depth++] = p;
+                    continue;
+                }
+                next[r]++;
+                if (parent == NULL || parent->generation == 0) {
+                    lost[r] = 1;
+                } else if (parent->generation > highest[r]) {
+                    highest[r] = parent->generation;
+                }
+                continue;
+            }
+            depth--;
+            if (!lost[r]) {
+                writer->records[r].generation = highest[r] + 1;
+            }
+        }
+    }
+    free(next);
+    free(highest);
+    free(lost);
+    free(stack);
+}
+
+int cache_writer_commit(CacheWriter *writer, const char *git_dir) {
+    qsort(writer->records, writer->count, sizeof(CacheRecord), compare_records);
+    fill_generations(writer);
+
+    size_t size = CACHE_HEADER_SIZE + CACHE_FANOUT_SIZE +
+                  (size_t)writer->count * CACHE_RECORD_SIZE +
+                  (size_t)writer->parent_total * OID_RAWSZ + CACHE_TRAILER_SIZE;
+    unsigned char *buf = calloc(1, size);
+    if (buf == NULL) {
+        return -1;
+    }
+
+    memcpy(buf, CACHE_SIGNATURE, 4);
+    put_be32(buf + 4, CACHE_VERSION);
+    put_be32(buf + 8, writer->count);
+    put_be32(buf + 12, writer->parent_total);
+
+    unsigned char *fanout = buf + CACHE_HEADER_SIZE;
+    unsigned char *record = fanout + CACHE_FANOUT_SIZE;
+    uint32_t counts[256] = {0};
+    for (uint32_t i = 0; i < writer->count; i++) {
+        const CacheRecord *r = &writer->records[i];
+        counts[r->oid[0]]++;
+        memcpy(record, r->oid, OID_RAWSZ);
+        put_be64(record + OID_RAWSZ, (uint64_t)r->commit_time);
+        put_be32(record + OID_RAWSZ + 8, r->generation);
+        put_be32(record + OID_RAWSZ + 12, r->parent_start);
+        put_be32(record + OID_RAWSZ + 16, r->parent_count);
+        record += CACHE_RECORD_SIZE;
+    }
+    for (uint32_t i = 0, total = 0; i < 256; i++) {
+        total += counts[i];
+        put_be32(fanout + i * 4, total);
+    }
+    if (writer->parent_total > 0) {
+        memcpy(record, writer->parents, (size_t)writer->parent_total * OID_RAWSZ);
+    }
+    put_be64(buf + size - CACHE_TRAILER_SIZE,
+             checksum(buf, size - CACHE_TRAILER_SIZE));
+
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".tmp.%ld", (long)getpid());
+    char *tmp_path = cache_path(git_dir, suffix);
+    char *path = cache_path(git_dir, "");
+    FILE *fp = tmp_path && path ? fopen(tmp_path, "wb") : NULL;
+    int ok = fp != NULL && fwrite(buf, 1, size, fp) == size;
+    if (fp != NULL && fclose(fp) != 0) {
+        ok = 0;
+    }
+    if (ok) {
+        ok = rename(tmp_path, path) == 0;
+    }
+    if (!ok && fp != NULL) {
+        unlink(tmp_path);
+    }
+
+    free(buf);
+    free(tmp_path);
+    free(path);
+    return ok ? 0 : -1;
+}
+
+void cache_writer_free(CacheWriter *writer) {
+    if (writer == NULL) {
+        return;
+    }
+    free(writer->records);
+    free(writer->parents);
+    free(writer);
+}
@@ -0,0 +1,56 @@
+#ifndef SHRUB_CACHE_H
+#define SHRUB_CACHE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "odb.h"
+
+// Persistent history cache in .git/shrub-cache. It remembers the commit
+// date, generation and parents of every commit the last tree view walked,
+// so the next run only reads commits that became reachable since. Commits
+// are addressed by content, so an entry can never go stale; commits that
+// a rewrite (rebase, force-push) left unreachable are simply dropped the
+// next time the cache is written.
+//
+// The file is a fixed header, a 256-entry fanout, one record per commit
+// sorted by id, the parent ids, and a checksum, all read through mmap.
+
+#define CACHE_FILE "shrub-cache"
+#define CACHE_NONE UINT32_MAX
+
+typedef struct HistoryCache HistoryCache;
+
+// Map the cache of a repository. Returns NULL if there is none, or if it
+// was written by another version or fails its checksum.
+HistoryCache *cache_open(const char *git_dir);
+void cache_close(HistoryCache *cache);
+
+uint32_t cache_count(const HistoryCache *cache);
+
+// Position of a commit in the cache; returns 0 if found, -1 otherwise
+int cache_find(const HistoryCache *cache, const unsigned char *oid,
+               uint32_t *pos);
+
+time_t cache_commit_time(const HistoryCache *cache, uint32_t pos);
+uint32_t cache_generation(const HistoryCache *cache, uint32_t pos);
+
+// Point *parents at the commit's parent ids, back to back; returns the count
+int cache_parents(const HistoryCache *cache, uint32_t pos,
+                  const unsigned char **parents);
+
+// Collects the commits of a walk for the next cache file
+typedef struct CacheWriter CacheWriter;
+
+CacheWriter *cache_writer_new();
+int cache_writer_add(CacheWriter *writer, const unsigned char *oid,
+                     time_t commit_time, uint32_t generation,
+                     const unsigned char *parents, int parent_count);
+uint32_t cache_writer_count(const CacheWriter *writer);
+
+// Replace the repository's cache; written to a temporary file first so
+// concurrent readers see either the old or the new cache
+int cache_writer_commit(CacheWriter *writer, const char *git_dir);
+void cache_writer_free(CacheWriter *writer);
+
+#endif
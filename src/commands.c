@@ -0,0 +1,596 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diff.h"
+#include "filelog.h"
+#include "odb.h"
+#include "profile.h"
+#include "reach.h"
+#include "shrub.h"
+#include "stats.h"
+#include "strbuf.h"
+
+int handle_reset_latest() {
+    // Get the latest commit hash
+    char *latest_commit = execute_command("git rev-parse HEAD");
+    if (strlen(latest_commit) == 0 || strstr(latest_commit, "fatal:") != NULL) {
+        fprintf(stderr, "Error: Failed to get latest commit\n");
+        return EXIT_FAILURE;
+    }
+    
+    // Remove newline from commit hash
+    latest_commit[strcspn(latest_commit, "\n")] = 0;
+    
+    // Create the reset command - using --soft to preserve changes
+    char reset_cmd[MAX_COMMAND_LENGTH];
+    snprintf(reset_cmd, MAX_COMMAND_LENGTH, "git reset --soft HEAD~1");
+    
+    // Execute the reset
+    char *reset_result = execute_command(reset_cmd);
+    if (strstr(reset_result, "fatal:") != NULL) {
+        fprintf(stderr, "Error: Failed to reset to previous commit\n");
+        return EXIT_FAILURE;
+    }
+    
+    printf("Successfully unstaged commit: %s\n", latest_commit);
+    printf("Your changes have been preserved and are ready to be committed again.\n");
+    printf("You can now modify your changes and create a new commit using:\n");
+    printf("  git add .\n");
+    printf("  git commit -m \"Your new commit message\"\n");
+    return EXIT_SUCCESS;
+}
+
+void print_usage() {
+    printf("git-shrub version %s\n", VERSION);
+    printf("Usage: git shrub [options]\n\n");
+    printf("Options:\n");
+    printf("  -reset latest         Unstage the latest commit (preserves changes)\n");
+    printf("  -stats [--json]      Show repository statistics\n");
+    printf("  -diff [commit]       Show changes in a specific commit\n");
+    printf("  -files [filename]    Show commits that modified a specific file\n");
+    printf("  -files [--json] [--stdin] [path...]\n");
+    printf("                       Histories of many files from one walk, as NDJSON\n");
+    printf("  -branches [--json] [base]\n");
+    printf("                       Show how far each branch is ahead of and behind base\n");
+    printf("                       (default: HEAD) and which are merged\n");
+    printf("  -version             Show version information\n");
+    printf("  -daemon [stop]       Serve this repository's queries from memory, or stop\n");
+    printf("  (no options)         Display the commit tree\n");
+    printf("  [revision...]        Display the history of these commits only, e.g. main,\n");
+    printf("                       ^old or old..new (default: every branch and tag)\n");
+    printf("\nTree options:\n");
+    printf("  --reader=MODE        Commit source: auto, native or log (default: auto)\n");
+    printf("  --date-order         Show no parent before all its children, newest first\n");
+    printf("                       (the default)\n");
+    printf("  --author-date-order  Like --date-order, by author date\n");
+    printf("  --topo-order         Like --date-order, one line of history at a time\n");
+    printf("  -n N                 Show at most N commits\n");
+    printf("  --since=DATE         Show commits newer than DATE, e.g. \"2 weeks ago\"\n");
+    printf("  --until=DATE         Show commits older than DATE\n");
+    printf("  --first-parent       Follow only the first parent of merges\n");
+    printf("  --collapse           Show each run of commits without branches or merges as one row\n");
+    printf("  --ahead-behind[=REV] Label branches with the commits they are ahead of and\n");
+    printf("                       behind REV (default: HEAD)\n");
+    printf("  --no-cache           Do not read or update .git/shrub-cache\n");
+    printf("  --viewer             Browse in the built-in viewer instead of less\n");
+    printf("  --export=FORMAT      Write rows to stdout as records: ndjson or binary\n");
+    printf("  --timing             Report time to first row and total time on stderr\n");
+    printf("\nWith any command:\n");
+    printf("  --profile            Print time, memory, I/O and allocations per phase on stderr as JSON\n");
+    printf("  --threads=N          Threads reading objects (default: one per core)\n");
+    printf("  --no-daemon          Do not ask a running daemon, work in this process\n");
+}
+
+// Ask git for each section; used when the objects cannot be read natively
+static int print_stats_from_git() {
+    char *output;
+    char command[MAX_COMMAND_LENGTH];
+    
+    printf("\nRepository Statistics:\n");
+    printf("====================\n\n");
+    
+    // Total number of commits
+    output = execute_command("git rev-list --count HEAD");
+    printf("Total commits: %s", output);
+    
+    // Commits per author
+    printf("\nCommits per author:\n");
+    snprintf(command, MAX_COMMAND_LENGTH, 
+             "git shortlog -sn --all");
+    output = execute_command(command);
+    printf("%s", output);
+    
+    // Active days
+    printf("\nRepository activity:\n");
+    snprintf(command, MAX_COMMAND_LENGTH,
+             "git log --format=%%ad --date=short | sort -u | wc -l");
+    output = execute_command(command);
+    printf("Active days: %s", output);
+    
+    // File statistics
+    printf("\nFile statistics:\n");
+    snprintf(command, MAX_COMMAND_LENGTH,
+             "git ls-files | wc -l");
+    output = execute_command(command);
+    printf("Total files: %s", output);
+    
+    // Most modified files
+    printf("\nMost modified files:\n");
+    snprintf(command, MAX_COMMAND_LENGTH,
+             "git log --pretty=format: --name-only | grep -v '^$' | sort | uniq -c | sort -rg | head -10");
+    output = execute_command(command);
+    printf("%s", output);
+    
+    return EXIT_SUCCESS;
+}
+
+static void append_json_counts(StrBuf *out, const char *key,
+                               const char *label, const StatsCount *counts,
+                               int count) {
+    sb_appendf(out, "  \"%s\": [", key);
+    for (int i = 0; i < count; i++) {
+        sb_append(out, i ? ",\n    {" : "\n    {");
+        sb_appendf(out, "\"%s\": ", label);
+        sb_append_json(out, counts[i].name);
+        sb_appendf(out, ", \"commits\": %d}", counts[i].count);
+    }
+    sb_append(out, count ? "\n  ],\n" : "],\n");
+}
+
+int handle_stats(const char *git_dir, int json) {
+    RepoStats stats;
+    ProfileMark mark;
+    profile_begin(&mark);
+    int status = stats_collect(git_dir, 0, &stats);
+    profile_end(&mark, PROFILE_STATS);
+    if (status != 0) {
+        if (json) {
+            fprintf(stderr, "Error: Failed to read the object database\n");
+            return EXIT_FAILURE;
+        }
+        return print_stats_from_git();
+    }
+
+    StrBuf out;
+    sb_init(&out);
+    if (json) {
+        sb_appendf(&out, "{\n  \"total_commits\": %d,\n", stats.total_commits);
+        append_json_counts(&out, "authors", "name", stats.authors, stats.author_count);
+        sb_appendf(&out, "  \"active_days\": %d,\n", stats.active_days);
+        sb_appendf(&out, "  \"total_files\": %d,\n", stats.total_files);
+        append_json_counts(&out, "most_modified", "path", stats.paths, stats.path_count);
+        append_json_counts(&out, "most_modified_directories", "path",
+                           stats.dirs, stats.dir_count);
+        // Replace the trailing comma
+        out.len -= 2;
+        sb_append(&out, "\n}\n");
+    } else {
+        sb_append(&out, "\nRepository Statistics:\n====================\n\n");
+        sb_appendf(&out, "Total commits: %d\n", stats.total_commits);
+        sb_append(&out, "\nCommits per author:\n");
+        for (int i = 0; i < stats.author_count; i++) {
+            sb_appendf(&out, "%6d\t%s\n", stats.authors[i].count, stats.authors[i].name);
+        }
+        sb_append(&out, "\nRepository activity:\n");
+        sb_appendf(&out, "Active days: %d\n", stats.active_days);
+        sb_append(&out, "\nFile statistics:\n");
+        sb_appendf(&out, "Total files: %d\n", stats.total_files);
+        sb_append(&out, "\nMost modified files:\n");
+        for (int i = 0; i < stats.path_count; i++) {
+            sb_appendf(&out, "%7d %s\n", stats.paths[i].count, stats.paths[i].name);
+        }
+        sb_append(&out, "\nMost modified directories:\n");
+        for (int i = 0; i < stats.dir_count; i++) {
+            sb_appendf(&out, "%7d %s\n", stats.dirs[i].count, stats.dirs[i].name);
+        }
+    }
+    fwrite(out.data, 1, out.len, stdout);
+
+    sb_free(&out);
+    stats_free(&stats);
+    return EXIT_SUCCESS;
+}
+
+// Copy `git show`'s output to the pager as it comes, however long it is
+static void stream_git_show(const char *revision, FILE *out) {
+    StrBuf command;
+    sb_init(&command);
+    sb_append(&command, "git show --color=always ");
+    sb_append_shell(&command, revision);
+
+    ProfileMark mark;
+    profile_begin(&mark);
+    FILE *fp = popen(command.data, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to execute command: %s\n", command.data);
+        profile_end(&mark, PROFILE_COMMANDS);
+        sb_free(&command);
+        return;
+    }
+    char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        profile_add_bytes(n);
+        if (fwrite(chunk, 1, n, out) != n) {
+            break;      // the pager was quit
+        }
+    }
+    pclose(fp);
+    profile_end(&mark, PROFILE_COMMANDS);
+    sb_free(&command);
+}
+
+int handle_diff(const char *git_dir, const char* commit_hash) {
+    char hex[OID_HEXSZ + 1];
+    const char *revision = commit_hash;
+
+    // Full and abbreviated ids are looked up in the object database;
+    // other names (HEAD~2, a branch) are left to git
+    unsigned char oid[OID_RAWSZ];
+    Odb *odb = odb_open(git_dir);
+    int resolved = odb ? odb_resolve_prefix(odb, commit_hash, strlen(commit_hash), oid)
+                       : -1;
+    odb_close(odb);
+    if (resolved == -2) {
+        fprintf(stderr, "Error: Ambiguous commit hash\n");
+        return EXIT_FAILURE;
+    }
+    if (resolved != 0) {
+        // Verify commit hash exists
+        StrBuf command;
+        sb_init(&command);
+        sb_append(&command, "git rev-parse --verify --end-of-options ");
+        sb_append_shell(&command, commit_hash);
+        sb_append(&command, " 2>/dev/null");
+        char *output = execute_command(command.data);
+        sb_free(&command);
+        if (strlen(output) == 0 || strstr(output, "fatal:") != NULL) {
+            fprintf(stderr, "Error: Invalid commit hash\n");
+            return EXIT_FAILURE;
+        }
+        resolved = hex_to_oid(output, oid);
+    }
+    if (resolved == 0) {
+        oid_to_hex(oid, hex);
+        revision = hex;
+    }
+
+    // The patch goes to the pager a window of files at a time; merges,
+    // and repositories whose settings change what git shows, stream
+    // `git show` instead
+    signal(SIGPIPE, SIG_IGN);
+    FILE *pager = popen("less -R", "w");
+    FILE *out = pager ? pager : stdout;
+    ProfileMark mark;
+    profile_begin(&mark);
+    int status = resolved == 0 ? diff_show_commit(git_dir, oid, 1, out, NULL) : -1;
+    profile_end(&mark, PROFILE_DIFF);
+    if (status == 1 || status == -1) {
+        stream_git_show(revision, out);
+    }
+    if (pager) {
+        pclose(pager);
+    } else {
+        fflush(stdout);
+    }
+    return status == -2 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int print_files_from_git(const char *filename) {
+    // Show commits that modified the file
+    StrBuf command;
+    sb_init(&command);
+    sb_append(&command, "git log --follow --pretty=format:'%C(yellow)%h%Creset %s (%an, %ad)'"
+                        " --date=iso --end-of-options -- ");
+    sb_append_shell(&command, filename);
+    char *output = execute_command(command.data);
+    sb_free(&command);
+
+    if (strlen(output) == 0) {
+        fprintf(stderr, "Error: No commits found for file '%s'\n", filename);
+        return EXIT_FAILURE;
+    }
+    
+    printf("\nCommit history for file: %s\n", filename);
+    printf("===============================\n\n");
+    printf("%s\n", output);
+    
+    return EXIT_SUCCESS;
+}
+
+// Paths are given from the current directory, the trees list them from
+// the top of the work tree. Returns -1 for a path shrub cannot place.
+static int tree_path(const char *prefix, const char *filename, char *path,
+                     size_t size) {
+    const char *name = filename;
+    while (strncmp(name, "./", 2) == 0) {
+        name += 2;
+    }
+    snprintf(path, size, "%s%s", prefix, name);
+    size_t len = strlen(path);
+    while (len > 0 && path[len - 1] == '/') {
+        path[--len] = '\0';
+    }
+    if (len == 0 || strstr(path, "..") != NULL || path[0] == '/') {
+        return -1;
+    }
+    return 0;
+}
+
+static const char *show_prefix(const char *prefix) {
+    if (prefix == NULL) {
+        char *output = execute_command("git rev-parse --show-prefix 2>/dev/null");
+        output[strcspn(output, "\n")] = '\0';
+        prefix = output;
+    }
+    return prefix;
+}
+
+int handle_files(const char *git_dir, const char *prefix, const char *filename) {
+    char path[MAX_COMMAND_LENGTH];
+    if (tree_path(show_prefix(prefix), filename, path, sizeof(path)) != 0) {
+        return print_files_from_git(filename);
+    }
+
+    StrBuf out;
+    FileLogStats stats;
+    sb_init(&out);
+    ProfileMark mark;
+    profile_begin(&mark);
+    int status = file_log(git_dir, path, &out, &stats);
+    profile_end(&mark, PROFILE_FILES);
+    if (status != 0) {
+        sb_free(&out);
+        return print_files_from_git(filename);
+    }
+    if (out.len == 0) {
+        sb_free(&out);
+        fprintf(stderr, "Error: No commits found for file '%s'\n", filename);
+        return EXIT_FAILURE;
+    }
+
+    printf("\nCommit history for file: %s\n", filename);
+    printf("===============================\n\n");
+    fputs(out.data, stdout);
+    // The listing is git's; how the filters did goes with the profile
+    if (profile_enabled) {
+        int checked = stats.skipped + stats.false_positives;
+        fprintf(stderr, "Bloom filters: %d of %d commits skipped, %d false positives (%.1f%%)",
+                stats.skipped, stats.commits, stats.false_positives,
+                checked ? 100.0 * stats.false_positives / checked : 0.0);
+        if (stats.built > 0) {
+            fprintf(stderr, ", %d filters built", stats.built);
+        }
+        fprintf(stderr, "\n");
+    }
+    sb_free(&out);
+    return EXIT_SUCCESS;
+}
+
+static int add_batch_path(char ***paths, int *count, int *capacity,
+                          const char *prefix, const char *filename) {
+    char path[MAX_COMMAND_LENGTH];
+    if (tree_path(prefix, filename, path, sizeof(path)) != 0) {
+        fprintf(stderr, "Error: '%s' is outside the repository\n", filename);
+        return -1;
+    }
+    if (*count == *capacity) {
+        int grown_capacity = *capacity ? *capacity * 2 : 64;
+        char **grown = realloc(*paths, grown_capacity * sizeof(char *));
+        if (grown == NULL) {
+            return -1;
+        }
+        *paths = grown;
+        *capacity = grown_capacity;
+    }
+    if (((*paths)[*count] = strdup(path)) == NULL) {
+        return -1;
+    }
+    (*count)++;
+    return 0;
+}
+
+int handle_files_batch(const char *git_dir, const char *prefix, int argc,
+                       char *argv[]) {
+    prefix = show_prefix(prefix);
+    // execute_command reuses its buffer
+    char *prefix_copy = strdup(prefix);
+    char **paths = NULL;
+    int count = 0, capacity = 0, status = 0;
+    for (int i = 0; i < argc && status == 0 && prefix_copy; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            continue;
+        }
+        if (strcmp(argv[i], "--stdin") != 0) {
+            status = add_batch_path(&paths, &count, &capacity, prefix_copy, argv[i]);
+            continue;
+        }
+        // One path per line
+        char line[MAX_COMMAND_LENGTH];
+        while (status == 0 && fgets(line, sizeof(line), stdin) != NULL) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] != '\0') {
+                status = add_batch_path(&paths, &count, &capacity, prefix_copy, line);
+            }
+        }
+    }
+    if (prefix_copy == NULL) {
+        status = -1;
+    }
+
+    FileLogStats stats;
+    if (status == 0 && count == 0) {
+        fprintf(stderr, "Error: Please provide a filename\n");
+        status = -1;
+    }
+    else if (status == 0) {
+        ProfileMark mark;
+        profile_begin(&mark);
+        status = file_log_batch(git_dir, (const char *const *)paths, count, stdout,
+                                &stats);
+        profile_end(&mark, PROFILE_FILES);
+        if (status != 0) {
+            fprintf(stderr, "Error: Failed to read the object database\n");
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        free(paths[i]);
+    }
+    free(paths);
+    free(prefix_copy);
+    return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// One rev-list per branch; used when the objects cannot be read natively
+static int print_branches_from_git(const char *base) {
+    StrBuf command;
+    sb_init(&command);
+    sb_append(&command, "git for-each-ref --format='%(refname:short)' refs/heads |"
+                        " while read -r branch; do"
+                        " printf '%s\\t%s\\n' \"$branch\""
+                        " \"$(git rev-list --left-right --count ");
+    sb_append_shell(&command, base);
+    sb_append(&command, "...\"$branch\" --)\"; done");
+    char *output = execute_command(command.data);
+    sb_free(&command);
+
+    printf("\nBranches compared with %s (behind, ahead):\n", base);
+    printf("%s", output);
+    return EXIT_SUCCESS;
+}
+
+static int compare_tip_names(const void *a, const void *b) {
+    return strcmp(((const RefTip *)a)->name, ((const RefTip *)b)->name);
+}
+
+int handle_branches(const char *git_dir, const char *base, int json) {
+    CommitWalk *walk = walk_open(git_dir, WALK_LAZY_TEXT | WALK_CACHE);
+    if (walk == NULL) {
+        if (json) {
+            fprintf(stderr, "Error: Failed to read the object database\n");
+            return EXIT_FAILURE;
+        }
+        return print_branches_from_git(base);
+    }
+
+    // Local branches by name, then the base
+    int tip_count;
+    const RefTip *tips = walk_ref_tips(walk, &tip_count);
+    RefTip *branches = malloc((tip_count + 1) * sizeof(RefTip));
+    int branch_count = 0;
+    unsigned char base_oid[OID_RAWSZ];
+    if (branches == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        walk_close(walk);
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < tip_count; i++) {
+        if (strncmp(tips[i].name, "refs/heads/", 11) == 0) {
+            branches[branch_count++] = tips[i];
+        }
+    }
+    qsort(branches, branch_count, sizeof(RefTip), compare_tip_names);
+    if (walk_resolve(walk, base, base_oid) != 0) {
+        fprintf(stderr, "Error: Unknown revision '%s'\n", base);
+        free(branches);
+        walk_close(walk);
+        return EXIT_FAILURE;
+    }
+
+    // Only the parents and dates are needed; the cache and the graph have
+    // them for all but the newest commits
+    CommitStore store;
+    int status = store_init(&store);
+    RawCommit raw;
+    while (status == 0 && walk_next(walk, &raw)) {
+        status = walk_fill_commit(walk, &raw, &store) < 0 ? -1 : 0;
+        free(raw.data);
+    }
+    if (status == 0) {
+        status = store_resolve_parents(&store);
+    }
+
+    int count = branch_count + 1;
+    int *indices = malloc(count * sizeof(int));
+    int *counts = malloc((size_t)count * count * sizeof(int));
+    ReachStats stats;
+    ProfileMark mark;
+    profile_begin(&mark);
+    if (status == 0 && indices && counts) {
+        for (int i = 0; i < branch_count; i++) {
+            indices[i] = store_find(&store, branches[i].oid);
+        }
+        indices[branch_count] = store_find(&store, base_oid);
+        // The base may be a commit no ref reaches
+        status = indices[branch_count] < 0 ? -2
+                 : reach_counts(&store, indices, count, counts, &stats);
+    } else {
+        status = -1;
+    }
+    profile_end(&mark, PROFILE_BRANCHES);
+    if (status != 0) {
+        fprintf(stderr, status == -2 ? "Error: '%s' is not reachable from any ref\n"
+                                     : "Error: Out of memory\n", base);
+        free(indices);
+        free(counts);
+        free(branches);
+        store_free(&store);
+        walk_close(walk);
+        return EXIT_FAILURE;
+    }
+
+    StrBuf out;
+    sb_init(&out);
+    int *row = counts + (size_t)branch_count * count;  // the base against each
+    if (json) {
+        sb_append(&out, "{\n  \"base\": ");
+        sb_append_json(&out, base);
+        sb_append(&out, ",\n  \"branches\": [");
+        for (int i = 0; i < branch_count; i++) {
+            const int *ahead = counts + (size_t)i * count;
+            sb_append(&out, i ? ",\n    {\"name\": " : "\n    {\"name\": ");
+            sb_append_json(&out, branches[i].name + 11);
+            sb_appendf(&out, ", \"ahead\": %d, \"behind\": %d, \"merged\": %s, "
+                       "\"merged_into\": [", ahead[branch_count], row[i],
+                       ahead[branch_count] == 0 ? "true" : "false");
+            for (int j = 0, listed = 0; j < branch_count; j++) {
+                if (j != i && ahead[j] == 0) {
+                    sb_append(&out, listed++ ? ", " : "");
+                    sb_append_json(&out, branches[j].name + 11);
+                }
+            }
+            sb_append(&out, "]}");
+        }
+        sb_append(&out, branch_count ? "\n  ]\n}\n" : "]\n}\n");
+    } else {
+        int width = 0;
+        for (int i = 0; i < branch_count; i++) {
+            int len = (int)strlen(branches[i].name + 11);
+            width = len > width ? len : width;
+        }
+        sb_appendf(&out, "\nBranches compared with %s:\n", base);
+        sb_append(&out, "===============================\n\n");
+        for (int i = 0; i < branch_count; i++) {
+            int ahead = counts[(size_t)i * count + branch_count];
+            char plus[16], minus[16];
+            snprintf(plus, sizeof(plus), "+%d", ahead);
+            snprintf(minus, sizeof(minus), "-%d", row[i]);
+            sb_appendf(&out, "  %-*s %7s %8s%s\n", width, branches[i].name + 11,
+                       plus, minus, ahead == 0 ? "  merged" : "");
+        }
+        sb_appendf(&out, "\nReachability: %d of %d commits labelled, %d sets of branches\n",
+                   stats.visited, stats.commits, stats.labels);
+    }
+    fwrite(out.data, 1, out.len, stdout);
+
+    sb_free(&out);
+    free(indices);
+    free(counts);
+    free(branches);
+    store_free(&store);
+    walk_close(walk);
+    return EXIT_SUCCESS;
+}
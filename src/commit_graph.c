@@ -0,0 +1,402 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "commit_graph.h"
+
+#define GRAPH_SIGNATURE "CGPH"
+#define GRAPH_HEADER_SIZE 8
+#define GRAPH_CHUNK_ENTRY_SIZE 12
+#define GRAPH_DATA_WIDTH (OID_RAWSZ + 16)
+#define GRAPH_MAX_LAYERS 64
+
+#define CHUNK_OID_FANOUT 0x4f494446  // "OIDF"
+#define CHUNK_OID_LOOKUP 0x4f49444c  // "OIDL"
+#define CHUNK_DATA       0x43444154  // "CDAT"
+#define CHUNK_EXTRA_EDGES 0x45444745 // "EDGE"
+#define CHUNK_BLOOM_INDEX 0x42494458 // "BIDX"
+#define CHUNK_BLOOM_DATA  0x42444154 // "BDAT"
+#define BLOOM_HEADER_SIZE 12
+
+#define PARENT_NONE 0x70000000
+#define PARENT_EXTRA 0x80000000
+#define PARENT_LAST 0x80000000
+
+// One graph file. A split graph stacks several, newest on top; positions
+// count from the bottom layer up.
+typedef struct {
+    unsigned char *map;
+    size_t size;
+    uint32_t count;
+    uint32_t base;                  // commits in the layers below
+    const unsigned char *fanout;    // 256 cumulative counts
+    const unsigned char *oids;      // sorted commit ids
+    const unsigned char *data;      // tree, parents, generation and date
+    const unsigned char *edges;     // parents beyond the second
+    uint32_t edge_count;
+    const unsigned char *bloom_index;   // end of each commit's filter
+    const unsigned char *bloom_data;    // settings, then the filters
+    size_t bloom_size;                  // filter bytes after the settings
+} GraphLayer;
+
+struct CommitGraph {
+    GraphLayer layers[GRAPH_MAX_LAYERS];
+    int layer_count;
+    uint32_t count;
+};
+
+static uint32_t get_be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t get_be64(const unsigned char *p) {
+    return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+static unsigned char *map_file(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    unsigned char *map = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            map = NULL;
+        } else {
+            *size = st.st_size;
+        }
+    }
+    close(fd);
+    return map;
+}
+
+// Map one graph file and locate its chunks. `layer_index` is the number of
+// layers expected below it.
+static int load_layer(GraphLayer *layer, const char *path, int layer_index) {
+    memset(layer, 0, sizeof(*layer));
+    layer->map = map_file(path, &layer->size);
+    if (layer->map == NULL) {
+        return -1;
+    }
+
+    const unsigned char *map = layer->map;
+    size_t size = layer->size;
+    if (size < GRAPH_HEADER_SIZE + OID_RAWSZ ||
+        memcmp(map, GRAPH_SIGNATURE, 4) != 0 ||
+        map[4] != 1 ||                  // file version
+        map[5] != 1 ||                  // SHA-1
+        map[7] != layer_index) {        // base layers
+        return -1;
+    }
+
+    int chunk_count = map[6];
+    size_t table_end = GRAPH_HEADER_SIZE +
+                       (size_t)(chunk_count + 1) * GRAPH_CHUNK_ENTRY_SIZE;
+    if (table_end > size) {
+        return -1;
+    }
+
+    size_t data_size = 0, edge_size = 0, oid_size = 0, bloom_index_size = 0;
+    for (int i = 0; i < chunk_count; i++) {
+        const unsigned char *entry = map + GRAPH_HEADER_SIZE + i * GRAPH_CHUNK_ENTRY_SIZE;
+        uint32_t id = get_be32(entry);
+        uint64_t offset = get_be64(entry + 4);
+        uint64_t end = get_be64(entry + 4 + GRAPH_CHUNK_ENTRY_SIZE);
+        if (offset < table_end || end < offset || end > size - OID_RAWSZ) {
+            return -1;
+        }
+
+        switch (id) {
+        case CHUNK_OID_FANOUT:
+            if (end - offset != 256 * 4) {
+                return -1;
+            }
+            layer->fanout = map + offset;
+            break;
+        case CHUNK_OID_LOOKUP:
+            layer->oids = map + offset;
+            oid_size = end - offset;
+            break;
+        case CHUNK_DATA:
+            layer->data = map + offset;
+            data_size = end - offset;
+            break;
+        case CHUNK_EXTRA_EDGES:
+            layer->edges = map + offset;
+            edge_size = end - offset;
+            break;
+        case CHUNK_BLOOM_INDEX:
+            layer->bloom_index = map + offset;
+            bloom_index_size = end - offset;
+            break;
+        case CHUNK_BLOOM_DATA:
+            if (end - offset >= BLOOM_HEADER_SIZE) {
+                layer->bloom_data = map + offset;
+                layer->bloom_size = end - offset - BLOOM_HEADER_SIZE;
+            }
+            break;
+        }
+    }
+
+    if (layer->fanout == NULL || layer->oids == NULL || layer->data == NULL) {
+        return -1;
+    }
+    layer->count = get_be32(layer->fanout + 255 * 4);
+    layer->edge_count = edge_size / 4;
+    if (oid_size != (size_t)layer->count * OID_RAWSZ ||
+        data_size != (size_t)layer->count * GRAPH_DATA_WIDTH) {
+        return -1;
+    }
+
+    // Filters are optional; a layer with a damaged pair just goes without
+    if (layer->bloom_index == NULL || layer->bloom_data == NULL ||
+        bloom_index_size != (size_t)layer->count * 4 ||
+        (layer->count > 0 &&
+         get_be32(layer->bloom_index + (size_t)(layer->count - 1) * 4) > layer->bloom_size)) {
+        layer->bloom_index = NULL;
+        layer->bloom_data = NULL;
+    }
+    return 0;
+}
+
+static void unload_layer(GraphLayer *layer) {
+    if (layer->map) {
+        munmap(layer->map, layer->size);
+    }
+}
+
+static int add_layer(CommitGraph *graph, const char *path) {
+    if (graph->layer_count == GRAPH_MAX_LAYERS) {
+        return -1;
+    }
+
+    GraphLayer *layer = &graph->layers[graph->layer_count];
+    if (load_layer(layer, path, graph->layer_count) != 0) {
+        unload_layer(layer);
+        return -1;
+    }
+    layer->base = graph->count;
+    graph->count += layer->count;
+    graph->layer_count++;
+    return 0;
+}
+
+// Stack the layers listed in a split graph's chain file, bottom first
+static int load_chain(CommitGraph *graph, const char *objects_dir) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/info/commit-graphs/commit-graph-chain",
+             objects_dir);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    char line[128];
+    int ok = 1;
+    while (ok && fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0') {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/info/commit-graphs/graph-%s.graph",
+                 objects_dir, line);
+        ok = add_layer(graph, path) == 0;
+    }
+    fclose(fp);
+    return ok && graph->layer_count > 0 ? 0 : -1;
+}
+
+CommitGraph *commit_graph_open(const char *objects_dir) {
+    if (objects_dir == NULL) {
+        return NULL;
+    }
+
+    CommitGraph *graph = calloc(1, sizeof(CommitGraph));
+    if (graph == NULL) {
+        return NULL;
+    }
+
+    // Like git, a single graph file wins over a chain
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/info/commit-graph", objects_dir);
+    if (add_layer(graph, path) != 0 && load_chain(graph, objects_dir) != 0) {
+        commit_graph_close(graph);
+        return NULL;
+    }
+    return graph;
+}
+
+void commit_graph_close(CommitGraph *graph) {
+    if (graph == NULL) {
+        return;
+    }
+    for (int i = 0; i < graph->layer_count; i++) {
+        unload_layer(&graph->layers[i]);
+    }
+    free(graph);
+}
+
+uint32_t commit_graph_count(const CommitGraph *graph) {
+    return graph->count;
+}
+
+static const GraphLayer *layer_of(const CommitGraph *graph, uint32_t pos) {
+    for (int i = graph->layer_count - 1; i > 0; i--) {
+        if (pos >= graph->layers[i].base) {
+            return &graph->layers[i];
+        }
+    }
+    return &graph->layers[0];
+}
+
+// Binary search the slice of each layer selected by the first byte
+int commit_graph_find(const CommitGraph *graph, const unsigned char *oid,
+                      uint32_t *pos) {
+    for (int i = graph->layer_count - 1; i >= 0; i--) {
+        const GraphLayer *layer = &graph->layers[i];
+        uint32_t lo = oid[0] ? get_be32(layer->fanout + (oid[0] - 1) * 4) : 0;
+        uint32_t hi = get_be32(layer->fanout + oid[0] * 4);
+        if (hi > layer->count) {
+            continue;
+        }
+
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            int cmp = memcmp(layer->oids + (size_t)mid * OID_RAWSZ, oid, OID_RAWSZ);
+            if (cmp == 0) {
+                *pos = layer->base + mid;
+                return 0;
+            }
+            if (cmp < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+    }
+    return -1;
+}
+
+const unsigned char *commit_graph_oid(const CommitGraph *graph, uint32_t pos) {
+    const GraphLayer *layer = layer_of(graph, pos);
+    return layer->oids + (size_t)(pos - layer->base) * OID_RAWSZ;
+}
+
+static const unsigned char *commit_data(const CommitGraph *graph, uint32_t pos,
+                                        const GraphLayer **layer_out) {
+    const GraphLayer *layer = layer_of(graph, pos);
+    if (layer_out) {
+        *layer_out = layer;
+    }
+    return layer->data + (size_t)(pos - layer->base) * GRAPH_DATA_WIDTH;
+}
+
+// The last 8 bytes hold the generation in the top 30 bits and a 34-bit
+// commit date below it
+time_t commit_graph_commit_time(const CommitGraph *graph, uint32_t pos) {
+    const unsigned char *data = commit_data(graph, pos, NULL) + OID_RAWSZ + 8;
+    return (time_t)(((uint64_t)(get_be32(data) & 0x3) << 32) | get_be32(data + 4));
+}
+
+uint32_t commit_graph_generation(const CommitGraph *graph, uint32_t pos) {
+    const unsigned char *data = commit_data(graph, pos, NULL) + OID_RAWSZ + 8;
+    return get_be32(data) >> 2;
+}
+
+int commit_graph_parents(const CommitGraph *graph, uint32_t pos,
+                         uint32_t *parents, int max) {
+    const GraphLayer *layer;
+    const unsigned char *data = commit_data(graph, pos, &layer) + OID_RAWSZ;
+    uint32_t first = get_be32(data);
+    uint32_t second = get_be32(data + 4);
+    int count = 0;
+
+    if (first == PARENT_NONE) {
+        return 0;
+    }
+    if (first >= graph->count) {
+        return -1;
+    }
+    if (count < max) {
+        parents[count] = first;
+    }
+    count++;
+
+    if (second == PARENT_NONE) {
+        return count;
+    }
+    if (!(second & PARENT_EXTRA)) {
+        if (second >= graph->count) {
+            return -1;
+        }
+        if (count < max) {
+            parents[count] = second;
+        }
+        return count + 1;
+    }
+
+    // An octopus merge lists its other parents in the edge chunk
+    for (uint32_t edge = second & ~PARENT_EXTRA; ; edge++) {
+        if (layer->edges == NULL || edge >= layer->edge_count) {
+            return -1;
+        }
+        uint32_t value = get_be32(layer->edges + (size_t)edge * 4);
+        uint32_t parent = value & ~PARENT_LAST;
+        if (parent >= graph->count) {
+            return -1;
+        }
+        if (count < max) {
+            parents[count] = parent;
+        }
+        count++;
+        if (value & PARENT_LAST) {
+            return count;
+        }
+    }
+}
+
+const unsigned char *commit_graph_tree(const CommitGraph *graph, uint32_t pos) {
+    return commit_data(graph, pos, NULL);
+}
+
+int commit_graph_has_bloom(const CommitGraph *graph) {
+    for (int i = 0; i < graph->layer_count; i++) {
+        if (graph->layers[i].bloom_data) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int commit_graph_bloom(const CommitGraph *graph, uint32_t pos,
+                       BloomFilter *filter) {
+    const GraphLayer *layer = layer_of(graph, pos);
+    if (layer->bloom_data == NULL) {
+        return -1;
+    }
+    uint32_t index = pos - layer->base;
+    uint32_t start = index ? get_be32(layer->bloom_index + (size_t)(index - 1) * 4) : 0;
+    uint32_t end = get_be32(layer->bloom_index + (size_t)index * 4);
+    if (start > end || end > layer->bloom_size) {
+        return -1;
+    }
+
+    const unsigned char *settings = layer->bloom_data;
+    filter->hash_version = (int)get_be32(settings);
+    filter->num_hashes = (int)get_be32(settings + 4);
+    filter->data = settings + BLOOM_HEADER_SIZE + start;
+    filter->len = end - start;
+    if ((filter->hash_version != 1 && filter->hash_version != 2) ||
+        filter->num_hashes < 1 || filter->num_hashes > BLOOM_MAX_HASHES) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,53 @@
+#ifndef SHRUB_COMMIT_GRAPH_H
+#define SHRUB_COMMIT_GRAPH_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "bloom.h"
+#include "odb.h"
+
+// Reader for the commit-graph file `git commit-graph write` and
+// `git maintenance` leave in objects/info. It holds every commit's
+// parents, commit date and generation number in fixed-width tables, so
+// the shape of history can be walked without inflating a single object.
+
+typedef struct CommitGraph CommitGraph;
+
+// Open objects/info/commit-graph, or the split chain listed in
+// objects/info/commit-graphs/commit-graph-chain. Returns NULL if there is
+// no graph or it cannot be used.
+CommitGraph *commit_graph_open(const char *objects_dir);
+void commit_graph_close(CommitGraph *graph);
+
+// Commits across all layers of the graph
+uint32_t commit_graph_count(const CommitGraph *graph);
+
+// Position of a commit in the graph; returns 0 if found, -1 otherwise
+int commit_graph_find(const CommitGraph *graph, const unsigned char *oid,
+                      uint32_t *pos);
+
+const unsigned char *commit_graph_oid(const CommitGraph *graph, uint32_t pos);
+time_t commit_graph_commit_time(const CommitGraph *graph, uint32_t pos);
+
+// Topological level: 1 for a root commit, otherwise one more than the
+// highest parent. 0 if the graph was written without generation numbers.
+uint32_t commit_graph_generation(const CommitGraph *graph, uint32_t pos);
+
+// Store up to `max` parent positions in `parents`; returns the number of
+// parents (which may exceed `max`), or -1 if the graph is corrupt
+int commit_graph_parents(const CommitGraph *graph, uint32_t pos,
+                         uint32_t *parents, int max);
+
+// Root tree of a commit
+const unsigned char *commit_graph_tree(const CommitGraph *graph, uint32_t pos);
+
+// Whether any layer was written with --changed-paths
+int commit_graph_has_bloom(const CommitGraph *graph);
+
+// Changed-path Bloom filter of a commit against its first parent. Returns
+// -1 if the layer holding the commit has no filters.
+int commit_graph_bloom(const CommitGraph *graph, uint32_t pos,
+                       BloomFilter *filter);
+
+#endif
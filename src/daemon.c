@@ -0,0 +1,866 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "odb.h"
+#include "strbuf.h"
+
+#define DAEMON_SOCKET "shrub-daemon.sock"
+#define DAEMON_MAX_ANSWERS 32
+#define DAEMON_MAX_CLIENTS 64
+#define DAEMON_MAX_REQUEST (64 * 1024)
+// Commands worked out at the same time, each in a process of its own
+#define DAEMON_MAX_WORKERS 4
+// Seconds a client gets to send its request and take the answer
+#define DAEMON_CLIENT_TIMEOUT 5
+// Seconds a client waits for its answer before working it out itself
+#define DAEMON_ANSWER_TIMEOUT 60
+
+// What a change makes out of date
+#define STALE_HISTORY 0x01  // HEAD or a ref: every answer
+#define STALE_INDEX   0x02  // the index: -stats counts its files
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                    IN_CLOSE_WRITE)
+
+// A command line answered, and what it printed. Every change that makes
+// the answer out of date bumps `version`; what it printed holds for
+// requests made up to version `done`.
+typedef struct {
+    char *request;          // prefix and arguments, NUL-terminated each
+    size_t request_len;
+    FILE *out;              // stdout, in an unlinked temporary file; NULL
+    size_t out_size;        // until the first run has ended
+    StrBuf err;
+    int status;
+    unsigned long version;
+    unsigned long done;
+    unsigned long used;     // requests served when it was last asked for
+    int waiting;            // clients waiting for the next run
+    pid_t worker;           // running it, 0 if none is
+    unsigned long worker_version;
+    FILE *next_out;         // what the worker prints
+    FILE *next_err;
+} Answer;
+
+enum { CLIENT_READING, CLIENT_WAITING, CLIENT_SENDING };
+
+// A connection, from its request to the end of its answer
+typedef struct {
+    int fd;
+    int state;
+    StrBuf in;              // the request as it arrives
+    Answer own;             // the answer to a request that is not kept
+    Answer *answer;
+    unsigned long want;     // the answer's version when it was asked for
+    double deadline;        // to send the request or take the answer
+    // Being sent: the status line and stderr, then stdout from a copy of
+    // the answer's file, so the answer can be run again meanwhile
+    StrBuf head;
+    size_t head_sent;
+    int out;
+    size_t out_size;
+    off_t out_sent;
+} Client;
+
+typedef struct {
+    int wd;
+    char *path;
+} Watch;
+
+typedef struct {
+    char *git_dir;          // absolute
+    char *common_dir;
+    DaemonHandler handler;
+    Answer answers[DAEMON_MAX_ANSWERS];
+    int answer_count;
+    Client *clients[DAEMON_MAX_CLIENTS];
+    int client_count;
+    int workers;
+    unsigned long requests;
+    int listener;
+    int signals;            // signalfd for SIGCHLD, SIGINT and SIGTERM
+    sigset_t saved_mask;    // what the workers run with
+    int inotify;            // -1 if unavailable: every request is run again
+    Watch *watches;
+    int watch_count;
+    int stopping;
+} Daemon;
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static int socket_path(const char *git_dir, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    int len = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/%s",
+                       git_dir, DAEMON_SOCKET);
+    return len > 0 && (size_t)len < sizeof(addr->sun_path) ? 0 : -1;
+}
+
+int daemon_connect(const char *git_dir) {
+    struct sockaddr_un addr;
+    if (socket_path(git_dir, &addr) != 0) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Everything the other end sends until it shuts down its side
+static int read_all(int fd, StrBuf *in) {
+    char buf[65536];
+    for (;;) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        size_t before = in->len;
+        sb_append_len(in, buf, n);
+        if (in->len != before + n) {
+            return -1;
+        }
+    }
+}
+
+int daemon_query(int fd, const char *prefix, int argc, char **argv, int page) {
+    StrBuf request, answer;
+    sb_init(&request);
+    sb_init(&answer);
+    sb_append_len(&request, prefix, strlen(prefix) + 1);
+    for (int i = 0; i < argc; i++) {
+        sb_append_len(&request, argv[i], strlen(argv[i]) + 1);
+    }
+
+    // A daemon that does not answer in time is given up on, and the
+    // command is worked out by the caller instead
+    struct timeval send_timeout = { DAEMON_CLIENT_TIMEOUT, 0 };
+    struct timeval answer_timeout = { DAEMON_ANSWER_TIMEOUT, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &answer_timeout, sizeof(answer_timeout));
+
+    // The whole answer is taken before paging, so a pager left open does
+    // not hold the daemon up
+    int status = -1;
+    int exit_status;
+    size_t err_size, out_size;
+    int header = 0;
+    if (request.data && write_all(fd, request.data, request.len) == 0 &&
+        shutdown(fd, SHUT_WR) == 0 && read_all(fd, &answer) == 0 &&
+        answer.data && sscanf(answer.data, "%d %zu %zu%n", &exit_status,
+                              &err_size, &out_size, &header) == 3 &&
+        answer.data[header++] == '\n' && answer.len == header + err_size + out_size) {
+        status = exit_status;
+    }
+    close(fd);
+    if (status < 0) {
+        sb_free(&request);
+        sb_free(&answer);
+        return -1;
+    }
+
+    const char *err = answer.data + header;
+    const char *out = err + err_size;
+    fwrite(err, 1, err_size, stderr);
+    FILE *pager = page && status == 0 && out_size > 0 && isatty(STDOUT_FILENO)
+                  ? popen("less -R", "w") : NULL;
+    signal(SIGPIPE, SIG_IGN);
+    fwrite(out, 1, out_size, pager ? pager : stdout);
+    if (pager) {
+        pclose(pager);
+    } else {
+        fflush(stdout);
+    }
+    sb_free(&request);
+    sb_free(&answer);
+    return status;
+}
+
+// The arguments of a request, after its prefix
+static const char *request_args(const char *request) {
+    return request + strlen(request) + 1;
+}
+
+static int is_stats(const Answer *answer) {
+    return answer->request && strcmp(request_args(answer->request), "-stats") == 0;
+}
+
+// Relative dates mean something else a minute later; such requests are
+// run every time instead of kept
+static int is_cacheable(const char *request, size_t len) {
+    static const char *const dates[] = { "--since=", "--after=", "--until=", "--before=" };
+    for (const char *arg = request; arg < request + len; arg += strlen(arg) + 1) {
+        for (size_t i = 0; i < sizeof(dates) / sizeof(dates[0]); i++) {
+            if (strncmp(arg, dates[i], strlen(dates[i])) == 0) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static void free_answer(Answer *answer) {
+    free(answer->request);
+    if (answer->out) {
+        fclose(answer->out);
+    }
+    if (answer->next_out) {
+        fclose(answer->next_out);
+    }
+    if (answer->next_err) {
+        fclose(answer->next_err);
+    }
+    sb_free(&answer->err);
+    memset(answer, 0, sizeof(*answer));
+}
+
+// The kept answer to a request, or a new one in a free slot or in place of
+// the least recently used answer nobody is waiting for; NULL when there
+// is none such or out of memory
+static Answer *find_answer(Daemon *daemon, const char *request, size_t len) {
+    Answer *oldest = NULL;
+    for (int i = 0; i < daemon->answer_count; i++) {
+        Answer *answer = &daemon->answers[i];
+        if (answer->request_len == len && memcmp(answer->request, request, len) == 0) {
+            return answer;
+        }
+        if (answer->worker == 0 && answer->waiting == 0 &&
+            (oldest == NULL || answer->used < oldest->used)) {
+            oldest = answer;
+        }
+    }
+    Answer *answer = daemon->answer_count < DAEMON_MAX_ANSWERS
+        ? &daemon->answers[daemon->answer_count++] : oldest;
+    if (answer == NULL) {
+        return NULL;
+    }
+    free_answer(answer);
+    answer->request = malloc(len);
+    if (answer->request == NULL) {
+        return NULL;
+    }
+    memcpy(answer->request, request, len);
+    answer->request_len = len;
+    return answer;
+}
+
+// Close a connection, the last client taking its slot
+static void drop_client(Daemon *daemon, int slot) {
+    Client *client = daemon->clients[slot];
+    if (client->state == CLIENT_WAITING) {
+        client->answer->waiting--;
+    }
+    if (client->own.worker) {
+        // Nobody wants what it prints; it is reaped with the others
+        kill(client->own.worker, SIGKILL);
+    }
+    close(client->fd);
+    if (client->out >= 0) {
+        close(client->out);
+    }
+    sb_free(&client->in);
+    sb_free(&client->head);
+    free_answer(&client->own);
+    free(client);
+    daemon->clients[slot] = daemon->clients[--daemon->client_count];
+}
+
+// Run a request through the handler in a worker process, with stdout
+// going to a fresh file and stderr collected, while the daemon goes on
+// serving other clients
+static int start_worker(Daemon *daemon, Answer *answer) {
+    FILE *out = tmpfile();
+    FILE *err = tmpfile();
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = out && err ? fork() : -1;
+    if (pid < 0) {
+        if (out) {
+            fclose(out);
+        }
+        if (err) {
+            fclose(err);
+        }
+        return -1;
+    }
+    if (pid == 0) {
+        // A connection left open here would keep its client waiting
+        for (int i = 0; i < daemon->client_count; i++) {
+            close(daemon->clients[i]->fd);
+        }
+        close(daemon->listener);
+        close(daemon->signals);
+        sigprocmask(SIG_SETMASK, &daemon->saved_mask, NULL);
+
+        char **argv = malloc((answer->request_len + 2) * sizeof(char *));
+        if (argv == NULL) {
+            _exit(EXIT_FAILURE);
+        }
+        int argc = 0;
+        argv[argc++] = "git-shrub";
+        const char *prefix = answer->request;
+        for (char *arg = answer->request + strlen(prefix) + 1;
+             arg < answer->request + answer->request_len; arg += strlen(arg) + 1) {
+            argv[argc++] = arg;
+        }
+        argv[argc] = NULL;
+        dup2(fileno(out), STDOUT_FILENO);
+        dup2(fileno(err), STDERR_FILENO);
+        int status = daemon->handler(prefix, argc, argv);
+        fflush(stdout);
+        fflush(stderr);
+        _exit(status);
+    }
+    answer->worker = pid;
+    answer->worker_version = answer->version;
+    answer->next_out = out;
+    answer->next_err = err;
+    daemon->workers++;
+    return 0;
+}
+
+// Start sending the answer as it is now
+static void begin_send(Client *client) {
+    Answer *answer = client->answer;
+    if (client->state == CLIENT_WAITING) {
+        answer->waiting--;
+    }
+    sb_appendf(&client->head, "%d %zu %zu\n", answer->status, answer->err.len,
+               answer->out_size);
+    sb_append_len(&client->head, answer->err.data ? answer->err.data : "",
+                  answer->err.len);
+    client->out = answer->out_size > 0 ? dup(fileno(answer->out)) : -1;
+    client->out_size = client->out >= 0 ? answer->out_size : 0;
+    client->state = CLIENT_SENDING;
+    client->deadline = now_ms() + DAEMON_CLIENT_TIMEOUT * 1000;
+}
+
+// Send as much as the socket takes: 1 once everything is sent, -1 on an
+// error
+static int send_some(Client *client) {
+    if (client->head.data == NULL) {
+        return -1;
+    }
+    while (client->head_sent < client->head.len) {
+        ssize_t n = send(client->fd, client->head.data + client->head_sent,
+                         client->head.len - client->head_sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+        client->head_sent += n;
+    }
+    while ((size_t)client->out_sent < client->out_size) {
+        ssize_t n = sendfile(client->fd, client->out, &client->out_sent,
+                             client->out_size - client->out_sent);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+// A worker has ended: what it printed becomes the answer, and goes to the
+// clients that asked before the answer went out of date again
+static void finish_worker(Daemon *daemon, pid_t pid, int status) {
+    daemon->workers--;
+    Answer *answer = NULL;
+    for (int i = 0; i < daemon->answer_count && answer == NULL; i++) {
+        answer = daemon->answers[i].worker == pid ? &daemon->answers[i] : NULL;
+    }
+    for (int i = 0; i < daemon->client_count && answer == NULL; i++) {
+        answer = daemon->clients[i]->own.worker == pid ? &daemon->clients[i]->own : NULL;
+    }
+    if (answer == NULL) {
+        return;
+    }
+    answer->worker = 0;
+    FILE *out = answer->next_out, *err = answer->next_err;
+    answer->next_out = answer->next_err = NULL;
+    struct stat st;
+    if (!WIFEXITED(status) || fstat(fileno(out), &st) != 0) {
+        // The clients waiting for it work it out themselves
+        fclose(out);
+        fclose(err);
+        for (int i = daemon->client_count - 1; i >= 0; i--) {
+            if (daemon->clients[i]->answer == answer &&
+                daemon->clients[i]->state == CLIENT_WAITING) {
+                drop_client(daemon, i);
+            }
+        }
+        return;
+    }
+
+    if (answer->out) {
+        fclose(answer->out);
+    }
+    answer->out = out;
+    answer->out_size = st.st_size;
+    answer->status = WEXITSTATUS(status);
+    answer->done = answer->worker_version;
+    sb_reset(&answer->err);
+    char buf[4096];
+    size_t n;
+    rewind(err);
+    while ((n = fread(buf, 1, sizeof(buf), err)) > 0) {
+        sb_append_len(&answer->err, buf, n);
+    }
+    fclose(err);
+    for (int i = 0; i < daemon->client_count; i++) {
+        Client *client = daemon->clients[i];
+        if (client->answer == answer && client->state == CLIENT_WAITING &&
+            client->want <= answer->done) {
+            begin_send(client);
+        }
+    }
+}
+
+// Run the answers that clients are waiting for, as many at a time as
+// there may be workers
+static void start_workers(Daemon *daemon) {
+    for (int i = 0; i < daemon->client_count && daemon->workers < DAEMON_MAX_WORKERS; i++) {
+        Client *client = daemon->clients[i];
+        if (client->state == CLIENT_WAITING && client->answer->worker == 0 &&
+            start_worker(daemon, client->answer) != 0) {
+            drop_client(daemon, i--);
+        }
+    }
+}
+
+// A whole request has arrived: answer it with what is kept if that still
+// holds, otherwise wait for a worker to run it
+static int take_request(Daemon *daemon, Client *client) {
+    const char *request = client->in.data;
+    size_t len = client->in.len;
+    if (len == 0 || request[len - 1] != '\0') {
+        return -1;
+    }
+    const char *args = request_args(request);
+    if ((size_t)(args - request) < len && strcmp(args, "-daemon") == 0) {
+        // -daemon stop; the answer is short enough to go out at once
+        daemon->stopping = 1;
+        write_all(client->fd, "0 0 0\n", 6);
+        return -1;
+    }
+    daemon->requests++;
+
+    Answer *answer = NULL;
+    if (daemon->inotify >= 0 && is_cacheable(request, len)) {
+        answer = find_answer(daemon, request, len);
+    }
+    if (answer == NULL) {
+        answer = &client->own;
+        answer->request = client->in.data;
+        answer->request_len = len;
+        sb_init(&client->in);
+    }
+    answer->used = daemon->requests;
+    client->answer = answer;
+    client->want = answer->version;
+    if (answer->out && answer->done >= client->want) {
+        begin_send(client);
+    } else {
+        answer->waiting++;
+        client->state = CLIENT_WAITING;
+    }
+    return 0;
+}
+
+// Read what the client has sent so far: -1 if it sent too much or went
+// away
+static int read_request(Daemon *daemon, Client *client) {
+    char buf[65536];
+    for (;;) {
+        ssize_t n = read(client->fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+        if (n == 0) {
+            return take_request(daemon, client);
+        }
+        size_t before = client->in.len;
+        if (before + n > DAEMON_MAX_REQUEST) {
+            return -1;
+        }
+        sb_append_len(&client->in, buf, n);
+        if (client->in.len != before + n) {
+            return -1;
+        }
+    }
+}
+
+static void accept_client(Daemon *daemon) {
+    int fd = accept4(daemon->listener, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd < 0) {
+        return;
+    }
+    Client *client = calloc(1, sizeof(Client));
+    if (client == NULL) {
+        close(fd);
+        return;
+    }
+    client->fd = fd;
+    client->out = -1;
+    client->state = CLIENT_READING;
+    client->deadline = now_ms() + DAEMON_CLIENT_TIMEOUT * 1000;
+    sb_init(&client->in);
+    sb_init(&client->head);
+    daemon->clients[daemon->client_count++] = client;
+}
+
+// Put out of date what a change touches; it is run again when next asked
+// for
+static void mark_stale(Daemon *daemon, int what) {
+    for (int i = 0; i < daemon->answer_count; i++) {
+        Answer *answer = &daemon->answers[i];
+        if ((what & STALE_HISTORY) || ((what & STALE_INDEX) && is_stats(answer))) {
+            answer->version++;
+        }
+    }
+}
+
+// Watch a directory and every directory below it
+static void watch_tree(Daemon *daemon, const char *path) {
+    int wd = inotify_add_watch(daemon->inotify, path, WATCH_MASK | IN_ONLYDIR);
+    if (wd < 0) {
+        return;
+    }
+    Watch *grown = realloc(daemon->watches, (daemon->watch_count + 1) * sizeof(Watch));
+    if (grown == NULL) {
+        return;
+    }
+    daemon->watches = grown;
+    daemon->watches[daemon->watch_count].wd = wd;
+    daemon->watches[daemon->watch_count++].path = strdup(path);
+
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char child[4096];
+        struct stat st;
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        if (stat(child, &st) == 0 && S_ISDIR(st.st_mode)) {
+            watch_tree(daemon, child);
+        }
+    }
+    if (dir) {
+        closedir(dir);
+    }
+}
+
+static const Watch *find_watch(const Daemon *daemon, int wd) {
+    for (int i = 0; i < daemon->watch_count; i++) {
+        if (daemon->watches[i].wd == wd) {
+            return &daemon->watches[i];
+        }
+    }
+    return NULL;
+}
+
+static int is_lock_file(const char *name) {
+    size_t len = strlen(name);
+    return len > 5 && strcmp(name + len - 5, ".lock") == 0;
+}
+
+// Sort the events into what they make out of date. Git writes a ref or
+// HEAD to a .lock file and renames it into place, so the lock files
+// themselves are ignored.
+static void read_events(Daemon *daemon) {
+    char buf[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len = read(daemon->inotify, buf, sizeof(buf));
+    for (char *p = buf; len > 0 && p < buf + len;) {
+        const struct inotify_event *event = (const struct inotify_event *)p;
+        p += sizeof(struct inotify_event) + event->len;
+        const Watch *watch = find_watch(daemon, event->wd);
+        const char *name = event->len ? event->name : "";
+        if (event->mask & IN_Q_OVERFLOW) {
+            mark_stale(daemon, STALE_HISTORY | STALE_INDEX);
+        } else if (watch == NULL || is_lock_file(name)) {
+            continue;
+        } else if (strcmp(watch->path, daemon->git_dir) == 0 ||
+                   strcmp(watch->path, daemon->common_dir) == 0) {
+            if (strcmp(name, "HEAD") == 0 || strcmp(name, "packed-refs") == 0) {
+                mark_stale(daemon, STALE_HISTORY);
+            } else if (strcmp(name, "index") == 0) {
+                mark_stale(daemon, STALE_INDEX);
+            }
+        } else {
+            // Under refs/: a new directory (refs/heads/topic/) gets watched too
+            if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+                char child[4096];
+                snprintf(child, sizeof(child), "%s/%s", watch->path, name);
+                watch_tree(daemon, child);
+            }
+            mark_stale(daemon, STALE_HISTORY);
+        }
+    }
+}
+
+static void watch_repository(Daemon *daemon) {
+    daemon->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (daemon->inotify < 0) {
+        fprintf(stderr, "Warning: inotify unavailable, every request is run again\n");
+        return;
+    }
+    char refs[4096];
+    snprintf(refs, sizeof(refs), "%s/refs", daemon->common_dir);
+    Watch *watches = calloc(2, sizeof(Watch));
+    if (watches == NULL) {
+        return;
+    }
+    daemon->watches = watches;
+    daemon->watches[daemon->watch_count].wd =
+        inotify_add_watch(daemon->inotify, daemon->git_dir, WATCH_MASK);
+    daemon->watches[daemon->watch_count++].path = strdup(daemon->git_dir);
+    if (strcmp(daemon->common_dir, daemon->git_dir) != 0) {
+        daemon->watches[daemon->watch_count].wd =
+            inotify_add_watch(daemon->inotify, daemon->common_dir, WATCH_MASK);
+        daemon->watches[daemon->watch_count++].path = strdup(daemon->common_dir);
+    }
+    watch_tree(daemon, refs);
+}
+
+// Wait for something to happen and deal with it: changes to the
+// repository, ended workers, then the clients
+static void serve_once(Daemon *daemon) {
+    // Changes come first, so a request sent after a commit is not
+    // answered from before it
+    struct pollfd fds[3 + DAEMON_MAX_CLIENTS];
+    fds[0] = (struct pollfd){ daemon->inotify, POLLIN, 0 };
+    fds[1] = (struct pollfd){ daemon->signals, POLLIN, 0 };
+    fds[2] = (struct pollfd){ daemon->client_count < DAEMON_MAX_CLIENTS ? daemon->listener : -1,
+                              POLLIN, 0 };
+    int count = daemon->client_count;
+    double deadline = -1;
+    for (int i = 0; i < count; i++) {
+        Client *client = daemon->clients[i];
+        short events = client->state == CLIENT_READING ? POLLIN
+                     : client->state == CLIENT_SENDING ? POLLOUT : 0;
+        fds[3 + i] = (struct pollfd){ events ? client->fd : -1, events, 0 };
+        if (events && (deadline < 0 || client->deadline < deadline)) {
+            deadline = client->deadline;
+        }
+    }
+    double now = now_ms();
+    int timeout = deadline < 0 ? -1 : deadline > now ? (int)(deadline - now) + 1 : 0;
+    if (poll(fds, 3 + count, timeout) < 0) {
+        if (errno != EINTR) {
+            daemon->stopping = 1;
+        }
+        return;
+    }
+
+    if (fds[0].revents & POLLIN) {
+        read_events(daemon);
+    }
+    if (fds[1].revents & POLLIN) {
+        struct signalfd_siginfo info;
+        while (read(daemon->signals, &info, sizeof(info)) == sizeof(info)) {
+            daemon->stopping |= info.ssi_signo != SIGCHLD;
+        }
+        pid_t pid;
+        int status;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            finish_worker(daemon, pid, status);
+        }
+    }
+
+    // Ended workers may have dropped clients and moved others into their
+    // slots; those are dealt with on the next round
+    now = now_ms();
+    for (int i = count - 1; i >= 0; i--) {
+        if (i >= daemon->client_count) {
+            continue;
+        }
+        Client *client = daemon->clients[i];
+        int result = 0;
+        if (client->state == CLIENT_READING && fds[3 + i].fd == client->fd &&
+            fds[3 + i].revents) {
+            result = read_request(daemon, client);
+        }
+        if (result == 0 && client->state == CLIENT_SENDING) {
+            result = send_some(client);
+        }
+        if (result == 0 && client->state != CLIENT_WAITING && now > client->deadline) {
+            result = -1;
+        }
+        if (result != 0) {
+            drop_client(daemon, i);
+        }
+    }
+    if (fds[2].revents & POLLIN) {
+        accept_client(daemon);
+    }
+    start_workers(daemon);
+}
+
+int daemon_serve(const char *git_dir, const char *top, DaemonHandler handler) {
+    Daemon daemon;
+    memset(&daemon, 0, sizeof(daemon));
+    daemon.handler = handler;
+    daemon.inotify = -1;
+    daemon.git_dir = realpath(git_dir, NULL);
+    daemon.common_dir = daemon.git_dir ? git_common_dir(daemon.git_dir) : NULL;
+    char *common_dir = daemon.common_dir ? realpath(daemon.common_dir, NULL) : NULL;
+    free(daemon.common_dir);
+    daemon.common_dir = common_dir;
+
+    struct sockaddr_un addr;
+    if (daemon.common_dir == NULL || socket_path(daemon.git_dir, &addr) != 0) {
+        fprintf(stderr, "Error: Cannot place the daemon socket in %s\n", git_dir);
+        free(daemon.git_dir);
+        free(daemon.common_dir);
+        return EXIT_FAILURE;
+    }
+    if (top && chdir(top) != 0) {
+        fprintf(stderr, "Error: Cannot enter %s\n", top);
+        free(daemon.git_dir);
+        free(daemon.common_dir);
+        return EXIT_FAILURE;
+    }
+    int other = daemon_connect(daemon.git_dir);
+    if (other >= 0) {
+        close(other);
+        fprintf(stderr, "Error: A daemon is already serving this repository\n");
+        free(daemon.git_dir);
+        free(daemon.common_dir);
+        return EXIT_FAILURE;
+    }
+
+    // Ended workers and the signals that stop the daemon are read from a
+    // descriptor, so none slips in between two polls
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, &daemon.saved_mask);
+    daemon.signals = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (daemon.signals < 0) {
+        fprintf(stderr, "Error: Cannot wait for signals: %s\n", strerror(errno));
+        sigprocmask(SIG_SETMASK, &daemon.saved_mask, NULL);
+        free(daemon.git_dir);
+        free(daemon.common_dir);
+        return EXIT_FAILURE;
+    }
+
+    // A socket left by a daemon that died is replaced
+    unlink(addr.sun_path);
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mode_t umask_saved = umask(077);
+    int bound = listener >= 0 &&
+                bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+                listen(listener, 16) == 0;
+    umask(umask_saved);
+    if (!bound) {
+        fprintf(stderr, "Error: Cannot listen on %s: %s\n", addr.sun_path,
+                strerror(errno));
+        if (listener >= 0) {
+            close(listener);
+        }
+        close(daemon.signals);
+        sigprocmask(SIG_SETMASK, &daemon.saved_mask, NULL);
+        free(daemon.git_dir);
+        free(daemon.common_dir);
+        return EXIT_FAILURE;
+    }
+    daemon.listener = listener;
+
+    watch_repository(&daemon);
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "git-shrub daemon serving %s\n", daemon.git_dir);
+
+    while (!daemon.stopping) {
+        serve_once(&daemon);
+    }
+
+    // Clients still waiting see the connection close and work out their
+    // command themselves
+    while (daemon.client_count > 0) {
+        drop_client(&daemon, daemon.client_count - 1);
+    }
+    for (int i = 0; i < daemon.answer_count; i++) {
+        if (daemon.answers[i].worker) {
+            kill(daemon.answers[i].worker, SIGKILL);
+        }
+    }
+    while (daemon.workers > 0 && waitpid(-1, NULL, 0) > 0) {
+        daemon.workers--;
+    }
+    close(daemon.signals);
+    sigprocmask(SIG_SETMASK, &daemon.saved_mask, NULL);
+
+    unlink(addr.sun_path);
+    close(listener);
+    if (daemon.inotify >= 0) {
+        close(daemon.inotify);
+    }
+    for (int i = 0; i < daemon.watch_count; i++) {
+        free(daemon.watches[i].path);
+    }
+    free(daemon.watches);
+    for (int i = 0; i < daemon.answer_count; i++) {
+        free_answer(&daemon.answers[i]);
+    }
+    free(daemon.git_dir);
+    free(daemon.common_dir);
+    return EXIT_SUCCESS;
+}
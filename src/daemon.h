@@ -0,0 +1,37 @@
+#ifndef SHRUB_DAEMON_H
+#define SHRUB_DAEMON_H
+
+#include <stdio.h>
+
+// A resident server for one repository, so scripts and editors that run
+// git shrub many times a minute do not pay for starting up and reading
+// the history on every call. It listens on <git dir>/shrub-daemon.sock
+// and answers a command line the way the CLI would, keeping what each
+// one printed. inotify on HEAD, packed-refs and refs/ tells it when the
+// history changed: what it kept is then run again when next asked for
+// (reading only the new commits, thanks to the history cache); a changed
+// index does the same for -stats. Commands run in worker processes, so
+// the daemon answers other clients meanwhile.
+//
+// A request is the client's directory below the top of the work tree
+// followed by its arguments, each NUL-terminated. The answer is a line
+// "<exit status> <stderr bytes> <stdout bytes>", then those bytes.
+
+// Run one command line with output on stdout and stderr, returning its
+// exit status. `prefix` is as in discover_git_dir().
+typedef int (*DaemonHandler)(const char *prefix, int argc, char **argv);
+
+// Serve the repository until `git shrub -daemon stop`. The daemon works
+// from `top` (NULL for a bare repository). Returns the exit status.
+int daemon_serve(const char *git_dir, const char *top, DaemonHandler handler);
+
+// Connect to the repository's daemon; -1 if none is running
+int daemon_connect(const char *git_dir);
+
+// Send a command line over a connection and copy the answer to stderr and
+// stdout, or to the pager if `page`, stdout is a terminal and the command
+// succeeded. Returns the
+// command's exit status, or -1 if the daemon did not answer.
+int daemon_query(int fd, const char *prefix, int argc, char **argv, int page);
+
+#endif
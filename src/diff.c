@@ -0,0 +1,2277 @@
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "shrub.h"
+#include "diff.h"
+#include "oidmap.h"
+#include "pool.h"
+#include "profile.h"
+#include "strbuf.h"
+#include "treediff.h"
+
+#define SPAN_HASHBASE 107927
+#define RENAME_LIMIT 1000           // git's diff.renameLimit
+#define RENAME_CANDIDATES 4         // best sources kept per destination
+#define BINARY_CHECK_BYTES 8000
+#define BIG_FILE_THRESHOLD ((size_t)512 << 20)
+#define CONTEXT_LINES 3
+#define FUNC_NAME_MAX 80
+#define FIRST_WINDOW_PER_THREAD 1
+#define WINDOW_PER_THREAD 8
+
+// Tuning of git's xdiff, kept as is so hunks fall where git puts them
+#define MAX_COST_MIN 256
+#define HEUR_MIN_COST 256
+#define SNAKE_COUNT 20
+#define K_HEUR 4
+#define MAX_EQUAL_LIMIT 1024
+#define SIMSCAN_WINDOW 100
+#define KPDIS_RUN 4
+#define MAX_INDENT 200
+#define MAX_BLANKS 20
+#define INDENT_HEURISTIC_MAX_SLIDING 100
+
+#define START_OF_FILE_PENALTY 1
+#define END_OF_FILE_PENALTY 21
+#define TOTAL_BLANK_WEIGHT (-30)
+#define POST_BLANK_WEIGHT 6
+#define RELATIVE_INDENT_PENALTY (-4)
+#define RELATIVE_INDENT_WITH_BLANK_PENALTY 10
+#define RELATIVE_OUTDENT_PENALTY 24
+#define RELATIVE_OUTDENT_WITH_BLANK_PENALTY 17
+#define RELATIVE_DEDENT_PENALTY 23
+#define RELATIVE_DEDENT_WITH_BLANK_PENALTY 17
+#define INDENT_WEIGHT 60
+
+#define MODE_TYPE_MASK 0170000
+#define MODE_REGULAR 0100000
+
+// git's default diff colors
+#define COLOR_RESET "\033[m"
+#define COLOR_COMMIT "\033[33m"
+#define COLOR_META "\033[1m"
+#define COLOR_FRAG "\033[36m"
+#define COLOR_OLD "\033[31m"
+#define COLOR_NEW "\033[32m"
+#define COLOR_WHITESPACE "\033[41m"
+
+// Chunks of a blob as git's rename detection counts them: up to 64 bytes
+// ending at a newline, hashed, with the bytes each hash covers
+typedef struct {
+    uint32_t hash;
+    uint32_t bytes;
+} Span;
+
+static int compare_spans(const void *a, const void *b) {
+    uint32_t x = ((const Span *)a)->hash, y = ((const Span *)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+static int is_binary(const unsigned char *data, size_t size) {
+    return memchr(data, '\0', size < BINARY_CHECK_BYTES ? size : BINARY_CHECK_BYTES) != NULL;
+}
+
+static Span *count_spans(const unsigned char *buf, size_t size, int *count_out) {
+    Span *spans = malloc((size + 1) * sizeof(Span));
+    if (spans == NULL) {
+        return NULL;
+    }
+    int is_text = !is_binary(buf, size);
+
+    int count = 0;
+    uint32_t accum1 = 0, accum2 = 0, n = 0;
+    for (size_t i = 0; i < size; i++) {
+        unsigned c = buf[i];
+        uint32_t old1 = accum1;
+        // CR of a CRLF in text does not count
+        if (is_text && c == '\r' && i + 1 < size && buf[i + 1] == '\n') {
+            continue;
+        }
+        accum1 = (accum1 << 7) ^ (accum2 >> 25);
+        accum2 = (accum2 << 7) ^ (old1 >> 25);
+        accum1 += c;
+        if (++n < 64 && c != '\n') {
+            continue;
+        }
+        spans[count].hash = (accum1 + accum2 * 0x61) % SPAN_HASHBASE;
+        spans[count++].bytes = n;
+        n = accum1 = accum2 = 0;
+    }
+    if (n > 0) {
+        spans[count].hash = (accum1 + accum2 * 0x61) % SPAN_HASHBASE;
+        spans[count++].bytes = n;
+    }
+
+    // Sum the bytes per hash
+    qsort(spans, count, sizeof(Span), compare_spans);
+    int merged = 0;
+    for (int i = 0; i < count; i++) {
+        if (merged > 0 && spans[merged - 1].hash == spans[i].hash) {
+            spans[merged - 1].bytes += spans[i].bytes;
+        } else {
+            spans[merged++] = spans[i];
+        }
+    }
+    *count_out = merged;
+    return spans;
+}
+
+// Whether sizes this far apart can still score `min_score`
+static int sizes_close(size_t src_size, size_t dst_size, int min_score) {
+    size_t max_size = src_size > dst_size ? src_size : dst_size;
+    size_t min_size = src_size < dst_size ? src_size : dst_size;
+    return max_size > 0 &&
+           (max_size - min_size) * DIFF_MAX_SCORE <=
+           max_size * (DIFF_MAX_SCORE - min_score);
+}
+
+static int span_score(const Span *src, int src_count, size_t src_size,
+                      const Span *dst, int dst_count, size_t dst_size) {
+    uint64_t copied = 0;
+    for (int i = 0, j = 0; i < src_count && j < dst_count;) {
+        if (src[i].hash < dst[j].hash) {
+            i++;
+        } else if (src[i].hash > dst[j].hash) {
+            j++;
+        } else {
+            copied += src[i].bytes < dst[j].bytes ? src[i].bytes : dst[j].bytes;
+            i++;
+            j++;
+        }
+    }
+    size_t max_size = src_size > dst_size ? src_size : dst_size;
+    return (int)(copied * DIFF_MAX_SCORE / max_size);
+}
+
+int diff_similarity(const unsigned char *src, size_t src_size,
+                    const unsigned char *dst, size_t dst_size) {
+    if (!sizes_close(src_size, dst_size, DIFF_MIN_RENAME_SCORE)) {
+        return 0;
+    }
+    int src_count, dst_count;
+    Span *src_spans = count_spans(src, src_size, &src_count);
+    Span *dst_spans = count_spans(dst, dst_size, &dst_count);
+    int score = src_spans && dst_spans
+                ? span_score(src_spans, src_count, src_size, dst_spans, dst_count, dst_size)
+                : 0;
+    free(src_spans);
+    free(dst_spans);
+    return score;
+}
+
+// git's isspace(): no vertical tab or form feed
+static int is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static int is_alpha(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+// One side of a file diff, split into lines
+typedef struct {
+    const char *ptr;
+    long size;                  // the newline included
+    long class;                 // lines with the same text share a class
+} Line;
+
+typedef struct {
+    Line *lines;
+    long count;
+    char *changed_base;
+    char *changed;              // per line; a 0 before the first and after the last
+    long *index;                // lines the search looks at, by position
+    long *classes;              // and their classes
+    long searched;
+    long start, end;            // lines between the common head and tail
+} Side;
+
+typedef struct {
+    long class_count;
+    long *counts[2];            // lines of each class on each side
+    long *slots;                // open addressing, class + 1 or 0 when free
+    uint32_t *hashes;
+    const Line **first;         // a line of each class
+    unsigned long mask;
+} Classifier;
+
+static uint32_t hash_line(const char *ptr, long size) {
+    uint32_t hash = 2166136261u;
+    for (long i = 0; i < size; i++) {
+        hash = (hash ^ (unsigned char)ptr[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static int split_lines(const unsigned char *data, size_t size, Side *side) {
+    memset(side, 0, sizeof(*side));
+    long count = 0;
+    for (size_t i = 0; i < size; i++) {
+        count += data[i] == '\n';
+    }
+    if (size > 0 && data[size - 1] != '\n') {
+        count++;
+    }
+    side->lines = malloc((count + 1) * sizeof(Line));
+    side->changed_base = calloc(count + 2, 1);
+    side->index = malloc((count + 1) * sizeof(long));
+    side->classes = malloc((count + 1) * sizeof(long));
+    if (side->lines == NULL || side->changed_base == NULL || side->index == NULL ||
+        side->classes == NULL) {
+        return -1;
+    }
+    side->changed = side->changed_base + 1;
+    side->count = count;
+
+    const char *p = (const char *)data, *end = p + size;
+    for (long i = 0; i < count; i++) {
+        const char *eol = memchr(p, '\n', end - p);
+        const char *next = eol ? eol + 1 : end;
+        side->lines[i].ptr = p;
+        side->lines[i].size = next - p;
+        p = next;
+    }
+    return 0;
+}
+
+static void free_side(Side *side) {
+    free(side->lines);
+    free(side->changed_base);
+    free(side->index);
+    free(side->classes);
+}
+
+static int classify(Classifier *cf, Side *sides) {
+    long total = sides[0].count + sides[1].count;
+    unsigned long size = 64;
+    while (size < (unsigned long)total * 2) {
+        size *= 2;
+    }
+    memset(cf, 0, sizeof(*cf));
+    cf->mask = size - 1;
+    cf->slots = calloc(size, sizeof(long));
+    cf->hashes = malloc((total + 1) * sizeof(uint32_t));
+    cf->first = malloc((total + 1) * sizeof(Line *));
+    cf->counts[0] = calloc(total + 1, sizeof(long));
+    cf->counts[1] = calloc(total + 1, sizeof(long));
+    if (cf->slots == NULL || cf->hashes == NULL || cf->first == NULL ||
+        cf->counts[0] == NULL || cf->counts[1] == NULL) {
+        return -1;
+    }
+
+    for (int s = 0; s < 2; s++) {
+        for (long i = 0; i < sides[s].count; i++) {
+            Line *line = &sides[s].lines[i];
+            uint32_t hash = hash_line(line->ptr, line->size);
+            unsigned long slot = hash & cf->mask;
+            long class = -1;
+            while (cf->slots[slot] != 0) {
+                long c = cf->slots[slot] - 1;
+                if (cf->hashes[c] == hash && cf->first[c]->size == line->size &&
+                    memcmp(cf->first[c]->ptr, line->ptr, line->size) == 0) {
+                    class = c;
+                    break;
+                }
+                slot = (slot + 1) & cf->mask;
+            }
+            if (class < 0) {
+                class = cf->class_count++;
+                cf->hashes[class] = hash;
+                cf->first[class] = line;
+                cf->slots[slot] = class + 1;
+            }
+            line->class = class;
+            cf->counts[s][class]++;
+        }
+    }
+    return 0;
+}
+
+static void free_classifier(Classifier *cf) {
+    free(cf->slots);
+    free(cf->hashes);
+    free(cf->first);
+    free(cf->counts[0]);
+    free(cf->counts[1]);
+}
+
+static long bogosqrt(long n) {
+    long i;
+    for (i = 1; n > 0; n >>= 2) {
+        i <<= 1;
+    }
+    return i;
+}
+
+// Drop the common head and tail from the search
+static void trim_ends(Side *a, Side *b) {
+    long lim = a->count < b->count ? a->count : b->count;
+    long i;
+    for (i = 0; i < lim && a->lines[i].class == b->lines[i].class; i++) {
+    }
+    a->start = b->start = i;
+    lim -= i;
+    for (i = 0; i < lim && a->lines[a->count - 1 - i].class ==
+                           b->lines[b->count - 1 - i].class; i++) {
+    }
+    a->end = a->count - i - 1;
+    b->end = b->count - i - 1;
+}
+
+// Whether a line with many matches sits in a run of lines without any,
+// and is better taken as changed too
+static int clean_multimatch(const char *dis, long i, long s, long e) {
+    if (i - s > SIMSCAN_WINDOW) {
+        s = i - SIMSCAN_WINDOW;
+    }
+    if (e - i > SIMSCAN_WINDOW) {
+        e = i + SIMSCAN_WINDOW;
+    }
+
+    long r, rdis0, rpdis0, rdis1, rpdis1;
+    for (r = 1, rdis0 = 0, rpdis0 = 1; i - r >= s; r++) {
+        if (!dis[i - r]) {
+            rdis0++;
+        } else if (dis[i - r] == 2) {
+            rpdis0++;
+        } else {
+            break;
+        }
+    }
+    if (rdis0 == 0) {
+        return 0;
+    }
+    for (r = 1, rdis1 = 0, rpdis1 = 1; i + r <= e; r++) {
+        if (!dis[i + r]) {
+            rdis1++;
+        } else if (dis[i + r] == 2) {
+            rpdis1++;
+        } else {
+            break;
+        }
+    }
+    if (rdis1 == 0) {
+        return 0;
+    }
+    rdis1 += rdis0;
+    rpdis1 += rpdis0;
+    return rpdis1 * KPDIS_RUN < rpdis1 + rdis1;
+}
+
+// Lines without a match on the other side are changed whatever the
+// search finds; leave them and the lines lost among them out of it
+static int discard_lines(const Classifier *cf, Side *sides) {
+    for (int s = 0; s < 2; s++) {
+        Side *side = &sides[s];
+        char *dis = calloc(side->count + 1, 1);
+        if (dis == NULL) {
+            return -1;
+        }
+        long limit = bogosqrt(side->count);
+        if (limit > MAX_EQUAL_LIMIT) {
+            limit = MAX_EQUAL_LIMIT;
+        }
+        for (long i = side->start; i <= side->end; i++) {
+            long matches = cf->counts[1 - s][side->lines[i].class];
+            dis[i] = matches == 0 ? 0 : matches >= limit ? 2 : 1;
+        }
+        long searched = 0;
+        for (long i = side->start; i <= side->end; i++) {
+            if (dis[i] == 1 ||
+                (dis[i] == 2 && !clean_multimatch(dis, i, side->start, side->end))) {
+                side->index[searched] = i;
+                side->classes[searched++] = side->lines[i].class;
+            } else {
+                side->changed[i] = 1;
+            }
+        }
+        side->searched = searched;
+        free(dis);
+    }
+    return 0;
+}
+
+typedef struct {
+    long i1, i2;
+    int min_lo, min_hi;
+} Split;
+
+typedef struct {
+    long max_cost;
+    long snake_count;
+    long heur_min;
+} SearchLimits;
+
+// The middle snake of Myers' algorithm, searched from both ends at once.
+// Past the cost limit it settles for a good-looking diagonal instead.
+static long split_box(const long *ha1, long off1, long lim1, const long *ha2,
+                      long off2, long lim2, long *kvdf, long *kvdb, int need_min,
+                      Split *spl, const SearchLimits *env) {
+    long dmin = off1 - lim2, dmax = lim1 - off2;
+    long fmid = off1 - off2, bmid = lim1 - lim2;
+    long odd = (fmid - bmid) & 1;
+    long fmin = fmid, fmax = fmid;
+    long bmin = bmid, bmax = bmid;
+    long ec, d, i1, i2, prev1, best, dd, v, k;
+
+    kvdf[fmid] = off1;
+    kvdb[bmid] = lim1;
+
+    for (ec = 1;; ec++) {
+        int got_snake = 0;
+
+        if (fmin > dmin) {
+            kvdf[--fmin - 1] = -1;
+        } else {
+            ++fmin;
+        }
+        if (fmax < dmax) {
+            kvdf[++fmax + 1] = -1;
+        } else {
+            --fmax;
+        }
+        for (d = fmax; d >= fmin; d -= 2) {
+            if (kvdf[d - 1] >= kvdf[d + 1]) {
+                i1 = kvdf[d - 1] + 1;
+            } else {
+                i1 = kvdf[d + 1];
+            }
+            prev1 = i1;
+            i2 = i1 - d;
+            for (; i1 < lim1 && i2 < lim2 && ha1[i1] == ha2[i2]; i1++, i2++) {
+            }
+            if (i1 - prev1 > env->snake_count) {
+                got_snake = 1;
+            }
+            kvdf[d] = i1;
+            if (odd && bmin <= d && d <= bmax && kvdb[d] <= i1) {
+                spl->i1 = i1;
+                spl->i2 = i2;
+                spl->min_lo = spl->min_hi = 1;
+                return ec;
+            }
+        }
+
+        if (bmin > dmin) {
+            kvdb[--bmin - 1] = LONG_MAX;
+        } else {
+            ++bmin;
+        }
+        if (bmax < dmax) {
+            kvdb[++bmax + 1] = LONG_MAX;
+        } else {
+            --bmax;
+        }
+        for (d = bmax; d >= bmin; d -= 2) {
+            if (kvdb[d - 1] < kvdb[d + 1]) {
+                i1 = kvdb[d - 1];
+            } else {
+                i1 = kvdb[d + 1] - 1;
+            }
+            prev1 = i1;
+            i2 = i1 - d;
+            for (; i1 > off1 && i2 > off2 && ha1[i1 - 1] == ha2[i2 - 1]; i1--, i2--) {
+            }
+            if (prev1 - i1 > env->snake_count) {
+                got_snake = 1;
+            }
+            kvdb[d] = i1;
+            if (!odd && fmin <= d && d <= fmax && i1 <= kvdf[d]) {
+                spl->i1 = i1;
+                spl->i2 = i2;
+                spl->min_lo = spl->min_hi = 1;
+                return ec;
+            }
+        }
+
+        if (need_min) {
+            continue;
+        }
+
+        // Past the trigger cost, a diagonal that got far along a long
+        // snake is taken as the split
+        if (got_snake && ec > env->heur_min) {
+            for (best = 0, d = fmax; d >= fmin; d -= 2) {
+                dd = d > fmid ? d - fmid : fmid - d;
+                i1 = kvdf[d];
+                i2 = i1 - d;
+                v = (i1 - off1) + (i2 - off2) - dd;
+                if (v > K_HEUR * ec && v > best &&
+                    off1 + env->snake_count <= i1 && i1 < lim1 &&
+                    off2 + env->snake_count <= i2 && i2 < lim2) {
+                    for (k = 1; ha1[i1 - k] == ha2[i2 - k]; k++) {
+                        if (k == env->snake_count) {
+                            best = v;
+                            spl->i1 = i1;
+                            spl->i2 = i2;
+                            break;
+                        }
+                    }
+                }
+            }
+            if (best > 0) {
+                spl->min_lo = 1;
+                spl->min_hi = 0;
+                return ec;
+            }
+
+            for (best = 0, d = bmax; d >= bmin; d -= 2) {
+                dd = d > bmid ? d - bmid : bmid - d;
+                i1 = kvdb[d];
+                i2 = i1 - d;
+                v = (lim1 - i1) + (lim2 - i2) - dd;
+                if (v > K_HEUR * ec && v > best &&
+                    off1 < i1 && i1 <= lim1 - env->snake_count &&
+                    off2 < i2 && i2 <= lim2 - env->snake_count) {
+                    for (k = 0; ha1[i1 + k] == ha2[i2 + k]; k++) {
+                        if (k == env->snake_count - 1) {
+                            best = v;
+                            spl->i1 = i1;
+                            spl->i2 = i2;
+                            break;
+                        }
+                    }
+                }
+            }
+            if (best > 0) {
+                spl->min_lo = 0;
+                spl->min_hi = 1;
+                return ec;
+            }
+        }
+
+        // Enough: take the furthest reaching path
+        if (ec >= env->max_cost) {
+            long fbest = -1, fbest1 = -1, bbest = LONG_MAX, bbest1 = LONG_MAX;
+            for (d = fmax; d >= fmin; d -= 2) {
+                i1 = kvdf[d] < lim1 ? kvdf[d] : lim1;
+                i2 = i1 - d;
+                if (lim2 < i2) {
+                    i1 = lim2 + d;
+                    i2 = lim2;
+                }
+                if (fbest < i1 + i2) {
+                    fbest = i1 + i2;
+                    fbest1 = i1;
+                }
+            }
+            for (d = bmax; d >= bmin; d -= 2) {
+                i1 = kvdb[d] > off1 ? kvdb[d] : off1;
+                i2 = i1 - d;
+                if (i2 < off2) {
+                    i1 = off2 + d;
+                    i2 = off2;
+                }
+                if (i1 + i2 < bbest) {
+                    bbest = i1 + i2;
+                    bbest1 = i1;
+                }
+            }
+            if ((lim1 + lim2) - bbest < fbest - (off1 + off2)) {
+                spl->i1 = fbest1;
+                spl->i2 = fbest - fbest1;
+                spl->min_lo = 1;
+                spl->min_hi = 0;
+            } else {
+                spl->i1 = bbest1;
+                spl->i2 = bbest - bbest1;
+                spl->min_lo = 0;
+                spl->min_hi = 1;
+            }
+            return ec;
+        }
+    }
+}
+
+static void compare_box(Side *a, long off1, long lim1, Side *b, long off2, long lim2,
+                        long *kvdf, long *kvdb, int need_min,
+                        const SearchLimits *env) {
+    const long *ha1 = a->classes, *ha2 = b->classes;
+
+    // Shrink the box by the snakes at either end
+    for (; off1 < lim1 && off2 < lim2 && ha1[off1] == ha2[off2]; off1++, off2++) {
+    }
+    for (; off1 < lim1 && off2 < lim2 && ha1[lim1 - 1] == ha2[lim2 - 1]; lim1--, lim2--) {
+    }
+
+    if (off1 == lim1) {
+        for (; off2 < lim2; off2++) {
+            b->changed[b->index[off2]] = 1;
+        }
+    } else if (off2 == lim2) {
+        for (; off1 < lim1; off1++) {
+            a->changed[a->index[off1]] = 1;
+        }
+    } else {
+        Split spl = { 0, 0, 0, 0 };
+        split_box(ha1, off1, lim1, ha2, off2, lim2, kvdf, kvdb, need_min, &spl, env);
+        compare_box(a, off1, spl.i1, b, off2, spl.i2, kvdf, kvdb, spl.min_lo, env);
+        compare_box(a, spl.i1, lim1, b, spl.i2, lim2, kvdf, kvdb, spl.min_hi, env);
+    }
+}
+
+// Indentation of a line in columns, -1 if it is blank
+static int get_indent(const Line *line) {
+    int ret = 0;
+    for (long i = 0; i < line->size; i++) {
+        char c = line->ptr[i];
+        if (!is_space(c)) {
+            return ret;
+        } else if (c == ' ') {
+            ret += 1;
+        } else if (c == '\t') {
+            ret += 8 - ret % 8;
+        }
+        if (ret >= MAX_INDENT) {
+            return MAX_INDENT;
+        }
+    }
+    return -1;
+}
+
+typedef struct {
+    int end_of_file;
+    int indent;
+    int pre_blank;
+    int pre_indent;
+    int post_blank;
+    int post_indent;
+} SplitMeasure;
+
+typedef struct {
+    int effective_indent;
+    int penalty;
+} SplitScore;
+
+static void measure_split(const Side *side, long split, SplitMeasure *m) {
+    if (split >= side->count) {
+        m->end_of_file = 1;
+        m->indent = -1;
+    } else {
+        m->end_of_file = 0;
+        m->indent = get_indent(&side->lines[split]);
+    }
+
+    m->pre_blank = 0;
+    m->pre_indent = -1;
+    for (long i = split - 1; i >= 0; i--) {
+        m->pre_indent = get_indent(&side->lines[i]);
+        if (m->pre_indent != -1) {
+            break;
+        }
+        m->pre_blank += 1;
+        if (m->pre_blank == MAX_BLANKS) {
+            m->pre_indent = 0;
+            break;
+        }
+    }
+
+    m->post_blank = 0;
+    m->post_indent = -1;
+    for (long i = split + 1; i < side->count; i++) {
+        m->post_indent = get_indent(&side->lines[i]);
+        if (m->post_indent != -1) {
+            break;
+        }
+        m->post_blank += 1;
+        if (m->post_blank == MAX_BLANKS) {
+            m->post_indent = 0;
+            break;
+        }
+    }
+}
+
+static void score_add_split(const SplitMeasure *m, SplitScore *s) {
+    if (m->pre_indent == -1 && m->pre_blank == 0) {
+        s->penalty += START_OF_FILE_PENALTY;
+    }
+    if (m->end_of_file) {
+        s->penalty += END_OF_FILE_PENALTY;
+    }
+
+    int post_blank = m->indent == -1 ? 1 + m->post_blank : 0;
+    int total_blank = m->pre_blank + post_blank;
+    s->penalty += TOTAL_BLANK_WEIGHT * total_blank;
+    s->penalty += POST_BLANK_WEIGHT * post_blank;
+
+    int indent = m->indent != -1 ? m->indent : m->post_indent;
+    int any_blanks = total_blank != 0;
+    s->effective_indent += indent;
+
+    if (indent == -1 || m->pre_indent == -1 || indent == m->pre_indent) {
+        // nothing to add
+    } else if (indent > m->pre_indent) {
+        s->penalty += any_blanks ? RELATIVE_INDENT_WITH_BLANK_PENALTY
+                                 : RELATIVE_INDENT_PENALTY;
+    } else if (m->post_indent != -1 && m->post_indent > indent) {
+        s->penalty += any_blanks ? RELATIVE_OUTDENT_WITH_BLANK_PENALTY
+                                 : RELATIVE_OUTDENT_PENALTY;
+    } else {
+        s->penalty += any_blanks ? RELATIVE_DEDENT_WITH_BLANK_PENALTY
+                                 : RELATIVE_DEDENT_PENALTY;
+    }
+}
+
+static int score_cmp(const SplitScore *s1, const SplitScore *s2) {
+    int cmp_indents = (s1->effective_indent > s2->effective_indent) -
+                      (s1->effective_indent < s2->effective_indent);
+    return INDENT_WEIGHT * cmp_indents + (s1->penalty - s2->penalty);
+}
+
+// A run of changed lines, [start, end)
+typedef struct {
+    long start, end;
+} Group;
+
+static void group_init(const Side *side, Group *g) {
+    g->start = g->end = 0;
+    while (side->changed[g->end]) {
+        g->end++;
+    }
+}
+
+static int group_next(const Side *side, Group *g) {
+    if (g->end == side->count) {
+        return -1;
+    }
+    g->start = g->end + 1;
+    for (g->end = g->start; side->changed[g->end]; g->end++) {
+    }
+    return 0;
+}
+
+static int group_previous(const Side *side, Group *g) {
+    if (g->start == 0) {
+        return -1;
+    }
+    g->end = g->start - 1;
+    for (g->start = g->end; side->changed[g->start - 1]; g->start--) {
+    }
+    return 0;
+}
+
+static int group_slide_down(Side *side, Group *g) {
+    if (g->end < side->count &&
+        side->lines[g->start].class == side->lines[g->end].class) {
+        side->changed[g->start++] = 0;
+        side->changed[g->end++] = 1;
+        while (side->changed[g->end]) {
+            g->end++;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+static int group_slide_up(Side *side, Group *g) {
+    if (g->start > 0 &&
+        side->lines[g->start - 1].class == side->lines[g->end - 1].class) {
+        side->changed[--g->start] = 1;
+        side->changed[--g->end] = 0;
+        while (side->changed[g->start - 1]) {
+            g->start--;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+// Slide each group of changed lines to where a reader expects it: next
+// to a change on the other side if it can be, otherwise where the indent
+// heuristic scores it best
+static void compact_changes(Side *side, Side *other) {
+    Group g, go;
+    group_init(side, &g);
+    group_init(other, &go);
+
+    while (1) {
+        if (g.end != g.start) {
+            long groupsize, earliest_end, end_matching_other;
+            do {
+                groupsize = g.end - g.start;
+                end_matching_other = -1;
+
+                while (!group_slide_up(side, &g)) {
+                    group_previous(other, &go);
+                }
+                earliest_end = g.end;
+                if (go.end > go.start) {
+                    end_matching_other = g.end;
+                }
+
+                while (!group_slide_down(side, &g)) {
+                    group_next(other, &go);
+                    if (go.end > go.start) {
+                        end_matching_other = g.end;
+                    }
+                }
+            } while (groupsize != g.end - g.start);
+
+            if (g.end == earliest_end) {
+                // no room to move
+            } else if (end_matching_other != -1) {
+                while (go.end == go.start) {
+                    group_slide_up(side, &g);
+                    group_previous(other, &go);
+                }
+            } else {
+                long shift = earliest_end, best_shift = -1;
+                SplitScore best_score = { 0, 0 };
+                if (g.end - groupsize - 1 > shift) {
+                    shift = g.end - groupsize - 1;
+                }
+                if (g.end - INDENT_HEURISTIC_MAX_SLIDING > shift) {
+                    shift = g.end - INDENT_HEURISTIC_MAX_SLIDING;
+                }
+                for (; shift <= g.end; shift++) {
+                    SplitMeasure m;
+                    SplitScore score = { 0, 0 };
+                    measure_split(side, shift, &m);
+                    score_add_split(&m, &score);
+                    measure_split(side, shift - groupsize, &m);
+                    score_add_split(&m, &score);
+                    if (best_shift == -1 || score_cmp(&score, &best_score) <= 0) {
+                        best_score = score;
+                        best_shift = shift;
+                    }
+                }
+                while (g.end > best_shift) {
+                    group_slide_up(side, &g);
+                    group_previous(other, &go);
+                }
+            }
+        }
+
+        if (group_next(side, &g)) {
+            break;
+        }
+        group_next(other, &go);
+    }
+}
+
+// Mark the changed lines of both sides
+static int diff_sides(Side *sides) {
+    Classifier cf;
+    if (classify(&cf, sides) != 0) {
+        free_classifier(&cf);
+        return -1;
+    }
+    trim_ends(&sides[0], &sides[1]);
+    if (discard_lines(&cf, sides) != 0) {
+        free_classifier(&cf);
+        return -1;
+    }
+    free_classifier(&cf);
+
+    long n1 = sides[0].searched, n2 = sides[1].searched;
+    long diagonals = n1 + n2 + 3;
+    long *kvd = malloc((2 * diagonals + 2) * sizeof(long));
+    if (kvd == NULL) {
+        return -1;
+    }
+    SearchLimits env = { bogosqrt(diagonals), SNAKE_COUNT, HEUR_MIN_COST };
+    if (env.max_cost < MAX_COST_MIN) {
+        env.max_cost = MAX_COST_MIN;
+    }
+    long *kvdf = kvd + n2 + 1;
+    long *kvdb = kvd + diagonals + n2 + 1;
+    compare_box(&sides[0], 0, n1, &sides[1], 0, n2, kvdf, kvdb, 0, &env);
+    free(kvd);
+
+    compact_changes(&sides[0], &sides[1]);
+    compact_changes(&sides[1], &sides[0]);
+    return 0;
+}
+
+typedef struct {
+    long i1, i2;                // first changed line on each side
+    long chg1, chg2;            // lines changed on each side
+} Change;
+
+// Trailing blank lines a side ends with, counted as git counts them
+static int count_trailing_blank(const unsigned char *data, size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+    const char *start = (const char *)data;
+    const char *ptr = start + size - 1;
+    if (*ptr == '\n') {
+        ptr--;
+    }
+    int count = 0;
+    while (start < ptr) {
+        const char *prev_eol;
+        for (prev_eol = ptr; start <= prev_eol; prev_eol--) {
+            if (*prev_eol == '\n') {
+                break;
+            }
+        }
+        for (const char *p = prev_eol + 1; p <= ptr; p++) {
+            if (!is_space(*p)) {
+                return count;
+            }
+        }
+        count++;
+        ptr = prev_eol - 1;
+    }
+    return count;
+}
+
+typedef struct {
+    StrBuf *out;
+    int color;
+    long old_lno, new_lno;      // as git counts lines for blank-at-eof
+    long blank_old, blank_new;  // where new blank lines at the end start
+} Emitter;
+
+// A line with its sign, the color reset before the CR and newline
+static void emit_simple(Emitter *e, const char *set, char sign, const char *line,
+                        long len) {
+    int newline = len > 0 && line[len - 1] == '\n';
+    len -= newline;
+    int cr = len > 0 && line[len - 1] == '\r';
+    len -= cr;
+    sb_append(e->out, set);
+    sb_append_len(e->out, &sign, 1);
+    sb_append_len(e->out, line, len);
+    sb_append(e->out, COLOR_RESET);
+    if (cr) {
+        sb_append(e->out, "\r");
+    }
+    if (newline) {
+        sb_append(e->out, "\n");
+    }
+}
+
+// An added line: indentation as is, whitespace at the end highlighted
+static void emit_added(Emitter *e, const char *line, long len) {
+    StrBuf *out = e->out;
+    int newline = len > 0 && line[len - 1] == '\n';
+    len -= newline;
+
+    int blank = 1;
+    for (long i = 0; i < len && blank; i++) {
+        blank = is_space(line[i]);
+    }
+    if (blank && e->blank_old && e->blank_new && e->blank_old <= e->old_lno &&
+        e->blank_new <= e->new_lno) {
+        emit_simple(e, COLOR_WHITESPACE, '+', line, len + newline);
+        return;
+    }
+
+    sb_append(out, COLOR_NEW "+" COLOR_RESET);
+    long trailing = len;
+    while (trailing > 0 && is_space(line[trailing - 1])) {
+        trailing--;
+    }
+    long written = 0;
+    for (long i = 0; i < trailing; i++) {
+        if (line[i] == ' ') {
+            continue;
+        }
+        if (line[i] != '\t') {
+            break;
+        }
+        if (written < i) {
+            // Spaces before a tab
+            sb_append(out, COLOR_WHITESPACE);
+            sb_append_len(out, line + written, i - written);
+            sb_append(out, COLOR_RESET);
+            sb_append_len(out, line + i, 1);
+        } else {
+            sb_append_len(out, line + written, i - written + 1);
+        }
+        written = i + 1;
+    }
+    if (trailing > written) {
+        sb_append(out, COLOR_NEW);
+        sb_append_len(out, line + written, trailing - written);
+        sb_append(out, COLOR_RESET);
+    }
+    if (trailing < len) {
+        sb_append(out, COLOR_WHITESPACE);
+        sb_append_len(out, line + trailing, len - trailing);
+        sb_append(out, COLOR_RESET);
+    }
+    if (newline) {
+        sb_append(out, "\n");
+    }
+}
+
+static void emit_line(Emitter *e, char sign, const Line *line) {
+    if (!e->color) {
+        sb_append_len(e->out, &sign, 1);
+        sb_append_len(e->out, line->ptr, line->size);
+    } else if (sign == '+') {
+        e->new_lno++;
+        emit_added(e, line->ptr, line->size);
+    } else if (sign == '-') {
+        e->old_lno++;
+        emit_simple(e, COLOR_OLD, '-', line->ptr, line->size);
+    } else {
+        e->old_lno++;
+        e->new_lno++;
+        emit_simple(e, "", ' ', line->ptr, line->size);
+    }
+    if (line->size == 0 || line->ptr[line->size - 1] != '\n') {
+        // git counts the marker as a line of the old side
+        e->old_lno++;
+        sb_append(e->out, e->color ? "\n\\ No newline at end of file" COLOR_RESET "\n"
+                                   : "\n\\ No newline at end of file\n");
+    }
+}
+
+// The function name git shows after a hunk header: the last line before
+// the hunk that starts with a letter, '_' or '$'
+static int func_line(const Side *side, long start, long limit, char *buf, int *len) {
+    for (long l = start; l > limit && l >= 0 && l < side->count; l--) {
+        const Line *line = &side->lines[l];
+        char c = line->ptr[0];
+        if (line->size > 0 && (is_alpha(c) || c == '_' || c == '$')) {
+            long n = line->size < FUNC_NAME_MAX ? line->size : FUNC_NAME_MAX;
+            while (n > 0 && is_space(line->ptr[n - 1])) {
+                n--;
+            }
+            memcpy(buf, line->ptr, n);
+            *len = (int)n;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void emit_hunk_header(Emitter *e, long s1, long c1, long s2, long c2,
+                             const char *func, int func_len) {
+    char range[128];
+    int n = snprintf(range, sizeof(range), "@@ -%ld", c1 ? s1 : s1 - 1);
+    if (c1 != 1) {
+        n += snprintf(range + n, sizeof(range) - n, ",%ld", c1);
+    }
+    n += snprintf(range + n, sizeof(range) - n, " +%ld", c2 ? s2 : s2 - 1);
+    if (c2 != 1) {
+        n += snprintf(range + n, sizeof(range) - n, ",%ld", c2);
+    }
+    n += snprintf(range + n, sizeof(range) - n, " @@");
+    // git builds the line in 128 bytes and cuts the name to fit
+    if (func_len > (int)sizeof(range) - n - 2) {
+        func_len = (int)sizeof(range) - n - 2;
+    }
+
+    e->old_lno = c1 ? s1 : s1 - 1;
+    e->new_lno = c2 ? s2 : s2 - 1;
+    if (!e->color) {
+        sb_append(e->out, range);
+        if (func_len > 0) {
+            sb_append(e->out, " ");
+            sb_append_len(e->out, func, func_len);
+        }
+        sb_append(e->out, "\n");
+        return;
+    }
+    sb_append(e->out, COLOR_FRAG);
+    sb_append(e->out, range);
+    sb_append(e->out, COLOR_RESET);
+    if (func_len > 0) {
+        sb_append(e->out, " " COLOR_RESET);
+        sb_append_len(e->out, func, func_len);
+        sb_append(e->out, COLOR_RESET);
+    }
+    sb_append(e->out, "\n");
+}
+
+// Group the changes into hunks with their context, as xdl_emit_diff()
+static void emit_hunks(Emitter *e, const Side *a, const Side *b,
+                       const Change *changes, int count) {
+    char func[FUNC_NAME_MAX];
+    int func_len = 0;
+    long func_limit = -1;
+    long max_common = 2 * CONTEXT_LINES;
+
+    for (int first = 0; first < count;) {
+        int last = first;
+        while (last + 1 < count &&
+               changes[last + 1].i1 - (changes[last].i1 + changes[last].chg1) <= max_common) {
+            last++;
+        }
+        const Change *xch = &changes[first], *xche = &changes[last];
+        long s1 = xch->i1 - CONTEXT_LINES > 0 ? xch->i1 - CONTEXT_LINES : 0;
+        long s2 = xch->i2 - CONTEXT_LINES > 0 ? xch->i2 - CONTEXT_LINES : 0;
+        long e1 = xche->i1 + xche->chg1 + CONTEXT_LINES;
+        long e2 = xche->i2 + xche->chg2 + CONTEXT_LINES;
+        e1 = e1 < a->count ? e1 : a->count;
+        e2 = e2 < b->count ? e2 : b->count;
+
+        // The name found before the last hunk stays if none is closer
+        func_line(a, s1 - 1, func_limit, func, &func_len);
+        func_limit = s1 - 1;
+        emit_hunk_header(e, s1 + 1, e1 - s1, s2 + 1, e2 - s2, func, func_len);
+
+        for (; s2 < xch->i2; s2++) {
+            emit_line(e, ' ', &b->lines[s2]);
+        }
+        for (int c = first;; c++) {
+            const Change *ch = &changes[c];
+            for (s1 = c == first ? ch->i1 : changes[c - 1].i1 + changes[c - 1].chg1,
+                 s2 = c == first ? ch->i2 : changes[c - 1].i2 + changes[c - 1].chg2;
+                 s1 < ch->i1 && s2 < ch->i2; s1++, s2++) {
+                emit_line(e, ' ', &b->lines[s2]);
+            }
+            for (s1 = ch->i1; s1 < ch->i1 + ch->chg1; s1++) {
+                emit_line(e, '-', &a->lines[s1]);
+            }
+            for (s2 = ch->i2; s2 < ch->i2 + ch->chg2; s2++) {
+                emit_line(e, '+', &b->lines[s2]);
+            }
+            if (c == last) {
+                break;
+            }
+        }
+        for (s2 = xche->i2 + xche->chg2; s2 < e2; s2++) {
+            emit_line(e, ' ', &b->lines[s2]);
+        }
+        first = last + 1;
+    }
+}
+
+int diff_buffers(const unsigned char *old_data, size_t old_size,
+                 const unsigned char *new_data, size_t new_size, int color,
+                 StrBuf *out) {
+    Side sides[2];
+    Change *changes = NULL;
+    int status = -1;
+    memset(sides, 0, sizeof(sides));
+    if (split_lines(old_data, old_size, &sides[0]) != 0 ||
+        split_lines(new_data, new_size, &sides[1]) != 0 ||
+        diff_sides(sides) != 0) {
+        goto done;
+    }
+
+    // Runs of changed lines, in order; unchanged lines pair up between them
+    int count = 0, capacity = 16;
+    changes = malloc(capacity * sizeof(Change));
+    if (changes == NULL) {
+        goto done;
+    }
+    long i1 = 0, i2 = 0;
+    while (i1 < sides[0].count || i2 < sides[1].count) {
+        if (!sides[0].changed[i1] && !sides[1].changed[i2]) {
+            i1++;
+            i2++;
+            continue;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            Change *grown = realloc(changes, capacity * sizeof(Change));
+            if (grown == NULL) {
+                goto done;
+            }
+            changes = grown;
+        }
+        Change *ch = &changes[count++];
+        ch->i1 = i1;
+        ch->i2 = i2;
+        while (sides[0].changed[i1]) {
+            i1++;
+        }
+        while (sides[1].changed[i2]) {
+            i2++;
+        }
+        ch->chg1 = i1 - ch->i1;
+        ch->chg2 = i2 - ch->i2;
+    }
+
+    Emitter e = { out, color, 0, 0, 0, 0 };
+    int blank_old = count_trailing_blank(old_data, old_size);
+    int blank_new = count_trailing_blank(new_data, new_size);
+    if (blank_new > blank_old) {
+        e.blank_old = sides[0].count - blank_old + 1;
+        e.blank_new = sides[1].count - blank_new + 1;
+    }
+    emit_hunks(&e, &sides[0], &sides[1], changes, count);
+    status = 0;
+
+done:
+    free(changes);
+    free_side(&sides[0]);
+    free_side(&sides[1]);
+    return status;
+}
+
+// A file the commit changed. A rename is the pair at its new path, with
+// the deletion it was found in dropped.
+typedef struct {
+    char *path;                 // where the tree diff found it
+    const char *old_path;       // NULL when added
+    const char *new_path;       // NULL when deleted
+    unsigned old_mode, new_mode;
+    unsigned char old_oid[OID_RAWSZ];
+    unsigned char new_oid[OID_RAWSZ];
+    int old_abbrev, new_abbrev; // hex digits of the index line
+    int score;                  // similarity of a rename, 0 otherwise
+    int rename_used;            // a deletion a rename took over
+    int is_rename;
+    int binary;                 // shown as "Binary files ... differ"
+    int failed;                 // a blob could not be read
+
+    // The blob rename detection compares, once loaded
+    Span *spans;
+    int span_count;
+    size_t blob_size;
+
+    StrBuf patch;
+} FilePair;
+
+// Candidate source of a destination in the rename matrix
+typedef struct {
+    int dst, src;               // dst -1 while the slot is free
+    int score;
+    int name_score;             // the basenames are the same
+    int order;                  // position in the matrix, for a stable sort
+} RenameScore;
+
+typedef struct {
+    Odb *odb;
+    Pool *pool;
+    int color;
+    PathTable paths;
+    StrBuf scratch;
+    FilePair *pairs;
+    int count;
+    int capacity;
+    int *list;                  // pairs a pool job works on
+    int start;                  // first pair of the window being diffed
+    int min_score;              // for the job scoring renames
+    RenameScore *matrix;
+    int *srcs, src_count;
+    int null_abbrev;            // hex digits shown for a missing side
+} DiffJob;
+
+static int is_regular(unsigned mode) {
+    return (mode & MODE_TYPE_MASK) == MODE_REGULAR;
+}
+
+static int is_gitlink(unsigned mode) {
+    return (mode & MODE_TYPE_MASK) == 0160000;
+}
+
+static int collect_file(void *ctx, uint32_t path, unsigned old_mode,
+                        const unsigned char *old_oid, unsigned new_mode,
+                        const unsigned char *new_oid) {
+    DiffJob *job = ctx;
+    if (job->count == job->capacity) {
+        int capacity = job->capacity ? job->capacity * 2 : 64;
+        FilePair *grown = realloc(job->pairs, capacity * sizeof(FilePair));
+        if (grown == NULL) {
+            return -1;
+        }
+        job->pairs = grown;
+        job->capacity = capacity;
+    }
+    sb_reset(&job->scratch);
+    path_format(&job->paths, path, 0, &job->scratch);
+
+    FilePair *pair = &job->pairs[job->count];
+    memset(pair, 0, sizeof(*pair));
+    pair->path = strdup(job->scratch.data);
+    if (pair->path == NULL) {
+        return -1;
+    }
+    pair->old_mode = old_mode;
+    pair->new_mode = new_mode;
+    if (old_oid) {
+        memcpy(pair->old_oid, old_oid, OID_RAWSZ);
+        pair->old_path = pair->path;
+    }
+    if (new_oid) {
+        memcpy(pair->new_oid, new_oid, OID_RAWSZ);
+        pair->new_path = pair->path;
+    }
+    sb_init(&pair->patch);
+    job->count++;
+    return 0;
+}
+
+static const char *base_name(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+// git's basename_same(): the paths end in the same file name
+static int same_basename(const char *src, const char *dst) {
+    size_t src_len = strlen(src), dst_len = strlen(dst);
+    while (src_len && dst_len) {
+        char c1 = src[--src_len];
+        char c2 = dst[--dst_len];
+        if (c1 != c2) {
+            return 0;
+        }
+        if (c1 == '/') {
+            return 1;
+        }
+    }
+    return (!src_len || src[src_len - 1] == '/') && (!dst_len || dst[dst_len - 1] == '/');
+}
+
+static void record_rename(DiffJob *job, int dst, int src, int score) {
+    FilePair *to = &job->pairs[dst], *from = &job->pairs[src];
+    from->rename_used = 1;
+    to->is_rename = 1;
+    to->score = score;
+    to->old_path = from->path;
+    to->old_mode = from->old_mode;
+    memcpy(to->old_oid, from->old_oid, OID_RAWSZ);
+}
+
+// Renames without edits: a deleted blob added again elsewhere. Sources
+// nothing has used yet win, then those with the same file name.
+static int find_exact_renames(DiffJob *job, const int *srcs, int src_count,
+                              const int *dsts, int dst_count) {
+    OidMap first;
+    int *next = malloc((src_count + 1) * sizeof(int));
+    if (next == NULL || oidmap_init(&first, src_count * 2) != 0) {
+        free(next);
+        return -1;
+    }
+    // Added back to front, so each chain lists sources in order
+    for (int i = src_count - 1; i >= 0; i--) {
+        const FilePair *src = &job->pairs[srcs[i]];
+        if (!oidmap_get(&first, src->old_oid, &next[i])) {
+            next[i] = -1;
+        }
+        if (oidmap_put(&first, src->old_oid, i) != 0) {
+            oidmap_free(&first);
+            free(next);
+            return -1;
+        }
+    }
+
+    for (int d = 0; d < dst_count; d++) {
+        FilePair *dst = &job->pairs[dsts[d]];
+        int i, best = -1, best_score = -1, tries = 100;
+        if (!oidmap_get(&first, dst->new_oid, &i)) {
+            continue;
+        }
+        for (; i >= 0; i = next[i]) {
+            const FilePair *src = &job->pairs[srcs[i]];
+            if ((!is_regular(src->old_mode) || !is_regular(dst->new_mode)) &&
+                src->old_mode != dst->new_mode) {
+                continue;
+            }
+            if (src->rename_used) {
+                continue;
+            }
+            int score = 1 + same_basename(src->path, dst->path);
+            if (score > best_score) {
+                best = srcs[i];
+                best_score = score;
+                if (score == 2) {
+                    break;
+                }
+            }
+            if (!--tries) {
+                break;
+            }
+        }
+        if (best >= 0) {
+            record_rename(job, dsts[d], best, DIFF_MAX_SCORE);
+        }
+    }
+    oidmap_free(&first);
+    free(next);
+    return 0;
+}
+
+static int read_blob(Odb *odb, const unsigned char *oid, unsigned char **data,
+                     size_t *size) {
+    ObjectType type;
+    if (odb_read(odb, oid, &type, data, size) != 0) {
+        return -1;
+    }
+    if (type != OBJ_BLOB) {
+        free(*data);
+        return -1;
+    }
+    return 0;
+}
+
+static void load_spans(void *ctx, int thread, int start, int end) {
+    (void)thread;
+    DiffJob *job = ctx;
+    for (int i = start; i < end; i++) {
+        FilePair *pair = &job->pairs[job->list[i]];
+        int deleted = pair->new_path == NULL;
+        unsigned char *data;
+        size_t size;
+        if (read_blob(job->odb, deleted ? pair->old_oid : pair->new_oid, &data, &size) != 0) {
+            continue;
+        }
+        pair->blob_size = size;
+        pair->spans = count_spans(data, size, &pair->span_count);
+        free(data);
+    }
+}
+
+// Read the blobs of the listed pairs that rename detection still needs
+static void load_all_spans(DiffJob *job, int *list, int count) {
+    int needed = 0;
+    for (int i = 0; i < count; i++) {
+        const FilePair *pair = &job->pairs[list[i]];
+        unsigned mode = pair->new_path ? pair->new_mode : pair->old_mode;
+        if (pair->spans == NULL && is_regular(mode)) {
+            list[needed++] = list[i];
+        }
+    }
+    job->list = list;
+    pool_run(job->pool, needed, 1, load_spans, job, PROFILE_DIFF_WORKERS);
+}
+
+// git's estimate_similarity() on loaded spans
+static int estimate_similarity(const FilePair *src, const FilePair *dst, int min_score) {
+    if (!is_regular(src->old_mode) || !is_regular(dst->new_mode) ||
+        src->spans == NULL || dst->spans == NULL ||
+        !sizes_close(src->blob_size, dst->blob_size, min_score)) {
+        return 0;
+    }
+    return span_score(src->spans, src->span_count, src->blob_size,
+                      dst->spans, dst->span_count, dst->blob_size);
+}
+
+typedef struct {
+    const char *name;
+    int pair;
+} BaseName;
+
+static int compare_base_names(const void *a, const void *b) {
+    const BaseName *x = a, *y = b;
+    int cmp = strcmp(x->name, y->name);
+    return cmp ? cmp : (x->pair > y->pair) - (x->pair < y->pair);
+}
+
+// Sort by file name and keep the names only one pair has
+static int unique_base_names(const DiffJob *job, const int *list, int count,
+                             int deleted, BaseName *names) {
+    for (int i = 0; i < count; i++) {
+        const FilePair *pair = &job->pairs[list[i]];
+        names[i].name = base_name(deleted ? pair->old_path : pair->new_path);
+        names[i].pair = list[i];
+    }
+    qsort(names, count, sizeof(BaseName), compare_base_names);
+    int unique = 0;
+    for (int i = 0; i < count; i++) {
+        if ((i == 0 || strcmp(names[i - 1].name, names[i].name) != 0) &&
+            (i + 1 == count || strcmp(names[i + 1].name, names[i].name) != 0)) {
+            names[unique++] = names[i];
+        }
+    }
+    return unique;
+}
+
+// Most renames move a file and keep its name: a source and destination
+// that are the only ones with a file name are paired if they are at
+// least 75% similar, before the full matrix is scored
+static int find_basename_renames(DiffJob *job, int *srcs, int src_count, int *dsts,
+                                 int dst_count) {
+    BaseName *src_names = malloc((src_count + 1) * sizeof(BaseName));
+    BaseName *dst_names = malloc((dst_count + 1) * sizeof(BaseName));
+    int *list = malloc((src_count + dst_count + 1) * sizeof(int));
+    int *matched = malloc((src_count + 1) * 2 * sizeof(int));
+    if (src_names == NULL || dst_names == NULL || list == NULL || matched == NULL) {
+        free(src_names);
+        free(dst_names);
+        free(list);
+        free(matched);
+        return -1;
+    }
+    int src_unique = unique_base_names(job, srcs, src_count, 1, src_names);
+    int dst_unique = unique_base_names(job, dsts, dst_count, 0, dst_names);
+
+    int match_count = 0, listed = 0;
+    for (int i = 0, j = 0; i < src_unique && j < dst_unique;) {
+        int cmp = strcmp(src_names[i].name, dst_names[j].name);
+        if (cmp < 0) {
+            i++;
+        } else if (cmp > 0) {
+            j++;
+        } else {
+            matched[2 * match_count] = src_names[i].pair;
+            matched[2 * match_count + 1] = dst_names[j].pair;
+            match_count++;
+            list[listed++] = src_names[i++].pair;
+            list[listed++] = dst_names[j++].pair;
+        }
+    }
+    load_all_spans(job, list, listed);
+
+    int min_score = DIFF_MIN_RENAME_SCORE + (DIFF_MAX_SCORE - DIFF_MIN_RENAME_SCORE) / 2;
+    for (int m = 0; m < match_count; m++) {
+        int src = matched[2 * m], dst = matched[2 * m + 1];
+        int score = estimate_similarity(&job->pairs[src], &job->pairs[dst], min_score);
+        if (score >= min_score) {
+            record_rename(job, dst, src, score);
+        }
+    }
+    free(src_names);
+    free(dst_names);
+    free(list);
+    free(matched);
+    return 0;
+}
+
+// git's score_compare(): best first, free slots last
+static int compare_scores(const RenameScore *a, const RenameScore *b) {
+    if (a->dst < 0) {
+        return 0 <= b->dst;
+    } else if (b->dst < 0) {
+        return -1;
+    }
+    if (a->score == b->score) {
+        return b->name_score - a->name_score;
+    }
+    return b->score - a->score;
+}
+
+static int compare_scores_stable(const void *a, const void *b) {
+    const RenameScore *x = a, *y = b;
+    int cmp = compare_scores(x, y);
+    return cmp ? cmp : x->order - y->order;
+}
+
+// Score one row of the matrix: every source against one destination,
+// keeping the best few
+static void score_row(void *ctx, int thread, int start, int end) {
+    (void)thread;
+    DiffJob *job = ctx;
+    for (int row = start; row < end; row++) {
+        RenameScore *best = &job->matrix[row * RENAME_CANDIDATES];
+        int dst = job->list[row];
+        for (int j = 0; j < RENAME_CANDIDATES; j++) {
+            best[j].dst = -1;
+        }
+        for (int j = 0; j < job->src_count; j++) {
+            const FilePair *src = &job->pairs[job->srcs[j]];
+            RenameScore candidate;
+            candidate.score = estimate_similarity(src, &job->pairs[dst], job->min_score);
+            candidate.name_score = same_basename(src->path, job->pairs[dst].path);
+            candidate.dst = dst;
+            candidate.src = job->srcs[j];
+
+            int worst = 0;
+            for (int k = 1; k < RENAME_CANDIDATES; k++) {
+                if (compare_scores(&best[k], &best[worst]) > 0) {
+                    worst = k;
+                }
+            }
+            if (compare_scores(&best[worst], &candidate) > 0) {
+                best[worst] = candidate;
+            }
+        }
+    }
+}
+
+// Every source scored against every destination, and the most similar
+// pairs taken first
+static int find_inexact_renames(DiffJob *job, int *srcs, int src_count, int *dsts,
+                                int dst_count) {
+    int *list = malloc((src_count + dst_count + 1) * sizeof(int));
+    job->matrix = malloc(((size_t)dst_count * RENAME_CANDIDATES + 1) * sizeof(RenameScore));
+    if (list == NULL || job->matrix == NULL) {
+        free(list);
+        free(job->matrix);
+        job->matrix = NULL;
+        return -1;
+    }
+    memcpy(list, srcs, src_count * sizeof(int));
+    memcpy(list + src_count, dsts, dst_count * sizeof(int));
+    load_all_spans(job, list, src_count + dst_count);
+
+    job->list = dsts;
+    job->srcs = srcs;
+    job->src_count = src_count;
+    job->min_score = DIFF_MIN_RENAME_SCORE;
+    pool_run(job->pool, dst_count, 1, score_row, job, PROFILE_DIFF_WORKERS);
+
+    int cells = dst_count * RENAME_CANDIDATES;
+    for (int i = 0; i < cells; i++) {
+        job->matrix[i].order = i;
+    }
+    qsort(job->matrix, cells, sizeof(RenameScore), compare_scores_stable);
+    for (int i = 0; i < cells; i++) {
+        const RenameScore *cell = &job->matrix[i];
+        if (cell->dst < 0 || cell->score < DIFF_MIN_RENAME_SCORE) {
+            break;
+        }
+        if (!job->pairs[cell->dst].is_rename && !job->pairs[cell->src].rename_used) {
+            record_rename(job, cell->dst, cell->src, cell->score);
+        }
+    }
+    free(list);
+    free(job->matrix);
+    job->matrix = NULL;
+    return 0;
+}
+
+// Deletions not yet used as a source, or additions not yet a rename
+static int rename_candidates(const DiffJob *job, int deleted, int *list) {
+    int count = 0;
+    for (int i = 0; i < job->count; i++) {
+        const FilePair *pair = &job->pairs[i];
+        if (deleted ? pair->new_path == NULL && !pair->rename_used
+                    : pair->old_path == NULL && !pair->is_rename) {
+            list[count++] = i;
+        }
+    }
+    return count;
+}
+
+// git's diffcore_rename(), without copies: exact renames, then unique
+// file names, then the matrix if it is within diff.renameLimit
+static int find_renames(DiffJob *job) {
+    int *srcs = malloc((job->count + 1) * sizeof(int));
+    int *dsts = malloc((job->count + 1) * sizeof(int));
+    int status = -1;
+    if (srcs == NULL || dsts == NULL) {
+        goto done;
+    }
+    int src_count = rename_candidates(job, 1, srcs);
+    int dst_count = rename_candidates(job, 0, dsts);
+    if (src_count == 0 || dst_count == 0) {
+        status = 0;
+        goto done;
+    }
+    if (find_exact_renames(job, srcs, src_count, dsts, dst_count) != 0) {
+        goto done;
+    }
+
+    src_count = rename_candidates(job, 1, srcs);
+    dst_count = rename_candidates(job, 0, dsts);
+    if (src_count > 0 && dst_count > 0 &&
+        find_basename_renames(job, srcs, src_count, dsts, dst_count) != 0) {
+        goto done;
+    }
+
+    src_count = rename_candidates(job, 1, srcs);
+    dst_count = rename_candidates(job, 0, dsts);
+    if (src_count > 0 && dst_count > 0 &&
+        (uint64_t)src_count * dst_count <= (uint64_t)RENAME_LIMIT * RENAME_LIMIT &&
+        find_inexact_renames(job, srcs, src_count, dsts, dst_count) != 0) {
+        goto done;
+    }
+    status = 0;
+
+done:
+    for (int i = 0; i < job->count; i++) {
+        free(job->pairs[i].spans);
+        job->pairs[i].spans = NULL;
+    }
+    free(srcs);
+    free(dsts);
+    return status;
+}
+
+// Append a path the way git's quote_c_style() writes it, with `prefix`
+// inside the quotes when it needs them
+static void append_quoted(StrBuf *out, const char *prefix, const char *path) {
+    int quote = 0;
+    for (const unsigned char *p = (const unsigned char *)path; *p && !quote; p++) {
+        quote = *p < 0x20 || *p == '"' || *p == '\\' || *p >= 0x7f;
+    }
+    if (!quote) {
+        sb_append(out, prefix);
+        sb_append(out, path);
+        return;
+    }
+    sb_append(out, "\"");
+    sb_append(out, prefix);
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+        const char *escape = strchr("\a\b\t\n\v\f\r", *p);
+        if (escape && *p) {
+            sb_appendf(out, "\\%c", "abtnvfr"[escape - "\a\b\t\n\v\f\r"]);
+        } else if (*p == '"' || *p == '\\') {
+            sb_appendf(out, "\\%c", *p);
+        } else if (*p < 0x20 || *p >= 0x7f) {
+            sb_appendf(out, "\\%03o", *p);
+        } else {
+            sb_append_len(out, (const char *)p, 1);
+        }
+    }
+    sb_append(out, "\"");
+}
+
+static void append_meta(StrBuf *out, int color, const char *line) {
+    if (color) {
+        sb_append(out, COLOR_META);
+    }
+    sb_append(out, line);
+    if (color) {
+        sb_append(out, COLOR_RESET);
+    }
+    sb_append(out, "\n");
+}
+
+// What the diff compares for one side of a pair: the blob, or the line
+// git makes up for a submodule
+static int load_side(Odb *odb, unsigned mode, const unsigned char *oid,
+                     unsigned char **data, size_t *size) {
+    *data = NULL;
+    *size = 0;
+    if (oid == NULL) {
+        return 0;
+    }
+    if (is_gitlink(mode)) {
+        char hex[OID_HEXSZ + 1];
+        oid_to_hex(oid, hex);
+        StrBuf line;
+        sb_init(&line);
+        sb_appendf(&line, "Subproject commit %s\n", hex);
+        *data = (unsigned char *)line.data;
+        *size = line.len;
+        return 0;
+    }
+    return read_blob(odb, oid, data, size);
+}
+
+// git takes files past core.bigFileThreshold as binary unread
+static int looks_binary(const unsigned char *data, size_t size) {
+    return size > BIG_FILE_THRESHOLD || (size > 0 && is_binary(data, size));
+}
+
+// The patch of one side-by-side pair of files, as git's builtin_diff()
+// writes it. Either side may be missing.
+static int diff_file(DiffJob *job, FilePair *pair, int with_old, int with_new,
+                     StrBuf *out) {
+    // A missing side is named after the other one
+    const char *old_path = with_old ? pair->old_path : pair->new_path;
+    const char *new_path = with_new ? pair->new_path : pair->old_path;
+    unsigned old_mode = with_old ? pair->old_mode : 0;
+    unsigned new_mode = with_new ? pair->new_mode : 0;
+    static const unsigned char null_oid[OID_RAWSZ];
+    const unsigned char *old_oid = with_old ? pair->old_oid : null_oid;
+    const unsigned char *new_oid = with_new ? pair->new_oid : null_oid;
+    int color = job->color;
+    StrBuf line;
+    sb_init(&line);
+
+    StrBuf old_label, new_label;
+    sb_init(&old_label);
+    sb_init(&new_label);
+    append_quoted(&old_label, "a/", old_path);
+    append_quoted(&new_label, "b/", new_path);
+
+    size_t header_start = out->len;
+    int must_show_header = 1;
+    sb_appendf(&line, "diff --git %s %s", old_label.data, new_label.data);
+    append_meta(out, color, line.data);
+    if (!with_old) {
+        sb_reset(&line);
+        sb_appendf(&line, "new file mode %06o", new_mode);
+        append_meta(out, color, line.data);
+    } else if (!with_new) {
+        sb_reset(&line);
+        sb_appendf(&line, "deleted file mode %06o", old_mode);
+        append_meta(out, color, line.data);
+    } else if (old_mode != new_mode) {
+        sb_reset(&line);
+        sb_appendf(&line, "old mode %06o", old_mode);
+        append_meta(out, color, line.data);
+        sb_reset(&line);
+        sb_appendf(&line, "new mode %06o", new_mode);
+        append_meta(out, color, line.data);
+    } else if (!pair->is_rename) {
+        must_show_header = 0;
+    }
+    if (pair->is_rename) {
+        sb_reset(&line);
+        sb_appendf(&line, "similarity index %d%%", pair->score * 100 / DIFF_MAX_SCORE);
+        append_meta(out, color, line.data);
+        sb_reset(&line);
+        sb_append(&line, "rename from ");
+        append_quoted(&line, "", pair->old_path);
+        append_meta(out, color, line.data);
+        sb_reset(&line);
+        sb_append(&line, "rename to ");
+        append_quoted(&line, "", pair->new_path);
+        append_meta(out, color, line.data);
+    }
+    if (memcmp(old_oid, new_oid, OID_RAWSZ) != 0) {
+        char old_hex[OID_HEXSZ + 1], new_hex[OID_HEXSZ + 1];
+        oid_to_hex(old_oid, old_hex);
+        oid_to_hex(new_oid, new_hex);
+        sb_reset(&line);
+        sb_appendf(&line, "index %.*s..%.*s", with_old ? pair->old_abbrev : job->null_abbrev,
+                   old_hex, with_new ? pair->new_abbrev : job->null_abbrev, new_hex);
+        if (old_mode == new_mode) {
+            sb_appendf(&line, " %06o", old_mode);
+        }
+        append_meta(out, color, line.data);
+    }
+
+    unsigned char *old_data = NULL, *new_data = NULL;
+    size_t old_size = 0, new_size = 0;
+    int status = -1;
+    if (load_side(job->odb, old_mode, with_old ? old_oid : NULL, &old_data, &old_size) != 0 ||
+        load_side(job->odb, new_mode, with_new ? new_oid : NULL, &new_data, &new_size) != 0) {
+        goto done;
+    }
+    status = 0;
+    const char *old_name = with_old ? old_label.data : "/dev/null";
+    const char *new_name = with_new ? new_label.data : "/dev/null";
+
+    if (old_size == new_size && (old_size == 0 || memcmp(old_data, new_data, old_size) == 0)) {
+        // Nothing to show but what the header says
+        if (!must_show_header) {
+            out->len = header_start;
+        }
+    } else if (looks_binary(old_data, old_size) || looks_binary(new_data, new_size)) {
+        sb_appendf(out, "Binary files %s and %s differ\n", old_name, new_name);
+        pair->binary = 1;
+    } else {
+        sb_reset(&line);
+        sb_appendf(&line, "--- %s", old_name);
+        append_meta(out, color, line.data);
+        if (strchr(old_name, ' ')) {
+            out->len--;
+            sb_append(out, "\t\n");
+        }
+        sb_reset(&line);
+        sb_appendf(&line, "+++ %s", new_name);
+        append_meta(out, color, line.data);
+        if (strchr(new_name, ' ')) {
+            out->len--;
+            sb_append(out, "\t\n");
+        }
+        status = diff_buffers(old_data, old_size, new_data, new_size, color, out);
+    }
+
+done:
+    free(old_data);
+    free(new_data);
+    sb_free(&old_label);
+    sb_free(&new_label);
+    sb_free(&line);
+    return status;
+}
+
+static void diff_window(void *ctx, int thread, int start, int end) {
+    (void)thread;
+    DiffJob *job = ctx;
+    for (int i = start; i < end; i++) {
+        FilePair *pair = &job->pairs[job->list[job->start + i]];
+        if (pair->old_path && pair->new_path &&
+            (pair->old_mode & MODE_TYPE_MASK) != (pair->new_mode & MODE_TYPE_MASK)) {
+            // A file that became a symlink or the like is shown deleted,
+            // then added
+            pair->failed = diff_file(job, pair, 1, 0, &pair->patch) != 0 ||
+                           diff_file(job, pair, 0, 1, &pair->patch) != 0;
+        } else {
+            pair->failed = diff_file(job, pair, pair->old_path != NULL,
+                                     pair->new_path != NULL, &pair->patch) != 0;
+        }
+    }
+}
+
+// A config file that sets anything changing what `git show` prints: the
+// [diff], [log] and [format] sections and the like, diff colors, and the
+// core keys for whitespace, quoting and abbreviation
+static int config_changes_show(const char *path) {
+    static const char *sections[] = {
+        "diff", "log", "format", "pretty", "notes", "mailmap", "i18n",
+        "include", "includeif", "color.diff", NULL,
+    };
+    static const char *core_keys[] = {
+        "whitespace", "quotepath", "abbrev", "bigfilethreshold", "attributesfile", NULL,
+    };
+    FILE *fp = path ? fopen(path, "r") : NULL;
+    if (fp == NULL) {
+        return 0;
+    }
+    char line[1024], section[64] = "";
+    int changes = 0;
+    while (!changes && fgets(line, sizeof(line), fp)) {
+        const char *p = line;
+        while (is_space(*p)) {
+            p++;
+        }
+        if (*p == '[') {
+            // [color "diff"] and [color.diff] name the same section
+            size_t len = 0;
+            for (p++; *p && *p != ']' && len + 1 < sizeof(section); p++) {
+                if (*p == ' ' || *p == '"') {
+                    if (len > 0 && section[len - 1] != '.') {
+                        section[len++] = '.';
+                    }
+                } else {
+                    section[len++] = (*p >= 'A' && *p <= 'Z') ? *p - 'A' + 'a' : *p;
+                }
+            }
+            while (len > 0 && section[len - 1] == '.') {
+                len--;
+            }
+            section[len] = '\0';
+            for (int i = 0; sections[i] && !changes; i++) {
+                size_t n = strlen(sections[i]);
+                changes = strncmp(section, sections[i], n) == 0 &&
+                          (section[n] == '\0' || (section[n] == '.' && strcmp(sections[i], "color")));
+            }
+        } else if (strcmp(section, "core") == 0) {
+            for (int i = 0; core_keys[i] && !changes; i++) {
+                size_t n = strlen(core_keys[i]);
+                changes = strncasecmp(p, core_keys[i], n) == 0 &&
+                          (p[n] == '=' || is_space(p[n]) || p[n] == '\0');
+            }
+        }
+    }
+    fclose(fp);
+    return changes;
+}
+
+static int file_exists(const char *dir, const char *name) {
+    StrBuf path;
+    sb_init(&path);
+    sb_appendf(&path, "%s/%s", dir, name);
+    FILE *fp = fopen(path.data, "r");
+    sb_free(&path);
+    if (fp) {
+        fclose(fp);
+    }
+    return fp != NULL;
+}
+
+// Whether `git show` would print this repository's commits with git's
+// defaults, which is all the native diff knows. Anything that could say
+// otherwise leaves the commit to git: config, attributes, a mailmap,
+// notes, or a repository without a work tree right above it.
+static int shows_defaults(const char *git_dir) {
+    static const char *env[] = {
+        "GIT_CONFIG_PARAMETERS", "GIT_CONFIG_COUNT", "GIT_CONFIG_GLOBAL",
+        "GIT_CONFIG_SYSTEM", "GIT_EXTERNAL_DIFF", "GIT_DIFF_OPTS", "GIT_NOTES_REF",
+        NULL,
+    };
+    for (int i = 0; env[i]; i++) {
+        if (getenv(env[i])) {
+            return 0;
+        }
+    }
+
+    size_t len = strlen(git_dir);
+    if (!(len >= 4 && strcmp(git_dir + len - 4, ".git") == 0 &&
+          (len == 4 || git_dir[len - 5] == '/'))) {
+        return 0;
+    }
+    StrBuf top, path;
+    sb_init(&top);
+    sb_init(&path);
+    sb_append_len(&top, git_dir, len - 4);
+    if (top.len == 0) {
+        sb_append(&top, ".");
+    }
+    int defaults = !file_exists(top.data, ".gitattributes") &&
+                   !file_exists(top.data, ".mailmap") &&
+                   !file_exists(git_dir, "info/attributes") &&
+                   !file_exists(git_dir, "refs/notes/commits");
+
+    char *common = git_common_dir(git_dir);
+    sb_appendf(&path, "%s/config", common ? common : git_dir);
+    defaults = defaults && !config_changes_show(path.data);
+    sb_reset(&path);
+    sb_appendf(&path, "%s/packed-refs", common ? common : git_dir);
+    FILE *packed = fopen(path.data, "r");
+    char line[1024];
+    while (defaults && packed && fgets(line, sizeof(line), packed)) {
+        defaults = strstr(line, " refs/notes/commits\n") == NULL;
+    }
+    if (packed) {
+        fclose(packed);
+    }
+    free(common);
+
+    const char *home = getenv("HOME");
+    const char *xdg = getenv("XDG_CONFIG_HOME");
+    if (home) {
+        sb_reset(&path);
+        sb_appendf(&path, "%s/.gitconfig", home);
+        defaults = defaults && !config_changes_show(path.data);
+    }
+    if (xdg || home) {
+        sb_reset(&path);
+        sb_appendf(&path, "%s%s/git", xdg ? xdg : home, xdg ? "" : "/.config");
+        defaults = defaults && !file_exists(path.data, "attributes");
+        sb_append(&path, "/config");
+        defaults = defaults && !config_changes_show(path.data);
+    }
+    defaults = defaults && !config_changes_show("/etc/gitconfig");
+    sb_free(&top);
+    sb_free(&path);
+    return defaults;
+}
+
+// Tab stops every 8 columns, counted from the start of the line
+static void append_expanded(StrBuf *out, const char *line, size_t len) {
+    size_t width = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (line[i] == '\t') {
+            size_t spaces = 8 - width % 8;
+            sb_append_len(out, "        ", spaces);
+            width += spaces;
+            continue;
+        }
+        sb_append_len(out, line + i, 1);
+        // A UTF-8 character is one column, whatever its length
+        width += ((unsigned char)line[i] & 0xc0) != 0x80;
+    }
+}
+
+// The header of `git show`'s default format
+static int append_commit_header(StrBuf *out, const unsigned char *oid,
+                                const char *data, int color) {
+    static const char *days[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+    static const char *months[] = {
+        "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
+    };
+    const char *ident = find_header(data, "author ");
+    const char *eol = ident ? strchr(ident, '\n') : NULL;
+    const char *mail = ident ? memchr(ident, '<', eol - ident) : NULL;
+    const char *mail_end = mail ? memchr(mail, '>', eol - mail) : NULL;
+    if (mail_end == NULL) {
+        return -1;
+    }
+    const char *name_end = mail;
+    while (name_end > ident && is_space(name_end[-1])) {
+        name_end--;
+    }
+    time_t when;
+    int tz;
+    parse_ident(ident, NULL, &when, &tz);
+    time_t local = when + (time_t)tz * 60;
+    struct tm tm;
+    if (gmtime_r(&local, &tm) == NULL) {
+        return -1;
+    }
+
+    char hex[OID_HEXSZ + 1];
+    oid_to_hex(oid, hex);
+    sb_appendf(out, "%scommit %s%s\n", color ? COLOR_COMMIT : "", hex, color ? COLOR_RESET : "");
+    sb_appendf(out, "Author: %.*s <%.*s>\n", (int)(name_end - ident), ident,
+               (int)(mail_end - mail - 1), mail + 1);
+    int zone = tz < 0 ? -tz : tz;
+    sb_appendf(out, "Date:   %s %s %d %02d:%02d:%02d %d %+05d\n", days[tm.tm_wday],
+               months[tm.tm_mon], tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+               tm.tm_year + 1900, (tz < 0 ? -1 : 1) * (zone / 60 * 100 + zone % 60));
+    sb_append(out, "\n");
+
+    // The message indented, its blank lines at the start dropped and
+    // trailing whitespace trimmed
+    const char *line = strstr(data, "\n\n");
+    int first = 1;
+    for (line = line ? line + 2 : ""; *line;) {
+        const char *next = strchr(line, '\n');
+        next = next ? next + 1 : line + strlen(line);
+        const char *end = next;
+        while (end > line && is_space(end[-1])) {
+            end--;
+        }
+        if (end > line || !first) {
+            first = 0;
+            sb_append(out, "    ");
+            append_expanded(out, line, end - line);
+            sb_append(out, "\n");
+        }
+        line = next;
+    }
+    while (out->len > 0 && is_space(out->data[out->len - 1])) {
+        out->len--;
+    }
+    sb_append(out, "\n");
+    return 0;
+}
+
+static int read_commit(Odb *odb, const unsigned char *oid, char **data) {
+    ObjectType type;
+    size_t size;
+    if (odb_read(odb, oid, &type, (unsigned char **)data, &size) != 0) {
+        return -1;
+    }
+    if (type != OBJ_COMMIT) {
+        free(*data);
+        return -1;
+    }
+    return 0;
+}
+
+// The tree and parents of a commit
+static int parse_commit(const char *data, unsigned char *tree, unsigned char *parent,
+                        int *parent_count) {
+    const char *hex = find_header(data, "tree ");
+    if (hex == NULL || hex_to_oid(hex, tree) != 0) {
+        return -1;
+    }
+    *parent_count = 0;
+    for (const char *line = data; *line && *line != '\n';) {
+        if (strncmp(line, "parent ", 7) == 0) {
+            if (*parent_count == 0 && hex_to_oid(line + 7, parent) != 0) {
+                return -1;
+            }
+            (*parent_count)++;
+        }
+        const char *eol = strchr(line, '\n');
+        line = eol ? eol + 1 : line + strlen(line);
+    }
+    return 0;
+}
+
+// Write a window's patches in file order; returns -1 once a write fails
+static int write_window(DiffJob *job, int start, int end, FILE *out, DiffStats *stats) {
+    int status = 0;
+    ProfileMark mark;
+    profile_begin(&mark);
+    for (int i = start; i < end; i++) {
+        FilePair *pair = &job->pairs[job->list[i]];
+        if (status == 0 && pair->patch.len > 0 &&
+            fwrite(pair->patch.data, 1, pair->patch.len, out) != pair->patch.len) {
+            status = -1;
+        }
+        sb_free(&pair->patch);
+        stats->files++;
+        stats->renames += pair->is_rename;
+        stats->binary += pair->binary;
+    }
+    if (status == 0 && fflush(out) != 0) {
+        status = -1;
+    }
+    profile_end(&mark, PROFILE_PAGER);
+    return status;
+}
+
+int diff_show_commit(const char *git_dir, const unsigned char *oid, int color,
+                     FILE *out, DiffStats *stats) {
+    DiffStats unused;
+    stats = stats ? stats : &unused;
+    memset(stats, 0, sizeof(*stats));
+    if (!shows_defaults(git_dir)) {
+        return -1;
+    }
+    Odb *odb = odb_open(git_dir);
+    if (odb == NULL) {
+        return -1;
+    }
+
+    DiffJob job;
+    memset(&job, 0, sizeof(job));
+    job.odb = odb;
+    job.color = color;
+    sb_init(&job.scratch);
+    StrBuf header;
+    sb_init(&header);
+    char *data = NULL, *parent_data = NULL;
+    unsigned char tree[OID_RAWSZ], parent[OID_RAWSZ], parent_tree[OID_RAWSZ];
+    int parent_count = 0, status = -1;
+    if (read_commit(odb, oid, &data) != 0 ||
+        parse_commit(data, tree, parent, &parent_count) != 0) {
+        goto done;
+    }
+    if (parent_count > 1) {
+        status = 1;
+        goto done;
+    }
+    // git re-encodes other messages to UTF-8
+    const char *encoding = find_header(data, "encoding ");
+    if ((encoding && strncasecmp(encoding, "utf-8\n", 6) != 0 &&
+         strncasecmp(encoding, "utf8\n", 5) != 0) ||
+        append_commit_header(&header, oid, data, color) != 0) {
+        goto done;
+    }
+    if (parent_count == 1) {
+        int grandparents;
+        unsigned char unused_parent[OID_RAWSZ];
+        if (read_commit(odb, parent, &parent_data) != 0 ||
+            parse_commit(parent_data, parent_tree, unused_parent, &grandparents) != 0) {
+            goto done;
+        }
+    }
+
+    TreeDiff diff = { odb, &job.paths, NULL, &job, collect_file };
+    int listed = path_table_init(&job.paths) == 0 &&
+                 tree_diff(&diff, parent_count ? parent_tree : NULL, tree) == 0;
+    if (listed) {
+        job.pool = pool_open(0);
+        listed = job.pool && find_renames(&job) == 0;
+    }
+    job.list = listed ? malloc((job.count + 1) * sizeof(int)) : NULL;
+    if (job.list == NULL) {
+        goto done;
+    }
+
+    // Deletions a rename took over are not shown
+    int shown = 0;
+    for (int i = 0; i < job.count; i++) {
+        if (!job.pairs[i].rename_used) {
+            job.list[shown++] = i;
+        }
+    }
+    if (shown > 0) {
+        sb_append(&header, "\n");
+    }
+    status = 0;
+    if (fwrite(header.data, 1, header.len, out) != header.len || fflush(out) != 0) {
+        goto done;
+    }
+
+    // Windows grow from a file per thread to a bounded batch, each one
+    // diffed on the pool and written as soon as it is done
+    static const unsigned char null_oid[OID_RAWSZ];
+    job.null_abbrev = odb_abbrev_len(odb, null_oid);
+    int threads = pool_threads(job.pool);
+    int window = threads * FIRST_WINDOW_PER_THREAD;
+    for (int start = 0; start < shown; start += window) {
+        if (start > 0 && window < threads * WINDOW_PER_THREAD) {
+            window *= 2;
+        }
+        int end = start + window < shown ? start + window : shown;
+        for (int i = start; i < end; i++) {
+            FilePair *pair = &job.pairs[job.list[i]];
+            pair->old_abbrev = pair->old_path ? odb_abbrev_len(odb, pair->old_oid) : 0;
+            pair->new_abbrev = pair->new_path ? odb_abbrev_len(odb, pair->new_oid) : 0;
+        }
+        job.start = start;
+        pool_run(job.pool, end - start, 1, diff_window, &job, PROFILE_DIFF_WORKERS);
+        stats->windows++;
+
+        for (int i = start; i < end; i++) {
+            const FilePair *pair = &job.pairs[job.list[i]];
+            if (pair->failed && status == 0) {
+                fprintf(stderr, "Error: Could not read %s\n",
+                        pair->new_path ? pair->new_path : pair->old_path);
+                status = -2;
+            }
+        }
+        if (write_window(&job, start, end, out, stats) != 0 || status != 0) {
+            // The pager was quit, or the patch cannot go on
+            for (int i = end; i < shown; i++) {
+                sb_free(&job.pairs[job.list[i]].patch);
+            }
+            break;
+        }
+    }
+
+done:
+    for (int i = 0; i < job.count; i++) {
+        free(job.pairs[i].path);
+        free(job.pairs[i].spans);
+        sb_free(&job.pairs[i].patch);
+    }
+    free(job.pairs);
+    free(job.list);
+    path_table_free(&job.paths);
+    if (job.pool) {
+        pool_close(job.pool);
+    }
+    sb_free(&job.scratch);
+    sb_free(&header);
+    free(data);
+    free(parent_data);
+    odb_close(odb);
+    return status;
+}
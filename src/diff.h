@@ -0,0 +1,60 @@
+#ifndef SHRUB_DIFF_H
+#define SHRUB_DIFF_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "odb.h"
+
+struct StrBuf;
+
+// -diff without git: the patch `git show` prints for a commit, worked out
+// from the object database.
+//
+// Lines are compared with git's Myers implementation: lines found only on
+// one side are set aside before the search, the search gives up on
+// minimality past a cost of about the square root of the line count, and
+// changed groups are slid to where the indent heuristic places them, so
+// hunks come out where git puts them. Renames are found the way git finds
+// them by default: exact ones by blob id, then pairs at least 50% similar.
+//
+// Files are diffed on a thread pool, a window of them at a time, and each
+// window is written in file order as soon as it is done. The first window
+// has one file per thread, so the first screen of a huge commit comes up
+// at once, and only a window's blobs and patches are held at a time.
+
+#define DIFF_MAX_SCORE 60000
+#define DIFF_MIN_RENAME_SCORE 30000     // 50% similar, git's default
+
+typedef struct {
+    int files;              // file pairs written
+    int renames;
+    int binary;             // pairs shown as "Binary files ... differ"
+    int windows;            // batches handed to the thread pool
+} DiffStats;
+
+// Similarity score of two blobs out of DIFF_MAX_SCORE, as git's rename
+// detection estimates it; 0 when their sizes are too far apart for a
+// score of DIFF_MIN_RENAME_SCORE
+int diff_similarity(const unsigned char *src, size_t src_size,
+                    const unsigned char *dst, size_t dst_size);
+
+// Append the hunks of a unified diff of two buffers with three lines of
+// context, colored as `git diff --color` colors them when `color` is set.
+// Returns -1 when out of memory.
+int diff_buffers(const unsigned char *old_data, size_t old_size,
+                 const unsigned char *new_data, size_t new_size, int color,
+                 struct StrBuf *out);
+
+// Write the header and patch of a commit against its first parent (the
+// empty tree for a root commit) to `out`, as `git show` prints it with
+// git's default settings. Returns 1 without writing anything for a merge,
+// whose combined diff is left to git, and -1, again before writing, if
+// the commit cannot be read natively or the repository's settings may
+// change what git shows. Returns -2 if a blob cannot be read partway
+// through. A failed write stops the patch early, as when the pager is
+// quit, and is not an error.
+int diff_show_commit(const char *git_dir, const unsigned char *oid, int color,
+                     FILE *out, DiffStats *stats);
+
+#endif
@@ -0,0 +1,267 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "export.h"
+#include "profile.h"
+
+#define WRITER_BLOCK (1 << 16)
+
+int export_writer_init(ExportWriter *writer, int fd) {
+    writer->fd = fd;
+    writer->buf = malloc(WRITER_BLOCK);
+    writer->len = 0;
+    writer->capacity = WRITER_BLOCK;
+    writer->failed = 0;
+    return writer->buf ? 0 : -1;
+}
+
+int export_flush(ExportWriter *writer) {
+    ProfileMark mark;
+    profile_begin_timer(&mark);
+    size_t done = 0;
+    while (!writer->failed && done < writer->len) {
+        ssize_t n = write(writer->fd, writer->buf + done, writer->len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            writer->failed = 1;
+            break;
+        }
+        done += n;
+    }
+    writer->len = 0;
+    profile_end(&mark, PROFILE_PAGER);
+    return writer->failed ? -1 : 0;
+}
+
+void export_writer_free(ExportWriter *writer) {
+    free(writer->buf);
+    writer->buf = NULL;
+}
+
+// Room for `bytes` more at the end of the buffer, flushing first if the
+// block is full. Returns NULL if even an empty buffer cannot hold them.
+static char *reserve(ExportWriter *writer, size_t bytes) {
+    if (writer->len + bytes > writer->capacity) {
+        export_flush(writer);
+    }
+    if (bytes > writer->capacity) {
+        char *grown = realloc(writer->buf, bytes);
+        if (grown == NULL) {
+            writer->failed = 1;
+            return NULL;
+        }
+        writer->buf = grown;
+        writer->capacity = bytes;
+    }
+    return writer->buf + writer->len;
+}
+
+static void put_bytes(ExportWriter *writer, const void *data, size_t len) {
+    char *p = reserve(writer, len);
+    if (p) {
+        memcpy(p, data, len);
+        writer->len += len;
+    }
+}
+
+static void put_str(ExportWriter *writer, const char *s) {
+    put_bytes(writer, s, strlen(s));
+}
+
+static void put_uint(ExportWriter *writer, uint64_t value) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+
+    char *p = reserve(writer, n);
+    if (p) {
+        for (int i = 0; i < n; i++) {
+            p[i] = digits[n - 1 - i];
+        }
+        writer->len += n;
+    }
+}
+
+static void put_int(ExportWriter *writer, int64_t value) {
+    if (value < 0) {
+        put_bytes(writer, "-", 1);
+        put_uint(writer, -(uint64_t)value);
+    } else {
+        put_uint(writer, value);
+    }
+}
+
+static void put_hex(ExportWriter *writer, const unsigned char *oid) {
+    char *p = reserve(writer, OID_HEXSZ + 2);
+    if (p) {
+        p[0] = '"';
+        oid_to_hex(oid, p + 1);     // its NUL is overwritten next
+        p[OID_HEXSZ + 1] = '"';
+        writer->len += OID_HEXSZ + 2;
+    }
+}
+
+// A JSON string, escaped as sb_append_json() does
+static void put_json(ExportWriter *writer, const char *s, size_t len) {
+    static const char digits[] = "0123456789abcdef";
+    char *p = reserve(writer, len * 6 + 2);
+    if (p == NULL) {
+        return;
+    }
+    char *start = p;
+    *p++ = '"';
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = c;
+        } else if (c < 0x20) {
+            memcpy(p, "\\u00", 4);
+            p[4] = digits[c >> 4];
+            p[5] = digits[c & 0xf];
+            p += 6;
+        } else {
+            *p++ = c;
+        }
+    }
+    *p++ = '"';
+    writer->len += p - start;
+}
+
+static void put_u8(ExportWriter *writer, unsigned value) {
+    unsigned char byte = value;
+    put_bytes(writer, &byte, 1);
+}
+
+static void put_le(ExportWriter *writer, uint64_t value, int bytes) {
+    unsigned char le[8];
+    for (int i = 0; i < bytes; i++) {
+        le[i] = (unsigned char)(value >> (8 * i));
+    }
+    put_bytes(writer, le, bytes);
+}
+
+static void put_blob(ExportWriter *writer, const char *s) {
+    size_t len = strlen(s);
+    put_le(writer, len, 4);
+    put_bytes(writer, s, len);
+}
+
+void export_begin(ExportWriter *writer, ExportFormat format) {
+    if (format == EXPORT_BINARY) {
+        put_bytes(writer, EXPORT_MAGIC, 8);
+    }
+}
+
+static void export_ndjson(ExportWriter *writer, const Commit *commit,
+                          const Commit *last, const Row *row, uint32_t row_number) {
+    put_str(writer, "{\"row\":");
+    put_uint(writer, row_number);
+    put_str(writer, ",\"commit\":");
+    put_hex(writer, commit->oid);
+    put_str(writer, ",\"lane\":");
+    put_uint(writer, *store_lane(&commit_store, row->commit));
+    put_str(writer, ",\"color\":");
+    put_uint(writer, row->color);
+
+    put_str(writer, ",\"parents\":[");
+    for (int j = 0; j < last->parent_count; j++) {
+        put_str(writer, j ? ",{\"commit\":" : "{\"commit\":");
+        put_hex(writer, last->parents + j * OID_RAWSZ);
+        put_str(writer, ",\"lane\":");
+        put_uint(writer, row->parent_lanes[j]);
+        put_bytes(writer, "}", 1);
+    }
+
+    // Ref names cannot contain spaces, so ", " only ever separates them
+    put_str(writer, "],\"refs\":[");
+    const char *ref = commit->refs;
+    while (*ref) {
+        const char *end = strstr(ref, ", ");
+        size_t len = end ? (size_t)(end - ref) : strlen(ref);
+        if (ref != commit->refs) {
+            put_bytes(writer, ",", 1);
+        }
+        put_json(writer, ref, len);
+        ref += len + (end ? 2 : 0);
+    }
+
+    put_str(writer, commit->is_merge ? "],\"merge\":true,\"pr\":"
+                                     : "],\"merge\":false,\"pr\":");
+    if (commit->is_pr) {
+        put_json(writer, commit->pr_number, strlen(commit->pr_number));
+    } else {
+        put_str(writer, "null");
+    }
+    put_str(writer, ",\"commit_time\":");
+    put_int(writer, commit->commit_time);
+    put_str(writer, ",\"author_time\":");
+    put_int(writer, commit->author_time);
+    put_str(writer, ",\"author_tz\":");
+    put_int(writer, commit->author_tz);
+    put_str(writer, ",\"author\":");
+    put_json(writer, commit->author, strlen(commit->author));
+    put_str(writer, ",\"subject\":");
+    put_json(writer, commit->subject, strlen(commit->subject));
+    put_str(writer, ",\"commits\":");
+    put_uint(writer, row->chain);
+    put_str(writer, "}\n");
+}
+
+static void export_binary(ExportWriter *writer, const Commit *commit,
+                          const Commit *last, const Row *row, uint32_t row_number) {
+    const char *pr = commit->is_pr ? commit->pr_number : "";
+    size_t length = 4 + 4 + 1 + 1 + 2 + OID_RAWSZ + 8 + 8 + 4 +
+                    (size_t)last->parent_count * (OID_RAWSZ + 4) +
+                    4 + strlen(commit->refs) + 4 + strlen(pr) +
+                    4 + strlen(commit->author) + 4 + strlen(commit->subject) + 4;
+
+    put_le(writer, length, 4);
+    put_le(writer, row_number, 4);
+    put_le(writer, *store_lane(&commit_store, row->commit), 4);
+    put_u8(writer, row->color);
+    put_u8(writer, (commit->is_merge ? EXPORT_FLAG_MERGE : 0) |
+                   (commit->is_pr ? EXPORT_FLAG_PR : 0));
+    put_le(writer, last->parent_count, 2);
+    put_bytes(writer, commit->oid, OID_RAWSZ);
+    put_le(writer, (uint64_t)(int64_t)commit->commit_time, 8);
+    put_le(writer, (uint64_t)(int64_t)commit->author_time, 8);
+    put_le(writer, (uint32_t)commit->author_tz, 4);
+    for (int j = 0; j < last->parent_count; j++) {
+        put_bytes(writer, last->parents + j * OID_RAWSZ, OID_RAWSZ);
+        put_le(writer, row->parent_lanes[j], 4);
+    }
+    put_blob(writer, commit->refs);
+    put_blob(writer, pr);
+    put_blob(writer, commit->author);
+    put_blob(writer, commit->subject);
+    put_le(writer, row->chain, 4);
+}
+
+void export_row(ExportWriter *writer, ExportFormat format, const Row *row,
+                uint32_t row_number) {
+    // A collapsed chain leads on from its last commit's parents
+    Commit commit, last;
+    store_get(&commit_store, row->commit, &commit);
+    last = commit;
+    if (row->chain > 1) {
+        int index = row->commit;
+        for (int i = 1; i < row->chain; i++) {
+            index = store_parent_index(&commit_store, index)[0];
+        }
+        store_get(&commit_store, index, &last);
+    }
+    if (format == EXPORT_BINARY) {
+        export_binary(writer, &commit, &last, row, row_number);
+    } else {
+        export_ndjson(writer, &commit, &last, row, row_number);
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef SHRUB_EXPORT_H
+#define SHRUB_EXPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "shrub.h"
+
+// --export: the laid-out tree as records for other programs, one per row,
+// written as each row is laid out.
+//
+// NDJSON, one object per line:
+//   {"row":0,"commit":"<hex>","lane":0,"color":3,
+//    "parents":[{"commit":"<hex>","lane":0}],"refs":["HEAD -> main"],
+//    "merge":false,"pr":"7","commit_time":1700000000,
+//    "author_time":1700000000,"author_tz":60,"author":"...","subject":"...",
+//    "commits":1}
+// "pr" is null for commits that are not pull request merges. With
+// --collapse a row can stand for a chain of "commits" commits; it shows
+// the first, and "parents" are those of the last.
+//
+// Binary: the 8 bytes "SHRUBGR1", then per row a u32 length of the rest
+// of the record followed by
+//   u32 row, u32 lane, u8 color, u8 flags (1 merge, 2 pull request),
+//   u16 parent count, 20-byte commit id, i64 commit time, i64 author time,
+//   i32 author zone in minutes, per parent a 20-byte id and u32 lane,
+//   then refs (joined by ", "), pull request number, author and subject,
+//   each a u32 length and that many bytes, and the u32 count of commits
+//   the row stands for.
+// Integers are little-endian. Readers skip fields past the ones they know
+// by the record length.
+
+#define EXPORT_MAGIC "SHRUBGR1"
+#define EXPORT_FLAG_MERGE 1
+#define EXPORT_FLAG_PR    2
+
+// Output buffered in large blocks on a file descriptor
+typedef struct {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t capacity;
+    int failed;             // a write failed, e.g. the reader went away
+} ExportWriter;
+
+int export_writer_init(ExportWriter *writer, int fd);
+// Returns -1 once any write has failed
+int export_flush(ExportWriter *writer);
+void export_writer_free(ExportWriter *writer);
+
+void export_begin(ExportWriter *writer, ExportFormat format);
+void export_row(ExportWriter *writer, ExportFormat format, const Row *row,
+                uint32_t row_number);
+
+#endif
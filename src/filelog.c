@@ -0,0 +1,1156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filelog.h"
+#include "bloom.h"
+#include "commit_graph.h"
+#include "diff.h"
+#include "oidmap.h"
+#include "store.h"
+#include "strbuf.h"
+#include "treediff.h"
+
+#define MODE_TYPE_MASK 0170000
+#define RENAME_LIMIT 1000
+
+// A commit reached by the walk
+typedef struct {
+    unsigned char oid[OID_RAWSZ];
+    unsigned char tree[OID_RAWSZ];
+    time_t commit_time;
+    uint32_t graph_pos;         // UINT32_MAX if the graph does not have it
+    int parent_start;           // into FileLog.parents
+    int parent_count;
+    int lookup_serial;          // path the entry below was looked up for
+    int has_entry;              // the path exists in this commit
+    unsigned mode;
+    unsigned char entry[OID_RAWSZ];
+} LogNode;
+
+typedef struct {
+    time_t commit_time;
+    unsigned long seq;          // insertion order, breaks date ties like git
+    int node;
+} LogQueueEntry;
+
+typedef struct {
+    Odb *odb;
+    CommitGraph *graph;
+    BloomIndex *bloom_index;    // .git/shrub-bloom as found
+    BloomWriter *bloom_writer;  // filters computed by this run
+    OidMap shallow;
+    OidMap node_index;          // commit id -> node
+    LogNode *nodes;
+    int node_count, node_capacity;
+    unsigned char (*parents)[OID_RAWSZ];
+    int parent_total, parent_capacity;
+    LogQueueEntry *queue;
+    int queue_count, queue_capacity;
+    unsigned long seq;
+
+    StrBuf path;                // the path being followed
+    int path_serial;            // bumped when a rename changes it
+    BloomKey *keys;             // the path and every directory above it
+    int key_count, key_capacity;
+    int key_serial, key_version, key_hashes;
+
+    PathTable paths;            // for the tree diffs below
+    uint32_t *changed;          // path id * 2 + is_dir, from the last diff
+    int changed_count, changed_capacity;
+    int failed;
+    FileLogStats *stats;
+} FileLog;
+
+static void queue_push(FileLog *log, int node) {
+    if (log->queue_count == log->queue_capacity) {
+        int capacity = log->queue_capacity ? log->queue_capacity * 2 : 256;
+        LogQueueEntry *grown = realloc(log->queue, capacity * sizeof(LogQueueEntry));
+        if (grown == NULL) {
+            log->failed = 1;
+            return;
+        }
+        log->queue = grown;
+        log->queue_capacity = capacity;
+    }
+
+    LogQueueEntry entry = { log->nodes[node].commit_time, log->seq++, node };
+    int i = log->queue_count++;
+    while (i > 0) {
+        LogQueueEntry *parent = &log->queue[(i - 1) / 2];
+        if (parent->commit_time > entry.commit_time ||
+            (parent->commit_time == entry.commit_time && parent->seq < entry.seq)) {
+            break;
+        }
+        log->queue[i] = *parent;
+        i = (i - 1) / 2;
+    }
+    log->queue[i] = entry;
+}
+
+static int queue_before(const LogQueueEntry *a, const LogQueueEntry *b) {
+    return a->commit_time > b->commit_time ||
+           (a->commit_time == b->commit_time && a->seq < b->seq);
+}
+
+static int queue_pop(FileLog *log) {
+    int node = log->queue[0].node;
+    LogQueueEntry last = log->queue[--log->queue_count];
+    int i = 0;
+    while (1) {
+        int child = 2 * i + 1;
+        if (child >= log->queue_count) {
+            break;
+        }
+        if (child + 1 < log->queue_count &&
+            queue_before(&log->queue[child + 1], &log->queue[child])) {
+            child++;
+        }
+        if (!queue_before(&log->queue[child], &last)) {
+            break;
+        }
+        log->queue[i] = log->queue[child];
+        i = child;
+    }
+    log->queue[i] = last;
+    return node;
+}
+
+static int add_parent(FileLog *log, const unsigned char *oid) {
+    if (log->parent_total == log->parent_capacity) {
+        int capacity = log->parent_capacity ? log->parent_capacity * 2 : 1024;
+        unsigned char (*grown)[OID_RAWSZ] = realloc(log->parents,
+                                                    (size_t)capacity * OID_RAWSZ);
+        if (grown == NULL) {
+            return -1;
+        }
+        log->parents = grown;
+        log->parent_capacity = capacity;
+    }
+    memcpy(log->parents[log->parent_total++], oid, OID_RAWSZ);
+    return 0;
+}
+
+// Tree, parents and date of a commit, from the graph or the object
+static int read_node(FileLog *log, LogNode *node) {
+    node->graph_pos = UINT32_MAX;
+    node->parent_start = log->parent_total;
+    node->parent_count = 0;
+
+    uint32_t pos;
+    if (log->graph && commit_graph_find(log->graph, node->oid, &pos) == 0) {
+        uint32_t local[8];
+        int count = commit_graph_parents(log->graph, pos, local, 8);
+        uint32_t *positions = local;
+        if (count > 8) {
+            positions = malloc(count * sizeof(uint32_t));
+            if (positions == NULL) {
+                return -1;
+            }
+            commit_graph_parents(log->graph, pos, positions, count);
+        }
+        for (int i = 0; i < count; i++) {
+            if (add_parent(log, commit_graph_oid(log->graph, positions[i])) != 0) {
+                count = -1;
+                break;
+            }
+        }
+        if (positions != local) {
+            free(positions);
+        }
+        if (count < 0) {
+            return -1;
+        }
+        node->graph_pos = pos;
+        node->parent_count = count;
+        memcpy(node->tree, commit_graph_tree(log->graph, pos), OID_RAWSZ);
+        node->commit_time = commit_graph_commit_time(log->graph, pos);
+    } else {
+        unsigned char *data;
+        size_t size;
+        ObjectType type;
+        if (odb_read(log->odb, node->oid, &type, &data, &size) != 0) {
+            return -1;
+        }
+        const char *tree = type == OBJ_COMMIT ? find_header((char *)data, "tree ") : NULL;
+        if (tree == NULL || hex_to_oid(tree, node->tree) != 0) {
+            free(data);
+            return -1;
+        }
+        // Parent lines follow the tree line
+        const char *line = strchr(tree, '\n');
+        while (line && strncmp(line + 1, "parent ", 7) == 0) {
+            unsigned char parent[OID_RAWSZ];
+            if (hex_to_oid(line + 8, parent) != 0 || add_parent(log, parent) != 0) {
+                free(data);
+                return -1;
+            }
+            node->parent_count++;
+            line = strchr(line + 1, '\n');
+        }
+        const char *committer = find_header((char *)data, "committer ");
+        node->commit_time = 0;
+        if (committer) {
+            parse_ident(committer, NULL, &node->commit_time, NULL);
+        }
+        free(data);
+    }
+
+    int value;
+    if (oidmap_get(&log->shallow, node->oid, &value)) {
+        node->parent_count = 0;
+    }
+    return 0;
+}
+
+// Node of a commit, reading it the first time; *added says it is new
+static int find_node(FileLog *log, const unsigned char *oid, int *added) {
+    int index;
+    *added = 0;
+    if (oidmap_get(&log->node_index, oid, &index)) {
+        return index;
+    }
+    if (log->node_count == log->node_capacity) {
+        int capacity = log->node_capacity ? log->node_capacity * 2 : 1024;
+        LogNode *grown = realloc(log->nodes, capacity * sizeof(LogNode));
+        if (grown == NULL) {
+            return -1;
+        }
+        log->nodes = grown;
+        log->node_capacity = capacity;
+    }
+
+    LogNode *node = &log->nodes[log->node_count];
+    memset(node, 0, sizeof(*node));
+    memcpy(node->oid, oid, OID_RAWSZ);
+    node->lookup_serial = -1;
+    if (read_node(log, node) != 0 ||
+        oidmap_put(&log->node_index, oid, log->node_count) != 0) {
+        return -1;
+    }
+    *added = 1;
+    return log->node_count++;
+}
+
+// Find a path in a tree. Returns 1 and its mode and id if it exists, 0 if
+// it does not, -1 if a tree cannot be read.
+static int lookup_path(Odb *odb, const unsigned char *tree, const char *path,
+                       unsigned *mode, unsigned char *oid) {
+    unsigned char current[OID_RAWSZ];
+    memcpy(current, tree, OID_RAWSZ);
+    const char *name = path;
+
+    while (1) {
+        const char *slash = strchr(name, '/');
+        size_t len = slash ? (size_t)(slash - name) : strlen(name);
+        unsigned char *data;
+        size_t size;
+        ObjectType type;
+        if (odb_read(odb, current, &type, &data, &size) != 0) {
+            return -1;
+        }
+        if (type != OBJ_TREE) {
+            free(data);
+            return 0;
+        }
+
+        int found = 0;
+        const unsigned char *p = data, *end = data + size;
+        while (p < end) {
+            unsigned entry_mode = 0;
+            while (p < end && *p >= '0' && *p <= '7') {
+                entry_mode = entry_mode * 8 + (*p++ - '0');
+            }
+            p++;
+            const unsigned char *nul = memchr(p, '\0', end - p);
+            if (nul == NULL || nul + 1 + OID_RAWSZ > end) {
+                break;
+            }
+            if ((size_t)(nul - p) == len && memcmp(p, name, len) == 0) {
+                *mode = entry_mode;
+                memcpy(current, nul + 1, OID_RAWSZ);
+                found = 1;
+                break;
+            }
+            p = nul + 1 + OID_RAWSZ;
+        }
+        free(data);
+
+        if (!found) {
+            return 0;
+        }
+        if (slash == NULL || slash[1] == '\0') {
+            memcpy(oid, current, OID_RAWSZ);
+            return 1;
+        }
+        name = slash + 1;
+    }
+}
+
+// The followed path in a commit, looked up once per path
+static int node_entry(FileLog *log, int index) {
+    LogNode *node = &log->nodes[index];
+    if (node->lookup_serial != log->path_serial) {
+        int found = lookup_path(log->odb, node->tree, log->path.data,
+                                &node->mode, node->entry);
+        if (found < 0) {
+            return -1;
+        }
+        node->has_entry = found;
+        node->lookup_serial = log->path_serial;
+    }
+    return node->has_entry;
+}
+
+// Bloom keys of the followed path and each directory above it
+static const BloomKey *query_keys(FileLog *log, int hash_version, int num_hashes) {
+    if (log->key_serial == log->path_serial && log->key_version == hash_version &&
+        log->key_hashes == num_hashes) {
+        return log->keys;
+    }
+
+    log->key_count = 0;
+    const char *path = log->path.data;
+    size_t len = log->path.len;
+    while (len > 0) {
+        if (log->key_count == log->key_capacity) {
+            int capacity = log->key_capacity ? log->key_capacity * 2 : 8;
+            BloomKey *grown = realloc(log->keys, capacity * sizeof(BloomKey));
+            if (grown == NULL) {
+                return NULL;
+            }
+            log->keys = grown;
+            log->key_capacity = capacity;
+        }
+        bloom_key_init(&log->keys[log->key_count++], path, len, hash_version,
+                       num_hashes);
+        while (len > 0 && path[len - 1] != '/') {
+            len--;
+        }
+        if (len > 0) {
+            len--;
+        }
+    }
+    log->key_serial = log->path_serial;
+    log->key_version = hash_version;
+    log->key_hashes = num_hashes;
+    return log->keys;
+}
+
+static void collect_change(void *ctx, uint32_t path, int is_dir) {
+    FileLog *log = ctx;
+    if (log->changed_count == log->changed_capacity) {
+        int capacity = log->changed_capacity ? log->changed_capacity * 2 : 256;
+        uint32_t *grown = realloc(log->changed, capacity * sizeof(uint32_t));
+        if (grown == NULL) {
+            log->failed = 1;
+            return;
+        }
+        log->changed = grown;
+        log->changed_capacity = capacity;
+    }
+    log->changed[log->changed_count++] = path * 2 + (is_dir ? 1 : 0);
+}
+
+// Every path a commit changed against its first parent, in log->changed
+static int diff_commit(FileLog *log, int index, int parent) {
+    TreeDiff diff = { log->odb, &log->paths, collect_change, log, NULL };
+    log->changed_count = 0;
+    const unsigned char *old_tree = parent >= 0 ? log->nodes[parent].tree : NULL;
+    if (tree_diff(&diff, old_tree, log->nodes[index].tree) != 0 || log->failed) {
+        return -1;
+    }
+    return 0;
+}
+
+static int compare_ids(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a / 2, y = *(const uint32_t *)b / 2;
+    return x < y ? -1 : x > y;
+}
+
+// Compute the filter git would store for a commit, and save it
+static unsigned char *build_filter(FileLog *log, int index, int parent,
+                                   size_t *len) {
+    if (diff_commit(log, index, parent) != 0) {
+        return NULL;
+    }
+
+    // A file and a directory of the same name share one key
+    qsort(log->changed, log->changed_count, sizeof(uint32_t), compare_ids);
+    BloomKey *keys = malloc((log->changed_count ? log->changed_count : 1) *
+                            sizeof(BloomKey));
+    if (keys == NULL) {
+        return NULL;
+    }
+    int count = 0;
+    StrBuf name;
+    sb_init(&name);
+    for (int i = 0; i < log->changed_count; i++) {
+        if (i > 0 && log->changed[i] / 2 == log->changed[i - 1] / 2) {
+            continue;
+        }
+        sb_reset(&name);
+        path_format(&log->paths, log->changed[i] / 2, 0, &name);
+        bloom_key_init(&keys[count++], name.data, name.len, BLOOM_HASH_VERSION,
+                       BLOOM_NUM_HASHES);
+    }
+    sb_free(&name);
+
+    unsigned char *filter = bloom_build(keys, count, len);
+    free(keys);
+    if (filter && log->bloom_writer &&
+        bloom_writer_add(log->bloom_writer, log->nodes[index].oid, filter, *len) == 0) {
+        log->stats->built++;
+    }
+    return filter;
+}
+
+// The commit's filter: the graph's, a saved one, or else computed now,
+// when *built is set to be freed and log->changed holds the diff. Returns
+// -1 if there is none.
+static int commit_filter(FileLog *log, int index, int parent,
+                         BloomFilter *filter, unsigned char **built) {
+    LogNode *node = &log->nodes[index];
+    *built = NULL;
+
+    // An empty filter was never computed, so look further
+    if (!(log->graph && node->graph_pos != UINT32_MAX &&
+          commit_graph_bloom(log->graph, node->graph_pos, filter) == 0 &&
+          filter->len > 0) &&
+        !(log->bloom_index &&
+          bloom_index_find(log->bloom_index, node->oid, filter) == 0 &&
+          filter->len > 0)) {
+        size_t len;
+        *built = build_filter(log, index, parent, &len);
+        if (*built == NULL) {
+            return -1;
+        }
+        filter->data = *built;
+        filter->len = len;
+        filter->hash_version = BLOOM_HASH_VERSION;
+        filter->num_hashes = BLOOM_NUM_HASHES;
+    }
+    log->stats->filtered++;
+    return 0;
+}
+
+// Ask the commit's filter whether the path may have changed: 1 if it
+// may, 0 if it certainly did not
+static int bloom_maybe_changed(FileLog *log, int index, int parent) {
+    BloomFilter filter;
+    unsigned char *built;
+    if (commit_filter(log, index, parent, &filter, &built) != 0) {
+        return 1;
+    }
+
+    int maybe = 1;
+    const BloomKey *keys = query_keys(log, filter.hash_version, filter.num_hashes);
+    for (int i = 0; keys && i < log->key_count && maybe; i++) {
+        maybe = bloom_contains(&filter, &keys[i]);
+    }
+    free(built);
+    return maybe;
+}
+
+static int read_blob(Odb *odb, const unsigned char *oid, unsigned char **data,
+                     size_t *size) {
+    ObjectType type;
+    if (odb_read(odb, oid, &type, data, size) != 0) {
+        return -1;
+    }
+    if (type != OBJ_BLOB) {
+        free(*data);
+        return -1;
+    }
+    return 0;
+}
+
+// The file a commit deleted that an added file of this mode and id was
+// renamed from, if any, into `best_name`. Exact copies win, then the most
+// similar file. log->changed must hold the commit's diff.
+static void find_rename_source(FileLog *log, int index, int parent,
+                               unsigned mode, const unsigned char *target,
+                               StrBuf *best_name) {
+    StrBuf name;
+    sb_init(&name);
+    unsigned char *target_data = NULL;
+    size_t target_size = 0;
+    int best_score = 0, exact = 0, candidates = 0;
+
+    for (int i = 0; i < log->changed_count && !exact; i++) {
+        if (log->changed[i] & 1) {
+            continue;
+        }
+        sb_reset(&name);
+        path_format(&log->paths, log->changed[i] / 2, 0, &name);
+        unsigned old_mode, new_mode;
+        unsigned char old_oid[OID_RAWSZ], new_oid[OID_RAWSZ];
+        if (lookup_path(log->odb, log->nodes[index].tree, name.data, &new_mode,
+                        new_oid) != 0 ||
+            lookup_path(log->odb, log->nodes[parent].tree, name.data, &old_mode,
+                        old_oid) != 1 ||
+            ((old_mode ^ mode) & MODE_TYPE_MASK) != 0) {
+            continue;   // not deleted here, or not the same kind of file
+        }
+
+        if (memcmp(old_oid, target, OID_RAWSZ) == 0) {
+            exact = 1;
+            sb_reset(best_name);
+            sb_append_len(best_name, name.data, name.len);
+            break;
+        }
+        if (candidates++ >= RENAME_LIMIT) {
+            continue;
+        }
+        if (target_data == NULL &&
+            read_blob(log->odb, target, &target_data, &target_size) != 0) {
+            break;
+        }
+        unsigned char *data;
+        size_t size;
+        if (read_blob(log->odb, old_oid, &data, &size) != 0) {
+            continue;
+        }
+        // An empty file is not taken as the source of a rename
+        int score = size > 0 ? diff_similarity(data, size, target_data, target_size) : 0;
+        free(data);
+        if (score >= DIFF_MIN_RENAME_SCORE && score > best_score) {
+            best_score = score;
+            sb_reset(best_name);
+            sb_append_len(best_name, name.data, name.len);
+        }
+    }
+    free(target_data);
+    sb_free(&name);
+}
+
+// The commit added the followed path; if a file it deleted is the same or
+// similar enough, carry on under that file's name
+static int follow_rename(FileLog *log, int index, int parent) {
+    LogNode *node = &log->nodes[index];
+    unsigned mode = node->mode;
+    unsigned char target[OID_RAWSZ];
+    memcpy(target, node->entry, OID_RAWSZ);
+    if (diff_commit(log, index, parent) != 0) {
+        return -1;
+    }
+
+    StrBuf best_name;
+    sb_init(&best_name);
+    find_rename_source(log, index, parent, mode, target, &best_name);
+    if (best_name.len > 0) {
+        sb_reset(&log->path);
+        sb_append_len(&log->path, best_name.data, best_name.len);
+        log->path_serial++;
+        log->stats->renames++;
+    }
+    sb_free(&best_name);
+    return 0;
+}
+
+// 1 if a non-merge commit changed the followed path, 0 if not
+static int path_changed(FileLog *log, int index, int parent) {
+    int maybe = -1;
+    if (parent >= 0) {
+        maybe = bloom_maybe_changed(log, index, parent);
+        if (maybe == 0) {
+            log->stats->skipped++;
+            return 0;
+        }
+    }
+
+    int has = node_entry(log, index);
+    int had = parent >= 0 ? node_entry(log, parent) : 0;
+    if (has < 0 || had < 0) {
+        return -1;
+    }
+    LogNode *node = &log->nodes[index];
+    int changed = has != had ||
+                  (has && (node->mode != log->nodes[parent].mode ||
+                           memcmp(node->entry, log->nodes[parent].entry, OID_RAWSZ) != 0));
+    if (maybe == 1 && !changed) {
+        log->stats->false_positives++;
+    }
+    if (changed && has && !had && parent >= 0) {
+        if (follow_rename(log, index, parent) != 0) {
+            return -1;
+        }
+    }
+    return changed;
+}
+
+static void append_line(FileLog *log, CommitText *text, int index, StrBuf *out) {
+    Commit commit;
+    memset(&commit, 0, sizeof(commit));
+    memcpy(commit.oid, log->nodes[index].oid, OID_RAWSZ);
+    commit.is_lazy = 1;
+    commit.refs = "";
+    if (commit_text_fill(text, &commit) != 0) {
+        log->failed = 1;
+        return;
+    }
+
+    char hex[OID_HEXSZ + 1];
+    char date[DATE_LENGTH];
+    oid_to_hex(commit.oid, hex);
+    format_iso_date(commit.author_time, commit.author_tz, date, sizeof(date));
+    sb_appendf(out, "%.*s %s (%s, %s)\n", odb_abbrev_len(log->odb, commit.oid),
+               hex, commit.subject, commit.author, date);
+}
+
+static void load_shallow(FileLog *log, const char *git_dir) {
+    char *common_dir = git_common_dir(git_dir);
+    char path[MAX_COMMAND_LENGTH];
+    snprintf(path, sizeof(path), "%s/shallow", common_dir ? common_dir : git_dir);
+    free(common_dir);
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return;
+    }
+    char line[MAX_LINE_LENGTH];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        unsigned char oid[OID_RAWSZ];
+        if (hex_to_oid(line, oid) == 0) {
+            oidmap_put(&log->shallow, oid, 1);
+        }
+    }
+    fclose(fp);
+}
+
+// Queue HEAD for the walk. Returns 1, or 0 when there are no commits
+static int start_walk(FileLog *log) {
+    char *head = execute_command("git rev-parse --verify -q HEAD 2>/dev/null");
+    unsigned char oid[OID_RAWSZ];
+    if (hex_to_oid(head, oid) != 0) {
+        return 0;
+    }
+    int added;
+    int start = find_node(log, oid, &added);
+    if (start < 0) {
+        return -1;
+    }
+    queue_push(log, start);
+    return 1;
+}
+
+// Take the newest commit waiting and queue its parents the first time
+// they are seen. Returns the commit, with its first parent in *parent (-1
+// for a root) and how many it has in *parent_count, or -1 when the walk
+// is over or has failed.
+static int next_commit(FileLog *log, int *parent, int *parent_count) {
+    if (log->queue_count == 0 || log->failed) {
+        return -1;
+    }
+    int index = queue_pop(log);
+    *parent = -1;
+    *parent_count = log->nodes[index].parent_count;
+    for (int i = 0; i < *parent_count; i++) {
+        // Reading the parent may move the parent array
+        unsigned char parent_oid[OID_RAWSZ];
+        memcpy(parent_oid, log->parents[log->nodes[index].parent_start + i],
+               OID_RAWSZ);
+        int added;
+        int p = find_node(log, parent_oid, &added);
+        if (p < 0) {
+            log->failed = 1;
+            return -1;
+        }
+        if (added) {
+            queue_push(log, p);
+        }
+        if (i == 0) {
+            *parent = p;
+        }
+    }
+    return index;
+}
+
+static int walk_file_history(FileLog *log, CommitText *text, StrBuf *out) {
+    int started = start_walk(log);
+    if (started <= 0) {
+        return started;     // no commits, nothing to show
+    }
+
+    // Renames change the path as the walk goes, so every commit is looked
+    // at rather than pruning the history that leaves the path untouched
+    int index, parent, parent_count;
+    while ((index = next_commit(log, &parent, &parent_count)) >= 0) {
+        if (parent_count > 1) {
+            continue;   // a merge shows no diff, so it is not listed
+        }
+
+        log->stats->commits++;
+        int changed = path_changed(log, index, parent);
+        if (changed < 0) {
+            return -1;
+        }
+        if (changed) {
+            append_line(log, text, index, out);
+            log->stats->shown++;
+        }
+    }
+    return log->failed ? -1 : 0;
+}
+// Keep the filters this run computed, along with the ones already saved
+static void save_filters(FileLog *log, const char *git_dir) {
+    if (bloom_writer_count(log->bloom_writer) == 0) {
+        return;
+    }
+    uint32_t count = log->bloom_index ? bloom_index_count(log->bloom_index) : 0;
+    for (uint32_t i = 0; i < count; i++) {
+        const unsigned char *oid;
+        BloomFilter filter;
+        bloom_index_entry(log->bloom_index, i, &oid, &filter);
+        if (bloom_writer_add(log->bloom_writer, oid, filter.data, filter.len) != 0) {
+            return;
+        }
+    }
+    bloom_writer_commit(log->bloom_writer, git_dir);
+}
+
+static int log_open(FileLog *log, const char *git_dir, FileLogStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    memset(log, 0, sizeof(*log));
+    log->stats = stats;
+    log->key_serial = -1;
+
+    log->odb = odb_open(git_dir);
+    if (log->odb == NULL ||
+        oidmap_init(&log->node_index, 1024) != 0 ||
+        oidmap_init(&log->shallow, 16) != 0 ||
+        path_table_init(&log->paths) != 0) {
+        odb_close(log->odb);
+        oidmap_free(&log->node_index);
+        oidmap_free(&log->shallow);
+        return -1;
+    }
+    log->graph = commit_graph_open(odb_objects_dir(log->odb));
+    log->bloom_index = bloom_index_open(git_dir);
+    log->bloom_writer = bloom_writer_new();
+    load_shallow(log, git_dir);
+    sb_init(&log->path);
+    return 0;
+}
+
+static void log_close(FileLog *log) {
+    bloom_writer_free(log->bloom_writer);
+    bloom_index_close(log->bloom_index);
+    commit_graph_close(log->graph);
+    odb_close(log->odb);
+    oidmap_free(&log->node_index);
+    oidmap_free(&log->shallow);
+    path_table_free(&log->paths);
+    sb_free(&log->path);
+    free(log->nodes);
+    free(log->parents);
+    free(log->queue);
+    free(log->keys);
+    free(log->changed);
+}
+
+int file_log(const char *git_dir, const char *path, StrBuf *out,
+             FileLogStats *stats) {
+    FileLog log;
+    if (log_open(&log, git_dir, stats) != 0) {
+        return -1;
+    }
+    CommitText *text = commit_text_open(git_dir, READER_NATIVE);
+    if (text == NULL) {
+        log_close(&log);
+        return -1;
+    }
+    sb_append(&log.path, path);
+
+    int status = walk_file_history(&log, text, out);
+    if (status == 0 && log.bloom_writer) {
+        save_filters(&log, git_dir);
+    }
+    commit_text_close(text);
+    log_close(&log);
+    return status;
+}
+
+// Many paths, one walk. Each path keeps the name it is followed under, and
+// the names and the directories above them form a trie of path ids. A
+// commit's filter is asked about the trie from the top, so a directory
+// the commit did not touch rules out every path below it; a commit that
+// may have changed one of them is diffed once for all of them.
+typedef struct {
+    const char *name;           // as asked for
+    StrBuf path;                // followed now
+    uint32_t id;
+    int next;                   // next path followed under the same id, or -1
+    int commits;
+    int hit_serial;             // commit it was last found changed in
+} BatchPath;
+
+typedef struct {
+    uint32_t id;
+    int followed;               // a followed path, not only a directory above one
+    int child;                  // first child, -1 for none
+    int sibling;                // next child of the same directory, -1 at the end
+    BloomKey key;
+} TrieNode;
+
+typedef struct {
+    FileLog *log;
+    BatchPath *paths;
+    int count;
+    int *followers;             // path id -> first path followed under it, or -1
+    uint32_t follower_count;
+    TrieNode *trie;
+    int trie_count, trie_capacity;
+    int roots;                  // first top-level node, -1 for none
+    int *stack;
+    int key_version, key_hashes;
+    int *hits;                  // paths the commit being looked at changed
+    int hit_count;
+} BatchLog;
+
+// Id of a path relative to the top of the work tree, or -1
+static int intern_path(PathTable *paths, const char *path) {
+    int id = PATH_ROOT;
+    while (*path) {
+        size_t len = strcspn(path, "/");
+        if (len > 0) {
+            id = path_intern(paths, (uint32_t)id, path, len);
+            if (id < 0) {
+                return -1;
+            }
+        }
+        path += len;
+        while (*path == '/') {
+            path++;
+        }
+    }
+    return id == PATH_ROOT ? -1 : id;
+}
+
+static int trie_add(BatchLog *batch, uint32_t id, int parent, int *node_of) {
+    if (node_of[id] >= 0) {
+        return node_of[id];
+    }
+    if (batch->trie_count == batch->trie_capacity) {
+        int capacity = batch->trie_capacity ? batch->trie_capacity * 2 : 64;
+        TrieNode *grown = realloc(batch->trie, capacity * sizeof(TrieNode));
+        if (grown == NULL) {
+            return -1;
+        }
+        batch->trie = grown;
+        batch->trie_capacity = capacity;
+    }
+    int index = batch->trie_count++;
+    TrieNode *node = &batch->trie[index];
+    memset(node, 0, sizeof(*node));
+    node->id = id;
+    node->child = -1;
+    int *first = parent >= 0 ? &batch->trie[parent].child : &batch->roots;
+    node->sibling = *first;
+    *first = index;
+    node_of[id] = index;
+    return index;
+}
+
+// Lay out the trie and the id -> path index for the names followed now
+static int build_trie(BatchLog *batch) {
+    PathTable *paths = &batch->log->paths;
+    uint32_t count = paths->count;
+    int *followers = realloc(batch->followers, count * sizeof(int));
+    int *node_of = malloc(count * sizeof(int));
+    if (followers == NULL || node_of == NULL) {
+        free(node_of);
+        if (followers) {
+            batch->followers = followers;
+        }
+        return -1;
+    }
+    batch->followers = followers;
+    batch->follower_count = count;
+    for (uint32_t i = 0; i < count; i++) {
+        followers[i] = -1;
+        node_of[i] = -1;
+    }
+    batch->trie_count = 0;
+    batch->roots = -1;
+    batch->key_version = -1;
+
+    uint32_t chain[MAX_COMMAND_LENGTH];
+    for (int i = 0; i < batch->count; i++) {
+        BatchPath *path = &batch->paths[i];
+        path->next = followers[path->id];
+        followers[path->id] = i;
+
+        // The directories above the path, top one first
+        int depth = 0;
+        for (uint32_t id = path->id; id != PATH_ROOT && depth < MAX_COMMAND_LENGTH;
+             id = paths->parent[id]) {
+            chain[depth++] = id;
+        }
+        int node = -1;
+        while (depth > 0 && (node = trie_add(batch, chain[--depth], node, node_of)) >= 0) {
+        }
+        if (node < 0) {
+            free(node_of);
+            return -1;
+        }
+        batch->trie[node].followed = 1;
+    }
+    free(node_of);
+
+    int *stack = realloc(batch->stack, (batch->trie_count + 1) * sizeof(int));
+    if (stack == NULL) {
+        return -1;
+    }
+    batch->stack = stack;
+    return 0;
+}
+
+// 1 if the filter says some followed path may have changed, 0 if none did
+static int trie_maybe_changed(BatchLog *batch, const BloomFilter *filter) {
+    if (batch->key_version != filter->hash_version ||
+        batch->key_hashes != filter->num_hashes) {
+        StrBuf name;
+        sb_init(&name);
+        for (int i = 0; i < batch->trie_count; i++) {
+            sb_reset(&name);
+            path_format(&batch->log->paths, batch->trie[i].id, 0, &name);
+            bloom_key_init(&batch->trie[i].key, name.data, name.len,
+                           filter->hash_version, filter->num_hashes);
+        }
+        sb_free(&name);
+        batch->key_version = filter->hash_version;
+        batch->key_hashes = filter->num_hashes;
+    }
+
+    int top = 0;
+    for (int n = batch->roots; n >= 0; n = batch->trie[n].sibling) {
+        batch->stack[top++] = n;
+    }
+    while (top > 0) {
+        const TrieNode *node = &batch->trie[batch->stack[--top]];
+        if (!bloom_contains(filter, &node->key)) {
+            continue;
+        }
+        if (node->followed) {
+            return 1;
+        }
+        for (int n = node->child; n >= 0; n = batch->trie[n].sibling) {
+            batch->stack[top++] = n;
+        }
+    }
+    return 0;
+}
+
+static void append_record(FileLog *log, CommitText *text, int index,
+                          const BatchPath *path, StrBuf *out) {
+    Commit commit;
+    memset(&commit, 0, sizeof(commit));
+    memcpy(commit.oid, log->nodes[index].oid, OID_RAWSZ);
+    commit.is_lazy = 1;
+    commit.refs = "";
+    if (commit_text_fill(text, &commit) != 0) {
+        log->failed = 1;
+        return;
+    }
+
+    char hex[OID_HEXSZ + 1];
+    char date[DATE_LENGTH];
+    oid_to_hex(commit.oid, hex);
+    format_iso_date(commit.author_time, commit.author_tz, date, sizeof(date));
+    sb_append(out, "{\"path\":");
+    sb_append_json(out, path->name);
+    sb_append(out, ",\"file\":");
+    sb_append_json(out, path->path.data);
+    sb_appendf(out, ",\"commit\":\"%s\",\"author\":", hex);
+    sb_append_json(out, commit.author);
+    sb_appendf(out, ",\"date\":\"%s\",\"subject\":", date);
+    sb_append_json(out, commit.subject);
+    sb_append(out, "}\n");
+}
+
+static int compare_hits(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+// Find the paths a non-merge commit changed, write a record for each, and
+// follow the ones it added to their older names
+static int batch_commit(BatchLog *batch, CommitText *text, int index, int parent,
+                        StrBuf *out) {
+    FileLog *log = batch->log;
+    int diffed = 0, maybe = -1;
+    if (parent >= 0) {
+        BloomFilter filter;
+        unsigned char *built;
+        if (commit_filter(log, index, parent, &filter, &built) == 0) {
+            diffed = built != NULL;
+            maybe = trie_maybe_changed(batch, &filter);
+            free(built);
+            if (maybe == 0) {
+                log->stats->skipped++;
+                return 0;
+            }
+        }
+    }
+    if (!diffed && diff_commit(log, index, parent) != 0) {
+        return -1;
+    }
+
+    batch->hit_count = 0;
+    for (int i = 0; i < log->changed_count; i++) {
+        uint32_t id = log->changed[i] / 2;
+        for (int p = id < batch->follower_count ? batch->followers[id] : -1; p >= 0;
+             p = batch->paths[p].next) {
+            // A file and a directory of the same name may both be listed
+            if (batch->paths[p].hit_serial != index) {
+                batch->paths[p].hit_serial = index;
+                batch->hits[batch->hit_count++] = p;
+            }
+        }
+    }
+    if (batch->hit_count == 0) {
+        if (maybe == 1) {
+            log->stats->false_positives++;
+        }
+        return 0;
+    }
+
+    // Records first, under the names the commit has, in the order the
+    // paths were asked for
+    qsort(batch->hits, batch->hit_count, sizeof(int), compare_hits);
+    for (int i = 0; i < batch->hit_count; i++) {
+        BatchPath *path = &batch->paths[batch->hits[i]];
+        append_record(log, text, index, path, out);
+        path->commits++;
+        log->stats->shown++;
+    }
+    if (parent < 0) {
+        return log->failed ? -1 : 0;
+    }
+
+    int renamed = 0;
+    StrBuf source;
+    sb_init(&source);
+    for (int i = 0; i < batch->hit_count; i++) {
+        BatchPath *path = &batch->paths[batch->hits[i]];
+        unsigned mode, old_mode;
+        unsigned char entry[OID_RAWSZ], old_entry[OID_RAWSZ];
+        int has = lookup_path(log->odb, log->nodes[index].tree, path->path.data,
+                              &mode, entry);
+        int had = lookup_path(log->odb, log->nodes[parent].tree, path->path.data,
+                              &old_mode, old_entry);
+        if (has < 0 || had < 0) {
+            sb_free(&source);
+            return -1;
+        }
+        if (!has || had) {
+            continue;
+        }
+        sb_reset(&source);
+        find_rename_source(log, index, parent, mode, entry, &source);
+        int id = source.len > 0 ? intern_path(&log->paths, source.data) : -1;
+        if (id >= 0) {
+            sb_reset(&path->path);
+            sb_append_len(&path->path, source.data, source.len);
+            path->id = (uint32_t)id;
+            log->stats->renames++;
+            renamed = 1;
+        }
+    }
+    sb_free(&source);
+    if (renamed && build_trie(batch) != 0) {
+        return -1;
+    }
+    return log->failed ? -1 : 0;
+}
+
+static int walk_batch_history(BatchLog *batch, CommitText *text, FILE *out) {
+    FileLog *log = batch->log;
+    int started = start_walk(log);
+    if (started <= 0) {
+        return started;
+    }
+
+    StrBuf records;
+    sb_init(&records);
+    int index, parent, parent_count;
+    while ((index = next_commit(log, &parent, &parent_count)) >= 0) {
+        if (parent_count > 1) {
+            continue;
+        }
+        log->stats->commits++;
+        if (batch_commit(batch, text, index, parent, &records) != 0) {
+            sb_free(&records);
+            return -1;
+        }
+        // Each commit's records go out as soon as they are found
+        if (records.len > 0) {
+            fwrite(records.data, 1, records.len, out);
+            fflush(out);
+            sb_reset(&records);
+        }
+    }
+    sb_free(&records);
+    return log->failed ? -1 : 0;
+}
+
+int file_log_batch(const char *git_dir, const char *const *paths, int count,
+                   FILE *out, FileLogStats *stats) {
+    FileLog log;
+    if (log_open(&log, git_dir, stats) != 0) {
+        return -1;
+    }
+    CommitText *text = commit_text_open(git_dir, READER_NATIVE);
+    BatchLog batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.log = &log;
+    batch.paths = calloc(count ? count : 1, sizeof(BatchPath));
+    batch.hits = malloc((count ? count : 1) * sizeof(int));
+    int status = text && batch.paths && batch.hits ? 0 : -1;
+    for (int i = 0; i < count && status == 0; i++) {
+        BatchPath *path = &batch.paths[i];
+        sb_init(&path->path);
+        sb_append(&path->path, paths[i]);
+        int id = intern_path(&log.paths, paths[i]);
+        path->name = paths[i];
+        path->id = (uint32_t)id;
+        path->hit_serial = -1;
+        batch.count++;
+        if (id < 0) {
+            status = -1;
+        }
+    }
+    if (status == 0) {
+        status = build_trie(&batch);
+    }
+    if (status == 0) {
+        status = walk_batch_history(&batch, text, out);
+    }
+    if (status == 0) {
+        StrBuf summary;
+        sb_init(&summary);
+        for (int i = 0; i < batch.count; i++) {
+            sb_append(&summary, "{\"path\":");
+            sb_append_json(&summary, batch.paths[i].name);
+            sb_appendf(&summary, ",\"commits\":%d}\n", batch.paths[i].commits);
+        }
+        fwrite(summary.data, 1, summary.len, out);
+        fflush(out);
+        sb_free(&summary);
+        if (log.bloom_writer) {
+            save_filters(&log, git_dir);
+        }
+    }
+
+    for (int i = 0; i < batch.count; i++) {
+        sb_free(&batch.paths[i].path);
+    }
+    free(batch.paths);
+    free(batch.hits);
+    free(batch.followers);
+    free(batch.trie);
+    free(batch.stack);
+    commit_text_close(text);
+    log_close(&log);
+    return status;
+}
@@ -0,0 +1,40 @@
+#ifndef SHRUB_FILELOG_H
+#define SHRUB_FILELOG_H
+
+#include "shrub.h"
+
+// History of one file, as `git log --follow -- <path>` lists it: every
+// commit from HEAD, newest first, whose diff against its first parent
+// touches the path; merges are left out. When the file turns out to have
+// been added by a rename, older commits are searched under the old name.
+//
+// Changed-path Bloom filters decide most commits without a tree diff:
+// those in the commit-graph file when it has them, otherwise ones shrub
+// builds and keeps in .git/shrub-bloom.
+
+typedef struct {
+    int commits;            // non-merge commits looked at
+    int shown;
+    int filtered;           // commits that had a Bloom filter
+    int skipped;            // filter said the path certainly did not change
+    int false_positives;    // filter said maybe, the path did not change
+    int built;              // filters computed and saved this run
+    int renames;            // times the path was followed to an older name
+} FileLogStats;
+
+// Append one "<hash> <subject> (<author>, <date>)" line per commit to
+// `out`. `path` is relative to the top of the work tree. Returns -1 if
+// the repository cannot be read natively.
+int file_log(const char *git_dir, const char *path, struct StrBuf *out,
+             FileLogStats *stats);
+
+// The histories of many paths from a single walk, as NDJSON on `out`: a
+// {"path","file","commit","author","date","subject"} record per commit
+// and path, written as each commit is found ("file" is the name the path
+// had then), and a {"path","commits"} summary per path once the walk is
+// done. Stats cover all the paths. Returns -1 if the repository cannot be
+// read natively; records already written stay written.
+int file_log_batch(const char *git_dir, const char *const *paths, int count,
+                   FILE *out, FileLogStats *stats);
+
+#endif
@@ -0,0 +1,575 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "oidmap.h"
+#include "shrub.h"
+#include "strbuf.h"
+
+// The graph is drawn in lanes, one per line of history that is waiting
+// for a commit further down. A commit takes the lane that waits for it
+// (or a free one if it is a tip), hands the lane on to its first parent
+// and opens lanes for any other parents. Freed lanes are reused in place
+// rather than compacted, so lines never have to shift sideways, and each
+// row costs time in the number of active lanes only.
+
+// Edge from a laid-out commit to a parent that has not arrived yet
+typedef struct {
+    int child;          // commit index
+    int parent;         // which of the child's parents
+    int next;           // next edge waiting in the same lane, or -1
+} PendingEdge;
+
+typedef struct {
+    unsigned char oid[OID_RAWSZ];   // commit this lane is waiting for
+    int active;
+    int color;
+    int edges;                      // first edge waiting here, or -1
+} Lane;
+
+// Layout state; rows are laid out one at a time in display order
+static Lane *lanes = NULL;
+static int lane_count = 0;          // lanes in use, trailing free ones trimmed
+static int lane_capacity = 0;
+static int next_color = 0;
+static OidMap branch_colors;        // branch tip -> its color
+static PendingEdge *pending_edges = NULL;
+static int pending_capacity = 0;
+static int pending_used = 0;
+static int free_edge = -1;
+static int *join_lanes = NULL;      // scratch: other lanes ending at a commit
+static int join_capacity = 0;
+
+// --ahead-behind counts of the local branches
+typedef struct {
+    char *name;         // as decorations show it, without refs/heads/
+    int ahead;
+    int behind;
+    int next;           // next branch at the same tip, or -1
+} BranchCounts;
+
+static BranchCounts *branch_counts = NULL;
+static int branch_count = 0;
+static int branch_count_capacity = 0;
+static OidMap branch_count_index;   // branch tip -> its first entry
+
+void layout_reset() {
+    free(lanes);
+    free(pending_edges);
+    free(join_lanes);
+    lanes = NULL;
+    lane_count = 0;
+    lane_capacity = 0;
+    next_color = 0;
+    oidmap_free(&branch_colors);
+    pending_edges = NULL;
+    pending_capacity = 0;
+    pending_used = 0;
+    free_edge = -1;
+    join_lanes = NULL;
+    join_capacity = 0;
+    for (int i = 0; i < branch_count; i++) {
+        free(branch_counts[i].name);
+    }
+    free(branch_counts);
+    oidmap_free(&branch_count_index);
+    branch_counts = NULL;
+    branch_count = 0;
+    branch_count_capacity = 0;
+}
+
+int layout_add_branch(const unsigned char *oid, const char *name) {
+    int color;
+    if (branch_colors.size == 0 && oidmap_init(&branch_colors, 64) != 0) {
+        return -1;
+    }
+    if (oidmap_get(&branch_colors, oid, &color)) {
+        return 0;
+    }
+    return oidmap_put(&branch_colors, oid, branch_color(name));
+}
+
+int render_add_ahead_behind(const unsigned char *oid, const char *name,
+                            int ahead, int behind) {
+    if (branch_count_index.size == 0 && oidmap_init(&branch_count_index, 64) != 0) {
+        return -1;
+    }
+    if (branch_count == branch_count_capacity) {
+        int capacity = branch_count_capacity ? branch_count_capacity * 2 : 16;
+        BranchCounts *grown = realloc(branch_counts, capacity * sizeof(BranchCounts));
+        if (grown == NULL) {
+            return -1;
+        }
+        branch_counts = grown;
+        branch_count_capacity = capacity;
+    }
+    BranchCounts *entry = &branch_counts[branch_count];
+    if ((entry->name = strdup(name)) == NULL) {
+        return -1;
+    }
+    entry->ahead = ahead;
+    entry->behind = behind;
+    if (!oidmap_get(&branch_count_index, oid, &entry->next)) {
+        entry->next = -1;
+    }
+    return oidmap_put(&branch_count_index, oid, branch_count++);
+}
+
+// The counts of a branch decorating this commit, or NULL
+static const BranchCounts *find_branch_counts(const unsigned char *oid,
+                                              const char *name) {
+    int i;
+    if (branch_count_index.size == 0 || !oidmap_get(&branch_count_index, oid, &i)) {
+        return NULL;
+    }
+    for (; i >= 0; i = branch_counts[i].next) {
+        if (strcmp(branch_counts[i].name, name) == 0) {
+            return &branch_counts[i];
+        }
+    }
+    return NULL;
+}
+
+static int new_edge() {
+    if (free_edge >= 0) {
+        int edge = free_edge;
+        free_edge = pending_edges[edge].next;
+        return edge;
+    }
+    if (pending_used == pending_capacity) {
+        int capacity = pending_capacity ? pending_capacity * 2 : 64;
+        PendingEdge *grown = realloc(pending_edges, capacity * sizeof(PendingEdge));
+        if (grown == NULL) {
+            return -1;
+        }
+        pending_edges = grown;
+        pending_capacity = capacity;
+    }
+    return pending_used++;
+}
+
+// Lowest free lane, growing the table if every lane is busy
+static int open_lane(const unsigned char *oid) {
+    int lane = 0;
+    while (lane < lane_count && lanes[lane].active) {
+        lane++;
+    }
+    if (lane == lane_count) {
+        if (lane_count == lane_capacity) {
+            int capacity = lane_capacity ? lane_capacity * 2 : 16;
+            Lane *grown = realloc(lanes, capacity * sizeof(Lane));
+            if (grown == NULL) {
+                return -1;
+            }
+            lanes = grown;
+            lane_capacity = capacity;
+        }
+        lane_count++;
+    }
+
+    memcpy(lanes[lane].oid, oid, OID_RAWSZ);
+    lanes[lane].active = 1;
+    int color;
+    if (branch_colors.size == 0 || !oidmap_get(&branch_colors, oid, &color)) {
+        color = next_color++ % COLOR_COUNT;
+    }
+    lanes[lane].color = color;
+    lanes[lane].edges = -1;
+    return lane;
+}
+
+static int find_lane(const unsigned char *oid) {
+    for (int lane = 0; lane < lane_count; lane++) {
+        if (lanes[lane].active && memcmp(lanes[lane].oid, oid, OID_RAWSZ) == 0) {
+            return lane;
+        }
+    }
+    return -1;
+}
+
+// The commit arrived: its children's edges waiting in this lane resolve
+// to its index
+static void close_lane(int lane, int index) {
+    int edge = lanes[lane].edges;
+    while (edge >= 0) {
+        PendingEdge *pending = &pending_edges[edge];
+        store_parent_index(&commit_store, pending->child)[pending->parent] = index;
+
+        int next = pending->next;
+        pending->next = free_edge;
+        free_edge = edge;
+        edge = next;
+    }
+    lanes[lane].edges = -1;
+    lanes[lane].active = 0;
+}
+
+static void wait_in_lane(int lane, int child, int parent) {
+    int edge = new_edge();
+    if (edge >= 0) {
+        pending_edges[edge].child = child;
+        pending_edges[edge].parent = parent;
+        pending_edges[edge].next = lanes[lane].edges;
+        lanes[lane].edges = edge;
+    }
+}
+
+// Draw a horizontal line on one line of cells between two lanes; the end
+// at `to` takes the given vertical bits
+static void draw_span(Cell *line, int from, int to, int end_bits, int color) {
+    int step = to > from ? 1 : -1;
+    line[from].mask |= step > 0 ? LINE_RIGHT : LINE_LEFT;
+    for (int x = from + step; x != to; x += step) {
+        line[x].mask |= LINE_LEFT | LINE_RIGHT;
+        if (!(line[x].mask & (LINE_UP | LINE_DOWN))) {
+            line[x].color = color;
+        }
+    }
+    line[to].mask |= end_bits | (step > 0 ? LINE_LEFT : LINE_RIGHT);
+    line[to].color = color;
+}
+
+// Place the next commit in display order. Children always come first, so
+// this is also where their parent ids are turned into commit indices.
+// Returns -1 when out of memory.
+int layout_commit(int index, Row *row) {
+    return layout_chain(index, 1, row);
+}
+
+// A chain takes its lane at the top commit and leaves it towards the last
+// commit's parents. The commits in between have no other edges, so the
+// lanes beside them just pass by and the row can be expanded when drawn.
+int layout_chain(int index, int length, Row *row) {
+    Commit commit;
+    store_get(&commit_store, index, &commit);
+    int last = index;
+    for (int i = 1; i < length; i++) {
+        last = store_parent_index(&commit_store, last)[0];
+    }
+    Commit bottom = commit;
+    if (last != index) {
+        store_get(&commit_store, last, &bottom);
+    }
+
+    // The commit takes the first lane waiting for it; any other lanes
+    // waiting for it end here
+    int col = -1, joins = 0;
+    for (int lane = 0; lane < lane_count; lane++) {
+        if (!lanes[lane].active || memcmp(lanes[lane].oid, commit.oid, OID_RAWSZ) != 0) {
+            continue;
+        }
+        if (col < 0) {
+            col = lane;
+            continue;
+        }
+        if (joins == join_capacity) {
+            int capacity = join_capacity ? join_capacity * 2 : 16;
+            int *grown = realloc(join_lanes, capacity * sizeof(int));
+            if (grown == NULL) {
+                return -1;
+            }
+            join_lanes = grown;
+            join_capacity = capacity;
+        }
+        join_lanes[joins++] = lane;
+    }
+    if (col < 0 && (col = open_lane(commit.oid)) < 0) {
+        return -1;
+    }
+    for (int i = 0, member = index; i < length; i++) {
+        *store_lane(&commit_store, member) = col;
+        if (i + 1 < length) {
+            member = store_parent_index(&commit_store, member)[0];
+        }
+    }
+
+    // Snapshot the lanes before the commit changes them
+    int width_before = lane_count;
+    int color = lanes[col].color;
+
+    // Commit line: lanes passing by, the commit, lanes joining it
+    Cell *line = calloc(width_before, sizeof(Cell));
+    if (line == NULL) {
+        return -1;
+    }
+    for (int x = 0; x < width_before; x++) {
+        if (lanes[x].active) {
+            line[x].mask = LINE_UP | LINE_DOWN;
+            line[x].color = lanes[x].color;
+        }
+    }
+    line[col].mask = CELL_COMMIT;
+    line[col].color = color;
+    for (int j = 0; j < joins; j++) {
+        int lane = join_lanes[j];
+        line[lane].mask = 0;
+        draw_span(line, col, lane, LINE_UP, lanes[lane].color);
+        close_lane(lane, index);
+    }
+    close_lane(col, index);
+
+    // Hand the lane on to the first parent and open lanes for the others.
+    // A parent some other lane already waits for is joined there instead.
+    int *targets = malloc((bottom.parent_count ? bottom.parent_count : 1) * sizeof(int));
+    if (targets == NULL) {
+        free(line);
+        return -1;
+    }
+    for (int j = 0; j < bottom.parent_count; j++) {
+        const unsigned char *parent = bottom.parents + j * OID_RAWSZ;
+        int lane = find_lane(parent);
+        if (lane < 0 && j == 0) {
+            lane = col;
+            memcpy(lanes[col].oid, parent, OID_RAWSZ);
+            lanes[col].active = 1;
+            lanes[col].edges = -1;
+        } else if (lane < 0 && (lane = open_lane(parent)) < 0) {
+            free(targets);
+            free(line);
+            return -1;
+        }
+        wait_in_lane(lane, last, j);
+        targets[j] = lane;
+    }
+
+    // Connector line: every lane continues straight down unless the
+    // commit's parents bend away from its own lane
+    int width = lane_count > width_before ? lane_count : width_before;
+    row->cells = calloc(2 * width, sizeof(Cell));
+    if (row->cells == NULL) {
+        free(targets);
+        free(line);
+        return -1;
+    }
+    memcpy(row->cells, line, width_before * sizeof(Cell));
+    free(line);
+
+    Cell *below = row->cells + width;
+    for (int x = 0; x < width; x++) {
+        int from_above = x < width_before &&
+                         (row->cells[x].mask & LINE_DOWN) &&
+                         !(row->cells[x].mask & CELL_COMMIT);
+        if (from_above) {
+            below[x].mask |= LINE_UP;
+        }
+        if (x < lane_count && lanes[x].active && (from_above || x == col)) {
+            below[x].mask |= LINE_DOWN;
+        }
+        if (x < lane_count && lanes[x].active) {
+            below[x].color = lanes[x].color;
+        }
+    }
+    row->has_connector = 0;
+    if (bottom.parent_count > 0) {
+        below[col].mask |= LINE_UP;
+        below[col].color = color;
+    }
+    for (int j = 0; j < bottom.parent_count; j++) {
+        if (targets[j] != col) {
+            // A lane opened for this parent starts here
+            int end_bits = below[targets[j]].mask & LINE_UP ? LINE_UP | LINE_DOWN
+                                                           : LINE_DOWN;
+            draw_span(below, col, targets[j], end_bits, lanes[targets[j]].color);
+            row->has_connector = 1;
+        }
+    }
+
+    // Lanes freed at the right edge are dropped
+    while (lane_count > 0 && !lanes[lane_count - 1].active) {
+        lane_count--;
+    }
+
+    row->commit = index;
+    row->color = color;
+    row->width = width;
+    row->parent_lanes = targets;
+    row->chain = length;
+    row->expanded = 0;
+    return 0;
+}
+
+void row_free(Row *row) {
+    free(row->cells);
+    free(row->parent_lanes);
+    row->cells = NULL;
+    row->parent_lanes = NULL;
+}
+
+// Box drawing for each combination of LINE_* bits
+static const char *const cell_glyphs[16] = {
+    " ", "│", "│", "│", "─", "╯", "╮", "┤",
+    "─", "╰", "╭", "├", "─", "┴", "┬", "┼"
+};
+
+// Append cells as two columns each, without trailing blanks. With
+// `verticals_only`, only the lines arriving from above are drawn, which
+// for a connector line gives the prefix of the message body above it.
+static int cell_mask(const Cell *cell, int verticals_only) {
+    if (verticals_only) {
+        return cell->mask & LINE_UP ? LINE_UP | LINE_DOWN : 0;
+    }
+    return cell->mask;
+}
+
+static void append_cells(StrBuf *out, const Cell *cells, int width,
+                         const char *symbol, int verticals_only) {
+    while (width > 0 && cell_mask(&cells[width - 1], verticals_only) == 0) {
+        width--;
+    }
+
+    // Escape codes dominate the output on wide graphs, so the color is
+    // only switched where it changes
+    int current = -1;
+    for (int x = 0; x < width; x++) {
+        int mask = cell_mask(&cells[x], verticals_only);
+        if (mask == 0) {
+            sb_append(out, "  ");
+            continue;
+        }
+
+        if (cells[x].color != current) {
+            current = cells[x].color;
+            sb_append(out, colors[current]);
+        }
+        sb_append(out, mask & CELL_COMMIT ? symbol : cell_glyphs[mask & 0x0f]);
+        if (mask & LINE_RIGHT) {
+            sb_append(out, "─");
+        } else if (x + 1 < width) {
+            sb_append(out, " ");
+        }
+    }
+    if (current >= 0) {
+        sb_append(out, RESET_COLOR);
+    }
+}
+
+// A commit's line and message. `line` holds its cells; a collapsed chain
+// of more than one commit gets a count instead of the message.
+static void render_commit(const Row *row, int index, const Cell *line,
+                          int chain, CommitText *text, StrBuf *out) {
+    Commit commit;
+    store_get(&commit_store, index, &commit);
+    if ((commit.is_lazy || commit.is_body_lazy) && text) {
+        // Only the rows that are drawn pay for reading the object
+        commit_text_fill(text, &commit);
+    }
+
+    char hash[OID_HEXSZ + 1];
+    char date[DATE_LENGTH];
+    oid_to_hex(commit.oid, hash);
+    format_iso_date(commit.author_time, commit.author_tz, date, sizeof(date));
+
+    // Add commit representation with hash
+    const char *symbol = chain > 1 ? CHAIN_SYMBOL
+                         : commit.is_merge ? MERGE_SYMBOL
+                         : commit.is_pr ? PR_SYMBOL : COMMIT_SYMBOL;
+    append_cells(out, line, row->width, symbol, 0);
+    sb_appendf(out, " %s%s%s ", colors[row->color], hash, RESET_COLOR);
+
+    // Add commit details
+    if (commit.is_pr) {
+        sb_appendf(out, "%s (PR #%s) (%s, %s)", commit.subject,
+                   commit.pr_number, commit.author, date);
+    } else if (commit.is_merge) {
+        sb_appendf(out, "%s (Merge commit) (%s, %s)", commit.subject,
+                   commit.author, date);
+    } else {
+        sb_appendf(out, "%s (%s, %s)", commit.subject, commit.author,
+                   date);
+    }
+
+    // Add branch labels if any
+    if (commit.refs[0]) {
+        char *refs = strdup(commit.refs);
+        char *next_ref;
+
+        sb_append(out, " [");
+        char *ref_token = strtok_r(refs, ",", &next_ref);
+        while (ref_token != NULL) {
+            while (*ref_token == ' ') ref_token++;
+            if (strncmp(ref_token, "refs/heads/", 11) == 0) {
+                ref_token += 11;
+            } else if (strncmp(ref_token, "HEAD -> ", 8) == 0) {
+                ref_token += 8;
+            }
+            sb_append(out, ref_token);
+            // A branch level with the base has nothing to add
+            const BranchCounts *counts = find_branch_counts(commit.oid, ref_token);
+            if (counts && (counts->ahead || counts->behind)) {
+                sb_appendf(out, " +%d/-%d", counts->ahead, counts->behind);
+            }
+            ref_token = strtok_r(NULL, ",", &next_ref);
+            if (ref_token != NULL) sb_append(out, ", ");
+        }
+        sb_append(out, "]");
+        free(refs);
+    }
+    if (chain > 1) {
+        sb_appendf(out, " %s(%d commits)%s\n", colors[row->color], chain,
+                   RESET_COLOR);
+        return;
+    }
+    sb_append(out, "\n");
+
+    // Add full commit message if it exists and differs from subject
+    if (strlen(commit.message) > strlen(commit.subject)) {
+        const char *msg_ptr = commit.message;
+        const char *first_newline = strchr(msg_ptr, '\n');
+
+        if (first_newline && *(first_newline + 1) != '\0') {
+            // Skip the first line (subject) and any blank lines
+            msg_ptr = first_newline + 1;
+            while (*msg_ptr == '\n') msg_ptr++;
+
+            // Add each line of the message with proper indentation
+            while (*msg_ptr) {
+                const char *newline = strchr(msg_ptr, '\n');
+                size_t len = newline ? (size_t)(newline - msg_ptr) : strlen(msg_ptr);
+                if (len > 0) {
+                    append_cells(out, row->cells + row->width, row->width,
+                                 symbol, 1);
+                    sb_append(out, "   ");  // Extra indent for message
+                    sb_append_len(out, msg_ptr, len);
+                    sb_append(out, "\n");
+                }
+                msg_ptr += newline ? len + 1 : len;
+            }
+        }
+    }
+}
+
+void render_row(const Row *row, CommitText *text, StrBuf *out) {
+    if (row->chain <= 1 || !row->expanded) {
+        render_commit(row, row->commit, row->cells, row->chain, text, out);
+    } else {
+        // The rest of an expanded chain sits in the same lane, with the
+        // lanes that continue below the first commit passing beside it
+        Cell *line = calloc(row->width, sizeof(Cell));
+        const Cell *below = row->cells + row->width;
+        int col = *store_lane(&commit_store, row->commit);
+        for (int x = 0; line && x < row->width; x++) {
+            if (below[x].mask & LINE_UP) {
+                line[x].mask = LINE_UP | LINE_DOWN;
+                line[x].color = below[x].color;
+            }
+        }
+        if (line) {
+            line[col].mask = CELL_COMMIT;
+            line[col].color = row->color;
+        }
+
+        render_commit(row, row->commit, row->cells, 1, text, out);
+        int index = row->commit;
+        for (int i = 1; line && i < row->chain; i++) {
+            index = store_parent_index(&commit_store, index)[0];
+            render_commit(row, index, line, 1, text, out);
+        }
+        free(line);
+    }
+
+    // Add the lines bending towards the commit's parents
+    if (row->has_connector) {
+        append_cells(out, row->cells + row->width, row->width, COMMIT_SYMBOL, 0);
+        sb_append(out, "\n");
+    }
+}
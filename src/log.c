@@ -0,0 +1,447 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "profile.h"
+#include "shrub.h"
+#include "strbuf.h"
+
+CommitStore commit_store;
+
+// ANSI color codes for branches
+const char* colors[] = {
+    "\033[1;31m", // Red
+    "\033[1;32m", // Green
+    "\033[1;33m", // Yellow
+    "\033[1;34m", // Blue
+    "\033[1;35m", // Magenta
+    "\033[1;36m", // Cyan
+    "\033[1;91m", // Bright Red
+    "\033[1;92m", // Bright Green
+    "\033[1;93m", // Bright Yellow
+    "\033[1;94m", // Bright Blue
+    "\033[1;95m", // Bright Magenta
+    "\033[1;96m"  // Bright Cyan
+};
+
+// Function to execute a command and return the output
+char* execute_command(const char* command) {
+    FILE* fp;
+    static char buffer[MAX_LINE_LENGTH * 100];
+    char line[MAX_LINE_LENGTH];
+    ProfileMark mark;
+
+    buffer[0] = '\0';
+
+    profile_begin(&mark);
+    fp = popen(command, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to execute command: %s\n", command);
+        profile_end(&mark, PROFILE_COMMANDS);
+        return buffer;
+    }
+
+    size_t len = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        size_t line_len = strlen(line);
+        profile_add_bytes(line_len);
+        if (len + line_len >= sizeof(buffer)) {
+            continue; // keep draining so the child can exit
+        }
+        memcpy(buffer + len, line, line_len + 1);
+        len += line_len;
+    }
+
+    int status = pclose(fp);
+    if (status != 0) {
+        fprintf(stderr, "Command exited with status %d: %s\n", status, command);
+    }
+
+    profile_end(&mark, PROFILE_COMMANDS);
+    return buffer;
+}
+
+// Read the whole output of a command into a malloc'd buffer
+static char *read_command_output(const char *command) {
+    ProfileMark mark;
+    profile_begin(&mark);
+    FILE *fp = popen(command, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to execute command: %s\n", command);
+        profile_end(&mark, PROFILE_COMMANDS);
+        return NULL;
+    }
+
+    size_t capacity = 1 << 16, len = 0, n;
+    char *output = malloc(capacity);
+    while (output && (n = fread(output + len, 1, capacity - len - 1, fp)) > 0) {
+        len += n;
+        if (capacity - len - 1 == 0) {
+            char *grown = realloc(output, capacity * 2);
+            if (grown == NULL) {
+                free(output);
+                output = NULL;
+                break;
+            }
+            output = grown;
+            capacity *= 2;
+        }
+    }
+    if (output) {
+        output[len] = '\0';
+    }
+    profile_add_bytes(len);
+
+    int status = pclose(fp);
+    if (status != 0) {
+        fprintf(stderr, "Command exited with status %d: %s\n", status, command);
+    }
+    profile_end(&mark, PROFILE_COMMANDS);
+    return output;
+}
+
+// Flag pull request merges and extract their number from the subject
+void detect_pull_request(Commit *commit, const char *subject) {
+    if (strstr(subject, "Merge pull request") ||
+        strstr(subject, "Merge PR") ||
+        strstr(subject, "Pull request")) {
+        commit->is_pr = 1;
+
+        // Extract PR number
+        const char *pr_start = strstr(subject, "#");
+        if (pr_start) {
+            char pr_num[16] = {0};
+            int i = 0;
+            pr_start++; // Skip the '#'
+            while (*pr_start && *pr_start != ' ' && *pr_start != ')' && i < 15) {
+                pr_num[i++] = *pr_start++;
+            }
+            pr_num[i] = '\0';
+            strcpy(commit->pr_number, pr_num);
+        }
+    } else {
+        commit->is_pr = 0;
+        commit->pr_number[0] = '\0';
+    }
+}
+
+// Parse an `--date=iso` date such as "2024-01-31 12:00:00 +0100"
+static int parse_iso_date(const char *date, time_t *when, int *tz) {
+    struct tm tm = {0};
+    char sign;
+    int tz_hours, tz_minutes;
+    if (sscanf(date, "%d-%d-%d %d:%d:%d %c%2d%2d", &tm.tm_year, &tm.tm_mon,
+               &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &sign,
+               &tz_hours, &tz_minutes) != 9) {
+        return -1;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    *tz = (sign == '-' ? -1 : 1) * (tz_hours * 60 + tz_minutes);
+    *when = timegm(&tm) - *tz * 60L;
+    return 0;
+}
+
+// "<n> <unit>s ago" (or "n.units.ago") relative to now
+static int parse_relative_date(const char *arg, time_t now, time_t *when) {
+    static const struct {
+        const char *name;
+        long seconds;       // 0: calendar months, scaled by `months`
+        int months;
+    } units[] = {
+        { "second", 1, 0 }, { "minute", 60, 0 }, { "hour", 3600, 0 },
+        { "day", 86400, 0 }, { "week", 7 * 86400, 0 },
+        { "month", 0, 1 }, { "year", 0, 12 },
+    };
+    char *end;
+    long count = strtol(arg, &end, 10);
+    if (end == arg || count < 0) {
+        return -1;
+    }
+    while (*end == ' ' || *end == '.') {
+        end++;
+    }
+    for (size_t i = 0; i < sizeof(units) / sizeof(units[0]); i++) {
+        size_t len = strlen(units[i].name);
+        if (strncmp(end, units[i].name, len) != 0) {
+            continue;
+        }
+        const char *rest = end + len + (end[len] == 's');
+        while (*rest == ' ' || *rest == '.') {
+            rest++;
+        }
+        if (strcmp(rest, "ago") != 0) {
+            return -1;
+        }
+        if (units[i].seconds) {
+            *when = now - count * units[i].seconds;
+        } else {
+            struct tm tm;
+            localtime_r(&now, &tm);
+            tm.tm_mon -= count * units[i].months;
+            tm.tm_isdst = -1;
+            *when = mktime(&tm);
+        }
+        return 0;
+    }
+    return -1;
+}
+
+// "2024-01-31", "2024-01-31 12:00[:00]" or with a "T", optionally with a
+// zone. Like git, a date alone keeps the current time of day.
+static int parse_absolute_date(const char *arg, time_t now, time_t *when) {
+    struct tm tm;
+    int consumed = 0;
+    localtime_r(&now, &tm);
+    if (sscanf(arg, "%4d-%2d-%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &consumed) != 3) {
+        return -1;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    const char *p = arg + consumed;
+    if (*p == ' ' || *p == 'T') {
+        tm.tm_sec = 0;
+        if (sscanf(p + 1, "%2d:%2d%n", &tm.tm_hour, &tm.tm_min, &consumed) != 2) {
+            return -1;
+        }
+        p += 1 + consumed;
+        if (*p == ':' && sscanf(p + 1, "%2d%n", &tm.tm_sec, &consumed) == 1) {
+            p += 1 + consumed;
+        }
+    }
+    while (*p == ' ') {
+        p++;
+    }
+    if (*p == '\0') {
+        tm.tm_isdst = -1;
+        *when = mktime(&tm);
+        return 0;
+    }
+
+    int tz_hours, tz_minutes;
+    if (strcmp(p, "Z") == 0) {
+        *when = timegm(&tm);
+        return 0;
+    }
+    if ((*p == '+' || *p == '-') && strlen(p) == 5 &&
+        sscanf(p + 1, "%2d%2d", &tz_hours, &tz_minutes) == 2) {
+        int tz = (*p == '-' ? -1 : 1) * (tz_hours * 60 + tz_minutes);
+        *when = timegm(&tm) - tz * 60L;
+        return 0;
+    }
+    return -1;
+}
+
+int parse_date_arg(const char *arg, time_t *when) {
+    time_t now = time(NULL);
+    size_t digits = strspn(arg, "0123456789");
+    if (arg[0] == '@' && arg[1] && strspn(arg + 1, "0123456789") == strlen(arg + 1)) {
+        *when = (time_t)strtoll(arg + 1, NULL, 10);
+        return 0;
+    }
+    if (digits >= 9 && arg[digits] == '\0') {
+        *when = (time_t)strtoll(arg, NULL, 10);
+        return 0;
+    }
+    if (parse_absolute_date(arg, now, when) == 0 ||
+        parse_relative_date(arg, now, when) == 0) {
+        return 0;
+    }
+
+    // git knows many more forms ("yesterday", "last friday")
+    StrBuf command;
+    sb_init(&command);
+    sb_append(&command, "git rev-parse --since=");
+    sb_append_shell(&command, arg);
+    sb_append(&command, " 2>/dev/null");
+    const char *output = execute_command(command.data);
+    sb_free(&command);
+    if (strncmp(output, "--max-age=", 10) != 0) {
+        return -1;
+    }
+    *when = (time_t)strtoll(output + 10, NULL, 10);
+    return 0;
+}
+
+// Parse one "COMMIT_SEP..." line of git log output and append it to the
+// store. Returns the new commit's index, -1 if the line held no commit, or
+// -2 if its id is not a SHA-1 id (a SHA-256 repository).
+int parse_log_record(char *line, CommitStore *store) {
+    char *commit_part = strstr(line, "COMMIT_SEP");
+    if (commit_part == NULL) {
+        return -1;
+    }
+    commit_part += 10; // Skip "COMMIT_SEP"
+
+    // Parse the fields; strsep keeps empty ones such as %P
+    // of a root commit or an undecorated %D
+    char *fields = commit_part;
+    char *hash = strsep(&fields, "|");
+    Commit commit;
+    memset(&commit, 0, sizeof(commit));
+    commit.subject = "";
+    if (hash == NULL) {
+        return -1;
+    }
+    if (strlen(hash) != OID_HEXSZ || hex_to_oid(hash, commit.oid) != 0) {
+        return -2;
+    }
+
+    strsep(&fields, "|"); // %h, derived from the full hash when needed
+
+    char *subject = strsep(&fields, "|");
+    if (subject) {
+        commit.subject = subject;
+
+        // Check if it's a PR
+        detect_pull_request(&commit, subject);
+    }
+
+    commit.author = strsep(&fields, "|");
+
+    char *date = strsep(&fields, "|");
+    if (date && parse_iso_date(date, &commit.author_time, &commit.author_tz) != 0) {
+        // Fallback if date parsing fails
+        commit.author_time = time(NULL);
+    }
+
+    char *commit_time = strsep(&fields, "|");
+    commit.commit_time = commit_time ? (time_t)strtoll(commit_time, NULL, 10)
+                                     : commit.author_time;
+
+    unsigned char local_parents[8][OID_RAWSZ];
+    unsigned char (*parents)[OID_RAWSZ] = local_parents;
+    char *parent_list = strsep(&fields, "|");
+    if (parent_list) {
+        // Octopus merges can have any number of parents
+        int capacity = 8;
+        char *parent_token;
+        while ((parent_token = strsep(&parent_list, " ")) != NULL) {
+            if (*parent_token == '\0') {
+                continue;
+            }
+            if (commit.parent_count == capacity) {
+                unsigned char (*grown)[OID_RAWSZ] = malloc(capacity * 2 * OID_RAWSZ);
+                if (grown == NULL) {
+                    break;
+                }
+                memcpy(grown, parents, capacity * OID_RAWSZ);
+                if (parents != local_parents) {
+                    free(parents);
+                }
+                parents = grown;
+                capacity *= 2;
+            }
+            if (hex_to_oid(parent_token, parents[commit.parent_count]) == 0) {
+                commit.parent_count++;
+            }
+        }
+
+        // If it has more than one parent, it's a merge commit
+        commit.is_merge = commit.parent_count > 1;
+    }
+    commit.parents = parents[0];
+
+    commit.refs = strsep(&fields, "|");
+
+    // The body is read when its row is drawn
+    commit.message = "";
+    commit.is_body_lazy = 1;
+
+    determine_commit_type(&commit);
+    int index = store_add(store, &commit);
+    if (parents != local_parents) {
+        free(parents);
+    }
+    return index;
+}
+
+char *git_log_command(const RevisionRange *range, int with_max_count) {
+    StrBuf command;
+    sb_init(&command);
+    sb_append(&command, "git log");
+    if (range->revision_count == 0) {
+        sb_append(&command, " --all");
+    }
+    sb_append(&command, GIT_LOG_OPTIONS);
+    if (with_max_count && range->max_count >= 0) {
+        sb_appendf(&command, " --max-count=%d", range->max_count);
+    }
+    if (range->since) {
+        sb_appendf(&command, " --max-age=%lld", (long long)range->since);
+    }
+    if (range->until) {
+        sb_appendf(&command, " --min-age=%lld", (long long)range->until);
+    }
+    if (range->first_parent) {
+        sb_append(&command, " --first-parent");
+    }
+    for (int i = 0; i < range->revision_count; i++) {
+        sb_append(&command, " ");
+        sb_append_shell(&command, range->revisions[i]);
+    }
+    return command.data;
+}
+
+// Function to parse git log and fill the commit store
+void parse_git_log(CommitStore *store) {
+    char *log_output;
+    char *line, *next_line;
+
+    if (DEBUG) {
+        printf("Executing: %s\n", GIT_LOG_COMMAND);  // Debug output
+    }
+
+    // The history can be far larger than execute_command() holds
+    log_output = read_command_output(GIT_LOG_COMMAND);
+
+    // Check if we got any output
+    if (log_output == NULL || strlen(log_output) < 10) {
+        printf("Error: Failed to get git log output\n");
+        free(log_output);
+        return;
+    }
+
+    line = strtok_r(log_output, "\n", &next_line);
+    while (line != NULL) {
+        if (parse_log_record(line, store) == -2) {
+            fprintf(stderr, "Error: Only SHA-1 repositories are supported\n");
+            break;
+        }
+
+        line = strtok_r(NULL, "\n", &next_line);
+    }
+
+    if (store_resolve_parents(store) != 0) {
+        fprintf(stderr, "Error: Out of memory\n");
+    }
+
+    // Add debug output
+    if (store->count == 0) {
+        printf("No commits were parsed. Debug info:\n");
+        printf("Git command output length: %zu\n", strlen(log_output));
+        printf("First 100 chars of output: %.100s\n", log_output);
+    } else {
+    if (DEBUG) {
+    fprintf(stderr, "Successfully parsed %d commits\n", store->count);
+    }
+    }
+
+    free(log_output);
+}
+
+void determine_commit_type(Commit *commit) {
+    // Check for PR
+    if (strstr(commit->subject, "Merge pull request #") != NULL) {
+        // Extract PR number
+        sscanf(strstr(commit->subject, "#"), "#%15s", commit->pr_number);
+        commit->is_pr = 1;
+    }
+    // Check for merge commit
+    else if (strncmp(commit->subject, "Merge", 5) == 0) {
+        commit->is_merge = 1;
+    }
+}
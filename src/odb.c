@@ -0,0 +1,1580 @@
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "odb.h"
+#include "profile.h"
+
+#define MAX_ALTERNATE_DEPTH 5
+#define MAX_DELTA_DEPTH 4096
+#define DELTA_CACHE_SLOTS 256
+#define DELTA_CACHE_LIMIT (32 * 1024 * 1024)
+#define MIN_ABBREV 4
+#define LINEAR_SCAN 8
+
+// Sorted object ids behind a 256-entry fanout of cumulative counts, as
+// .idx and multi-pack-index files store them
+typedef struct {
+    const unsigned char *fanout;
+    const unsigned char *oids;          // the first id
+    size_t stride;                      // bytes from one id to the next
+    uint32_t nr;
+} OidTable;
+
+typedef struct {
+    char *path;
+    unsigned char *idx_map;
+    size_t idx_size;
+    unsigned char *pack_map;
+    size_t pack_size;
+    int idx_version;
+    OidTable ids;
+    const unsigned char *offsets;       // 32-bit pack offsets (v2)
+    const unsigned char *large_offsets; // 64-bit pack offsets (v2)
+    int in_midx;                        // a multi-pack-index lists its objects
+} Pack;
+
+// Loose objects of one fan-out directory, for resolving abbreviated ids
+typedef struct {
+    unsigned char *oids;        // sorted
+    int count;
+    int listed;
+} LooseDir;
+
+// A multi-pack-index: one id table for the packs it lists, each id with
+// the pack holding it and its offset there
+typedef struct {
+    unsigned char *map;
+    size_t size;
+    OidTable ids;
+    const unsigned char *offsets;       // (pack id, 32-bit offset) pairs
+    const unsigned char *large_offsets; // 64-bit offsets, optional
+    size_t large_count;
+    int *packs;                         // pack id to odb->packs, -1 if missing
+    uint32_t pack_count;
+} Midx;
+
+// Recently inflated delta bases, keyed by their position in a pack
+typedef struct {
+    const Pack *pack;
+    size_t offset;
+    ObjectType type;
+    unsigned char *data;
+    size_t size;
+} DeltaCacheEntry;
+
+// Threads share one Odb: the packs are read-only once mapped, and the
+// delta base cache is locked, so a base inflated by one thread serves all
+struct Odb {
+    char **object_dirs;
+    int object_dir_count;
+    Pack *packs;
+    int pack_count;
+    Midx *midxes;
+    int midx_count;
+    pthread_mutex_t loose_lock;
+    LooseDir *loose;            // 256 per object directory, once needed
+    pthread_mutex_t delta_lock;
+    DeltaCacheEntry delta_cache[DELTA_CACHE_SLOTS];
+    size_t delta_cache_bytes;
+    int delta_cache_evict;
+    atomic_size_t bytes_read;
+    int default_abbrev;         // hex digits, 0 until first needed
+};
+
+// Each thread keeps one inflate context and resets it between objects
+// instead of setting up zlib's window for every one
+static pthread_key_t inflate_key;
+static pthread_once_t inflate_once = PTHREAD_ONCE_INIT;
+
+static void free_inflate_context(void *arg) {
+    z_stream *stream = arg;
+    inflateEnd(stream);
+    free(stream);
+}
+
+static void create_inflate_key() {
+    pthread_key_create(&inflate_key, free_inflate_context);
+}
+
+// The calling thread's inflate context, reset and reading from `in`
+static z_stream *inflate_context(const unsigned char *in, size_t in_len) {
+    pthread_once(&inflate_once, create_inflate_key);
+    z_stream *stream = pthread_getspecific(inflate_key);
+    if (stream == NULL) {
+        stream = calloc(1, sizeof(z_stream));
+        if (stream == NULL || inflateInit(stream) != Z_OK) {
+            free(stream);
+            return NULL;
+        }
+        pthread_setspecific(inflate_key, stream);
+    } else if (inflateReset(stream) != Z_OK) {
+        return NULL;
+    }
+    stream->next_in = (Bytef *)in;
+    stream->avail_in = in_len > UINT_MAX ? UINT_MAX : (uInt)in_len;
+    return stream;
+}
+
+static uint32_t get_be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t get_be64(const unsigned char *p) {
+    return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+int hex_to_oid(const char *hex, unsigned char *oid) {
+    for (int i = 0; i < OID_RAWSZ; i++) {
+        int hi = hex_value(hex[2 * i]);
+        int lo = hi < 0 ? -1 : hex_value(hex[2 * i + 1]);
+        if (lo < 0) {
+            return -1;
+        }
+        oid[i] = (unsigned char)((hi << 4) | lo);
+    }
+    return 0;
+}
+
+void oid_to_hex(const unsigned char *oid, char *hex) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < OID_RAWSZ; i++) {
+        hex[2 * i] = digits[oid[i] >> 4];
+        hex[2 * i + 1] = digits[oid[i] & 0xf];
+    }
+    hex[OID_HEXSZ] = '\0';
+}
+
+static char *join_path(const char *dir, const char *name) {
+    size_t len = strlen(dir) + strlen(name) + 2;
+    char *path = malloc(len);
+    if (path) {
+        snprintf(path, len, "%s/%s", dir, name);
+    }
+    return path;
+}
+
+char *read_file(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    // Room for the NUL and one byte more, so that reaching the end of a
+    // file that did not grow takes no realloc
+    struct stat st;
+    size_t capacity = fstat(fd, &st) == 0 && st.st_size > 0 ? (size_t)st.st_size + 2 : 4096;
+    size_t len = 0;
+    char *buf = malloc(capacity);
+    while (buf) {
+        ssize_t n = read(fd, buf + len, capacity - len - 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n < 0) {
+                free(buf);
+                buf = NULL;
+            }
+            break;
+        }
+        len += n;
+        if (capacity - len - 1 == 0) {
+            char *grown = realloc(buf, capacity * 2);
+            if (grown == NULL) {
+                free(buf);
+                buf = NULL;
+                break;
+            }
+            buf = grown;
+            capacity *= 2;
+        }
+    }
+    close(fd);
+
+    if (buf) {
+        buf[len] = '\0';
+        if (size) {
+            *size = len;
+        }
+    }
+    return buf;
+}
+
+static void trim_trailing_space(char *s) {
+    size_t len = strlen(s);
+    while (len > 0 && isspace((unsigned char)s[len - 1])) {
+        s[--len] = '\0';
+    }
+}
+
+static unsigned char *map_file(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    unsigned char *map = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            map = NULL;
+        } else {
+            *size = st.st_size;
+        }
+    }
+    close(fd);
+    return map;
+}
+
+// Validate an .idx file and locate its tables
+static int parse_pack_index(Pack *pack) {
+    const unsigned char *map = pack->idx_map;
+    size_t size = pack->idx_size;
+    OidTable *ids = &pack->ids;
+
+    if (size >= 8 && memcmp(map, "\377tOc", 4) == 0) {
+        pack->idx_version = get_be32(map + 4);
+        if (pack->idx_version != 2 || size < 8 + 1024) {
+            return -1;
+        }
+        ids->fanout = map + 8;
+        ids->nr = get_be32(ids->fanout + 255 * 4);
+        if (size < 8 + 1024 + (size_t)ids->nr * 28 + 40) {
+            return -1;
+        }
+        ids->oids = ids->fanout + 1024;
+        ids->stride = OID_RAWSZ;
+        pack->offsets = ids->oids + (size_t)ids->nr * 24;
+        pack->large_offsets = pack->offsets + (size_t)ids->nr * 4;
+    } else {
+        // Version 1: fanout followed by (offset, oid) pairs
+        pack->idx_version = 1;
+        if (size < 1024) {
+            return -1;
+        }
+        ids->fanout = map;
+        ids->nr = get_be32(ids->fanout + 255 * 4);
+        if (size < 1024 + (size_t)ids->nr * 24 + 40) {
+            return -1;
+        }
+        ids->oids = map + 1024 + 4;
+        ids->stride = 24;
+    }
+    return 0;
+}
+
+static const unsigned char *table_oid_at(const OidTable *ids, uint32_t i) {
+    return ids->oids + (size_t)i * ids->stride;
+}
+
+static size_t pack_offset_at(const Pack *pack, uint32_t i) {
+    if (pack->idx_version == 1) {
+        return get_be32(pack->ids.fanout + 1024 + (size_t)i * 24);
+    }
+    uint32_t off = get_be32(pack->offsets + (size_t)i * 4);
+    if (off & 0x80000000) {
+        return get_be64(pack->large_offsets + (size_t)(off & 0x7fffffff) * 8);
+    }
+    return off;
+}
+
+// memcmp() of two ids. With SSE2 their first 16 bytes are compared in one
+// step and the first byte that differs decides.
+static inline int oid_cmp(const unsigned char *a, const unsigned char *b) {
+#ifdef __SSE2__
+    __m128i x = _mm_loadu_si128((const __m128i *)a);
+    __m128i y = _mm_loadu_si128((const __m128i *)b);
+    unsigned differ = ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xffff;
+    if (differ) {
+        int i = __builtin_ctz(differ);
+        return (int)a[i] - (int)b[i];
+    }
+    return memcmp(a + 16, b + 16, OID_RAWSZ - 16);
+#else
+    return memcmp(a, b, OID_RAWSZ);
+#endif
+}
+
+// Position of the first id not less than `oid`. The fanout narrows the
+// search to the ids sharing its first byte. Ids are uniformly spread, so
+// the next bytes tell about where in that slice it is: the search starts
+// there and gallops outwards until it has the id between two probes,
+// usually a few entries apart, then binary searches down to a few
+// neighbours that are scanned in order. That touches a handful of cache
+// lines where a plain binary search over a large pack misses on almost
+// every probe.
+static uint32_t table_lower_bound(const OidTable *ids, const unsigned char *oid) {
+    uint32_t lo = oid[0] ? get_be32(ids->fanout + (oid[0] - 1) * 4) : 0;
+    uint32_t hi = get_be32(ids->fanout + oid[0] * 4);
+    if (hi > ids->nr || lo > hi) {
+        return ids->nr;     // damaged fanout
+    }
+
+    if (hi - lo > LINEAR_SCAN) {
+        uint32_t guess = lo + (uint32_t)(((uint64_t)get_be32(oid + 1) * (hi - lo)) >> 32);
+        uint32_t step = LINEAR_SCAN;
+        if (oid_cmp(table_oid_at(ids, guess), oid) < 0) {
+            lo = guess + 1;
+            while (hi - lo > step && oid_cmp(table_oid_at(ids, lo + step), oid) < 0) {
+                lo += step + 1;
+                step *= 2;
+            }
+            if (hi - lo > step) {
+                hi = lo + step;
+            }
+        } else {
+            hi = guess;
+            while (hi - lo > step && oid_cmp(table_oid_at(ids, hi - step - 1), oid) >= 0) {
+                hi -= step + 1;
+                step *= 2;
+            }
+            if (hi - lo > step) {
+                lo = hi - step;
+            }
+        }
+    }
+    while (hi - lo > LINEAR_SCAN) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (oid_cmp(table_oid_at(ids, mid), oid) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    while (lo < hi && oid_cmp(table_oid_at(ids, lo), oid) < 0) {
+        lo++;
+    }
+    return lo;
+}
+
+static int table_find(const OidTable *ids, const unsigned char *oid,
+                      uint32_t *pos) {
+    uint32_t i = table_lower_bound(ids, oid);
+    if (i < ids->nr && oid_cmp(table_oid_at(ids, i), oid) == 0) {
+        *pos = i;
+        return 0;
+    }
+    return -1;
+}
+
+static int find_pack_entry(const Pack *pack, const unsigned char *oid,
+                           size_t *offset) {
+    uint32_t pos;
+    if (table_find(&pack->ids, oid, &pos) != 0) {
+        return -1;
+    }
+    *offset = pack_offset_at(pack, pos);
+    return 0;
+}
+
+// The pack and offset a multi-pack-index gives for an id. Returns -1 if
+// it does not list the id, -2 if the pack it names cannot be read.
+static int find_midx_entry(const Odb *odb, const Midx *midx,
+                           const unsigned char *oid, const Pack **pack,
+                           size_t *offset) {
+    uint32_t pos;
+    if (table_find(&midx->ids, oid, &pos) != 0) {
+        return -1;
+    }
+    const unsigned char *entry = midx->offsets + (size_t)pos * 8;
+    uint32_t pack_id = get_be32(entry);
+    uint32_t off = get_be32(entry + 4);
+    if (pack_id >= midx->pack_count || midx->packs[pack_id] < 0) {
+        return -2;
+    }
+    if (off & 0x80000000) {
+        off &= 0x7fffffff;
+        if (midx->large_offsets == NULL || off >= midx->large_count) {
+            return -2;
+        }
+        *offset = get_be64(midx->large_offsets + (size_t)off * 8);
+    } else {
+        *offset = off;
+    }
+    *pack = &odb->packs[midx->packs[pack_id]];
+    return 0;
+}
+
+static void add_pack(Odb *odb, const char *idx_path) {
+    Pack pack;
+    memset(&pack, 0, sizeof(pack));
+
+    size_t len = strlen(idx_path);
+    pack.path = malloc(len + 2);
+    if (pack.path == NULL) {
+        return;
+    }
+    memcpy(pack.path, idx_path, len - 4);
+    strcpy(pack.path + len - 4, ".pack");
+
+    pack.idx_map = map_file(idx_path, &pack.idx_size);
+    pack.pack_map = map_file(pack.path, &pack.pack_size);
+    if (pack.idx_map == NULL || pack.pack_map == NULL ||
+        parse_pack_index(&pack) != 0 || pack.pack_size < 32 ||
+        memcmp(pack.pack_map, "PACK", 4) != 0) {
+        if (pack.idx_map) {
+            munmap(pack.idx_map, pack.idx_size);
+        }
+        if (pack.pack_map) {
+            munmap(pack.pack_map, pack.pack_size);
+        }
+        free(pack.path);
+        return;
+    }
+
+    Pack *grown = realloc(odb->packs, (odb->pack_count + 1) * sizeof(Pack));
+    if (grown == NULL) {
+        munmap(pack.idx_map, pack.idx_size);
+        munmap(pack.pack_map, pack.pack_size);
+        free(pack.path);
+        return;
+    }
+    odb->packs = grown;
+    odb->packs[odb->pack_count++] = pack;
+}
+
+// The pack among packs[first..] an .idx name from a multi-pack-index
+// stands for, or -1
+static int midx_pack_index(const Odb *odb, int first, const char *name,
+                           size_t len) {
+    if (len > 4 && memcmp(name + len - 4, ".idx", 4) == 0) {
+        len -= 4;
+    } else if (len > 5 && memcmp(name + len - 5, ".pack", 5) == 0) {
+        len -= 5;
+    }
+    for (int i = first; i < odb->pack_count; i++) {
+        const char *base = strrchr(odb->packs[i].path, '/');
+        base = base ? base + 1 : odb->packs[i].path;
+        if (strlen(base) == len + 5 && memcmp(base, name, len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Read pack/multi-pack-index and mark the packs it covers, which lookups
+// then skip. A file that cannot be used leaves every pack searched on its
+// own, as before git wrote one.
+static void load_midx(Odb *odb, const char *pack_dir, int first) {
+    char *path = join_path(pack_dir, "multi-pack-index");
+    Midx midx;
+    memset(&midx, 0, sizeof(midx));
+    midx.map = path ? map_file(path, &midx.size) : NULL;
+    free(path);
+    if (midx.map == NULL) {
+        return;
+    }
+
+    const unsigned char *map = midx.map;
+    size_t size = midx.size;
+    // Version 1 or 2, SHA-1, no incremental base layers
+    if (size < 12 || memcmp(map, "MIDX", 4) != 0 ||
+        (map[4] != 1 && map[4] != 2) || map[5] != 1 || map[7] != 0 ||
+        size < 12 + ((size_t)map[6] + 1) * 12) {
+        munmap(midx.map, midx.size);
+        return;
+    }
+    midx.pack_count = get_be32(map + 8);
+
+    const unsigned char *names = NULL;
+    size_t names_size = 0, oids_size = 0, offsets_size = 0;
+    for (int c = 0; c < map[6]; c++) {
+        const unsigned char *chunk = map + 12 + (size_t)c * 12;
+        uint64_t start = get_be64(chunk + 4), end = get_be64(chunk + 16);
+        if (start > end || end > size) {
+            munmap(midx.map, midx.size);
+            return;
+        }
+        if (memcmp(chunk, "PNAM", 4) == 0) {
+            names = map + start;
+            names_size = end - start;
+        } else if (memcmp(chunk, "OIDF", 4) == 0 && end - start >= 1024) {
+            midx.ids.fanout = map + start;
+        } else if (memcmp(chunk, "OIDL", 4) == 0) {
+            midx.ids.oids = map + start;
+            oids_size = end - start;
+        } else if (memcmp(chunk, "OOFF", 4) == 0) {
+            midx.offsets = map + start;
+            offsets_size = end - start;
+        } else if (memcmp(chunk, "LOFF", 4) == 0) {
+            midx.large_offsets = map + start;
+            midx.large_count = (end - start) / 8;
+        }
+    }
+    if (names == NULL || midx.ids.fanout == NULL || midx.ids.oids == NULL ||
+        midx.offsets == NULL) {
+        munmap(midx.map, midx.size);
+        return;
+    }
+    midx.ids.nr = get_be32(midx.ids.fanout + 255 * 4);
+    midx.ids.stride = OID_RAWSZ;
+    midx.packs = malloc((midx.pack_count ? midx.pack_count : 1) * sizeof(int));
+    if (oids_size < (size_t)midx.ids.nr * OID_RAWSZ ||
+        offsets_size < (size_t)midx.ids.nr * 8 || midx.packs == NULL) {
+        free(midx.packs);
+        munmap(midx.map, midx.size);
+        return;
+    }
+
+    // Names are NUL-terminated, in pack id order
+    const unsigned char *name = names, *names_end = names + names_size;
+    for (uint32_t id = 0; id < midx.pack_count; id++) {
+        const unsigned char *nul = name < names_end
+            ? memchr(name, '\0', names_end - name) : NULL;
+        if (nul == NULL) {
+            free(midx.packs);
+            munmap(midx.map, midx.size);
+            return;
+        }
+        midx.packs[id] = midx_pack_index(odb, first, (const char *)name,
+                                         nul - name);
+        name = nul + 1;
+    }
+
+    Midx *grown = realloc(odb->midxes, (odb->midx_count + 1) * sizeof(Midx));
+    if (grown == NULL) {
+        free(midx.packs);
+        munmap(midx.map, midx.size);
+        return;
+    }
+    odb->midxes = grown;
+    odb->midxes[odb->midx_count++] = midx;
+    for (uint32_t id = 0; id < midx.pack_count; id++) {
+        if (midx.packs[id] >= 0) {
+            odb->packs[midx.packs[id]].in_midx = 1;
+        }
+    }
+}
+
+static void load_packs(Odb *odb, const char *objects_dir) {
+    char *pack_dir = join_path(objects_dir, "pack");
+    DIR *dir = pack_dir ? opendir(pack_dir) : NULL;
+    if (dir == NULL) {
+        free(pack_dir);
+        return;
+    }
+
+    int first = odb->pack_count;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len > 4 && strcmp(entry->d_name + len - 4, ".idx") == 0) {
+            char *idx_path = join_path(pack_dir, entry->d_name);
+            if (idx_path) {
+                add_pack(odb, idx_path);
+                free(idx_path);
+            }
+        }
+    }
+    closedir(dir);
+    load_midx(odb, pack_dir, first);
+    free(pack_dir);
+}
+
+static void add_object_dir(Odb *odb, const char *path, int depth) {
+    for (int i = 0; i < odb->object_dir_count; i++) {
+        if (strcmp(odb->object_dirs[i], path) == 0) {
+            return;
+        }
+    }
+
+    char **grown = realloc(odb->object_dirs,
+                           (odb->object_dir_count + 1) * sizeof(char *));
+    if (grown == NULL) {
+        return;
+    }
+    odb->object_dirs = grown;
+    odb->object_dirs[odb->object_dir_count++] = strdup(path);
+    load_packs(odb, path);
+
+    if (depth >= MAX_ALTERNATE_DEPTH) {
+        return;
+    }
+
+    // Borrowed objects listed in info/alternates
+    char *alternates_path = join_path(path, "info/alternates");
+    char *alternates = alternates_path ? read_file(alternates_path, NULL) : NULL;
+    free(alternates_path);
+    if (alternates == NULL) {
+        return;
+    }
+
+    char *next_line;
+    char *line = strtok_r(alternates, "\n", &next_line);
+    while (line != NULL) {
+        trim_trailing_space(line);
+        if (line[0] != '\0' && line[0] != '#') {
+            if (line[0] == '/') {
+                add_object_dir(odb, line, depth + 1);
+            } else {
+                char *alternate = join_path(path, line);
+                if (alternate) {
+                    add_object_dir(odb, alternate, depth + 1);
+                    free(alternate);
+                }
+            }
+        }
+        line = strtok_r(NULL, "\n", &next_line);
+    }
+    free(alternates);
+}
+
+// Only SHA-1 repositories are understood by the pack reader
+static int has_supported_format(const char *common_dir) {
+    char *config_path = join_path(common_dir, "config");
+    char *config = config_path ? read_file(config_path, NULL) : NULL;
+    free(config_path);
+    if (config == NULL) {
+        return 1;
+    }
+
+    for (char *p = config; *p; p++) {
+        *p = tolower((unsigned char)*p);
+    }
+
+    int supported = 1;
+    char *format = strstr(config, "objectformat");
+    if (format != NULL) {
+        format += strlen("objectformat");
+        format += strspn(format, " \t=");
+        supported = strncmp(format, "sha1", 4) == 0;
+    }
+    free(config);
+    return supported;
+}
+
+char *git_common_dir(const char *git_dir) {
+    char *commondir_path = join_path(git_dir, "commondir");
+    char *commondir = commondir_path ? read_file(commondir_path, NULL) : NULL;
+    free(commondir_path);
+    if (commondir == NULL) {
+        return strdup(git_dir);
+    }
+
+    trim_trailing_space(commondir);
+    char *common_dir = commondir[0] == '/' ? strdup(commondir)
+                                           : join_path(git_dir, commondir);
+    free(commondir);
+    return common_dir;
+}
+
+// A directory git would take as a repository: HEAD, and objects and refs
+// here or in the common directory
+static int is_git_dir(const char *path) {
+    char *head = join_path(path, "HEAD");
+    char *common_dir = git_common_dir(path);
+    char *objects = common_dir ? join_path(common_dir, "objects") : NULL;
+    char *refs = common_dir ? join_path(common_dir, "refs") : NULL;
+    struct stat st;
+    int is_repo = head && objects && refs && stat(head, &st) == 0 &&
+                  stat(objects, &st) == 0 && S_ISDIR(st.st_mode) &&
+                  stat(refs, &st) == 0 && S_ISDIR(st.st_mode);
+    free(head);
+    free(common_dir);
+    free(objects);
+    free(refs);
+    return is_repo;
+}
+
+// The repository a .git file points to ("gitdir: <path>"), or NULL
+static char *read_gitfile(const char *dir, const char *path) {
+    char *content = read_file(path, NULL);
+    if (content == NULL || strncmp(content, "gitdir: ", 8) != 0) {
+        free(content);
+        return NULL;
+    }
+    trim_trailing_space(content);
+    char *target = content[8] == '/' ? strdup(content + 8)
+                                     : join_path(dir, content + 8);
+    free(content);
+    return target;
+}
+
+char *discover_git_dir(char **top, char **prefix) {
+    // Leave the environment's overrides and ceilings to git
+    if (getenv("GIT_DIR") || getenv("GIT_WORK_TREE") ||
+        getenv("GIT_CEILING_DIRECTORIES")) {
+        return NULL;
+    }
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        return NULL;
+    }
+
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", cwd);
+    for (;;) {
+        char *dot_git = join_path(dir, ".git");
+        char *git_dir = NULL;
+        struct stat st;
+        if (dot_git && stat(dot_git, &st) == 0) {
+            if (S_ISDIR(st.st_mode)) {
+                git_dir = is_git_dir(dot_git) ? strdup(dot_git) : NULL;
+            } else if (S_ISREG(st.st_mode)) {
+                git_dir = read_gitfile(dir, dot_git);
+                if (git_dir && !is_git_dir(git_dir)) {
+                    free(git_dir);
+                    git_dir = NULL;
+                }
+            }
+        }
+        free(dot_git);
+        if (git_dir) {
+            // Like `git rev-parse --git-dir`: relative at the top of a
+            // work tree with its own .git directory. A gitfile may name
+            // any directory, shorter than this one too.
+            size_t top_len = strlen(dir);
+            int at_top = strcmp(dir, cwd) == 0;
+            if (at_top && strlen(git_dir) >= top_len &&
+                strncmp(git_dir, dir, top_len) == 0 &&
+                strcmp(git_dir + top_len, "/.git") == 0) {
+                strcpy(git_dir, ".git");
+            }
+            *top = strdup(dir);
+            size_t rest = at_top ? 0 : strlen(cwd) - top_len - 1;
+            *prefix = malloc(rest + 2);
+            if (*top == NULL || *prefix == NULL) {
+                free(*top);
+                free(*prefix);
+                free(git_dir);
+                return NULL;
+            }
+            memcpy(*prefix, cwd + strlen(cwd) - rest, rest);
+            strcpy(*prefix + rest, rest ? "/" : "");
+            return git_dir;
+        }
+
+        // Inside a .git directory or a bare repository: ask git
+        if (is_git_dir(dir)) {
+            return NULL;
+        }
+        char *slash = strrchr(dir, '/');
+        if (slash == NULL || slash == dir) {
+            return NULL;
+        }
+        *slash = '\0';
+    }
+}
+
+Odb *odb_open(const char *git_dir) {
+    // Linked worktrees keep their objects in the main repository
+    char *common_dir = git_common_dir(git_dir);
+    if (common_dir == NULL) {
+        return NULL;
+    }
+
+    if (!has_supported_format(common_dir)) {
+        free(common_dir);
+        return NULL;
+    }
+
+    Odb *odb = calloc(1, sizeof(Odb));
+    if (odb == NULL) {
+        free(common_dir);
+        return NULL;
+    }
+    pthread_mutex_init(&odb->delta_lock, NULL);
+    pthread_mutex_init(&odb->loose_lock, NULL);
+
+    const char *env_dir = getenv("GIT_OBJECT_DIRECTORY");
+    char *objects_dir = env_dir ? strdup(env_dir)
+                                : join_path(common_dir, "objects");
+    free(common_dir);
+
+    struct stat st;
+    if (objects_dir == NULL || stat(objects_dir, &st) != 0 ||
+        !S_ISDIR(st.st_mode)) {
+        free(objects_dir);
+        odb_close(odb);
+        return NULL;
+    }
+    add_object_dir(odb, objects_dir, 0);
+    free(objects_dir);
+
+    const char *env_alternates = getenv("GIT_ALTERNATE_OBJECT_DIRECTORIES");
+    if (env_alternates != NULL) {
+        char *list = strdup(env_alternates);
+        char *next_dir;
+        char *dir = list ? strtok_r(list, ":", &next_dir) : NULL;
+        while (dir != NULL) {
+            add_object_dir(odb, dir, 1);
+            dir = strtok_r(NULL, ":", &next_dir);
+        }
+        free(list);
+    }
+
+    return odb;
+}
+
+void odb_close(Odb *odb) {
+    if (odb == NULL) {
+        return;
+    }
+    for (int i = 0; i < odb->pack_count; i++) {
+        munmap(odb->packs[i].idx_map, odb->packs[i].idx_size);
+        munmap(odb->packs[i].pack_map, odb->packs[i].pack_size);
+        free(odb->packs[i].path);
+    }
+    for (int i = 0; i < odb->midx_count; i++) {
+        munmap(odb->midxes[i].map, odb->midxes[i].size);
+        free(odb->midxes[i].packs);
+    }
+    for (int i = 0; i < odb->object_dir_count; i++) {
+        free(odb->object_dirs[i]);
+    }
+    for (int i = 0; i < DELTA_CACHE_SLOTS; i++) {
+        free(odb->delta_cache[i].data);
+    }
+    free(odb->packs);
+    free(odb->midxes);
+    for (int i = 0; odb->loose && i < odb->object_dir_count * 256; i++) {
+        free(odb->loose[i].oids);
+    }
+    free(odb->loose);
+    free(odb->object_dirs);
+    pthread_mutex_destroy(&odb->delta_lock);
+    pthread_mutex_destroy(&odb->loose_lock);
+    free(odb);
+}
+
+const char *odb_objects_dir(const Odb *odb) {
+    return odb->object_dir_count > 0 ? odb->object_dirs[0] : NULL;
+}
+
+size_t odb_bytes_read(const Odb *odb) {
+    return atomic_load(&odb->bytes_read);
+}
+
+// Inflate exactly out_len bytes; out must have room for out_len + 1
+static int inflate_buffer(Odb *odb, const unsigned char *in, size_t in_len,
+                          unsigned char *out, size_t out_len) {
+    z_stream *stream = inflate_context(in, in_len);
+    if (stream == NULL) {
+        return -1;
+    }
+    stream->next_out = out;
+    stream->avail_out = out_len + 1;
+
+    int status = inflate(stream, Z_FINISH);
+    atomic_fetch_add(&odb->bytes_read, stream->total_in);
+    profile_add_bytes(stream->total_in);
+
+    if (status != Z_STREAM_END || stream->total_out != out_len) {
+        return -1;
+    }
+    return 0;
+}
+
+static unsigned char *delta_cache_get(Odb *odb, const Pack *pack,
+                                      size_t offset, ObjectType *type,
+                                      size_t *size) {
+    DeltaCacheEntry *entry =
+        &odb->delta_cache[(offset ^ (uintptr_t)pack) % DELTA_CACHE_SLOTS];
+    unsigned char *copy = NULL;
+    pthread_mutex_lock(&odb->delta_lock);
+    if (entry->data && entry->pack == pack && entry->offset == offset) {
+        copy = malloc(entry->size + 1);
+        if (copy) {
+            memcpy(copy, entry->data, entry->size + 1);
+            *type = entry->type;
+            *size = entry->size;
+        }
+    }
+    pthread_mutex_unlock(&odb->delta_lock);
+    return copy;
+}
+
+static void delta_cache_put(Odb *odb, const Pack *pack, size_t offset,
+                            ObjectType type, const unsigned char *data,
+                            size_t size) {
+    if (size > DELTA_CACHE_LIMIT / 4) {
+        return;
+    }
+
+    // Copied before taking the lock, so other threads only wait for the
+    // bookkeeping
+    unsigned char *copy = malloc(size + 1);
+    if (copy == NULL) {
+        return;
+    }
+    memcpy(copy, data, size + 1);
+
+    DeltaCacheEntry *entry =
+        &odb->delta_cache[(offset ^ (uintptr_t)pack) % DELTA_CACHE_SLOTS];
+    pthread_mutex_lock(&odb->delta_lock);
+    unsigned char *dropped = entry->data;
+    if (dropped) {
+        odb->delta_cache_bytes -= entry->size;
+        entry->data = NULL;
+    }
+
+    // Make room by dropping other bases in round-robin order
+    while (odb->delta_cache_bytes + size > DELTA_CACHE_LIMIT) {
+        DeltaCacheEntry *victim = &odb->delta_cache[odb->delta_cache_evict];
+        odb->delta_cache_evict = (odb->delta_cache_evict + 1) % DELTA_CACHE_SLOTS;
+        if (victim->data) {
+            odb->delta_cache_bytes -= victim->size;
+            free(victim->data);
+            victim->data = NULL;
+        }
+    }
+
+    entry->data = copy;
+    entry->pack = pack;
+    entry->offset = offset;
+    entry->type = type;
+    entry->size = size;
+    odb->delta_cache_bytes += size;
+    pthread_mutex_unlock(&odb->delta_lock);
+    free(dropped);
+}
+
+// Decode the type/size header of a pack entry; returns the header length
+static size_t parse_entry_header(const Pack *pack, size_t offset,
+                                 ObjectType *type, size_t *size) {
+    const unsigned char *p = pack->pack_map + offset;
+    const unsigned char *end = pack->pack_map + pack->pack_size - 20;
+    if (p >= end) {
+        return 0;
+    }
+
+    unsigned char c = *p++;
+    *type = (c >> 4) & 7;
+    *size = c & 15;
+    int shift = 4;
+    while (c & 0x80) {
+        if (p >= end || shift > 57) {
+            return 0;
+        }
+        c = *p++;
+        *size += (size_t)(c & 0x7f) << shift;
+        shift += 7;
+    }
+    return p - (pack->pack_map + offset);
+}
+
+// Decode the negative base distance of an OFS_DELTA entry
+static size_t parse_ofs_delta(const Pack *pack, size_t offset, size_t *base) {
+    const unsigned char *start = pack->pack_map + offset;
+    const unsigned char *p = start;
+    const unsigned char *end = pack->pack_map + pack->pack_size - 20;
+    if (p >= end) {
+        return 0;
+    }
+
+    unsigned char c = *p++;
+    size_t distance = c & 127;
+    while (c & 128) {
+        if (p >= end) {
+            return 0;
+        }
+        distance += 1;
+        c = *p++;
+        distance = (distance << 7) + (c & 127);
+    }
+    *base = distance;
+    return p - start;
+}
+
+static size_t read_delta_size(const unsigned char **p, const unsigned char *end) {
+    size_t size = 0;
+    int shift = 0;
+    unsigned char c;
+    do {
+        if (*p >= end) {
+            return 0;
+        }
+        c = *(*p)++;
+        size |= (size_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while ((c & 0x80) && shift < 64);
+    return size;
+}
+
+// Apply a git delta to a base object
+static unsigned char *patch_delta(const unsigned char *base, size_t base_size,
+                                  const unsigned char *delta, size_t delta_size,
+                                  size_t *result_size) {
+    const unsigned char *p = delta;
+    const unsigned char *end = delta + delta_size;
+
+    if (read_delta_size(&p, end) != base_size) {
+        return NULL;
+    }
+    size_t size = read_delta_size(&p, end);
+
+    unsigned char *result = malloc(size + 1);
+    if (result == NULL) {
+        return NULL;
+    }
+
+    unsigned char *out = result;
+    unsigned char *out_end = result + size;
+    while (p < end) {
+        unsigned char op = *p++;
+        if (op & 0x80) {
+            size_t copy_offset = 0, copy_size = 0;
+            for (int i = 0; i < 4; i++) {
+                if (op & (1 << i)) {
+                    if (p >= end) {
+                        goto corrupt;
+                    }
+                    copy_offset |= (size_t)*p++ << (8 * i);
+                }
+            }
+            for (int i = 0; i < 3; i++) {
+                if (op & (0x10 << i)) {
+                    if (p >= end) {
+                        goto corrupt;
+                    }
+                    copy_size |= (size_t)*p++ << (8 * i);
+                }
+            }
+            if (copy_size == 0) {
+                copy_size = 0x10000;
+            }
+            if (copy_offset + copy_size > base_size ||
+                copy_size > (size_t)(out_end - out)) {
+                goto corrupt;
+            }
+            memcpy(out, base + copy_offset, copy_size);
+            out += copy_size;
+        } else if (op) {
+            if (op > end - p || op > out_end - out) {
+                goto corrupt;
+            }
+            memcpy(out, p, op);
+            out += op;
+            p += op;
+        } else {
+            goto corrupt;
+        }
+    }
+    if (out != out_end) {
+        goto corrupt;
+    }
+
+    result[size] = '\0';
+    *result_size = size;
+    return result;
+
+corrupt:
+    free(result);
+    return NULL;
+}
+
+static int unpack_entry(Odb *odb, const Pack *pack, size_t offset,
+                        ObjectType *type, unsigned char **data, size_t *size);
+
+// Resolve an entry to its innermost base, remembering the deltas on the way
+static int unpack_base(Odb *odb, const Pack *pack, size_t *chain, int *depth,
+                       size_t offset, ObjectType *type, unsigned char **data,
+                       size_t *size, size_t *base_offset) {
+    for (;;) {
+        *data = delta_cache_get(odb, pack, offset, type, size);
+        if (*data) {
+            *base_offset = offset;
+            return 0;
+        }
+
+        ObjectType entry_type;
+        size_t entry_size;
+        size_t header_len = parse_entry_header(pack, offset, &entry_type,
+                                               &entry_size);
+        if (header_len == 0) {
+            return -1;
+        }
+
+        if (entry_type == OBJ_OFS_DELTA || entry_type == OBJ_REF_DELTA) {
+            if (*depth == MAX_DELTA_DEPTH) {
+                return -1;
+            }
+            chain[(*depth)++] = offset;
+
+            if (entry_type == OBJ_OFS_DELTA) {
+                size_t distance;
+                if (parse_ofs_delta(pack, offset + header_len, &distance) == 0 ||
+                    distance > offset) {
+                    return -1;
+                }
+                offset -= distance;
+                continue;
+            }
+
+            const unsigned char *base_oid = pack->pack_map + offset + header_len;
+            if (offset + header_len + OID_RAWSZ > pack->pack_size) {
+                return -1;
+            }
+            if (find_pack_entry(pack, base_oid, &offset) == 0) {
+                continue;
+            }
+            // Base lives in another pack or loose
+            *base_offset = 0;
+            return odb_read(odb, base_oid, type, data, size);
+        }
+
+        if (entry_type < OBJ_COMMIT || entry_type > OBJ_TAG) {
+            return -1;
+        }
+
+        *data = malloc(entry_size + 1);
+        if (*data == NULL) {
+            return -1;
+        }
+        const unsigned char *in = pack->pack_map + offset + header_len;
+        if (inflate_buffer(odb, in, pack->pack_size - offset - header_len,
+                           *data, entry_size) != 0) {
+            free(*data);
+            *data = NULL;
+            return -1;
+        }
+        (*data)[entry_size] = '\0';
+        *type = entry_type;
+        *size = entry_size;
+        *base_offset = offset;
+        return 0;
+    }
+}
+
+static int unpack_entry(Odb *odb, const Pack *pack, size_t offset,
+                        ObjectType *type, unsigned char **data, size_t *size) {
+    size_t *chain = malloc(MAX_DELTA_DEPTH * sizeof(size_t));
+    if (chain == NULL) {
+        return -1;
+    }
+
+    int depth = 0;
+    size_t base_offset;
+    unsigned char *base;
+    size_t base_size;
+    if (unpack_base(odb, pack, chain, &depth, offset, type, &base,
+                    &base_size, &base_offset) != 0) {
+        free(chain);
+        return -1;
+    }
+
+    // Replay the deltas from the innermost base outwards
+    while (depth > 0) {
+        size_t delta_offset = chain[--depth];
+        ObjectType entry_type;
+        size_t delta_size;
+        size_t header_len = parse_entry_header(pack, delta_offset, &entry_type,
+                                               &delta_size);
+        size_t data_offset = delta_offset + header_len;
+        if (entry_type == OBJ_OFS_DELTA) {
+            size_t distance;
+            data_offset += parse_ofs_delta(pack, data_offset, &distance);
+        } else {
+            data_offset += OID_RAWSZ;
+        }
+
+        if (base_offset != 0) {
+            delta_cache_put(odb, pack, base_offset, *type, base, base_size);
+        }
+
+        unsigned char *delta = malloc(delta_size + 1);
+        unsigned char *result = NULL;
+        size_t result_size = 0;
+        if (delta && inflate_buffer(odb, pack->pack_map + data_offset,
+                                    pack->pack_size - data_offset,
+                                    delta, delta_size) == 0) {
+            result = patch_delta(base, base_size, delta, delta_size,
+                                 &result_size);
+        }
+        free(delta);
+        free(base);
+        if (result == NULL) {
+            free(chain);
+            return -1;
+        }
+        base = result;
+        base_size = result_size;
+        base_offset = delta_offset;
+    }
+
+    free(chain);
+    *data = base;
+    *size = base_size;
+    return 0;
+}
+
+static ObjectType type_from_name(const char *name, size_t len) {
+    static const struct {
+        const char *name;
+        ObjectType type;
+    } names[] = {
+        {"commit", OBJ_COMMIT}, {"tree", OBJ_TREE},
+        {"blob", OBJ_BLOB}, {"tag", OBJ_TAG}
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strlen(names[i].name) == len && memcmp(names[i].name, name, len) == 0) {
+            return names[i].type;
+        }
+    }
+    return OBJ_BAD;
+}
+
+static int read_loose(Odb *odb, const char *objects_dir,
+                      const unsigned char *oid, ObjectType *type,
+                      unsigned char **data, size_t *size) {
+    char hex[OID_HEXSZ + 1];
+    char name[OID_HEXSZ + 2];
+    oid_to_hex(oid, hex);
+    snprintf(name, sizeof(name), "%.2s/%s", hex, hex + 2);
+
+    char *path = join_path(objects_dir, name);
+    size_t compressed_size;
+    unsigned char *compressed = path ? (unsigned char *)read_file(path, &compressed_size)
+                                     : NULL;
+    free(path);
+    if (compressed == NULL) {
+        return -1;
+    }
+
+    z_stream *stream = inflate_context(compressed, compressed_size);
+    if (stream == NULL) {
+        free(compressed);
+        return -1;
+    }
+
+    // The "<type> <size>\0" header tells how much to allocate
+    unsigned char header[64];
+    stream->next_out = header;
+    stream->avail_out = sizeof(header);
+    int status = inflate(stream, Z_SYNC_FLUSH);
+    unsigned char *nul = memchr(header, '\0', sizeof(header) - stream->avail_out);
+    unsigned char *space = memchr(header, ' ', sizeof(header) - stream->avail_out);
+    if ((status != Z_OK && status != Z_STREAM_END) || nul == NULL ||
+        space == NULL || space > nul) {
+        free(compressed);
+        return -1;
+    }
+
+    *type = type_from_name((char *)header, space - header);
+    *size = strtoull((char *)space + 1, NULL, 10);
+    *data = malloc(*size + 1);
+    if (*type == OBJ_BAD || *data == NULL) {
+        free(*data);
+        *data = NULL;
+        free(compressed);
+        return -1;
+    }
+
+    size_t already = (header + sizeof(header) - stream->avail_out) - (nul + 1);
+    if (already > *size) {
+        already = *size;
+    }
+    memcpy(*data, nul + 1, already);
+    stream->next_out = *data + already;
+    stream->avail_out = *size - already + 1;
+    if (status != Z_STREAM_END) {
+        status = inflate(stream, Z_FINISH);
+    }
+    size_t produced = stream->next_out - *data;
+    atomic_fetch_add(&odb->bytes_read, stream->total_in);
+    profile_add_bytes(stream->total_in);
+    free(compressed);
+
+    if (status != Z_STREAM_END || produced != *size) {
+        free(*data);
+        *data = NULL;
+        return -1;
+    }
+    (*data)[*size] = '\0';
+    return 0;
+}
+
+// Hex digits two ids have in common
+static int common_hex_digits(const unsigned char *a, const unsigned char *b) {
+    int digits = 0;
+    for (int i = 0; i < OID_RAWSZ; i++) {
+        if (a[i] != b[i]) {
+            return digits + ((a[i] >> 4) == (b[i] >> 4));
+        }
+        digits += 2;
+    }
+    return digits;
+}
+
+// Longest prefix the id shares with another id in a table: only its
+// neighbours in sorted order need checking
+static int table_common_digits(const OidTable *ids, const unsigned char *oid) {
+    uint32_t first = oid[0] ? get_be32(ids->fanout + (oid[0] - 1) * 4) : 0;
+    uint32_t last = get_be32(ids->fanout + oid[0] * 4);
+    uint32_t lo = table_lower_bound(ids, oid);
+    if (last > ids->nr || lo > last) {
+        return 0;
+    }
+
+    int best = 0;
+    if (lo > first) {
+        int common = common_hex_digits(table_oid_at(ids, lo - 1), oid);
+        best = common > best ? common : best;
+    }
+    if (lo < last && oid_cmp(table_oid_at(ids, lo), oid) == 0) {
+        lo++;
+    }
+    if (lo < last) {
+        int common = common_hex_digits(table_oid_at(ids, lo), oid);
+        best = common > best ? common : best;
+    }
+    return best;
+}
+
+// Whether an id starts with the first `len` hex digits of `key`
+static int prefix_matches(const unsigned char *id, const unsigned char *key,
+                          size_t len) {
+    return memcmp(id, key, len / 2) == 0 &&
+           (len % 2 == 0 || (id[len / 2] >> 4) == (key[len / 2] >> 4));
+}
+
+// Keep the first match in `oid`, counting up to two distinct ones in *found
+static void match_found(const unsigned char *id, unsigned char *oid, int *found) {
+    if (*found == 0) {
+        memcpy(oid, id, OID_RAWSZ);
+        *found = 1;
+    } else if (memcmp(id, oid, OID_RAWSZ) != 0) {
+        *found = 2;
+    }
+}
+
+static int compare_oids(const void *a, const void *b) {
+    return memcmp(a, b, OID_RAWSZ);
+}
+
+// Collect the ids in a table that start with a prefix
+static void table_match_prefix(const OidTable *ids, const unsigned char *key,
+                               size_t len, unsigned char *oid, int *found) {
+    for (uint32_t i = table_lower_bound(ids, key);
+         i < ids->nr && *found < 2 && prefix_matches(table_oid_at(ids, i), key, len);
+         i++) {
+        match_found(table_oid_at(ids, i), oid, found);
+    }
+}
+
+// The sorted ids of the loose objects in one fan-out directory, listed on
+// first use
+static const LooseDir *loose_dir(Odb *odb, int dir_index, unsigned char first) {
+    pthread_mutex_lock(&odb->loose_lock);
+    if (odb->loose == NULL) {
+        odb->loose = calloc((size_t)odb->object_dir_count * 256, sizeof(LooseDir));
+    }
+    LooseDir *loose = odb->loose ? &odb->loose[dir_index * 256 + first] : NULL;
+    if (loose == NULL || loose->listed) {
+        pthread_mutex_unlock(&odb->loose_lock);
+        return loose;
+    }
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%02x", odb->object_dirs[dir_index], first);
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+    int capacity = 0;
+    while (dir && (entry = readdir(dir)) != NULL) {
+        char name[OID_HEXSZ + 1];
+        if (strlen(entry->d_name) != OID_HEXSZ - 2) {
+            continue;
+        }
+        snprintf(name, sizeof(name), "%02x%s", first, entry->d_name);
+        if (loose->count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            unsigned char *grown = realloc(loose->oids, (size_t)capacity * OID_RAWSZ);
+            if (grown == NULL) {
+                break;
+            }
+            loose->oids = grown;
+        }
+        if (hex_to_oid(name, loose->oids + (size_t)loose->count * OID_RAWSZ) == 0) {
+            loose->count++;
+        }
+    }
+    if (dir) {
+        closedir(dir);
+    }
+    if (loose->count > 1) {
+        qsort(loose->oids, loose->count, OID_RAWSZ, compare_oids);
+    }
+    loose->listed = 1;
+    pthread_mutex_unlock(&odb->loose_lock);
+    return loose;
+}
+
+// Longest prefix shared with a loose object in the id's fan-out directory
+static int loose_common_digits(Odb *odb, int dir_index, const unsigned char *oid) {
+    const LooseDir *loose = loose_dir(odb, dir_index, oid[0]);
+    int best = 0;
+    for (int i = 0; loose && i < loose->count; i++) {
+        const unsigned char *other = loose->oids + (size_t)i * OID_RAWSZ;
+        if (memcmp(other, oid, OID_RAWSZ) != 0) {
+            int common = common_hex_digits(other, oid);
+            best = common > best ? common : best;
+        }
+    }
+    return best;
+}
+
+int odb_abbrev_len(Odb *odb, const unsigned char *oid) {
+    // Like git: about half the bits needed to count the packed objects,
+    // in hex digits, and never fewer than 7
+    if (odb->default_abbrev == 0) {
+        unsigned long count = 0;
+        for (int i = 0; i < odb->pack_count; i++) {
+            count += odb->packs[i].ids.nr;
+        }
+        int bits = 1;
+        while (count >>= 1) {
+            bits++;
+        }
+        odb->default_abbrev = (bits + 1) / 2 < 7 ? 7 : (bits + 1) / 2;
+    }
+
+    int common = 0;
+    for (int i = 0; i < odb->midx_count; i++) {
+        int digits = table_common_digits(&odb->midxes[i].ids, oid);
+        common = digits > common ? digits : common;
+    }
+    for (int i = 0; i < odb->pack_count; i++) {
+        if (!odb->packs[i].in_midx) {
+            int digits = table_common_digits(&odb->packs[i].ids, oid);
+            common = digits > common ? digits : common;
+        }
+    }
+    for (int i = 0; i < odb->object_dir_count; i++) {
+        int digits = loose_common_digits(odb, i, oid);
+        common = digits > common ? digits : common;
+    }
+
+    int len = common + 1 > odb->default_abbrev ? common + 1 : odb->default_abbrev;
+    return len < OID_HEXSZ ? len : OID_HEXSZ;
+}
+
+int odb_resolve_prefix(Odb *odb, const char *hex, size_t len,
+                       unsigned char *oid) {
+    if (len < MIN_ABBREV || len > OID_HEXSZ) {
+        return -1;
+    }
+    // The prefix padded with zeros sorts right before the ids it starts
+    unsigned char key[OID_RAWSZ] = {0};
+    for (size_t i = 0; i < len; i++) {
+        int value = hex_value(hex[i]);
+        if (value < 0) {
+            return -1;
+        }
+        key[i / 2] |= i % 2 ? value : value << 4;
+    }
+
+    int found = 0;
+    for (int i = 0; i < odb->midx_count && found < 2; i++) {
+        table_match_prefix(&odb->midxes[i].ids, key, len, oid, &found);
+    }
+    for (int i = 0; i < odb->pack_count && found < 2; i++) {
+        if (!odb->packs[i].in_midx) {
+            table_match_prefix(&odb->packs[i].ids, key, len, oid, &found);
+        }
+    }
+    for (int i = 0; i < odb->object_dir_count && found < 2; i++) {
+        const LooseDir *loose = loose_dir(odb, i, key[0]);
+        for (int j = 0; loose && j < loose->count && found < 2; j++) {
+            const unsigned char *id = loose->oids + (size_t)j * OID_RAWSZ;
+            if (prefix_matches(id, key, len)) {
+                match_found(id, oid, &found);
+            }
+        }
+    }
+    return found == 1 ? 0 : found == 0 ? -1 : -2;
+}
+
+int odb_has_object(Odb *odb, const unsigned char *oid) {
+    uint32_t pos;
+    for (int i = 0; i < odb->midx_count; i++) {
+        if (table_find(&odb->midxes[i].ids, oid, &pos) == 0) {
+            return 1;
+        }
+    }
+    for (int i = 0; i < odb->pack_count; i++) {
+        if (!odb->packs[i].in_midx && table_find(&odb->packs[i].ids, oid, &pos) == 0) {
+            return 1;
+        }
+    }
+
+    char hex[OID_HEXSZ + 1];
+    char name[OID_HEXSZ + 2];
+    oid_to_hex(oid, hex);
+    snprintf(name, sizeof(name), "%.2s/%s", hex, hex + 2);
+    for (int i = 0; i < odb->object_dir_count; i++) {
+        char *path = join_path(odb->object_dirs[i], name);
+        int exists = path && access(path, F_OK) == 0;
+        free(path);
+        if (exists) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int odb_read(Odb *odb, const unsigned char *oid, ObjectType *type,
+             unsigned char **data, size_t *size) {
+    const Pack *pack;
+    size_t offset;
+
+    // A multi-pack-index answers for the packs it lists in one search.
+    // Should its pack fail to give the object, every pack is searched.
+    int fallback = 0;
+    for (int i = 0; i < odb->midx_count; i++) {
+        int status = find_midx_entry(odb, &odb->midxes[i], oid, &pack, &offset);
+        if (status == 0 &&
+            unpack_entry(odb, pack, offset, type, data, size) == 0) {
+            return 0;
+        }
+        fallback |= status != -1;
+    }
+
+    for (int i = 0; i < odb->pack_count; i++) {
+        if (odb->packs[i].in_midx && !fallback) {
+            continue;
+        }
+        if (find_pack_entry(&odb->packs[i], oid, &offset) == 0) {
+            if (unpack_entry(odb, &odb->packs[i], offset, type, data, size) == 0) {
+                return 0;
+            }
+        }
+    }
+
+    for (int i = 0; i < odb->object_dir_count; i++) {
+        if (read_loose(odb, odb->object_dirs[i], oid, type, data, size) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
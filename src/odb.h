@@ -0,0 +1,71 @@
+#ifndef SHRUB_ODB_H
+#define SHRUB_ODB_H
+
+#include <stddef.h>
+
+#define OID_RAWSZ 20
+#define OID_HEXSZ 40
+
+// Object types as stored in pack entry headers
+typedef enum {
+    OBJ_BAD = -1,
+    OBJ_NONE = 0,
+    OBJ_COMMIT = 1,
+    OBJ_TREE = 2,
+    OBJ_BLOB = 3,
+    OBJ_TAG = 4,
+    OBJ_OFS_DELTA = 6,
+    OBJ_REF_DELTA = 7
+} ObjectType;
+
+typedef struct Odb Odb;
+
+// Directory holding objects, refs and config (differs for linked worktrees).
+// Returns a malloc'd path.
+char *git_common_dir(const char *git_dir);
+
+// Read a whole file into a malloc'd, NUL-terminated buffer, its length in
+// *size unless that is NULL. Returns NULL if it cannot be read.
+char *read_file(const char *path, size_t *size);
+
+// Find the repository of the current directory without running git: the
+// nearest .git directory or gitfile above it. Returns the malloc'd path
+// `git rev-parse --git-dir` prints, with the top of the work tree in *top
+// and the current directory below it in *prefix ("" or "sub/dir/"). NULL
+// when git should be asked instead: $GIT_DIR and the like are set, or the
+// directory is inside a .git directory or a bare repository.
+char *discover_git_dir(char **top, char **prefix);
+
+// Open the object database of a repository (loose objects, packs and
+// alternates). Returns NULL if the layout is not supported.
+Odb *odb_open(const char *git_dir);
+void odb_close(Odb *odb);
+
+// Read an object by binary id. On success returns 0 and stores a malloc'd,
+// NUL-terminated copy of the object contents in *data.
+int odb_read(Odb *odb, const unsigned char *oid, ObjectType *type,
+             unsigned char **data, size_t *size);
+
+// Whether the repository has an object, without reading it. Packed
+// objects are found in the mmap'd .idx and multi-pack-index files.
+int odb_has_object(Odb *odb, const unsigned char *oid);
+
+// Resolve an abbreviated id of `len` hex digits (at least 4) to the one
+// object it starts. Returns 0, -1 if no object matches and -2 if several do.
+int odb_resolve_prefix(Odb *odb, const char *hex, size_t len,
+                       unsigned char *oid);
+
+// Hex digits `%h` shows for an object: git's default length for a
+// repository this size, grown until no other object shares the prefix
+int odb_abbrev_len(Odb *odb, const unsigned char *oid);
+
+// The repository's own object directory (alternates excluded)
+const char *odb_objects_dir(const Odb *odb);
+
+// Number of compressed bytes consumed from packs and loose files
+size_t odb_bytes_read(const Odb *odb);
+
+int hex_to_oid(const char *hex, unsigned char *oid);
+void oid_to_hex(const unsigned char *oid, char *hex);
+
+#endif
@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "oidmap.h"
+
+static size_t oidmap_slot(const unsigned char *oid, size_t size) {
+    size_t h;
+    memcpy(&h, oid, sizeof(h));
+    return h & (size - 1);
+}
+
+int oidmap_init(OidMap *map, size_t size) {
+    size_t rounded = 16;
+    while (rounded < size) {
+        rounded *= 2;
+    }
+    map->keys = malloc(rounded * OID_RAWSZ);
+    map->values = malloc(rounded * sizeof(int));
+    map->used = calloc(rounded, 1);
+    map->size = rounded;
+    map->count = 0;
+    if (!map->keys || !map->values || !map->used) {
+        oidmap_free(map);
+        return -1;
+    }
+    return 0;
+}
+
+void oidmap_free(OidMap *map) {
+    free(map->keys);
+    free(map->values);
+    free(map->used);
+    memset(map, 0, sizeof(*map));
+}
+
+// Slot holding the id, or the empty slot where it would go
+static size_t oidmap_find(const OidMap *map, const unsigned char *oid) {
+    size_t i = oidmap_slot(oid, map->size);
+    while (map->used[i] && memcmp(map->keys[i], oid, OID_RAWSZ) != 0) {
+        i = (i + 1) & (map->size - 1);
+    }
+    return i;
+}
+
+static int oidmap_grow(OidMap *map) {
+    OidMap grown;
+    if (oidmap_init(&grown, map->size * 2) != 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < map->size; i++) {
+        if (map->used[i]) {
+            size_t j = oidmap_find(&grown, map->keys[i]);
+            memcpy(grown.keys[j], map->keys[i], OID_RAWSZ);
+            grown.values[j] = map->values[i];
+            grown.used[j] = 1;
+        }
+    }
+    grown.count = map->count;
+    oidmap_free(map);
+    *map = grown;
+    return 0;
+}
+
+int oidmap_put(OidMap *map, const unsigned char *oid, int value) {
+    if ((map->count + 1) * 2 > map->size && oidmap_grow(map) != 0) {
+        return -1;
+    }
+
+    size_t i = oidmap_find(map, oid);
+    if (!map->used[i]) {
+        memcpy(map->keys[i], oid, OID_RAWSZ);
+        map->used[i] = 1;
+        map->count++;
+    }
+    map->values[i] = value;
+    return 0;
+}
+
+int oidmap_get(const OidMap *map, const unsigned char *oid, int *value) {
+    size_t i = oidmap_find(map, oid);
+    if (!map->used[i]) {
+        return 0;
+    }
+    *value = map->values[i];
+    return 1;
+}
+
+int oidmap_contains(const OidMap *map, const unsigned char *oid) {
+    return map->used[oidmap_find(map, oid)];
+}
+
+int oidmap_add(OidMap *map, const unsigned char *oid) {
+    size_t i = oidmap_find(map, oid);
+    if (map->used[i]) {
+        return 0;
+    }
+    if ((map->count + 1) * 2 > map->size) {
+        if (oidmap_grow(map) != 0) {
+            return -1;
+        }
+        i = oidmap_find(map, oid);
+    }
+    memcpy(map->keys[i], oid, OID_RAWSZ);
+    map->values[i] = 0;
+    map->used[i] = 1;
+    map->count++;
+    return 1;
+}
+
+// Linear probing allows deletion without tombstones: shift later entries
+// of the same probe run back into the hole
+void oidmap_remove(OidMap *map, const unsigned char *oid) {
+    size_t mask = map->size - 1;
+    size_t hole = oidmap_find(map, oid);
+    if (!map->used[hole]) {
+        return;
+    }
+
+    size_t i = hole;
+    for (;;) {
+        i = (i + 1) & mask;
+        if (!map->used[i]) {
+            break;
+        }
+        size_t home = oidmap_slot(map->keys[i], map->size);
+        // Move the entry unless its home lies cyclically in (hole, i]
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            memcpy(map->keys[hole], map->keys[i], OID_RAWSZ);
+            map->values[hole] = map->values[i];
+            hole = i;
+        }
+    }
+    map->used[hole] = 0;
+    map->count--;
+}
@@ -0,0 +1,35 @@
+#ifndef SHRUB_OIDMAP_H
+#define SHRUB_OIDMAP_H
+
+#include <stddef.h>
+
+#include "odb.h"
+
+// Open-addressing hash map from binary object ids to ints. Object ids are
+// uniformly distributed, so their leading bytes serve as the hash.
+typedef struct {
+    unsigned char (*keys)[OID_RAWSZ];
+    int *values;
+    char *used;
+    size_t size;        // power of two
+    size_t count;
+} OidMap;
+
+int oidmap_init(OidMap *map, size_t size);
+void oidmap_free(OidMap *map);
+
+// Insert or replace; returns -1 when out of memory
+int oidmap_put(OidMap *map, const unsigned char *oid, int value);
+
+// Returns 1 and stores the value if the id is present
+int oidmap_get(const OidMap *map, const unsigned char *oid, int *value);
+
+void oidmap_remove(OidMap *map, const unsigned char *oid);
+
+// As a set of ids, the values unused
+int oidmap_contains(const OidMap *map, const unsigned char *oid);
+// Returns 1 if the id was added, 0 if already present, -1 when out of
+// memory
+int oidmap_add(OidMap *map, const unsigned char *oid);
+
+#endif
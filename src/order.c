@@ -0,0 +1,431 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "shrub.h"
+#include "oidmap.h"
+
+// Kahn's algorithm over the commit store: a commit becomes ready once all
+// of its children have been emitted, and the ready set is drained by date
+// (newest first) or, for --topo-order, as a stack so that each line of
+// history is finished before the next one starts. This is the ordering
+// git's sort_in_topological_order() produces. Only an index array moves.
+
+typedef struct {
+    time_t key;
+    uint64_t seq;           // insertion order, breaks ties like git
+    int index;
+} ReadyEntry;
+
+typedef struct {
+    ReadyEntry *entries;
+    int count;
+    int capacity;
+    uint64_t next_seq;
+    SortOrder order;
+} ReadyQueue;
+
+static int ready_before(const ReadyEntry *a, const ReadyEntry *b) {
+    if (a->key != b->key) {
+        return a->key > b->key;
+    }
+    return a->seq < b->seq;
+}
+
+// Returns -1 when out of memory
+static int ready_insert(ReadyQueue *queue, ReadyEntry entry) {
+    if (queue->count == queue->capacity) {
+        int capacity = queue->capacity ? queue->capacity * 2 : 256;
+        ReadyEntry *grown = realloc(queue->entries, capacity * sizeof(ReadyEntry));
+        if (grown == NULL) {
+            return -1;
+        }
+        queue->entries = grown;
+        queue->capacity = capacity;
+    }
+
+    // A stack needs no sifting
+    if (queue->order == ORDER_TOPO) {
+        queue->entries[queue->count++] = entry;
+        return 0;
+    }
+
+    int i = queue->count++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!ready_before(&entry, &queue->entries[parent])) {
+            break;
+        }
+        queue->entries[i] = queue->entries[parent];
+        i = parent;
+    }
+    queue->entries[i] = entry;
+    return 0;
+}
+
+static void ready_push(ReadyQueue *queue, const CommitStore *store, int index) {
+    ReadyEntry entry;
+    entry.index = index;
+    entry.seq = queue->next_seq++;
+    entry.key = queue->order == ORDER_AUTHOR_DATE ? store_author_time(store, index)
+                                                  : store_commit_time(store, index);
+    ready_insert(queue, entry);
+}
+
+static int ready_pop(ReadyQueue *queue) {
+    if (queue->order == ORDER_TOPO) {
+        return queue->entries[--queue->count].index;
+    }
+
+    int top = queue->entries[0].index;
+    ReadyEntry last = queue->entries[--queue->count];
+
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= queue->count) {
+            break;
+        }
+        if (child + 1 < queue->count &&
+            ready_before(&queue->entries[child + 1], &queue->entries[child])) {
+            child++;
+        }
+        if (!ready_before(&queue->entries[child], &last)) {
+            break;
+        }
+        queue->entries[i] = queue->entries[child];
+        i = child;
+    }
+    if (queue->count > 0) {
+        queue->entries[i] = last;
+    }
+    return top;
+}
+
+// Fill permutation with store indices in display order. Parents must have
+// been resolved. Returns -1 when out of memory.
+int sort_commits(const CommitStore *store, SortOrder order, int *permutation) {
+    int count = store->count;
+    int *children = calloc(count, sizeof(int));
+    ReadyQueue queue = {malloc((count ? count : 1) * sizeof(ReadyEntry)), 0, count, 0, order};
+    if (children == NULL || queue.entries == NULL) {
+        free(children);
+        free(queue.entries);
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        const int *parents = store_parent_index(store, i);
+        for (int j = 0; j < store_parent_count(store, i); j++) {
+            if (parents[j] >= 0) {
+                children[parents[j]]++;
+            }
+        }
+    }
+
+    // Tips start out ready, in the order they were read
+    for (int i = 0; i < count; i++) {
+        if (children[i] == 0) {
+            ready_push(&queue, store, i);
+        }
+    }
+    if (order == ORDER_TOPO) {
+        for (int i = 0, j = queue.count - 1; i < j; i++, j--) {
+            ReadyEntry swap = queue.entries[i];
+            queue.entries[i] = queue.entries[j];
+            queue.entries[j] = swap;
+        }
+    }
+
+    int emitted = 0;
+    while (queue.count > 0) {
+        int index = ready_pop(&queue);
+        permutation[emitted++] = index;
+
+        const int *parents = store_parent_index(store, index);
+        for (int j = 0; j < store_parent_count(store, index); j++) {
+            if (parents[j] >= 0 && --children[parents[j]] == 0) {
+                ready_push(&queue, store, parents[j]);
+            }
+        }
+    }
+
+    free(children);
+    free(queue.entries);
+    return 0;
+}
+
+// --date-order while the history is still being read. Commits come in as
+// the walk produces them, with what it still had queued at the time, and
+// each is let through once it is certain to be the one sort_commits()
+// would put next. That takes two things:
+//
+// - Its children are all in. Children have higher generation numbers, and
+//   whatever the walk produces later descends from a queued commit, so a
+//   commit is final once no queued generation is above its own.
+// - Nothing that could be ready is missing. An unread commit that could be
+//   is queued, so it is no newer than the newest queued date. A read one
+//   that may still get a child is checked as if it were ready.
+//
+// Ties go as in sort_commits(): tips first in read order, then the other
+// commits in the order they became ready, by the step at which their last
+// child was shown and their place among its parents. Without generation
+// numbers no commit is final before the end, and the order is the sorted
+// one, only later.
+
+#define NOT_TIP (1ULL << 62)
+#define READY_SEQ(step, slot) (NOT_TIP | ((uint64_t)(step) << 20) | (uint64_t)(slot))
+
+typedef struct {
+    int index;              // store index, -1 until read
+    int waiting;            // children read and not shown yet
+    int children;           // children read
+    uint64_t seq;           // READY_SEQ once its last child was shown
+    unsigned char final;    // no child can still be read
+    unsigned char shown;
+} StreamNode;
+
+struct DateStream {
+    const CommitStore *store;
+    OidMap ids;             // commit id -> node, for commits and parents
+    StreamNode *nodes;
+    int node_count;
+    int node_capacity;
+    int *node_of;           // store index -> node
+    int node_of_capacity;
+    ReadyQueue ready;       // final commits with every child shown
+    ReadyQueue unsure;      // the others with every child read shown
+    ReadyQueue open;        // commits not final yet, by generation
+    unsigned int steps;     // commits shown
+    uint32_t pending_generation;
+    time_t pending_time;
+};
+
+DateStream *date_stream_open(const CommitStore *store) {
+    DateStream *stream = calloc(1, sizeof(DateStream));
+    if (stream == NULL) {
+        return NULL;
+    }
+    stream->store = store;
+    stream->ready.order = stream->unsure.order = stream->open.order = ORDER_DATE;
+    stream->pending_generation = UINT32_MAX;
+    if (oidmap_init(&stream->ids, 1024) != 0) {
+        date_stream_close(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+void date_stream_close(DateStream *stream) {
+    if (stream == NULL) {
+        return;
+    }
+    oidmap_free(&stream->ids);
+    free(stream->nodes);
+    free(stream->node_of);
+    free(stream->ready.entries);
+    free(stream->unsure.entries);
+    free(stream->open.entries);
+    free(stream);
+}
+
+// The node of a commit id, made on first sight; -1 when out of memory
+static int stream_node(DateStream *stream, const unsigned char *oid) {
+    int node;
+    if (oidmap_get(&stream->ids, oid, &node)) {
+        return node;
+    }
+    if (stream->node_count == stream->node_capacity) {
+        int capacity = stream->node_capacity ? stream->node_capacity * 2 : 1024;
+        StreamNode *grown = realloc(stream->nodes, capacity * sizeof(StreamNode));
+        if (grown == NULL) {
+            return -1;
+        }
+        stream->nodes = grown;
+        stream->node_capacity = capacity;
+    }
+    node = stream->node_count;
+    if (oidmap_put(&stream->ids, oid, node) != 0) {
+        return -1;
+    }
+    stream->node_count++;
+    memset(&stream->nodes[node], 0, sizeof(StreamNode));
+    stream->nodes[node].index = -1;
+    return node;
+}
+
+// Where sort_commits() would rank the commit among those ready with it
+static uint64_t node_seq(const StreamNode *node) {
+    return node->children == 0 ? (uint64_t)node->index : node->seq;
+}
+
+// A read commit whose children have all been shown
+static int mark_waiting_done(DateStream *stream, int node) {
+    const StreamNode *n = &stream->nodes[node];
+    ReadyEntry entry = {store_commit_time(stream->store, n->index), node_seq(n), node};
+    return ready_insert(n->final ? &stream->ready : &stream->unsure, entry);
+}
+
+// Make final the commits no queued one can be a child of
+static int settle(DateStream *stream) {
+    while (stream->open.count > 0) {
+        uint32_t generation = (uint32_t)stream->open.entries[0].key;
+        if (stream->pending_generation != 0 &&
+            (stream->pending_generation == UINT32_MAX || generation == 0 ||
+             generation < stream->pending_generation)) {
+            break;
+        }
+        int node = stream->open.entries[0].index;
+        ready_pop(&stream->open);
+        stream->nodes[node].final = 1;
+        if (stream->nodes[node].waiting == 0 && mark_waiting_done(stream, node) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int date_stream_add(DateStream *stream, int index, uint32_t pending_generation,
+                    time_t pending_time) {
+    const CommitStore *store = stream->store;
+    int node = stream_node(stream, store_oid(store, index));
+    if (node < 0) {
+        return -1;
+    }
+    if (index >= stream->node_of_capacity) {
+        int capacity = stream->node_of_capacity ? stream->node_of_capacity * 2 : 1024;
+        while (capacity <= index) {
+            capacity *= 2;
+        }
+        int *grown = realloc(stream->node_of, capacity * sizeof(int));
+        if (grown == NULL) {
+            return -1;
+        }
+        stream->node_of = grown;
+        stream->node_of_capacity = capacity;
+    }
+    stream->node_of[index] = node;
+    stream->nodes[node].index = index;
+
+    for (int j = 0; j < store_parent_count(store, index); j++) {
+        int parent = stream_node(stream, store_parent_oid(store, index, j));
+        if (parent < 0) {
+            return -1;
+        }
+        stream->nodes[parent].waiting++;
+        stream->nodes[parent].children++;
+    }
+
+    ReadyEntry open = {store_generation(store, index), 0, node};
+    if (ready_insert(&stream->open, open) != 0 ||
+        (stream->nodes[node].waiting == 0 && mark_waiting_done(stream, node) != 0)) {
+        return -1;
+    }
+    stream->pending_generation = pending_generation;
+    stream->pending_time = pending_time;
+    return settle(stream);
+}
+
+int date_stream_finish(DateStream *stream) {
+    stream->pending_generation = 0;
+    return settle(stream);
+}
+
+// Whether nothing missing from the ready queue could go before its top
+static int top_is_certain(DateStream *stream) {
+    const ReadyEntry *top = &stream->ready.entries[0];
+
+    // At an equal date only a tip is sure to go first: unread tips come
+    // later in read order, and other commits after every tip
+    if (stream->pending_generation != 0 &&
+        (stream->pending_time > top->key ||
+         (stream->pending_time == top->key && top->seq >= NOT_TIP))) {
+        return 0;
+    }
+
+    while (stream->unsure.count > 0) {
+        const ReadyEntry *first = &stream->unsure.entries[0];
+        const StreamNode *node = &stream->nodes[first->index];
+        if (node->shown || node->final || node->waiting > 0 || first->seq != node_seq(node)) {
+            ready_pop(&stream->unsure);
+            continue;
+        }
+        return !ready_before(first, top);
+    }
+    return 1;
+}
+
+int date_stream_next(DateStream *stream) {
+    if (stream->ready.count == 0 || !top_is_certain(stream)) {
+        return -1;
+    }
+    int node = ready_pop(&stream->ready);
+    int index = stream->nodes[node].index;
+    unsigned int step = stream->steps++;
+    stream->nodes[node].shown = 1;
+
+    const CommitStore *store = stream->store;
+    for (int j = 0; j < store_parent_count(store, index); j++) {
+        int parent;
+        oidmap_get(&stream->ids, store_parent_oid(store, index, j), &parent);
+        StreamNode *p = &stream->nodes[parent];
+        if (--p->waiting == 0) {
+            p->seq = READY_SEQ(step, j);
+            if (p->index >= 0 && mark_waiting_done(stream, parent) != 0) {
+                return -2;
+            }
+        }
+    }
+    return index;
+}
+
+// A commit continues the chain of its child when it is the child's only
+// parent, the child is its only child and no ref points at it, so that
+// every branch and tag keeps a row of its own. The chain is counted at
+// its top, the first of its commits to be shown; the others get 0.
+int find_chains(const CommitStore *store, int *chain) {
+    int count = store->count;
+    int *children = calloc(count ? count : 1, sizeof(int));
+    if (children == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        const int *parents = store_parent_index(store, i);
+        for (int j = 0; j < store_parent_count(store, i); j++) {
+            if (parents[j] >= 0) {
+                children[parents[j]]++;
+            }
+        }
+    }
+
+    // Which commits continue a chain; a top is any commit that does not
+    for (int i = 0; i < count; i++) {
+        chain[i] = 1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (store_parent_count(store, i) != 1) {
+            continue;
+        }
+        int parent = store_parent_index(store, i)[0];
+        if (parent >= 0 && children[parent] == 1 && store_refs(store, parent)[0] == '\0') {
+            chain[parent] = 0;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (chain[i] == 0) {
+            continue;
+        }
+        int length = 1;
+        for (int next = i; store_parent_count(store, next) == 1; length++) {
+            next = store_parent_index(store, next)[0];
+            if (next < 0 || chain[next] != 0) {
+                break;
+            }
+        }
+        chain[i] = length;
+    }
+
+    free(children);
+    return 0;
+}
@@ -0,0 +1,666 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shrub.h"
+#include "export.h"
+#include "profile.h"
+#include "queue.h"
+#include "reach.h"
+#include "strbuf.h"
+#include "viewer.h"
+
+// The tree view runs as four stages, each on its own thread:
+//
+//   ingest -> parse -> layout -> render (main thread, writes to the pager)
+//
+// so the first screen is shown while older history is still being read.
+// A sorted order needs the whole graph first; it adds an order stage
+// between parse and layout that holds rows back until parsing is done.
+// So does --collapse, which needs every commit's children to find the
+// linear chains, and lets only the first commit of each through, and
+// --ahead-behind, which counts the commits of every branch at once.
+// Every stage drains its input until the upstream queue is closed, which
+// lets a cancelled run (pager quit early) shut down without deadlocking.
+
+#define CHUNK_SIZE 65536
+#define QUEUE_DEPTH 1024
+
+// A slice of git log output; lines may span chunks
+typedef struct {
+    char *data;
+    size_t len;
+} Chunk;
+
+// A commit in the store, with what the walk still had queued when it read
+// it (see RawCommit); git log output is already in order
+typedef struct {
+    int index;
+    uint32_t pending_generation;
+    time_t pending_time;
+} Parsed;
+
+typedef struct {
+    ReaderMode mode;          // READER_LOG or READER_NATIVE
+    SortOrder order;
+    int held;                 // the order stage runs
+    int streamed;             // ... and lets commits through as they come
+    int max_count;            // rows the order stage keeps, -1 for all
+    int first_parent;         // merges keep their first parent only once
+                              // ordered
+    int collapse;
+    int *chains;              // --collapse: chain length of each commit, set
+                              // before the first row is let through
+    RefTip *branches;         // --ahead-behind: local branches and their
+    int branch_count;         // tips, compared with base
+    unsigned char base[OID_RAWSZ];
+    FILE *log;                // git log output in log mode
+    CommitWalk *walk;         // commit iterator in native mode
+    CommitText *text;         // reads the text of lazily walked commits
+    SpscQueue raw;            // Chunk or RawCommit
+    SpscQueue parsed;         // Parsed
+    SpscQueue sorted;         // commit indices in display order
+    SpscQueue rows;           // Row
+    atomic_int cancelled;     // the pager went away
+    atomic_int full;          // the commit store cannot grow, stop reading
+    atomic_int foreign_ids;   // git log printed ids that are not SHA-1
+    atomic_int enough;        // the order stage has the rows -n asks for
+} Pipeline;
+
+double elapsed_ms(double since_ms) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1e6 - since_ms;
+}
+
+static int should_stop(Pipeline *pipeline) {
+    return atomic_load(&pipeline->cancelled) || atomic_load(&pipeline->full) ||
+           atomic_load(&pipeline->foreign_ids) || atomic_load(&pipeline->enough);
+}
+
+static void *ingest_stage(void *arg) {
+    Pipeline *pipeline = arg;
+    ProfileMark mark;
+    profile_begin(&mark);
+
+    if (pipeline->mode == READER_LOG) {
+        // read() returns what the pipe holds instead of waiting for a full
+        // chunk, so the first commits move on as soon as git prints them
+        int fd = fileno(pipeline->log);
+        while (!should_stop(pipeline)) {
+            Chunk chunk;
+            chunk.data = malloc(CHUNK_SIZE);
+            if (chunk.data == NULL) {
+                break;
+            }
+            ssize_t n = read(fd, chunk.data, CHUNK_SIZE);
+            if (n <= 0) {
+                free(chunk.data);
+                break;
+            }
+            chunk.len = n;
+            profile_add_bytes(n);
+            spsc_push(&pipeline->raw, &chunk);
+        }
+    } else {
+        RawCommit raw;
+        while (!should_stop(pipeline) && walk_next(pipeline->walk, &raw)) {
+            spsc_push(&pipeline->raw, &raw);
+        }
+    }
+
+    spsc_close(&pipeline->raw);
+    profile_end(&mark, PROFILE_INGEST);
+    return NULL;
+}
+
+// Parse one complete log line into the commit store
+static void parse_line(Pipeline *pipeline, char *line) {
+    Parsed parsed = { parse_log_record(line, &commit_store), 0, 0 };
+    int index = parsed.index;
+    if (index >= 0) {
+        spsc_push(&pipeline->parsed, &parsed);
+    } else if (index == -2) {
+        atomic_store(&pipeline->foreign_ids, 1);
+    }
+}
+
+static void *parse_stage(void *arg) {
+    Pipeline *pipeline = arg;
+    ProfileMark mark;
+    profile_begin(&mark);
+
+    if (pipeline->mode == READER_LOG) {
+        StrBuf partial;
+        sb_init(&partial);
+
+        Chunk chunk;
+        while (spsc_pop(&pipeline->raw, &chunk)) {
+            const char *p = chunk.data;
+            const char *end = chunk.data + chunk.len;
+            const char *newline;
+            while (!should_stop(pipeline) &&
+                   (newline = memchr(p, '\n', end - p)) != NULL) {
+                sb_append_len(&partial, p, newline - p);
+                parse_line(pipeline, partial.data);
+                sb_reset(&partial);
+                p = newline + 1;
+            }
+            sb_append_len(&partial, p, end - p);
+            free(chunk.data);
+        }
+        if (partial.len > 0 && !should_stop(pipeline)) {
+            parse_line(pipeline, partial.data);
+        }
+        sb_free(&partial);
+    } else {
+        RawCommit raw;
+        while (spsc_pop(&pipeline->raw, &raw)) {
+            if (!should_stop(pipeline)) {
+                Parsed parsed = { walk_fill_commit(pipeline->walk, &raw, &commit_store),
+                                  raw.pending_generation, raw.pending_time };
+                if (parsed.index >= 0) {
+                    spsc_push(&pipeline->parsed, &parsed);
+                } else {
+                    atomic_store(&pipeline->full, 1);
+                }
+            }
+            free(raw.data);
+        }
+    }
+
+    spsc_close(&pipeline->parsed);
+    profile_end(&mark, PROFILE_PARSE);
+    return NULL;
+}
+
+// Give the branches shown their counts against the base, before the
+// first row is let through. A branch or base outside the history read
+// (left out by revisions or --since) is not labelled.
+static void count_ahead_behind(Pipeline *pipeline) {
+    int count = 0;
+    int *tips = malloc((pipeline->branch_count + 1) * sizeof(int));
+    int *shown = malloc((pipeline->branch_count + 1) * sizeof(int));
+    int base = store_find(&commit_store, pipeline->base);
+    for (int i = 0; tips && shown && base >= 0 && i < pipeline->branch_count; i++) {
+        int index = store_find(&commit_store, pipeline->branches[i].oid);
+        if (index >= 0) {
+            shown[count] = i;
+            tips[count++] = index;
+        }
+    }
+
+    ReachStats stats;
+    int *counts = count ? malloc((size_t)(count + 1) * (count + 1) * sizeof(int)) : NULL;
+    if (counts) {
+        tips[count] = base;
+        if (reach_counts(&commit_store, tips, count + 1, counts, &stats) == 0) {
+            const int *behind = counts + (size_t)count * (count + 1);
+            for (int i = 0; i < count; i++) {
+                const RefTip *branch = &pipeline->branches[shown[i]];
+                render_add_ahead_behind(branch->oid, branch->name + 11,
+                                        counts[(size_t)i * (count + 1) + count],
+                                        behind[i]);
+            }
+        }
+    }
+    free(counts);
+    free(tips);
+    free(shown);
+}
+
+// Pass on what the stream is sure of, up to -n rows. Returns -1 when out
+// of memory.
+static int release_rows(Pipeline *pipeline, DateStream *stream, int *rows) {
+    int index = -1;
+    while ((pipeline->max_count < 0 || *rows < pipeline->max_count) &&
+           (index = date_stream_next(stream)) >= 0) {
+        // The stream is done with its parents
+        if (pipeline->first_parent) {
+            store_first_parent_only(&commit_store, index);
+        }
+        spsc_push(&pipeline->sorted, &index);
+        (*rows)++;
+    }
+    if (pipeline->max_count >= 0 && *rows >= pipeline->max_count) {
+        atomic_store(&pipeline->enough, 1);
+    }
+    return index == -2 ? -1 : 0;
+}
+
+// --date-order while the walk is still reading: each commit goes on as
+// soon as none still to come can go above it
+static void stream_order(Pipeline *pipeline) {
+    DateStream *stream = date_stream_open(&commit_store);
+    int status = stream ? 0 : -1, rows = 0;
+    Parsed parsed;
+    while (spsc_pop(&pipeline->parsed, &parsed)) {
+        if (status == 0 && !should_stop(pipeline)) {
+            status = date_stream_add(stream, parsed.index, parsed.pending_generation,
+                                     parsed.pending_time);
+            if (status == 0) {
+                status = release_rows(pipeline, stream, &rows);
+            }
+        }
+    }
+    if (status == 0 && !atomic_load(&pipeline->cancelled) && !atomic_load(&pipeline->enough)) {
+        status = date_stream_finish(stream);
+        if (status == 0) {
+            status = release_rows(pipeline, stream, &rows);
+        }
+    }
+    if (status != 0) {
+        fprintf(stderr, "Error: Out of memory\n");
+        atomic_store(&pipeline->cancelled, 1);
+    }
+    date_stream_close(stream);
+}
+
+static void *order_stage(void *arg) {
+    Pipeline *pipeline = arg;
+    ProfileMark mark;
+    profile_begin(&mark);
+
+    if (pipeline->streamed) {
+        stream_order(pipeline);
+        spsc_close(&pipeline->sorted);
+        profile_end(&mark, PROFILE_ORDER);
+        return NULL;
+    }
+
+    Parsed parsed;
+    while (spsc_pop(&pipeline->parsed, &parsed)) {
+        // The parser appends in index order; nothing to keep
+    }
+
+    int count = commit_store.count;
+    int *permutation = malloc((count ? count : 1) * sizeof(int));
+    if (!atomic_load(&pipeline->cancelled) && permutation != NULL &&
+        store_resolve_parents(&commit_store) == 0 &&
+        sort_commits(&commit_store, pipeline->order, permutation) == 0) {
+        // Sorted on every parent as git does; chains, counts and the
+        // graph follow the first only
+        for (int i = 0; pipeline->first_parent && i < count; i++) {
+            store_first_parent_only(&commit_store, i);
+        }
+        // -n counts rows from the top of the sorted history, so it can
+        // only be applied here
+        int *chains = pipeline->collapse ? malloc((count ? count : 1) * sizeof(int)) : NULL;
+        if (chains && find_chains(&commit_store, chains) == 0) {
+            pipeline->chains = chains;
+        } else {
+            free(chains);
+            chains = NULL;
+        }
+        if (pipeline->branches) {
+            count_ahead_behind(pipeline);
+        }
+        int rows = 0;
+        for (int i = 0; i < count && !atomic_load(&pipeline->cancelled) &&
+                        (pipeline->max_count < 0 || rows < pipeline->max_count); i++) {
+            if (chains == NULL || chains[permutation[i]] > 0) {
+                spsc_push(&pipeline->sorted, &permutation[i]);
+                rows++;
+            }
+        }
+    }
+    free(permutation);
+
+    spsc_close(&pipeline->sorted);
+    profile_end(&mark, PROFILE_ORDER);
+    return NULL;
+}
+
+// The next commit to lay out, from the order stage if it runs
+static int next_index(Pipeline *pipeline, int *index) {
+    if (pipeline->held) {
+        return spsc_pop(&pipeline->sorted, index);
+    }
+    Parsed parsed;
+    if (!spsc_pop(&pipeline->parsed, &parsed)) {
+        return 0;
+    }
+    *index = parsed.index;
+    return 1;
+}
+
+static void *layout_stage(void *arg) {
+    Pipeline *pipeline = arg;
+    Row row;
+    int index;
+    ProfileMark mark;
+    profile_begin(&mark);
+
+    while (next_index(pipeline, &index)) {
+        if (atomic_load(&pipeline->cancelled)) {
+            continue;
+        }
+        int length = pipeline->chains ? pipeline->chains[index] : 1;
+        if (layout_chain(index, length, &row) != 0) {
+            fprintf(stderr, "Error: Out of memory\n");
+            atomic_store(&pipeline->cancelled, 1);
+            continue;
+        }
+        spsc_push(&pipeline->rows, &row);
+    }
+
+    spsc_close(&pipeline->rows);
+    profile_end(&mark, PROFILE_LAYOUT);
+    return NULL;
+}
+
+// Render rows as they arrive. Output is flushed whenever the renderer
+// catches up with layout, so the pager fills in while history loads.
+static void render_stage(Pipeline *pipeline, FILE *out, double start_ms,
+                         PipelineStats *stats) {
+    StrBuf text;
+    sb_init(&text);
+    Row row;
+    ProfileMark mark, pager;
+    profile_begin(&mark);
+
+    while (1) {
+        if (spsc_is_empty(&pipeline->rows) && !atomic_load(&pipeline->cancelled)) {
+            profile_begin_timer(&pager);
+            if (fflush(out) != 0) {
+                atomic_store(&pipeline->cancelled, 1);
+            }
+            profile_end(&pager, PROFILE_PAGER);
+        }
+        if (!spsc_pop(&pipeline->rows, &row)) {
+            break;
+        }
+        if (atomic_load(&pipeline->cancelled)) {
+            row_free(&row);
+            continue;
+        }
+
+        sb_reset(&text);
+        render_row(&row, pipeline->text, &text);
+        row_free(&row);
+        profile_begin_timer(&pager);
+        size_t written = fwrite(text.data, 1, text.len, out);
+        profile_end(&pager, PROFILE_PAGER);
+        if (written != text.len) {
+            atomic_store(&pipeline->cancelled, 1);
+            continue;
+        }
+        if (stats->rows++ == 0) {
+            fflush(out);
+            stats->first_row_ms = elapsed_ms(start_ms);
+        }
+    }
+
+    sb_free(&text);
+    profile_end(&mark, PROFILE_RENDER);
+}
+
+// --export: records instead of drawn rows, flushed like the pager output
+// whenever layout has nothing more yet, so a reader downstream sees rows
+// while history is still loading
+static void export_stage(Pipeline *pipeline, ExportFormat format,
+                         double start_ms, PipelineStats *stats) {
+    ExportWriter writer;
+    Row row;
+    ProfileMark mark;
+    profile_begin(&mark);
+
+    if (export_writer_init(&writer, STDOUT_FILENO) != 0) {
+        fprintf(stderr, "Error: Out of memory\n");
+        atomic_store(&pipeline->cancelled, 1);
+    } else {
+        export_begin(&writer, format);
+    }
+    while (1) {
+        if (spsc_is_empty(&pipeline->rows) && !atomic_load(&pipeline->cancelled) &&
+            export_flush(&writer) != 0) {
+            atomic_store(&pipeline->cancelled, 1);
+        }
+        if (!spsc_pop(&pipeline->rows, &row)) {
+            break;
+        }
+        if (!atomic_load(&pipeline->cancelled)) {
+            export_row(&writer, format, &row, stats->rows);
+            if (stats->rows++ == 0) {
+                stats->first_row_ms = elapsed_ms(start_ms);
+            }
+        }
+        row_free(&row);
+    }
+    if (!atomic_load(&pipeline->cancelled)) {
+        export_flush(&writer);
+    }
+    export_writer_free(&writer);
+    profile_end(&mark, PROFILE_RENDER);
+}
+
+// Give each local branch its color; git log's decorations would only
+// name them once their commits arrive
+static void add_branch_colors(const Pipeline *pipeline, const char *git_dir) {
+    if (pipeline->walk) {
+        int count;
+        const RefTip *tips = walk_ref_tips(pipeline->walk, &count);
+        for (int i = 0; i < count; i++) {
+            if (strncmp(tips[i].name, "refs/heads/", 11) == 0) {
+                layout_add_branch(tips[i].oid, tips[i].name + 11);
+            }
+        }
+        return;
+    }
+
+    RefList refs;
+    if (refs_read(git_dir, &refs) != 0) {
+        return;
+    }
+    for (int i = 0; i < refs.count; i++) {
+        if (strncmp(refs.refs[i].name, "refs/heads/", 11) == 0) {
+            layout_add_branch(refs.refs[i].oid, refs.refs[i].name + 11);
+        }
+    }
+    refs_free(&refs);
+}
+
+// --ahead-behind: the local branches and the commit they are compared with
+static int load_branches(Pipeline *pipeline, const char *git_dir,
+                         const char *base) {
+    RefList refs = { NULL, 0, 0 };
+    const RefTip *tips = NULL;
+    int count = 0;
+    if (pipeline->walk) {
+        tips = walk_ref_tips(pipeline->walk, &count);
+        if (walk_resolve(pipeline->walk, base, pipeline->base) != 0) {
+            return -1;
+        }
+    } else {
+        StrBuf command;
+        sb_init(&command);
+        sb_append(&command, "git rev-parse --verify -q --end-of-options ");
+        sb_append_shell(&command, base);
+        sb_append(&command, "^{commit} 2>/dev/null");
+        int resolved = hex_to_oid(execute_command(command.data), pipeline->base);
+        sb_free(&command);
+        if (resolved != 0) {
+            return -1;
+        }
+        if (refs_read(git_dir, &refs) == 0) {
+            count = refs.count;
+        }
+    }
+
+    pipeline->branches = calloc(count ? count : 1, sizeof(RefTip));
+    if (pipeline->branches == NULL) {
+        refs_free(&refs);
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        const char *name = tips ? tips[i].name : refs.refs[i].name;
+        if (strncmp(name, "refs/heads/", 11) != 0) {
+            continue;
+        }
+        RefTip *branch = &pipeline->branches[pipeline->branch_count++];
+        memcpy(branch->oid, tips ? tips[i].oid : refs.refs[i].oid, OID_RAWSZ);
+        branch->name = strdup(name);
+    }
+    refs_free(&refs);
+    return 0;
+}
+
+// Show the commit tree. Returns -1 if the requested reader cannot be used
+// before anything has been printed, so the caller can report or fall back,
+// or if git log turns out to print ids that are not SHA-1.
+int run_tree_pipeline(const TreeOptions *options, const char *git_dir,
+                      double start_ms, PipelineStats *stats) {
+    ReaderMode mode = options->reader;
+    SortOrder order = options->order;
+    Pipeline pipeline;
+    memset(&pipeline, 0, sizeof(pipeline));
+    memset(stats, 0, sizeof(*stats));
+
+    pipeline.mode = mode == READER_LOG ? READER_LOG : READER_NATIVE;
+    pipeline.order = order;
+    // git log prints --date-order itself, and the native walk is sorted as
+    // it reads; the other orders, --collapse and --ahead-behind need the
+    // whole history first. git orders --first-parent on the first parents
+    // alone when it has a commit-graph and on them all when not, so both
+    // readers order it here on them all.
+    int whole = order != ORDER_DATE || options->collapse || options->ahead_behind;
+    pipeline.held = whole || options->range.first_parent;
+    pipeline.first_parent = options->range.first_parent;
+    pipeline.collapse = options->collapse;
+    if (pipeline.mode == READER_NATIVE) {
+        // Author dates are only in the objects, so that order reads them
+        // all; so does --export, whose records carry every subject
+        if (order != ORDER_AUTHOR_DATE && options->export == EXPORT_NONE) {
+            pipeline.text = commit_text_open(git_dir, READER_NATIVE);
+        }
+        int flags = (pipeline.text ? WALK_LAZY_TEXT : 0) |
+                    (options->use_cache ? WALK_CACHE : 0);
+        // The walk's order is not the one shown, so -n is applied after
+        RevisionRange range = options->range;
+        range.max_count = -1;
+        pipeline.walk = walk_open_range(git_dir, flags, &range);
+        if (pipeline.walk == NULL) {
+            commit_text_close(pipeline.text);
+            pipeline.text = NULL;
+            if (mode == READER_NATIVE) {
+                return -1;
+            }
+            pipeline.mode = READER_LOG;
+        } else {
+            pipeline.held = 1;
+            pipeline.streamed = !whole;
+        }
+    }
+    pipeline.max_count = pipeline.held ? options->range.max_count : -1;
+    if (pipeline.mode == READER_LOG) {
+        // git log leaves out the bodies; they are read for the rows drawn
+        if (options->export == EXPORT_NONE) {
+            pipeline.text = commit_text_open(git_dir, READER_LOG);
+        }
+        char *command = git_log_command(&options->range, !pipeline.held);
+        pipeline.log = command ? popen(command, "r") : NULL;
+        if (pipeline.log == NULL) {
+            fprintf(stderr, "Failed to execute command: %s\n",
+                    command ? command : GIT_LOG_COMMAND);
+            free(command);
+            commit_text_close(pipeline.text);
+            return -1;
+        }
+        free(command);
+    }
+
+    if (options->ahead_behind &&
+        load_branches(&pipeline, git_dir, options->ahead_behind) != 0) {
+        fprintf(stderr, "Error: Unknown revision '%s'\n", options->ahead_behind);
+        if (pipeline.log) {
+            pclose(pipeline.log);
+        }
+        walk_close(pipeline.walk);
+        commit_text_close(pipeline.text);
+        return -1;
+    }
+
+    size_t raw_size = pipeline.mode == READER_LOG ? sizeof(Chunk) : sizeof(RawCommit);
+    size_t raw_depth = pipeline.mode == READER_LOG ? 16 : QUEUE_DEPTH;
+    if (spsc_init(&pipeline.raw, raw_depth, raw_size) != 0 ||
+        spsc_init(&pipeline.parsed, QUEUE_DEPTH, sizeof(Parsed)) != 0 ||
+        spsc_init(&pipeline.sorted, QUEUE_DEPTH, sizeof(int)) != 0 ||
+        spsc_init(&pipeline.rows, QUEUE_DEPTH, sizeof(Row)) != 0) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return -1;
+    }
+    layout_reset();
+    add_branch_colors(&pipeline, git_dir);
+
+    // Write errors are handled through fwrite's result
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t ingest, parse, sort, layout;
+    pthread_create(&ingest, NULL, ingest_stage, &pipeline);
+    pthread_create(&parse, NULL, parse_stage, &pipeline);
+    if (pipeline.held) {
+        pthread_create(&sort, NULL, order_stage, &pipeline);
+    }
+    pthread_create(&layout, NULL, layout_stage, &pipeline);
+
+    FILE *pager = NULL;
+    if (options->export != EXPORT_NONE) {
+        export_stage(&pipeline, options->export, start_ms, stats);
+    } else if (options->use_viewer && isatty(STDOUT_FILENO) &&
+        view_tree(&pipeline.rows, pipeline.text, start_ms, stats) == 0) {
+        // Stop the stages the viewer no longer listens to
+        atomic_store(&pipeline.cancelled, 1);
+        Row row;
+        while (spsc_pop(&pipeline.rows, &row)) {
+            row_free(&row);
+        }
+    } else {
+        pager = options->use_pager && isatty(STDOUT_FILENO) ? popen("less -R", "w") : NULL;
+        render_stage(&pipeline, pager ? pager : stdout, start_ms, stats);
+    }
+
+    pthread_join(ingest, NULL);
+    pthread_join(parse, NULL);
+    if (pipeline.held) {
+        pthread_join(sort, NULL);
+    }
+    pthread_join(layout, NULL);
+
+    if (pipeline.log) {
+        pclose(pipeline.log);
+    }
+    if (pipeline.walk) {
+        walk_close(pipeline.walk);
+    }
+    if (pipeline.text) {
+        commit_text_stats(pipeline.text, &stats->text);
+        commit_text_close(pipeline.text);
+    }
+    spsc_destroy(&pipeline.raw);
+    spsc_destroy(&pipeline.parsed);
+    spsc_destroy(&pipeline.sorted);
+    spsc_destroy(&pipeline.rows);
+    free(pipeline.chains);
+    for (int i = 0; i < pipeline.branch_count; i++) {
+        free(pipeline.branches[i].name);
+    }
+    free(pipeline.branches);
+
+    if (pager) {
+        pclose(pager);
+    } else if (options->export == EXPORT_NONE) {
+        fflush(stdout);
+    }
+    stats->total_ms = elapsed_ms(start_ms);
+    if (atomic_load(&pipeline.foreign_ids)) {
+        fprintf(stderr, "Error: Only SHA-1 repositories are supported\n");
+        return -1;
+    }
+    return 0;
+}
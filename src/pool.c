@@ -0,0 +1,237 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+int pool_default_threads = 0;
+
+// The items one thread has left of the current job. Only its lock holder
+// moves the bounds; thieves read them unlocked to pick a victim.
+typedef struct {
+    pthread_mutex_t lock;
+    atomic_int next;            // first item not taken yet
+    atomic_int end;
+} PoolShare;
+
+typedef struct {
+    struct Pool *pool;
+    int index;
+    pthread_t handle;
+} PoolThread;
+
+struct Pool {
+    int threads;
+    PoolThread workers[POOL_MAX_THREADS];
+    PoolShare shares[POOL_MAX_THREADS];
+
+    pthread_mutex_t lock;
+    pthread_cond_t start;       // a new job, or closing
+    pthread_cond_t done;        // the last helper finished its share
+    unsigned generation;        // jobs started so far
+    int running;                // helpers still on the current job
+    int closing;
+
+    PoolTask task;
+    void *ctx;
+    int grain;
+    ProfilePhase phase;
+};
+
+static int take_own(PoolShare *share, int grain, int *start, int *end) {
+    pthread_mutex_lock(&share->lock);
+    int next = atomic_load(&share->next), last = atomic_load(&share->end);
+    int taken = next < last;
+    if (taken) {
+        *start = next;
+        *end = last - next > grain ? next + grain : last;
+        atomic_store(&share->next, *end);
+    }
+    pthread_mutex_unlock(&share->lock);
+    return taken;
+}
+
+// Move the back half of the largest other share into the thief's own;
+// returns 0 once every share is empty
+static int steal(Pool *pool, int thief) {
+    for (;;) {
+        int victim = -1, most = 0;
+        for (int t = 0; t < pool->threads; t++) {
+            int left = atomic_load(&pool->shares[t].end) -
+                       atomic_load(&pool->shares[t].next);
+            if (t != thief && left > most) {
+                victim = t;
+                most = left;
+            }
+        }
+        if (victim < 0) {
+            return 0;
+        }
+
+        PoolShare *share = &pool->shares[victim];
+        pthread_mutex_lock(&share->lock);
+        int next = atomic_load(&share->next), last = atomic_load(&share->end);
+        int left = last - next;
+        int from = left > pool->grain ? next + left / 2 : next;
+        if (left > 0) {
+            atomic_store(&share->end, from);
+        }
+        pthread_mutex_unlock(&share->lock);
+        if (left <= 0) {
+            continue;   // emptied meanwhile; look again
+        }
+
+        PoolShare *own = &pool->shares[thief];
+        pthread_mutex_lock(&own->lock);
+        atomic_store(&own->next, from);
+        atomic_store(&own->end, last);
+        pthread_mutex_unlock(&own->lock);
+        return 1;
+    }
+}
+
+static void run_share(Pool *pool, int thread) {
+    ProfileMark mark;
+    profile_begin_timer(&mark);
+    int start, end;
+    do {
+        while (take_own(&pool->shares[thread], pool->grain, &start, &end)) {
+            pool->task(pool->ctx, thread, start, end);
+        }
+    } while (steal(pool, thread));
+    profile_end(&mark, pool->phase);
+}
+
+static void *pool_thread(void *arg) {
+    PoolThread *self = arg;
+    Pool *pool = self->pool;
+    unsigned seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->closing && pool->generation == seen) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->closing) {
+            break;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        run_share(pool, self->index);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+Pool *pool_open(int threads) {
+    if (threads <= 0) {
+        threads = pool_default_threads;
+    }
+    if (threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int)cpus : 1;
+    }
+    if (threads > POOL_MAX_THREADS) {
+        threads = POOL_MAX_THREADS;
+    }
+
+    Pool *pool = calloc(1, sizeof(Pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (int t = 0; t < POOL_MAX_THREADS; t++) {
+        pthread_mutex_init(&pool->shares[t].lock, NULL);
+    }
+
+    // Fewer threads than asked for still make a working pool
+    pool->threads = 1;
+    for (int t = 1; t < threads; t++) {
+        PoolThread *worker = &pool->workers[t];
+        worker->pool = pool;
+        worker->index = t;
+        if (pthread_create(&worker->handle, NULL, pool_thread, worker) != 0) {
+            break;
+        }
+        pool->threads++;
+    }
+    return pool;
+}
+
+void pool_close(Pool *pool) {
+    if (pool == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->closing = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (int t = 1; t < pool->threads; t++) {
+        pthread_join(pool->workers[t].handle, NULL);
+    }
+
+    for (int t = 0; t < POOL_MAX_THREADS; t++) {
+        pthread_mutex_destroy(&pool->shares[t].lock);
+    }
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+int pool_threads(const Pool *pool) {
+    return pool->threads;
+}
+
+void pool_run(Pool *pool, int count, int grain, PoolTask task, void *ctx,
+              ProfilePhase phase) {
+    if (count <= 0) {
+        return;
+    }
+    if (grain < 1) {
+        grain = 1;
+    }
+    pool->task = task;
+    pool->ctx = ctx;
+    pool->grain = grain;
+    pool->phase = phase;
+
+    // Waking the other threads costs more than a grain or two of work
+    if (pool->threads == 1 || count <= grain) {
+        atomic_store(&pool->shares[0].next, 0);
+        atomic_store(&pool->shares[0].end, count);
+        for (int t = 1; t < pool->threads; t++) {
+            atomic_store(&pool->shares[t].next, 0);
+            atomic_store(&pool->shares[t].end, 0);
+        }
+        run_share(pool, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    for (int t = 0; t < pool->threads; t++) {
+        atomic_store(&pool->shares[t].next, (int)((long long)count * t / pool->threads));
+        atomic_store(&pool->shares[t].end, (int)((long long)count * (t + 1) / pool->threads));
+    }
+    pool->running = pool->threads - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    run_share(pool, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
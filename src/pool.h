@@ -0,0 +1,39 @@
+#ifndef SHRUB_POOL_H
+#define SHRUB_POOL_H
+
+#include "profile.h"
+
+// A fixed set of threads for data-parallel jobs over an index range, such
+// as decoding the commits of a walk or diffing their trees. Each thread
+// starts on an equal share of the range and takes `grain` items at a time
+// from its front; a thread whose share runs out steals the back half of
+// the largest share left, so a few slow items (a commit with a huge tree,
+// a long delta chain) do not leave the other threads idle. The thread
+// calling pool_run() works as thread 0.
+//
+// Results go to per-item slots or per-thread state, never to a shared
+// order, so what a job produces does not depend on how it was split.
+
+typedef struct Pool Pool;
+
+// Process items [start, end) on thread `thread` (0 .. pool_threads() - 1)
+typedef void (*PoolTask)(void *ctx, int thread, int start, int end);
+
+// Threads used when pool_open() is asked for 0: one per core unless set,
+// e.g. by --threads
+extern int pool_default_threads;
+
+#define POOL_MAX_THREADS 64
+
+// Start a pool of `threads` threads, 0 for the default. Returns NULL if
+// not even the calling thread's share can be set up.
+Pool *pool_open(int threads);
+void pool_close(Pool *pool);
+int pool_threads(const Pool *pool);
+
+// Run `task` over items [0, count) and return once all are done. The time
+// every thread spends is added to `phase`.
+void pool_run(Pool *pool, int count, int grain, PoolTask task, void *ctx,
+              ProfilePhase phase);
+
+#endif
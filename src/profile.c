@@ -0,0 +1,249 @@
+#define _GNU_SOURCE
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "profile.h"
+
+int profile_enabled = 0;
+__thread uint64_t profile_bytes_read = 0;
+
+static __thread uint64_t thread_allocations = 0;
+static __thread uint64_t thread_frees = 0;
+static __thread uint64_t thread_allocated_bytes = 0;
+
+typedef struct {
+    int calls;
+    double wall_ms;
+    double cpu_ms;
+    long peak_rss_kb;
+    uint64_t bytes_read;
+    uint64_t allocations;
+    uint64_t frees;
+    uint64_t allocated_bytes;
+    int counted;            // calls that had hardware counters
+    uint64_t cycles;
+    uint64_t instructions;
+    uint64_t cache_misses;
+} PhaseTotals;
+
+static const char *phase_names[PROFILE_PHASES] = {
+    "startup", "commands", "ingest", "parse", "order", "layout", "render",
+    "pager", "stats", "stats workers", "decode", "files",
+    "branches", "diff", "diff workers",
+};
+
+static PhaseTotals totals[PROFILE_PHASES];
+static pthread_mutex_t totals_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char *profile_command = "";
+static atomic_int perf_usable = 1;  // cleared once the kernel refuses
+static int has_alloc_hooks = 0;
+
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+// Count allocations by standing in for glibc's allocator entry points
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size) {
+    if (profile_enabled) {
+        thread_allocations++;
+        thread_allocated_bytes += size;
+    }
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    if (profile_enabled) {
+        thread_allocations++;
+        thread_allocated_bytes += count * size;
+    }
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (profile_enabled) {
+        thread_allocations++;
+        thread_allocated_bytes += size;
+    }
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    if (profile_enabled && ptr) {
+        thread_frees++;
+    }
+    __libc_free(ptr);
+}
+#define ALLOC_HOOKS 1
+#else
+#define ALLOC_HOOKS 0
+#endif
+
+static double clock_ms(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static int open_counter(uint64_t config, int group_fd) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+static void close_counters(int *fds) {
+    for (int i = 2; i >= 0; i--) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+        fds[i] = -1;
+    }
+}
+
+// Cycles, instructions and cache misses of this thread, as one group
+static void open_counters(int *fds) {
+    fds[0] = fds[1] = fds[2] = -1;
+    if (!atomic_load(&perf_usable)) {
+        return;
+    }
+    fds[0] = open_counter(PERF_COUNT_HW_CPU_CYCLES, -1);
+    if (fds[0] >= 0) {
+        fds[1] = open_counter(PERF_COUNT_HW_INSTRUCTIONS, fds[0]);
+        fds[2] = open_counter(PERF_COUNT_HW_CACHE_MISSES, fds[0]);
+    }
+    if (fds[0] < 0 || fds[1] < 0 || fds[2] < 0) {
+        // Not allowed, or no PMU in this machine; stop asking
+        close_counters(fds);
+        atomic_store(&perf_usable, 0);
+    }
+}
+
+static void report_at_exit() {
+    profile_report(stderr);
+}
+
+void profile_start(const char *command) {
+    profile_command = command;
+    has_alloc_hooks = ALLOC_HOOKS;
+    profile_enabled = 1;
+    atexit(report_at_exit);
+}
+
+static void take_mark(ProfileMark *mark) {
+    mark->wall_ms = clock_ms(CLOCK_MONOTONIC);
+    mark->cpu_ms = clock_ms(CLOCK_THREAD_CPUTIME_ID);
+    mark->allocations = thread_allocations;
+    mark->frees = thread_frees;
+    mark->allocated_bytes = thread_allocated_bytes;
+    mark->bytes_read = profile_bytes_read;
+}
+
+void profile_begin(ProfileMark *mark) {
+    if (profile_enabled) {
+        take_mark(mark);
+        open_counters(mark->perf_fds);
+    }
+}
+
+void profile_begin_timer(ProfileMark *mark) {
+    if (profile_enabled) {
+        take_mark(mark);
+        mark->perf_fds[0] = mark->perf_fds[1] = mark->perf_fds[2] = -1;
+    }
+}
+
+void profile_end(ProfileMark *mark, ProfilePhase phase) {
+    if (!profile_enabled) {
+        return;
+    }
+    double wall_ms = clock_ms(CLOCK_MONOTONIC) - mark->wall_ms;
+    double cpu_ms = clock_ms(CLOCK_THREAD_CPUTIME_ID) - mark->cpu_ms;
+
+    uint64_t counters[4] = {0};     // count, then one value per counter
+    int counted = 0;
+    if (mark->perf_fds[0] >= 0) {
+        counted = read(mark->perf_fds[0], counters, sizeof(counters)) ==
+                  (ssize_t)sizeof(counters) && counters[0] == 3;
+        close_counters(mark->perf_fds);
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    pthread_mutex_lock(&totals_lock);
+    PhaseTotals *t = &totals[phase];
+    t->calls++;
+    t->wall_ms += wall_ms;
+    t->cpu_ms += cpu_ms;
+    if (usage.ru_maxrss > t->peak_rss_kb) {
+        t->peak_rss_kb = usage.ru_maxrss;
+    }
+    t->bytes_read += profile_bytes_read - mark->bytes_read;
+    t->allocations += thread_allocations - mark->allocations;
+    t->frees += thread_frees - mark->frees;
+    t->allocated_bytes += thread_allocated_bytes - mark->allocated_bytes;
+    if (counted) {
+        t->counted++;
+        t->cycles += counters[1];
+        t->instructions += counters[2];
+        t->cache_misses += counters[3];
+    }
+    pthread_mutex_unlock(&totals_lock);
+}
+
+void profile_report(FILE *out) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    pthread_mutex_lock(&totals_lock);
+    fprintf(out, "{\"command\":\"%s\",\"cpu_ms\":%.3f,\"peak_rss_kb\":%ld,"
+            "\"allocation_counts\":%s,\"hardware_counters\":%s,\"phases\":[",
+            profile_command,
+            usage.ru_utime.tv_sec * 1000.0 + usage.ru_utime.tv_usec / 1000.0 +
+            usage.ru_stime.tv_sec * 1000.0 + usage.ru_stime.tv_usec / 1000.0,
+            usage.ru_maxrss, has_alloc_hooks ? "true" : "false",
+            atomic_load(&perf_usable) ? "true" : "false");
+    int first = 1;
+    for (int i = 0; i < PROFILE_PHASES; i++) {
+        const PhaseTotals *t = &totals[i];
+        if (t->calls == 0) {
+            continue;
+        }
+        fprintf(out, "%s\n  {\"phase\":\"%s\",\"calls\":%d,\"wall_ms\":%.3f,"
+                "\"cpu_ms\":%.3f,\"peak_rss_kb\":%ld,\"bytes_read\":%llu",
+                first ? "" : ",", phase_names[i], t->calls, t->wall_ms,
+                t->cpu_ms, t->peak_rss_kb, (unsigned long long)t->bytes_read);
+        if (has_alloc_hooks) {
+            fprintf(out, ",\"allocations\":%llu,\"frees\":%llu,"
+                    "\"allocated_bytes\":%llu",
+                    (unsigned long long)t->allocations,
+                    (unsigned long long)t->frees,
+                    (unsigned long long)t->allocated_bytes);
+        }
+        if (t->counted == t->calls) {
+            fprintf(out, ",\"cycles\":%llu,\"instructions\":%llu,"
+                    "\"cache_misses\":%llu",
+                    (unsigned long long)t->cycles,
+                    (unsigned long long)t->instructions,
+                    (unsigned long long)t->cache_misses);
+        }
+        fprintf(out, "}");
+        first = 0;
+    }
+    fprintf(out, "\n]}\n");
+    pthread_mutex_unlock(&totals_lock);
+}
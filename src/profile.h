@@ -0,0 +1,73 @@
+#ifndef SHRUB_PROFILE_H
+#define SHRUB_PROFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// --profile: where a run spends its time. Code brackets a phase with
+// profile_begin() and profile_end(); the difference between the two is
+// added to the phase, whatever thread it ran on. Phases may nest, and a
+// phase entered many times (every git command, every stats worker) sums
+// its calls.
+//
+// Per phase it records wall and CPU time of the calling thread, the
+// process's peak RSS when the phase ended, bytes read from packs, loose
+// objects and git's output, and the allocations the thread made. When
+// perf_event_open is allowed, it also counts cycles, instructions and
+// cache misses of the thread.
+//
+// Disabled, every hook is a test of profile_enabled and nothing else.
+
+typedef enum {
+    PROFILE_STARTUP,        // main() until the command starts
+    PROFILE_COMMANDS,       // running git and reading its output
+    PROFILE_INGEST,
+    PROFILE_PARSE,
+    PROFILE_ORDER,
+    PROFILE_LAYOUT,
+    PROFILE_RENDER,
+    PROFILE_PAGER,          // writing to less or --export's output
+    PROFILE_STATS,
+    PROFILE_STATS_WORKERS,  // summed over the worker threads
+    PROFILE_DECODE,         // commit text read by the walk's thread pool
+    PROFILE_FILES,
+    PROFILE_BRANCHES,       // labelling commits for -branches
+    PROFILE_DIFF,
+    PROFILE_DIFF_WORKERS,   // summed over the worker threads
+    PROFILE_PHASES
+} ProfilePhase;
+
+// Counters of the calling thread when a phase began
+typedef struct {
+    double wall_ms;
+    double cpu_ms;
+    uint64_t allocations;
+    uint64_t frees;
+    uint64_t allocated_bytes;
+    uint64_t bytes_read;
+    int perf_fds[3];        // hardware counter group, [0] is -1 if none
+} ProfileMark;
+
+extern int profile_enabled;
+extern __thread uint64_t profile_bytes_read;
+
+// Turn profiling on; the report is printed on stderr when the process
+// exits, labelled with `command`
+void profile_start(const char *command);
+
+void profile_begin(ProfileMark *mark);
+// Same without the hardware counters, for phases entered many times
+void profile_begin_timer(ProfileMark *mark);
+void profile_end(ProfileMark *mark, ProfilePhase phase);
+
+static inline void profile_add_bytes(size_t bytes) {
+    if (profile_enabled) {
+        profile_bytes_read += bytes;
+    }
+}
+
+// JSON report of every phase entered so far
+void profile_report(FILE *out);
+
+#endif
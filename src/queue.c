@@ -0,0 +1,128 @@
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue.h"
+
+// Yields before falling back to the condition variable
+#define SPSC_SPINS 32
+
+int spsc_init(SpscQueue *queue, size_t capacity, size_t elem_size) {
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->closed, 0);
+    atomic_init(&queue->sleepers, 0);
+    queue->mask = size - 1;
+    queue->elem_size = elem_size;
+    queue->slots = malloc(size * elem_size);
+    if (queue->slots == NULL) {
+        return -1;
+    }
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->wakeup, NULL);
+    return 0;
+}
+
+void spsc_destroy(SpscQueue *queue) {
+    free(queue->slots);
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->wakeup);
+}
+
+static int can_push(SpscQueue *queue) {
+    return atomic_load(&queue->tail) - atomic_load(&queue->head) <= queue->mask;
+}
+
+static int can_pop(SpscQueue *queue) {
+    return atomic_load(&queue->tail) != atomic_load(&queue->head) ||
+           atomic_load(&queue->closed);
+}
+
+// The sleeper registers itself before re-checking, and the other side
+// publishes its index before reading the sleeper count, so a wakeup
+// cannot be missed.
+static void wait_until(SpscQueue *queue, int (*ready)(SpscQueue *)) {
+    for (int i = 0; i < SPSC_SPINS; i++) {
+        if (ready(queue)) {
+            return;
+        }
+        sched_yield();
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    atomic_fetch_add(&queue->sleepers, 1);
+    while (!ready(queue)) {
+        pthread_cond_wait(&queue->wakeup, &queue->lock);
+    }
+    atomic_fetch_sub(&queue->sleepers, 1);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static void wake(SpscQueue *queue) {
+    if (atomic_load(&queue->sleepers) > 0) {
+        pthread_mutex_lock(&queue->lock);
+        pthread_cond_broadcast(&queue->wakeup);
+        pthread_mutex_unlock(&queue->lock);
+    }
+}
+
+void spsc_push(SpscQueue *queue, const void *elem) {
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&queue->head, memory_order_acquire) > queue->mask) {
+        wait_until(queue, can_push);
+    }
+
+    memcpy(queue->slots + (tail & queue->mask) * queue->elem_size, elem,
+           queue->elem_size);
+    atomic_store(&queue->tail, tail + 1);
+    wake(queue);
+}
+
+int spsc_pop(SpscQueue *queue, void *elem) {
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    if (atomic_load_explicit(&queue->tail, memory_order_acquire) == head) {
+        wait_until(queue, can_pop);
+        if (atomic_load(&queue->tail) == head) {
+            return 0; // closed and drained
+        }
+    }
+
+    memcpy(elem, queue->slots + (head & queue->mask) * queue->elem_size,
+           queue->elem_size);
+    atomic_store(&queue->head, head + 1);
+    wake(queue);
+    return 1;
+}
+
+int spsc_try_pop(SpscQueue *queue, void *elem) {
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    if (atomic_load_explicit(&queue->tail, memory_order_acquire) == head) {
+        // Closed is published after the last push, so check it first
+        if (!atomic_load(&queue->closed) || atomic_load(&queue->tail) != head) {
+            return 0;
+        }
+        return -1;
+    }
+
+    memcpy(elem, queue->slots + (head & queue->mask) * queue->elem_size,
+           queue->elem_size);
+    atomic_store(&queue->head, head + 1);
+    wake(queue);
+    return 1;
+}
+
+int spsc_is_empty(SpscQueue *queue) {
+    return atomic_load(&queue->tail) == atomic_load(&queue->head);
+}
+
+void spsc_close(SpscQueue *queue) {
+    atomic_store(&queue->closed, 1);
+    pthread_mutex_lock(&queue->lock);
+    pthread_cond_broadcast(&queue->wakeup);
+    pthread_mutex_unlock(&queue->lock);
+}
@@ -0,0 +1,41 @@
+#ifndef SHRUB_QUEUE_H
+#define SHRUB_QUEUE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+// Bounded single-producer/single-consumer ring of fixed-size elements.
+// Push and pop are lock-free; a side only sleeps on the condition variable
+// when the ring is full (producer) or empty (consumer).
+typedef struct {
+    _Alignas(64) atomic_size_t head;    // next slot to pop, owned by consumer
+    _Alignas(64) atomic_size_t tail;    // next slot to push, owned by producer
+    _Alignas(64) atomic_int closed;
+    atomic_int sleepers;
+    size_t mask;
+    size_t elem_size;
+    unsigned char *slots;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+} SpscQueue;
+
+int spsc_init(SpscQueue *queue, size_t capacity, size_t elem_size);
+void spsc_destroy(SpscQueue *queue);
+
+// Blocks while the ring is full
+void spsc_push(SpscQueue *queue, const void *elem);
+
+// Blocks while the ring is empty; returns 0 once closed and drained
+int spsc_pop(SpscQueue *queue, void *elem);
+
+// Never blocks: returns 1 if an element was popped, 0 if the ring is
+// empty for now, -1 once closed and drained
+int spsc_try_pop(SpscQueue *queue, void *elem);
+
+int spsc_is_empty(SpscQueue *queue);
+
+// Producer is done; wakes a waiting consumer
+void spsc_close(SpscQueue *queue);
+
+#endif
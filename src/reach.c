@@ -0,0 +1,464 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "reach.h"
+
+#define LABEL_INITIAL_SIZE 64
+
+// A remembered union; slots with a == 0 are free, as a union with the
+// empty label is never looked up
+typedef struct {
+    int a, b;               // a < b
+    int result;
+} UnionEntry;
+
+// Interned sets of tips. Label 0 is the empty set. Every other label was
+// made by adding tips to an older, smaller one, its parent.
+typedef struct {
+    int words;              // 64-bit words per label
+    uint64_t *bits;         // label l at bits + l * words
+    uint32_t *hashes;
+    int *parents;
+    int *bit_counts;        // tips in each label
+    int *sizes;             // commits visited with each label
+    int count;
+    int capacity;
+    int *slots;             // intern table: label + 1, 0 if free
+    size_t slot_mask;
+    UnionEntry *unions;
+    size_t union_mask;
+    size_t union_count;
+    uint64_t *scratch;
+} LabelTable;
+
+typedef struct {
+    uint32_t generation;    // UINT32_MAX for commits newer than the graph
+    time_t time;
+    int index;
+} ReadyCommit;
+
+static uint32_t hash_bits(const uint64_t *bits, int words) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL;
+    for (int i = 0; i < words; i++) {
+        h ^= bits[i];
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+    }
+    return (uint32_t)h;
+}
+
+static size_t hash_pair(int a, int b) {
+    uint64_t h = ((uint64_t)(uint32_t)a << 32 | (uint32_t)b) * 0x9e3779b97f4a7c15ULL;
+    return (size_t)(h >> 17);
+}
+
+static void labels_free(LabelTable *table) {
+    free(table->bits);
+    free(table->hashes);
+    free(table->parents);
+    free(table->bit_counts);
+    free(table->sizes);
+    free(table->slots);
+    free(table->unions);
+    free(table->scratch);
+}
+
+static int labels_init(LabelTable *table, int tip_count) {
+    memset(table, 0, sizeof(*table));
+    table->words = (tip_count + 63) / 64;
+    table->capacity = LABEL_INITIAL_SIZE;
+    table->bits = calloc((size_t)table->capacity * table->words, sizeof(uint64_t));
+    table->hashes = malloc(table->capacity * sizeof(uint32_t));
+    table->parents = calloc(table->capacity, sizeof(int));
+    table->bit_counts = calloc(table->capacity, sizeof(int));
+    table->sizes = calloc(table->capacity, sizeof(int));
+    table->slot_mask = 2 * LABEL_INITIAL_SIZE - 1;
+    table->slots = calloc(table->slot_mask + 1, sizeof(int));
+    table->union_mask = 2 * LABEL_INITIAL_SIZE - 1;
+    table->unions = calloc(table->union_mask + 1, sizeof(UnionEntry));
+    table->scratch = malloc(table->words * sizeof(uint64_t));
+    if (table->bits == NULL || table->hashes == NULL || table->parents == NULL ||
+        table->bit_counts == NULL || table->sizes == NULL ||
+        table->slots == NULL || table->unions == NULL || table->scratch == NULL) {
+        labels_free(table);
+        return -1;
+    }
+
+    // The empty label
+    table->hashes[0] = hash_bits(table->bits, table->words);
+    table->slots[table->hashes[0] & table->slot_mask] = 1;
+    table->count = 1;
+    return 0;
+}
+
+static int grow_slots(LabelTable *table) {
+    size_t mask = table->slot_mask * 2 + 1;
+    int *slots = calloc(mask + 1, sizeof(int));
+    if (slots == NULL) {
+        return -1;
+    }
+    for (int label = 0; label < table->count; label++) {
+        size_t slot = table->hashes[label] & mask;
+        while (slots[slot]) {
+            slot = (slot + 1) & mask;
+        }
+        slots[slot] = label + 1;
+    }
+    free(table->slots);
+    table->slots = slots;
+    table->slot_mask = mask;
+    return 0;
+}
+
+static int grow_labels(LabelTable *table) {
+    int capacity = table->capacity * 2;
+    size_t words = (size_t)capacity * table->words;
+    uint64_t *bits = realloc(table->bits, words * sizeof(uint64_t));
+    if (bits == NULL) {
+        return -1;
+    }
+    table->bits = bits;
+    uint32_t *hashes = realloc(table->hashes, capacity * sizeof(uint32_t));
+    if (hashes == NULL) {
+        return -1;
+    }
+    table->hashes = hashes;
+    int *parents = realloc(table->parents, capacity * sizeof(int));
+    if (parents == NULL) {
+        return -1;
+    }
+    table->parents = parents;
+    int *bit_counts = realloc(table->bit_counts, capacity * sizeof(int));
+    if (bit_counts == NULL) {
+        return -1;
+    }
+    table->bit_counts = bit_counts;
+    int *sizes = realloc(table->sizes, capacity * sizeof(int));
+    if (sizes == NULL) {
+        return -1;
+    }
+    memset(sizes + table->capacity, 0, (capacity - table->capacity) * sizeof(int));
+    table->sizes = sizes;
+    table->capacity = capacity;
+    return 0;
+}
+
+// The label holding exactly these bits, added as a child of `parent` if
+// new; -1 when out of memory
+static int label_intern(LabelTable *table, const uint64_t *bits, int parent) {
+    int words = table->words;
+    uint32_t hash = hash_bits(bits, words);
+    size_t slot = hash & table->slot_mask;
+    while (table->slots[slot]) {
+        int label = table->slots[slot] - 1;
+        if (table->hashes[label] == hash &&
+            memcmp(table->bits + (size_t)label * words, bits,
+                   words * sizeof(uint64_t)) == 0) {
+            return label;
+        }
+        slot = (slot + 1) & table->slot_mask;
+    }
+
+    if (table->count == table->capacity && grow_labels(table) != 0) {
+        return -1;
+    }
+    int label = table->count++;
+    memcpy(table->bits + (size_t)label * words, bits, words * sizeof(uint64_t));
+    table->hashes[label] = hash;
+    table->parents[label] = parent;
+    table->bit_counts[label] = 0;
+    for (int i = 0; i < words; i++) {
+        table->bit_counts[label] += __builtin_popcountll(bits[i]);
+    }
+    table->slots[slot] = label + 1;
+    if ((size_t)table->count * 2 > table->slot_mask && grow_slots(table) != 0) {
+        return -1;
+    }
+    return label;
+}
+
+static int grow_unions(LabelTable *table) {
+    size_t mask = table->union_mask * 2 + 1;
+    UnionEntry *unions = calloc(mask + 1, sizeof(UnionEntry));
+    if (unions == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i <= table->union_mask; i++) {
+        const UnionEntry *entry = &table->unions[i];
+        if (entry->a == 0) {
+            continue;
+        }
+        size_t slot = hash_pair(entry->a, entry->b) & mask;
+        while (unions[slot].a) {
+            slot = (slot + 1) & mask;
+        }
+        unions[slot] = *entry;
+    }
+    free(table->unions);
+    table->unions = unions;
+    table->union_mask = mask;
+    return 0;
+}
+
+static int label_union(LabelTable *table, int a, int b) {
+    if (a == b || b == 0) {
+        return a;
+    }
+    if (a == 0) {
+        return b;
+    }
+    if (a > b) {
+        int swap = a;
+        a = b;
+        b = swap;
+    }
+
+    size_t slot = hash_pair(a, b) & table->union_mask;
+    while (table->unions[slot].a) {
+        if (table->unions[slot].a == a && table->unions[slot].b == b) {
+            return table->unions[slot].result;
+        }
+        slot = (slot + 1) & table->union_mask;
+    }
+
+    const uint64_t *x = table->bits + (size_t)a * table->words;
+    const uint64_t *y = table->bits + (size_t)b * table->words;
+    for (int i = 0; i < table->words; i++) {
+        table->scratch[i] = x[i] | y[i];
+    }
+    int parent = table->bit_counts[a] > table->bit_counts[b] ? a : b;
+    int result = label_intern(table, table->scratch, parent);
+    if (result < 0) {
+        return -1;
+    }
+
+    UnionEntry entry = { a, b, result };
+    table->unions[slot] = entry;
+    if (++table->union_count * 2 > table->union_mask && grow_unions(table) != 0) {
+        return -1;
+    }
+    return result;
+}
+
+static int label_with_tip(LabelTable *table, int label, int tip) {
+    memcpy(table->scratch, table->bits + (size_t)label * table->words,
+           table->words * sizeof(uint64_t));
+    table->scratch[tip / 64] |= 1ULL << (tip % 64);
+    return label_intern(table, table->scratch, label);
+}
+
+static int ready_before(const ReadyCommit *a, const ReadyCommit *b) {
+    if (a->generation != b->generation) {
+        return a->generation > b->generation;
+    }
+    return a->time > b->time;
+}
+
+static void ready_push(ReadyCommit *heap, int *count, const CommitStore *store,
+                       int index) {
+    ReadyCommit entry;
+    uint32_t generation = store_generation(store, index);
+    entry.generation = generation ? generation : UINT32_MAX;
+    entry.time = store_commit_time(store, index);
+    entry.index = index;
+
+    int i = (*count)++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!ready_before(&entry, &heap[parent])) {
+            break;
+        }
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = entry;
+}
+
+static int ready_pop(ReadyCommit *heap, int *count) {
+    int top = heap[0].index;
+    ReadyCommit last = heap[--(*count)];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= *count) {
+            break;
+        }
+        if (child + 1 < *count && ready_before(&heap[child + 1], &heap[child])) {
+            child++;
+        }
+        if (!ready_before(&heap[child], &last)) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    if (*count > 0) {
+        heap[i] = last;
+    }
+    return top;
+}
+
+// Label the commits from the tips down, counting the commits of each label;
+// -1 when out of memory
+static int label_commits(const CommitStore *store, const int *tips, int tip_count,
+                         LabelTable *table, ReachStats *stats) {
+    int count = store->count;
+    size_t slots = count ? count : 1;
+    int *label = calloc(slots, sizeof(int));
+    int *children = calloc(slots, sizeof(int));
+    ReadyCommit *heap = malloc(slots * sizeof(ReadyCommit));
+    int status = -1;
+    if (label == NULL || children == NULL || heap == NULL) {
+        goto done;
+    }
+
+    for (int i = 0; i < count; i++) {
+        const int *parents = store_parent_index(store, i);
+        for (int j = 0; j < store_parent_count(store, i); j++) {
+            if (parents[j] >= 0) {
+                children[parents[j]]++;
+            }
+        }
+    }
+
+    // Each tip starts with its own bit; full is the label of every tip.
+    // partial counts the commits waiting with a label that is neither.
+    int partial = 0, full = 0;
+    for (int t = 0; t < tip_count; t++) {
+        if ((full = label_with_tip(table, full, t)) < 0) {
+            goto done;
+        }
+    }
+    for (int t = 0; t < tip_count; t++) {
+        int old = label[tips[t]];
+        int own = label_with_tip(table, old, t);
+        if (own < 0) {
+            goto done;
+        }
+        partial += (own != full) - (old != 0 && old != full);
+        label[tips[t]] = own;
+    }
+
+    int ready = 0;
+    for (int i = 0; i < count; i++) {
+        if (children[i] == 0) {
+            ready_push(heap, &ready, store, i);
+        }
+    }
+
+    // A commit is labelled once all its children have been. Once no
+    // commit waits with a partial label, the rest are reached by all tips
+    // or by none.
+    while (ready > 0 && partial > 0) {
+        int index = ready_pop(heap, &ready);
+        int own = label[index];
+        partial -= own != 0 && own != full;
+        table->sizes[own]++;
+        stats->visited++;
+
+        const int *parents = store_parent_index(store, index);
+        for (int j = 0; j < store_parent_count(store, index); j++) {
+            int parent = parents[j];
+            if (parent < 0) {
+                continue;
+            }
+            int old = label[parent];
+            int merged = label_union(table, old, own);
+            if (merged < 0) {
+                goto done;
+            }
+            if (merged != old) {
+                partial += (merged != full) - (old != 0 && old != full);
+                label[parent] = merged;
+            }
+            if (--children[parent] == 0) {
+                ready_push(heap, &ready, store, parent);
+            }
+        }
+    }
+    status = 0;
+
+done:
+    free(label);
+    free(children);
+    free(heap);
+    return status;
+}
+
+int reach_counts(const CommitStore *store, const int *tips, int tip_count,
+                 int *counts, ReachStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->commits = store->count;
+    memset(counts, 0, (size_t)tip_count * tip_count * sizeof(int));
+    if (tip_count == 0) {
+        return 0;
+    }
+
+    LabelTable table;
+    if (labels_init(&table, tip_count) != 0) {
+        return -1;
+    }
+    int *members = malloc(tip_count * sizeof(int));
+    if (members == NULL || label_commits(store, tips, tip_count, &table, stats) != 0) {
+        free(members);
+        labels_free(&table);
+        return -1;
+    }
+    stats->labels = table.count - 1;
+
+    // both[a][b], commits reachable from a and b, is the sum of the sizes
+    // of the labels holding both. A label's size is passed on to its
+    // parent, which then counts it for the pairs of the parent's tips, so
+    // a label only adds the pairs involving the tips its parent lacks.
+    // Children are newer than their parents and come first.
+    int *both = counts;
+    for (int label = table.count - 1; label > 0; label--) {
+        int size = table.sizes[label];
+        if (size == 0) {
+            continue;
+        }
+        int parent = table.parents[label];
+        table.sizes[parent] += size;
+
+        int k = 0;
+        const uint64_t *bits = table.bits + (size_t)label * table.words;
+        const uint64_t *old = table.bits + (size_t)parent * table.words;
+        for (int w = 0; w < table.words; w++) {
+            for (uint64_t word = bits[w] & ~old[w]; word; word &= word - 1) {
+                members[k++] = w * 64 + __builtin_ctzll(word);
+            }
+        }
+        int added = k;
+        for (int w = 0; w < table.words; w++) {
+            for (uint64_t word = bits[w] & old[w]; word; word &= word - 1) {
+                members[k++] = w * 64 + __builtin_ctzll(word);
+            }
+        }
+        for (int i = 0; i < added; i++) {
+            int *row = both + (size_t)members[i] * tip_count;
+            for (int j = 0; j < k; j++) {
+                row[members[j]] += size;
+            }
+        }
+        for (int i = added; i < k; i++) {
+            int *row = both + (size_t)members[i] * tip_count;
+            for (int j = 0; j < added; j++) {
+                row[members[j]] += size;
+            }
+        }
+    }
+
+    // How far a is ahead of b: |a| - |a and b|
+    for (int a = 0; a < tip_count; a++) {
+        int *row = counts + (size_t)a * tip_count;
+        int total = row[a];
+        for (int b = 0; b < tip_count; b++) {
+            row[b] = total - row[b];
+        }
+    }
+
+    free(members);
+    labels_free(&table);
+    return 0;
+}
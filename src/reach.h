@@ -0,0 +1,32 @@
+#ifndef SHRUB_REACH_H
+#define SHRUB_REACH_H
+
+#include "store.h"
+
+// Ahead/behind counts between many commits at once, from one walk of the
+// commit store instead of a `git rev-list --count` per pair.
+//
+// Every commit is labelled with the set of tips it is reachable from. The
+// walk goes from children to parents, highest generation number first
+// (commit date for commits newer than the commit-graph), and a parent's
+// label is the union of its children's. Labels are interned as bitmaps and
+// unions are remembered, so a line of history that shares one label costs
+// a table lookup per commit. Once each labelled commit still waiting is
+// reachable from every tip, nothing below can change a count and the walk
+// stops.
+
+typedef struct {
+    int commits;            // commits in the store
+    int visited;            // commits labelled before the walk could stop
+    int labels;             // distinct sets of tips
+} ReachStats;
+
+// Fill counts[a * tip_count + b] with the number of commits reachable from
+// tips[a] but not from tips[b]: how far a is ahead of b, and behind it in
+// counts[b * tip_count + a]. a is merged into b when that count is 0.
+// Tips are store indices; parents must have been resolved, and commits
+// outside the store are not counted. Returns -1 when out of memory.
+int reach_counts(const CommitStore *store, const int *tips, int tip_count,
+                 int *counts, ReachStats *stats);
+
+#endif
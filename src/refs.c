@@ -0,0 +1,380 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "refs.h"
+#include "profile.h"
+#include "shrub.h"
+#include "strbuf.h"
+
+#define MAX_SYMREF_DEPTH 5
+#define MAX_LOOSE_REF 1024
+
+// A ref before symbolic refs are resolved
+typedef struct {
+    Ref ref;
+    char *target;       // symbolic ref: name of the ref it points at
+    int loose;          // a loose file, which overrides a packed entry
+} RawRef;
+
+typedef struct {
+    RawRef *entries;
+    int count;
+    int capacity;
+} RawRefList;
+
+static RawRef *add_raw_ref(RawRefList *list, const char *name, size_t name_len) {
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 256;
+        RawRef *grown = realloc(list->entries, capacity * sizeof(RawRef));
+        if (grown == NULL) {
+            return NULL;
+        }
+        list->entries = grown;
+        list->capacity = capacity;
+    }
+    RawRef *entry = &list->entries[list->count];
+    memset(entry, 0, sizeof(*entry));
+    entry->ref.name = strndup(name, name_len);
+    if (entry->ref.name == NULL) {
+        return NULL;
+    }
+    list->count++;
+    return entry;
+}
+
+static void free_raw_refs(RawRefList *list) {
+    for (int i = 0; i < list->count; i++) {
+        free(list->entries[i].ref.name);
+        free(list->entries[i].target);
+    }
+    free(list->entries);
+}
+
+// A full object id followed by the end of the line
+static int parse_oid_line(const char *p, const char *end, unsigned char *oid) {
+    if (end - p < OID_HEXSZ || hex_to_oid(p, oid) != 0) {
+        return -1;
+    }
+    p += OID_HEXSZ;
+    return p == end || *p == '\n' || *p == '\r' || *p == ' ' ? 0 : -1;
+}
+
+// packed-refs: "<id> <name>" lines, each optionally followed by "^<id>",
+// the commit an annotated tag peels to
+static int read_packed_refs(const char *common_dir, RawRefList *list) {
+    StrBuf path = {0};
+    sb_appendf(&path, "%s/packed-refs", common_dir);
+    size_t size = 0;
+    char *data = read_file(path.data, &size);
+    sb_free(&path);
+    if (data == NULL) {
+        return 0;   // nothing packed yet
+    }
+    profile_add_bytes(size);
+
+    // Traits say which refs would have had a peel line: with
+    // "fully-peeled" all of them, with "peeled" those under refs/tags/
+    int fully_peeled = 0, tags_peeled = 0;
+    const char *p = data, *end = data + size;
+    if (strncmp(p, "# pack-refs with:", 17) == 0) {
+        const char *eol = memchr(p, '\n', end - p);
+        eol = eol ? eol : end;
+        for (const char *t = p + 17; t < eol; ) {
+            while (t < eol && *t == ' ') {
+                t++;
+            }
+            const char *word = t;
+            while (t < eol && *t != ' ') {
+                t++;
+            }
+            if (t - word == 12 && strncmp(word, "fully-peeled", 12) == 0) {
+                fully_peeled = 1;
+            } else if (t - word == 6 && strncmp(word, "peeled", 6) == 0) {
+                tags_peeled = 1;
+            }
+        }
+        p = eol < end ? eol + 1 : end;
+    }
+
+    RawRef *last = NULL;
+    int status = 0;
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        eol = eol ? eol : end;
+        const char *line_end = eol > p && eol[-1] == '\r' ? eol - 1 : eol;
+
+        if (*p == '^') {
+            if (last && parse_oid_line(p + 1, line_end, last->ref.peeled) == 0) {
+                last->ref.peeled_known = 1;
+            }
+        } else if (*p != '#') {
+            unsigned char oid[OID_RAWSZ];
+            last = NULL;
+            if (parse_oid_line(p, line_end, oid) == 0 &&
+                line_end - p > OID_HEXSZ + 1 && p[OID_HEXSZ] == ' ') {
+                const char *name = p + OID_HEXSZ + 1;
+                last = add_raw_ref(list, name, line_end - name);
+                if (last == NULL) {
+                    status = -1;
+                    break;
+                }
+                memcpy(last->ref.oid, oid, OID_RAWSZ);
+                memcpy(last->ref.peeled, oid, OID_RAWSZ);
+                last->ref.peeled_known = fully_peeled ||
+                    (tags_peeled && strncmp(last->ref.name, "refs/tags/", 10) == 0);
+            }
+        }
+        p = eol < end ? eol + 1 : end;
+    }
+    free(data);
+    return status;
+}
+
+// Refs that belong to one worktree rather than the repository
+static int is_per_worktree(const char *name) {
+    return strncmp(name, "refs/bisect/", 12) == 0 ||
+           strncmp(name, "refs/worktree/", 14) == 0 ||
+           strncmp(name, "refs/rewritten/", 15) == 0;
+}
+
+// Loose refs: one file per ref holding an id or "ref: <target>". `path`
+// holds the directory, whose ref name starts at `name_offset`.
+static int read_loose_dir(StrBuf *path, size_t name_offset, int skip_per_worktree,
+                          int only_per_worktree, RawRefList *list) {
+    DIR *dir = opendir(path->data);
+    if (dir == NULL) {
+        return 0;
+    }
+
+    size_t dir_len = path->len;
+    int status = 0;
+    struct dirent *entry;
+    while (status == 0 && (entry = readdir(dir)) != NULL) {
+        // git skips dotfiles and the lock files of refs being updated
+        size_t len = strlen(entry->d_name);
+        if (entry->d_name[0] == '.' ||
+            (len >= 5 && strcmp(entry->d_name + len - 5, ".lock") == 0)) {
+            continue;
+        }
+        path->len = dir_len;
+        path->data[dir_len] = '\0';
+        sb_appendf(path, "/%s", entry->d_name);
+
+        // The entry's type saves a stat() per ref where the file system
+        // reports it
+        int is_dir = entry->d_type == DT_DIR;
+        int is_file = entry->d_type == DT_REG;
+        struct stat st;
+        if (!is_dir && !is_file) {
+            if (stat(path->data, &st) != 0) {
+                continue;
+            }
+            is_dir = S_ISDIR(st.st_mode);
+            is_file = S_ISREG(st.st_mode);
+        }
+        if (is_dir) {
+            status = read_loose_dir(path, name_offset, skip_per_worktree,
+                                    only_per_worktree, list);
+            continue;
+        }
+        const char *name = path->data + name_offset;
+        if (!is_file ||
+            (skip_per_worktree && is_per_worktree(name)) ||
+            (only_per_worktree && !is_per_worktree(name))) {
+            continue;
+        }
+
+        // A loose ref is one short line; anything longer is not a ref
+        char data[MAX_LOOSE_REF];
+        int fd = open(path->data, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        ssize_t size = read(fd, data, sizeof(data) - 1);
+        close(fd);
+        if (size <= 0) {
+            continue;
+        }
+        data[size] = '\0';
+        profile_add_bytes(size);
+        unsigned char oid[OID_RAWSZ];
+        char *eol = data + strcspn(data, "\r\n");
+        if (strncmp(data, "ref:", 4) == 0) {
+            char *target = data + 4;
+            while (*target == ' ' || *target == '\t') {
+                target++;
+            }
+            RawRef *ref = add_raw_ref(list, name, strlen(name));
+            if (ref == NULL || (ref->target = strndup(target, eol - target)) == NULL) {
+                status = -1;
+            } else {
+                ref->loose = 1;
+            }
+        } else if (parse_oid_line(data, data + size, oid) == 0) {
+            RawRef *ref = add_raw_ref(list, name, strlen(name));
+            if (ref == NULL) {
+                status = -1;
+            } else {
+                memcpy(ref->ref.oid, oid, OID_RAWSZ);
+                memcpy(ref->ref.peeled, oid, OID_RAWSZ);
+                ref->loose = 1;
+            }
+        }
+    }
+    closedir(dir);
+    path->len = dir_len;
+    path->data[dir_len] = '\0';
+    return status;
+}
+
+static int read_loose_refs(const char *dir, int skip_per_worktree,
+                           int only_per_worktree, RawRefList *list) {
+    StrBuf path = {0};
+    sb_appendf(&path, "%s/refs", dir);
+    size_t name_offset = path.len - 4;
+    int status = path.data ? read_loose_dir(&path, name_offset, skip_per_worktree,
+                                            only_per_worktree, list) : -1;
+    sb_free(&path);
+    return status;
+}
+
+// Name order, the loose copy of a ref before its packed one
+static int compare_raw_refs(const void *a, const void *b) {
+    const RawRef *x = a, *y = b;
+    int cmp = strcmp(x->ref.name, y->ref.name);
+    return cmp ? cmp : y->loose - x->loose;
+}
+
+static const RawRef *find_raw_ref(const RawRefList *list, const char *name) {
+    int lo = 0, hi = list->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = strcmp(list->entries[mid].ref.name, name);
+        if (cmp == 0) {
+            return &list->entries[mid];
+        } else if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+int refs_read(const char *git_dir, RefList *list) {
+    memset(list, 0, sizeof(*list));
+    char *common_dir = git_common_dir(git_dir);
+    if (common_dir == NULL) {
+        return -1;
+    }
+
+    struct stat st;
+    StrBuf reftable = {0};
+    sb_appendf(&reftable, "%s/reftable", common_dir);
+    int has_reftable = reftable.data && stat(reftable.data, &st) == 0;
+    sb_free(&reftable);
+    if (has_reftable) {
+        free(common_dir);
+        return -1;
+    }
+
+    // A linked worktree shares the repository's refs but has its own
+    // bisect and worktree refs
+    RawRefList raw = {0};
+    int linked = strcmp(common_dir, git_dir) != 0;
+    int status = read_packed_refs(common_dir, &raw);
+    if (status == 0) {
+        status = read_loose_refs(common_dir, linked, 0, &raw);
+    }
+    if (status == 0 && linked) {
+        status = read_loose_refs(git_dir, 0, 1, &raw);
+    }
+    free(common_dir);
+    if (status != 0) {
+        free_raw_refs(&raw);
+        return -1;
+    }
+
+    qsort(raw.entries, raw.count, sizeof(RawRef), compare_raw_refs);
+    int kept = 0;
+    for (int i = 0; i < raw.count; i++) {
+        if (kept > 0 && strcmp(raw.entries[kept - 1].ref.name,
+                               raw.entries[i].ref.name) == 0) {
+            free(raw.entries[i].ref.name);
+            free(raw.entries[i].target);
+            continue;
+        }
+        raw.entries[kept++] = raw.entries[i];
+    }
+    raw.count = kept;
+
+    // Resolve symbolic refs before any name moves to the list
+    int *resolved = malloc((raw.count ? raw.count : 1) * sizeof(int));
+    list->refs = malloc((raw.count ? raw.count : 1) * sizeof(Ref));
+    if (resolved == NULL || list->refs == NULL) {
+        free(resolved);
+        free(list->refs);
+        list->refs = NULL;
+        free_raw_refs(&raw);
+        return -1;
+    }
+    for (int i = 0; i < raw.count; i++) {
+        const RawRef *target = &raw.entries[i];
+        for (int depth = 0; target && target->target && depth < MAX_SYMREF_DEPTH; depth++) {
+            target = find_raw_ref(&raw, target->target);
+        }
+        // Dangling and looping symbolic refs are dropped
+        resolved[i] = target && !target->target ? (int)(target - raw.entries) : -1;
+    }
+    for (int i = 0; i < raw.count; i++) {
+        if (resolved[i] < 0) {
+            continue;
+        }
+        Ref *ref = &list->refs[list->count++];
+        *ref = raw.entries[resolved[i]].ref;
+        ref->name = raw.entries[i].ref.name;
+        raw.entries[i].ref.name = NULL;
+    }
+    free(resolved);
+    list->capacity = raw.count;
+    free_raw_refs(&raw);
+    return 0;
+}
+
+void refs_free(RefList *list) {
+    for (int i = 0; i < list->count; i++) {
+        free(list->refs[i].name);
+    }
+    free(list->refs);
+    memset(list, 0, sizeof(*list));
+}
+
+const Ref *refs_find(const RefList *list, const char *name) {
+    int lo = 0, hi = list->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = strcmp(list->refs[mid].name, name);
+        if (cmp == 0) {
+            return &list->refs[mid];
+        } else if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+int branch_color(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return (int)(hash % COLOR_COUNT);
+}
@@ -0,0 +1,41 @@
+#ifndef SHRUB_REFS_H
+#define SHRUB_REFS_H
+
+#include "odb.h"
+
+// A ref as the repository stores it, read from packed-refs or a loose file
+// under refs/. Symbolic refs (refs/remotes/origin/HEAD) carry the id of the
+// ref they point at under their own name.
+typedef struct {
+    char *name;                         // full name, e.g. refs/heads/main
+    unsigned char oid[OID_RAWSZ];
+    unsigned char peeled[OID_RAWSZ];    // what a tag points at, else oid
+    int peeled_known;                   // packed-refs recorded the peel
+} Ref;
+
+typedef struct {
+    Ref *refs;          // in name order, as `git for-each-ref` lists them
+    int count;
+    int capacity;
+} RefList;
+
+// A ref tip, peeled to the commit it decorates
+typedef struct {
+    unsigned char oid[OID_RAWSZ];
+    char *name;
+} RefTip;
+
+// Read every ref of a repository without running git. Loose refs win over
+// packed ones of the same name; refs whose value cannot be parsed and
+// symbolic refs that lead nowhere are left out, as git does. Returns -1 if
+// the repository keeps its refs some other way (reftable) or on error.
+int refs_read(const char *git_dir, RefList *list);
+void refs_free(RefList *list);
+
+// The ref of that full name, or NULL
+const Ref *refs_find(const RefList *list, const char *name);
+
+// Lane color of a branch, from its name so it keeps it from run to run
+int branch_color(const char *name);
+
+#endif
@@ -1,871 +1,355 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
-#include <unistd.h>
 
-#define VERSION "0.0.1"
-#define MAX_COMMAND_LENGTH 1024
-#define MAX_LINE_LENGTH 4096
-#define MAX_BRANCHES 100
-#define MAX_COMMITS 10000
-#define DATE_LENGTH 30
-#define DEBUG 0
+#include "daemon.h"
+#include "pool.h"
+#include "profile.h"
+#include "shrub.h"
 
-#define COMMIT_SYMBOL "●"
-#define MERGE_SYMBOL "◆"
-#define PR_SYMBOL    "◉"
-
-// Define structs first
-typedef struct {
-    char name[128];
-    char hash[41];
-    int color;
-    int x_pos;
-} Branch;
-
-typedef struct {
-    char hash[41];
-    char short_hash[8];
-    char subject[256];
-    char full_message[4096];  // Added to store full commit message
-    char author[128];
-    char date[DATE_LENGTH];
-    time_t timestamp;
-    char refs[256];
-    int is_merge;
-    char symbol[8];
-    int is_pr;
-    char pr_number[16];
-    int branch_index;
-    int x_pos;
-    int y_pos;
-    int parent_count;
-    char parent_hashes[5][41];
-} Commit;
-
-// Then declare function prototypes
-void determine_commit_type(Commit *commit);
-void print_graph_lines(Commit *commit, Branch *branches);
-void print_usage();
-int handle_reset_latest();
-int handle_stats();
-int handle_diff(const char* commit_hash);
-int handle_files(const char* filename);
-
-Commit commits[MAX_COMMITS];
-Branch branches[MAX_BRANCHES];
-int commit_count = 0;
-int branch_count = 0;
-
-// ANSI color codes for branches
-const char* colors[] = {
-    "\033[1;31m", // Red
-    "\033[1;32m", // Green
-    "\033[1;33m", // Yellow
-    "\033[1;34m", // Blue
-    "\033[1;35m", // Magenta
-    "\033[1;36m", // Cyan
-    "\033[1;91m", // Bright Red
-    "\033[1;92m", // Bright Green
-    "\033[1;93m", // Bright Yellow
-    "\033[1;94m", // Bright Blue
-    "\033[1;95m", // Bright Magenta
-    "\033[1;96m"  // Bright Cyan
-};
-#define COLOR_COUNT 12
-#define RESET_COLOR "\033[0m"
+// -stats, -diff and the like, as opposed to tree options such as -n
+static int is_command(const char *arg) {
+    return arg[0] == '-' && arg[1] != '-' && arg[1] != 'n' && arg[1] != '\0';
+}
 
-// Function to execute a command and return the output
-char* execute_command(const char* command) {
-    FILE* fp;
-    static char buffer[MAX_LINE_LENGTH * 100];
-    char line[MAX_LINE_LENGTH];
-    
-    buffer[0] = '\0';
-    
-    fp = popen(command, "r");
-    if (fp == NULL) {
-        fprintf(stderr, "Failed to execute command: %s\n", command);
-        return buffer;
-    }
-    
-    while (fgets(line, sizeof(line), fp) != NULL) {
-        strcat(buffer, line);
+// The number in -n N, -nN or --max-count=N
+static int parse_count(const char *arg, int *count) {
+    char *end;
+    long value = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || value < 0 || value > 1000000000) {
+        fprintf(stderr, "Error: Invalid count '%s'\n", arg);
+        return -1;
     }
-    
-    int status = pclose(fp);
-    if (status != 0) {
-        fprintf(stderr, "Command exited with status %d: %s\n", status, command);
+    *count = (int)value;
+    return 0;
+}
+
+static int parse_date_option(const char *arg, time_t *date) {
+    if (parse_date_arg(arg, date) != 0) {
+        fprintf(stderr, "Error: Invalid date '%s'\n", arg);
+        return -1;
     }
-    
-    return buffer;
+    return 0;
 }
 
+// Set while a command runs for the daemon: its output is kept, so it
+// goes to stdout rather than a pager or the viewer
+static int serving = 0;
+static const char *serving_git_dir = NULL;
 
-// Function to parse git log and fill the commits array
-void parse_git_log() {
-    char command[MAX_COMMAND_LENGTH];
-    char *log_output;
-    char *line, *next_line;
-    
-    // Modified format to include full commit message
-    snprintf(command, MAX_COMMAND_LENGTH, 
-             "git log --all --graph --date=iso"
-             " --pretty=format:\"COMMIT_SEP%%H|%%h|%%s|%%an|%%ad|%%P|%%D|%%B\""
-             " --date-order --color=always");
-    
-    if (DEBUG) {
-        printf("Executing: %s\n", command);  // Debug output 
-    }
-    
-    log_output = execute_command(command);
-    
-    // Check if we got any output
-    if (log_output == NULL || strlen(log_output) < 10) {
-        printf("Error: Failed to get git log output\n");
-        return;
+// Run a command line: a command such as -stats, or the tree view with its
+// options. `prefix` is the current directory below the top of the work
+// tree, NULL if not known.
+static int run_command(const char *git_dir, const char *prefix, int argc,
+                       char *argv[], double start_ms, ProfileMark *startup) {
+    TreeOptions options = { READER_AUTO, ORDER_DATE, 1, 0, 1, 0, NULL, EXPORT_NONE,
+                            { NULL, 0, -1, 0, 0, 0 } };
+    int show_timing = 0;
+
+    // Handle command line arguments
+    if (argc > 1 && is_command(argv[1])) {
+        profile_end(startup, PROFILE_STARTUP);
     }
-    
-    line = strtok_r(log_output, "\n", &next_line);
-    while (line != NULL && commit_count < MAX_COMMITS) {
-        if (strstr(line, "COMMIT_SEP") != NULL) {
-            char *commit_part = strstr(line, "COMMIT_SEP");
-            if (commit_part) {
-                commit_part += 10; // Skip "COMMIT_SEP"
-                
-                // Parse the fields
-                char *hash = strtok(commit_part, "|");
-                if (hash) {
-                    strncpy(commits[commit_count].hash, hash, 40);
-                    commits[commit_count].hash[40] = '\0';
-                    
-                    char *short_hash = strtok(NULL, "|");
-                    if (short_hash) {
-                        strncpy(commits[commit_count].short_hash, short_hash, 7);
-                        commits[commit_count].short_hash[7] = '\0';
-                    }
-                    
-                    char *subject = strtok(NULL, "|");
-                    if (subject) {
-                        strncpy(commits[commit_count].subject, subject, 255);
-                        commits[commit_count].subject[255] = '\0';
-                        
-                        // Check if it's a PR
-                        if (strstr(subject, "Merge pull request") || 
-                            strstr(subject, "Merge PR") || 
-                            strstr(subject, "Pull request")) {
-                            commits[commit_count].is_pr = 1;
-                            
-                            // Extract PR number
-                            char *pr_start = strstr(subject, "#");
-                            if (pr_start) {
-                                char pr_num[16] = {0};
-                                int i = 0;
-                                pr_start++; // Skip the '#'
-                                while (*pr_start && *pr_start != ' ' && *pr_start != ')' && i < 15) {
-                                    pr_num[i++] = *pr_start++;
-                                }
-                                pr_num[i] = '\0';
-                                strcpy(commits[commit_count].pr_number, pr_num);
-                            }
-                        } else {
-                            commits[commit_count].is_pr = 0;
-                            commits[commit_count].pr_number[0] = '\0';
-                        }
-                    }
-                    
-                    char *author = strtok(NULL, "|");
-                    if (author) {
-                        strncpy(commits[commit_count].author, author, 127);
-                        commits[commit_count].author[127] = '\0';
-                    }
-                    
-                    char *date = strtok(NULL, "|");
-                    if (date) {
-                        strncpy(commits[commit_count].date, date, DATE_LENGTH-1);
-                        commits[commit_count].date[DATE_LENGTH-1] = '\0';
-                        
-                        // Convert to timestamp for sorting
-                        struct tm tm = {0};
-                        if (strptime(date, "%Y-%m-%d %H:%M:%S %z", &tm) != NULL) {
-                            commits[commit_count].timestamp = mktime(&tm);
-                        } else {
-                            // Fallback if date parsing fails
-                            commits[commit_count].timestamp = time(NULL);
-                        }
-                    }
-                    
-                    char *parents = strtok(NULL, "|");
-                    if (parents) {
-                        commits[commit_count].parent_count = 0;
-                        if (strlen(parents) > 0) {
-                            char *parent_token;
-                            char parents_copy[256];
-                            strncpy(parents_copy, parents, 255);
-                            parents_copy[255] = '\0';
-                            
-                            parent_token = strtok(parents_copy, " ");
-                            while (parent_token != NULL && commits[commit_count].parent_count < 5) {
-                                strncpy(commits[commit_count].parent_hashes[commits[commit_count].parent_count], 
-                                        parent_token, 40);
-                                commits[commit_count].parent_hashes[commits[commit_count].parent_count][40] = '\0';
-                                commits[commit_count].parent_count++;
-                                parent_token = strtok(NULL, " ");
-                            }
-                        }
-                        
-                        // If it has more than one parent, it's a merge commit
-                        if (commits[commit_count].parent_count > 1) {
-                            commits[commit_count].is_merge = 1;
-                        } else {
-                            commits[commit_count].is_merge = 0;
-                        }
-                    }
-                    
-                    char *refs = strtok(NULL, "|");
-                    if (refs) {
-                        if (refs && strlen(refs) > 0) {
-                            strncpy(commits[commit_count].refs, refs, 255);
-                            commits[commit_count].refs[255] = '\0';
-                            
-                            // Extract branch names
-                            if (strstr(refs, "HEAD -> ")) {
-                                char *branch_start = strstr(refs, "HEAD -> ");
-                                branch_start += 8; // Skip "HEAD -> "
-                                
-                                if (branch_count < MAX_BRANCHES) {
-                                    int i = 0;
-                                    while (branch_start[i] != ',' && branch_start[i] != '\0' && branch_start[i] != ' ' && i < 127) {
-                                        branches[branch_count].name[i] = branch_start[i];
-                                        i++;
-                                    }
-                                    branches[branch_count].name[i] = '\0';
-                                    strcpy(branches[branch_count].hash, commits[commit_count].hash);
-                                    branches[branch_count].color = branch_count % COLOR_COUNT;
-                                    branch_count++;
-                                }
-                            }
-                            
-                            // Also check for refs/heads/ branches
-                            char *branch_ref = refs;
-                            while ((branch_ref = strstr(branch_ref, "refs/heads/")) != NULL) {
-                                branch_ref += 11; // Skip "refs/heads/"
-                                
-                                if (branch_count < MAX_BRANCHES) {
-                                    int i = 0;
-                                    while (branch_ref[i] != ',' && branch_ref[i] != '\0' && branch_ref[i] != ' ' && i < 127) {
-                                        branches[branch_count].name[i] = branch_ref[i];
-                                        i++;
-                                    }
-                                    branches[branch_count].name[i] = '\0';
-                                    strcpy(branches[branch_count].hash, commits[commit_count].hash);
-                                    branches[branch_count].color = branch_count % COLOR_COUNT;
-                                    branch_count++;
-                                }
-                                
-                                branch_ref++;
-                            }
-                        } else {
-                            commits[commit_count].refs[0] = '\0';
-                        }
-                    }
-                    
-                    // Parse full commit message
-                    char *full_message = strtok(NULL, "|");
-                    if (full_message) {
-                        strncpy(commits[commit_count].full_message, full_message, 4095);
-                        commits[commit_count].full_message[4095] = '\0';
-                    }
-                    
-                    determine_commit_type(&commits[commit_count]);
-                    commit_count++;
-                }
+    if (argc > 1) {
+        if (strcmp(argv[1], "-reset") == 0) {
+            if (argc != 3 || strcmp(argv[2], "latest") != 0) {
+                print_usage();
+                return EXIT_FAILURE;
             }
+            return handle_reset_latest();
         }
-        
-        line = strtok_r(NULL, "\n", &next_line);
-    }
-    
-    // Add debug output
-    if (commit_count == 0) {
-        printf("No commits were parsed. Debug info:\n");
-        printf("Git command output length: %zu\n", strlen(log_output));
-        printf("First 100 chars of output: %.100s\n", log_output);
-    } else {
-    if (DEBUG) {
-    fprintf(stderr, "Successfully parsed %d commits and %d branches\n", commit_count, branch_count);
-    }
-    }
-}
-
-// Assign horizontal positions to branches
-void assign_branch_positions() {
-    int max_x = 0;
-    
-    // First, find the main branch (usually master or main)
-    for (int i = 0; i < branch_count; i++) {
-        if (strcmp(branches[i].name, "master") == 0 || 
-            strcmp(branches[i].name, "main") == 0) {
-            branches[i].x_pos = 0;
-            max_x = 1;
-            break;
-        }
-    }
-    
-    // Assign positions to other branches
-    for (int i = 0; i < branch_count; i++) {
-        if (branches[i].x_pos == 0 && 
-            strcmp(branches[i].name, "master") != 0 && 
-            strcmp(branches[i].name, "main") != 0) {
-            branches[i].x_pos = max_x++;
+        else if (strcmp(argv[1], "-stats") == 0) {
+            if (argc > 3 || (argc == 3 && strcmp(argv[2], "--json") != 0)) {
+                print_usage();
+                return EXIT_FAILURE;
+            }
+            return handle_stats(git_dir, argc == 3);
         }
-    }
-}
-
-// Assign positions to commits
-void assign_commit_positions() {
-    // Sort commits by timestamp (newest first)
-    for (int i = 0; i < commit_count - 1; i++) {
-        for (int j = 0; j < commit_count - i - 1; j++) {
-            if (commits[j].timestamp < commits[j + 1].timestamp) {
-                Commit temp = commits[j];
-                commits[j] = commits[j + 1];
-                commits[j + 1] = temp;
+        else if (strcmp(argv[1], "-diff") == 0) {
+            if (argc != 3) {
+                fprintf(stderr, "Error: Please provide a commit hash\n");
+                print_usage();
+                return EXIT_FAILURE;
             }
+            return handle_diff(git_dir, argv[2]);
         }
-    }
-    
-    // Assign y positions (newest at top)
-    for (int i = 0; i < commit_count; i++) {
-        commits[i].y_pos = i;
-        
-        // Assign x position based on branch
-        commits[i].x_pos = 0; // Default to leftmost position
-        
-        // Find the branch this commit belongs to
-        for (int j = 0; j < branch_count; j++) {
-            if (strcmp(commits[i].hash, branches[j].hash) == 0) {
-                commits[i].x_pos = branches[j].x_pos;
-                break;
+        else if (strcmp(argv[1], "-branches") == 0) {
+            int json = argc > 2 && strcmp(argv[2], "--json") == 0;
+            if (argc > 3 + json) {
+                print_usage();
+                return EXIT_FAILURE;
             }
+            return handle_branches(git_dir, argc > 2 + json ? argv[2 + json] : "HEAD",
+                                   json);
         }
-        
-        // For merge commits, try to position to the right
-        if (commits[i].is_merge && commits[i].parent_count > 1) {
-            int rightmost_parent = 0;
-            
-            // Find the rightmost parent branch
-            for (int j = 0; j < commits[i].parent_count; j++) {
-                for (int k = 0; k < commit_count; k++) {
-                    if (strcmp(commits[i].parent_hashes[j], commits[k].hash) == 0) {
-                        if (commits[k].x_pos > rightmost_parent) {
-                            rightmost_parent = commits[k].x_pos;
-                        }
-                        break;
-                    }
-                }
+        else if (strcmp(argv[1], "-files") == 0) {
+            if (argc < 3) {
+                fprintf(stderr, "Error: Please provide a filename\n");
+                print_usage();
+                return EXIT_FAILURE;
             }
-            
-            // Position this merge commit on the rightmost parent's branch
-            if (rightmost_parent > 0) {
-                commits[i].x_pos = rightmost_parent;
+            // One path keeps the text listing; more, or a list, are NDJSON
+            if (argc == 3 && argv[2][0] != '-') {
+                return handle_files(git_dir, prefix, argv[2]);
             }
+            return handle_files_batch(git_dir, prefix, argc - 2, argv + 2);
         }
     }
-}
 
-// Print the commit tree
-void print_commit_tree() {
-    int max_x = 0;
-    
-    // Find the maximum x position
-    for (int i = 0; i < commit_count; i++) {
-        if (commits[i].x_pos > max_x) {
-            max_x = commits[i].x_pos;
-        }
+    // Remaining arguments are tree view options and revisions
+    const char **revisions = malloc(argc * sizeof(char *));
+    if (revisions == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return EXIT_FAILURE;
     }
-    
-    // Create a buffer for the entire output
-    char *output_buffer = malloc(MAX_COMMITS * MAX_LINE_LENGTH * 4);
-    output_buffer[0] = '\0';
-    
-    // Print the tree
-    int y = 0;
-    while (y < commit_count) {
-        char line[4096] = {0};
-        int branch_lines[MAX_BRANCHES] = {0};
-        int child_connections[MAX_BRANCHES][MAX_BRANCHES] = {0};
-        
-        // Mark which branches have commits at this level and below
-        for (int i = 0; i < commit_count; i++) {
-            if (commits[i].y_pos >= y) {
-                // Mark the branch line
-                branch_lines[commits[i].x_pos] = 1;
-                
-                // If this is a merge commit, mark the connection to its parents
-                if (commits[i].parent_count > 1) {
-                    for (int j = 0; j < commits[i].parent_count; j++) {
-                        for (int k = 0; k < commit_count; k++) {
-                            if (strcmp(commits[i].parent_hashes[j], commits[k].hash) == 0) {
-                                child_connections[commits[i].x_pos][commits[k].x_pos] = 1;
-                                child_connections[commits[k].x_pos][commits[i].x_pos] = 1;
-                                break;
-                            }
-                        }
-                    }
-                }
-                // For regular commits, mark connection to single parent
-                else if (commits[i].parent_count == 1) {
-                    for (int k = 0; k < commit_count; k++) {
-                        if (strcmp(commits[i].parent_hashes[0], commits[k].hash) == 0) {
-                            child_connections[commits[i].x_pos][commits[k].x_pos] = 1;
-                            child_connections[commits[k].x_pos][commits[i].x_pos] = 1;
-                            break;
-                        }
-                    }
-                }
+    // Usage errors and failures leave through `done`, which frees them
+    int result = EXIT_FAILURE;
+    options.range.revisions = revisions;
+    RevisionRange *range = &options.range;
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-') {
+            revisions[range->revision_count++] = argv[i];
+        }
+        else if (strcmp(argv[i], "-n") == 0) {
+            if (i + 1 == argc || parse_count(argv[++i], &range->max_count) != 0) {
+                print_usage();
+                goto done;
+            }
+        }
+        else if (strncmp(argv[i], "-n", 2) == 0 ||
+                 strncmp(argv[i], "--max-count=", 12) == 0) {
+            const char *count = argv[i][1] == 'n' ? argv[i] + 2 : argv[i] + 12;
+            if (parse_count(count, &range->max_count) != 0) {
+                goto done;
             }
         }
-        
-        // Find commit at this y position
-        for (int i = 0; i < commit_count; i++) {
-            if (commits[i].y_pos == y) {
-                // Add initial indentation
-                if (commits[i].x_pos > 0) {
-                    strcat(line, "    ");  // Base indentation for non-root commits
-                }
-                
-                // Print branch lines before commit
-                for (int x = 1; x < commits[i].x_pos; x++) {
-                    if (branch_lines[x] || child_connections[x][commits[i].x_pos]) {
-                        strcat(line, "│   ");
-                    } else {
-                        strcat(line, "    ");
-                    }
-                }
-                
-                // Get branch color
-                int color_index = 0;
-                for (int j = 0; j < branch_count; j++) {
-                    if (strstr(commits[i].refs, branches[j].name) != NULL) {
-                        color_index = branches[j].color;
-                        break;
-                    }
-                }
-                
-                // Add commit representation with hash
-                char commit_str[1024];
-                if (commits[i].is_merge) {
-                    sprintf(commit_str, "%s◆ %s%s ", colors[color_index], commits[i].hash, RESET_COLOR);
-                } else if (commits[i].is_pr) {
-                    sprintf(commit_str, "%s◉ %s%s ", colors[color_index], commits[i].hash, RESET_COLOR);
-                } else {
-                    sprintf(commit_str, "%s● %s%s ", colors[color_index], commits[i].hash, RESET_COLOR);
-                }
-                strcat(line, commit_str);
-                
-                // Add commit details
-                char details[2048];
-                if (commits[i].is_pr) {
-                    sprintf(details, "%s (PR #%s) (%s, %s)", 
-                            commits[i].subject,
-                            commits[i].pr_number,
-                            commits[i].author,
-                            commits[i].date);
-                } else if (commits[i].is_merge) {
-                    sprintf(details, "%s (Merge commit) (%s, %s)",
-                            commits[i].subject,
-                            commits[i].author,
-                            commits[i].date);
-                } else {
-                    sprintf(details, "%s (%s, %s)",
-                            commits[i].subject,
-                            commits[i].author,
-                            commits[i].date);
-                }
-                strcat(line, details);
-                
-                // Add branch labels if any
-                if (strlen(commits[i].refs) > 0) {
-                    strcat(line, " [");
-                    char *ref_token = strtok(commits[i].refs, ",");
-                    while (ref_token != NULL) {
-                        while (*ref_token == ' ') ref_token++;
-                        if (strstr(ref_token, "refs/heads/") != NULL) {
-                            strcat(line, ref_token + 11);
-                        } else if (strstr(ref_token, "HEAD -> ") != NULL) {
-                            strcat(line, ref_token + 8);
-                        } else {
-                            strcat(line, ref_token);
-                        }
-                        ref_token = strtok(NULL, ",");
-                        if (ref_token != NULL) strcat(line, ", ");
-                    }
-                    strcat(line, "]");
-                }
-                
-                strcat(line, "\n");
-                
-                // Add full commit message if it exists and differs from subject
-                if (strlen(commits[i].full_message) > strlen(commits[i].subject)) {
-                    char *msg_ptr = commits[i].full_message;
-                    char *first_newline = strchr(msg_ptr, '\n');
-                    
-                    if (first_newline && *(first_newline + 1) != '\0') {
-                        // Skip the first line (subject) and any blank lines
-                        msg_ptr = first_newline + 1;
-                        while (*msg_ptr == '\n') msg_ptr++;
-                        
-                        if (*msg_ptr != '\0') {
-                            // Add indentation for the message
-                            char indent[128] = {0};
-                            if (commits[i].x_pos > 0) {
-                                strcat(indent, "    ");
-                            }
-                            for (int x = 1; x < commits[i].x_pos; x++) {
-                                if (branch_lines[x] || child_connections[x][commits[i].x_pos]) {
-                                    strcat(indent, "│   ");
-                                } else {
-                                    strcat(indent, "    ");
-                                }
-                            }
-                            strcat(indent, "    ");  // Extra indent for message
-                            
-                            // Add each line of the message with proper indentation
-                            char msg_line[1024];
-                            while (*msg_ptr) {
-                                char *newline = strchr(msg_ptr, '\n');
-                                if (newline) {
-                                    size_t len = newline - msg_ptr;
-                                    strncpy(msg_line, msg_ptr, len);
-                                    msg_line[len] = '\0';
-                                    msg_ptr = newline + 1;
-                                } else {
-                                    strcpy(msg_line, msg_ptr);
-                                    msg_ptr += strlen(msg_ptr);
-                                }
-                                
-                                if (strlen(msg_line) > 0) {
-                                    strcat(line, indent);
-                                    strcat(line, msg_line);
-                                    strcat(line, "\n");
-                                }
-                            }
-                        }
-                    }
-                }
-                
-                break;
+        else if (strncmp(argv[i], "--since=", 8) == 0 ||
+                 strncmp(argv[i], "--after=", 8) == 0) {
+            if (parse_date_option(argv[i] + 8, &range->since) != 0) {
+                goto done;
             }
         }
-        
-        // Add line to output buffer
-        if (strlen(line) > 0) {
-            strcat(output_buffer, line);
-            
-            // Add branch lines for visual connection
-            if (y < commit_count - 1) {  // Don't add after last commit
-                char connection_line[1024] = {0};
-                int has_connections = 0;
-                
-                // Add initial indentation for non-root level
-                if (commits[y+1].x_pos > 0) {
-                    strcat(connection_line, "    ");
-                }
-                
-                // Add branch lines
-                for (int x = 1; x < max_x; x++) {
-                    int is_connected = 0;
-                    for (int j = 0; j < max_x; j++) {
-                        if (child_connections[x][j] || child_connections[j][x]) {
-                            is_connected = 1;
-                            break;
-                        }
-                    }
-                    
-                    if (branch_lines[x] || is_connected) {
-                        strcat(connection_line, "│   ");
-                        has_connections = 1;
-                    } else {
-                        strcat(connection_line, "    ");
-                    }
-                }
-                
-                // Only add connection line if there are actual connections
-                if (has_connections) {
-                    strcat(output_buffer, connection_line);
-                    strcat(output_buffer, "\n");
-                }
+        else if (strncmp(argv[i], "--until=", 8) == 0 ||
+                 strncmp(argv[i], "--before=", 9) == 0) {
+            const char *date = strchr(argv[i], '=') + 1;
+            if (parse_date_option(date, &range->until) != 0) {
+                goto done;
             }
         }
-        
-        y++;
+        else if (strcmp(argv[i], "--reader=log") == 0) {
+            options.reader = READER_LOG;
+        }
+        else if (strcmp(argv[i], "--reader=native") == 0) {
+            options.reader = READER_NATIVE;
+        }
+        else if (strcmp(argv[i], "--reader=auto") == 0) {
+            options.reader = READER_AUTO;
+        }
+        else if (strcmp(argv[i], "--date-order") == 0) {
+            options.order = ORDER_DATE;
+        }
+        else if (strcmp(argv[i], "--author-date-order") == 0) {
+            options.order = ORDER_AUTHOR_DATE;
+        }
+        else if (strcmp(argv[i], "--topo-order") == 0) {
+            options.order = ORDER_TOPO;
+        }
+        else if (strcmp(argv[i], "--first-parent") == 0) {
+            range->first_parent = 1;
+        }
+        else if (strcmp(argv[i], "--collapse") == 0) {
+            options.collapse = 1;
+        }
+        else if (strcmp(argv[i], "--ahead-behind") == 0) {
+            options.ahead_behind = "HEAD";
+        }
+        else if (strncmp(argv[i], "--ahead-behind=", 15) == 0 && argv[i][15]) {
+            options.ahead_behind = argv[i] + 15;
+        }
+        else if (strcmp(argv[i], "--no-cache") == 0) {
+            options.use_cache = 0;
+        }
+        else if (strcmp(argv[i], "--export=ndjson") == 0) {
+            options.export = EXPORT_NDJSON;
+        }
+        else if (strcmp(argv[i], "--export=binary") == 0) {
+            options.export = EXPORT_BINARY;
+        }
+        else if (strcmp(argv[i], "--viewer") == 0) {
+            options.use_viewer = !serving;
+        }
+        else if (strcmp(argv[i], "--timing") == 0) {
+            show_timing = 1;
+        }
+        else {
+            print_usage();
+            goto done;
+        }
     }
     
-    // Use less with proper options for git log-like experience
-    FILE *pager = popen("less -R +G", "w");
-    if (pager) {
-        fputs(output_buffer, pager);
-        pclose(pager);
-    } else {
-        printf("%s", output_buffer);
+    // Check if repo has any commits; counting them would take as long as
+    // the history is deep
+    char *head = execute_command("git rev-parse --verify -q HEAD 2>/dev/null");
+    if (strlen(head) == 0 || strstr(head, "fatal:") != NULL) {
+        fprintf(stderr, "Error: This repository has no commits\n");
+        goto done;
     }
     
-    free(output_buffer);
-}
-
-void determine_commit_type(Commit *commit) {
-    // Check for PR
-    if (strstr(commit->subject, "Merge pull request #") != NULL) {
-        strcpy(commit->symbol, PR_SYMBOL);
-        // Extract PR number
-        sscanf(strstr(commit->subject, "#"), "#%s", commit->pr_number);
-        commit->is_pr = 1;
-    }
-    // Check for merge commit
-    else if (strstr(commit->subject, "Merge") == commit->subject) {
-        strcpy(commit->symbol, MERGE_SYMBOL);
-        commit->is_merge = 1;
+    if (store_init(&commit_store) != 0) {
+        fprintf(stderr, "Error: Out of memory\n");
+        goto done;
     }
-    // Regular commit
-    else {
-        strcpy(commit->symbol, COMMIT_SYMBOL);
-    }
-}
 
-void print_commit_line(Commit *commit, Branch *branches, int branch_count) {
-    // Print graph connection lines
-    print_graph_lines(commit, NULL);  // We don't use branches here
-    
-    // Get branch color from branch_index
-    int color_index = (branch_count > 0 && commit->branch_index < branch_count) ? 
-                     branches[commit->branch_index].color : 0;
-    
-    // Print commit symbol with color
-    printf("%s%s%s ", colors[color_index], 
-           commit->symbol, RESET_COLOR);
-           
-    // Print commit info
-    printf("%s %.7s%s %s", 
-           colors[color_index],
-           commit->hash,
-           RESET_COLOR,
-           commit->subject);
-           
-    // Print PR number if applicable
-    if (commit->is_pr) {
-        printf(" (PR #%s)", commit->pr_number);
+    profile_end(startup, PROFILE_STARTUP);
+    options.use_pager = !serving;
+    PipelineStats stats;
+    int status = run_tree_pipeline(&options, git_dir, start_ms, &stats);
+    if (serving) {
+        store_free(&commit_store);
     }
-    
-    // Print author and date
-    printf(" (%s, %s)\n", commit->author, commit->date);
-}
-
-// Add print_graph_lines implementation
-void print_graph_lines(Commit *commit, Branch *branches) {
-    (void)branches;  // Explicitly mark branches as unused
-    for (int i = 0; i < commit->x_pos; i++) {
-        printf("│ ");
+    if (status != 0) {
+        fprintf(stderr, "Error: Failed to read the object database\n");
+        goto done;
     }
-}
 
-int handle_reset_latest() {
-    // Get the latest commit hash
-    char *latest_commit = execute_command("git rev-parse HEAD");
-    if (strlen(latest_commit) == 0 || strstr(latest_commit, "fatal:") != NULL) {
-        fprintf(stderr, "Error: Failed to get latest commit\n");
-        return EXIT_FAILURE;
-    }
-    
-    // Remove newline from commit hash
-    latest_commit[strcspn(latest_commit, "\n")] = 0;
-    
-    // Create the reset command - using --soft to preserve changes
-    char reset_cmd[MAX_COMMAND_LENGTH];
-    snprintf(reset_cmd, MAX_COMMAND_LENGTH, "git reset --soft HEAD~1");
-    
-    // Execute the reset
-    char *reset_result = execute_command(reset_cmd);
-    if (strstr(reset_result, "fatal:") != NULL) {
-        fprintf(stderr, "Error: Failed to reset to previous commit\n");
-        return EXIT_FAILURE;
+    if (show_timing) {
+        fprintf(stderr, "rows: %d, first row: %.1f ms, total: %.1f ms\n",
+                stats.rows, stats.first_row_ms, stats.total_ms);
+        const TextStats *text = &stats.text;
+        if (text->fetched > 0) {
+            fprintf(stderr, "text: %d read (%.1f KB), %d cached, "
+                    "%.1f us per read, %.1f us max\n",
+                    text->fetched, text->bytes / 1024.0, text->hits,
+                    text->fetch_ms * 1000 / text->fetched,
+                    text->max_fetch_ms * 1000);
+        }
     }
-    
-    printf("Successfully unstaged commit: %s\n", latest_commit);
-    printf("Your changes have been preserved and are ready to be committed again.\n");
-    printf("You can now modify your changes and create a new commit using:\n");
-    printf("  git add .\n");
-    printf("  git commit -m \"Your new commit message\"\n");
-    return EXIT_SUCCESS;
-}
+    result = EXIT_SUCCESS;
 
-void print_usage() {
-    printf("git-shrub version %s\n", VERSION);
-    printf("Usage: git shrub [options]\n\n");
-    printf("Options:\n");
-    printf("  -reset latest         Unstage the latest commit (preserves changes)\n");
-    printf("  -stats               Show repository statistics\n");
-    printf("  -diff [commit]       Show changes in a specific commit\n");
-    printf("  -files [filename]    Show commits that modified a specific file\n");
-    printf("  -version             Show version information\n");
-    printf("  (no options)         Display the commit tree\n");
+done:
+    free(revisions);
+    return result;
 }
 
-int handle_stats() {
-    char *output;
-    char command[MAX_COMMAND_LENGTH];
-    
-    printf("\nRepository Statistics:\n");
-    printf("====================\n\n");
-    
-    // Total number of commits
-    output = execute_command("git rev-list --count HEAD");
-    printf("Total commits: %s", output);
-    
-    // Commits per author
-    printf("\nCommits per author:\n");
-    snprintf(command, MAX_COMMAND_LENGTH, 
-             "git shortlog -sn --all");
-    output = execute_command(command);
-    printf("%s", output);
-    
-    // Active days
-    printf("\nRepository activity:\n");
-    snprintf(command, MAX_COMMAND_LENGTH,
-             "git log --format=%%ad --date=short | sort -u | wc -l");
-    output = execute_command(command);
-    printf("Active days: %s", output);
-    
-    // File statistics
-    printf("\nFile statistics:\n");
-    snprintf(command, MAX_COMMAND_LENGTH,
-             "git ls-files | wc -l");
-    output = execute_command(command);
-    printf("Total files: %s", output);
-    
-    // Most modified files
-    printf("\nMost modified files:\n");
-    snprintf(command, MAX_COMMAND_LENGTH,
-             "git log --pretty=format: --name-only | grep -v '^$' | sort | uniq -c | sort -rg | head -10");
-    output = execute_command(command);
-    printf("%s", output);
-    
-    return EXIT_SUCCESS;
+static int serve_request(const char *prefix, int argc, char *argv[]) {
+    ProfileMark startup;
+    profile_begin(&startup);
+    serving = 1;
+    int status = run_command(serving_git_dir, prefix, argc, argv, elapsed_ms(0),
+                             &startup);
+    serving = 0;
+    return status;
 }
 
-int handle_diff(const char* commit_hash) {
-    char command[MAX_COMMAND_LENGTH];
-    char *output;
-    
-    // Verify commit hash exists
-    snprintf(command, MAX_COMMAND_LENGTH, "git rev-parse --verify %s", commit_hash);
-    output = execute_command(command);
-    if (strstr(output, "fatal:") != NULL) {
-        fprintf(stderr, "Error: Invalid commit hash\n");
-        return EXIT_FAILURE;
+// Commands the daemon can answer: not those that change the repository or
+// talk to the terminal, and nothing whose output is about this run
+static int daemon_answers(int argc, char *argv[]) {
+    if (argc > 1 && (strcmp(argv[1], "-reset") == 0 || strcmp(argv[1], "-diff") == 0 ||
+                     strcmp(argv[1], "-daemon") == 0)) {
+        return 0;
     }
-    
-    // Show commit info
-    snprintf(command, MAX_COMMAND_LENGTH,
-             "git show --color=always %s", commit_hash);
-    output = execute_command(command);
-    
-    // Use pager for output
-    FILE *pager = popen("less -R", "w");
-    if (pager) {
-        fputs(output, pager);
-        pclose(pager);
-    } else {
-        printf("%s", output);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--viewer") == 0 || strcmp(argv[i], "--timing") == 0 ||
+            strcmp(argv[i], "--stdin") == 0) {
+            return 0;
+        }
     }
-    
-    return EXIT_SUCCESS;
+    return 1;
 }
 
-int handle_files(const char* filename) {
-    char command[MAX_COMMAND_LENGTH];
-    char *output;
-    
-    // Show commits that modified the file
-    snprintf(command, MAX_COMMAND_LENGTH,
-             "git log --follow --pretty=format:'%%C(yellow)%%h%%Creset %%s (%%an, %%ad)' --date=iso -- %s",
-             filename);
-    output = execute_command(command);
-    
-    if (strlen(output) == 0) {
-        fprintf(stderr, "Error: No commits found for file '%s'\n", filename);
+// -daemon runs the server, -daemon stop ends it
+static int handle_daemon(const char *git_dir, const char *top, int argc,
+                         char *argv[]) {
+    if (argc == 3 && strcmp(argv[2], "stop") == 0) {
+        int fd = daemon_connect(git_dir);
+        if (fd < 0 || daemon_query(fd, "", argc - 1, argv + 1, 0) != 0) {
+            fprintf(stderr, "Error: No daemon is serving this repository\n");
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+    if (argc != 2) {
+        print_usage();
         return EXIT_FAILURE;
     }
-    
-    printf("\nCommit history for file: %s\n", filename);
-    printf("===============================\n\n");
-    printf("%s\n", output);
-    
-    return EXIT_SUCCESS;
+    serving_git_dir = git_dir;
+    return daemon_serve(git_dir, top, serve_request);
 }
 
 int main(int argc, char *argv[]) {
+    double start_ms = elapsed_ms(0);
+    ProfileMark startup;
+
+    // --profile, --threads and --no-daemon go with any command
+    int profile = 0, use_daemon = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--profile") == 0) {
+            profile = 1;
+        }
+        else if (strcmp(argv[i], "--no-daemon") == 0) {
+            use_daemon = 0;
+        }
+        else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            if (parse_count(argv[i] + 10, &pool_default_threads) != 0 ||
+                pool_default_threads == 0) {
+                fprintf(stderr, "Error: --threads needs at least 1\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else {
+            continue;
+        }
+        memmove(&argv[i], &argv[i + 1], (argc - i) * sizeof(char *));
+        argc--;
+        i--;
+    }
+    if (profile) {
+        profile_start(argc > 1 && is_command(argv[1]) ? argv[1] + 1 : "tree");
+    }
+    profile_begin(&startup);
+
     // Check if git repository
     if (argc > 1 && strcmp(argv[1], "-version") == 0) {
         printf("git-shrub version %s\n", VERSION);
         return EXIT_SUCCESS;
     }
     
-    char *git_dir = execute_command("git rev-parse --git-dir 2>/dev/null");
-    if (strlen(git_dir) == 0 || strstr(git_dir, "fatal:") != NULL) {
-        fprintf(stderr, "Error: Not a git repository\n");
-        return EXIT_FAILURE;
-    }
-    
-    // Handle command line arguments
-    if (argc > 1) {
-        if (strcmp(argv[1], "-reset") == 0) {
-            if (argc != 3 || strcmp(argv[2], "latest") != 0) {
-                print_usage();
-                return EXIT_FAILURE;
-            }
-            return handle_reset_latest();
+    // Found without running git where the layout is the usual one
+    char *top = NULL, *prefix = NULL;
+    char *git_dir = discover_git_dir(&top, &prefix);
+    if (git_dir == NULL) {
+        git_dir = execute_command("git rev-parse --git-dir 2>/dev/null");
+        if (strlen(git_dir) == 0 || strstr(git_dir, "fatal:") != NULL) {
+            fprintf(stderr, "Error: Not a git repository\n");
+            return EXIT_FAILURE;
         }
-        else if (strcmp(argv[1], "-stats") == 0) {
-            return handle_stats();
+        git_dir[strcspn(git_dir, "\n")] = '\0';
+        git_dir = strdup(git_dir);
+    }
+
+    if (argc > 1 && strcmp(argv[1], "-daemon") == 0) {
+        if (top == NULL) {
+            char *output = execute_command("git rev-parse --show-toplevel 2>/dev/null");
+            output[strcspn(output, "\n")] = '\0';
+            top = output[0] ? strdup(output) : NULL;
         }
-        else if (strcmp(argv[1], "-diff") == 0) {
-            if (argc != 3) {
-                fprintf(stderr, "Error: Please provide a commit hash\n");
-                print_usage();
-                return EXIT_FAILURE;
+        return handle_daemon(git_dir, top, argc, argv);
+    }
+
+    // A running daemon answers from memory; a profile is about this process
+    if (use_daemon && !profile && prefix && daemon_answers(argc, argv)) {
+        int fd = daemon_connect(git_dir);
+        if (fd >= 0) {
+            int page = argc == 1 || !is_command(argv[1]);
+            for (int i = 1; i < argc && page; i++) {
+                page = strncmp(argv[i], "--export=", 9) != 0;
             }
-            return handle_diff(argv[2]);
-        }
-        else if (strcmp(argv[1], "-files") == 0) {
-            if (argc != 3) {
-                fprintf(stderr, "Error: Please provide a filename\n");
-                print_usage();
-                return EXIT_FAILURE;
+            int status = daemon_query(fd, prefix, argc - 1, argv + 1, page);
+            if (status >= 0) {
+                return status;
             }
-            return handle_files(argv[2]);
-        }
-        else {
-            print_usage();
-            return EXIT_FAILURE;
         }
     }
-    
-    // Check if repo has any commits
-    char *commit_count_str = execute_command("git rev-list --count HEAD 2>/dev/null");
-    if (strlen(commit_count_str) == 0 || strstr(commit_count_str, "fatal:") != NULL || atoi(commit_count_str) == 0) {
-        fprintf(stderr, "Error: This repository has no commits\n");
-        return EXIT_FAILURE;
-    }
-    
-    parse_git_log();
-    
-    if (commit_count > 0) {
-        assign_branch_positions();
-        assign_commit_positions();
-        print_commit_tree();
-    }
-    
-    return EXIT_SUCCESS;
+
+    return run_command(git_dir, prefix, argc, argv, start_ms, &startup);
 }
@@ -0,0 +1,239 @@
+#ifndef SHRUB_H
+#define SHRUB_H
+
+#include <time.h>
+
+#include "odb.h"
+#include "refs.h"
+#include "store.h"
+
+#define VERSION "0.0.1"
+#define MAX_COMMAND_LENGTH 1024
+#define MAX_LINE_LENGTH 4096
+#define DATE_LENGTH 30
+#define DEBUG 0
+
+#define COMMIT_SYMBOL "●"
+#define MERGE_SYMBOL "◆"
+#define PR_SYMBOL    "◉"
+#define CHAIN_SYMBOL "◎"
+
+#define GIT_LOG_OPTIONS \
+    " --graph --date=iso" \
+    " --pretty=format:\"COMMIT_SEP%H|%h|%s|%an|%ad|%ct|%P|%D\"" \
+    " --date-order --color=always"
+#define GIT_LOG_COMMAND "git log --all" GIT_LOG_OPTIONS
+
+#define COLOR_COUNT 12
+#define RESET_COLOR "\033[0m"
+
+// Line segments leaving the middle of a graph cell
+#define LINE_UP     0x01
+#define LINE_DOWN   0x02
+#define LINE_LEFT   0x04
+#define LINE_RIGHT  0x08
+#define CELL_COMMIT 0x10
+
+typedef struct {
+    unsigned char mask;     // LINE_* bits, or CELL_COMMIT
+    unsigned char color;
+} Cell;
+
+// One laid-out row of the tree view
+typedef struct {
+    int commit;             // index into the commit store
+    int color;              // the commit's lane color
+    int width;              // cells per line
+    int has_connector;      // the connector line bends, so draw it
+    Cell *cells;            // commit line, then the connector line below it
+    int *parent_lanes;      // lane each parent is waited for in
+    int chain;              // commits the row stands for; more than 1 for
+                            // a collapsed chain, whose last commit's
+                            // parents the lanes lead to
+    int expanded;           // a chain drawn commit by commit
+} Row;
+
+// Commit text read for the rows drawn
+typedef struct {
+    int fetched;            // objects read
+    int hits;               // rows whose text was still cached
+    size_t bytes;           // bytes read from packs, loose objects or git
+    double fetch_ms;        // total time spent reading
+    double max_fetch_ms;
+} TextStats;
+
+// Tree view timings, measured from process start
+typedef struct {
+    int rows;
+    double first_row_ms;
+    double total_ms;
+    TextStats text;
+} PipelineStats;
+
+// Where the commit records for the tree view come from
+typedef enum {
+    READER_AUTO,    // native reader, falling back to git log
+    READER_LOG,     // scrape `git log --graph` output
+    READER_NATIVE   // read .git/objects directly
+} ReaderMode;
+
+// Display order of the commit tree
+typedef enum {
+    ORDER_DATE,         // the default, --date-order: children first, then
+                        // commit date
+    ORDER_AUTHOR_DATE,  // --author-date-order: children first, then author date
+    ORDER_TOPO          // --topo-order: children first, one line at a time
+} SortOrder;
+
+// Machine-readable output instead of the drawn tree (see export.h)
+typedef enum {
+    EXPORT_NONE,
+    EXPORT_NDJSON,      // one JSON object per line
+    EXPORT_BINARY       // length-prefixed records
+} ExportFormat;
+
+// Which commits the tree view shows, as in git log's arguments
+typedef struct {
+    const char *const *revisions;   // "main", "^old", "from..to"; none is --all
+    int revision_count;
+    int max_count;          // -n, or -1 for all
+    time_t since;           // --since, or 0
+    time_t until;           // --until, or 0
+    int first_parent;       // --first-parent: follow merges to their first
+                            // parent only
+} RevisionRange;
+
+// Options of the tree view
+typedef struct {
+    ReaderMode reader;
+    SortOrder order;
+    int use_cache;          // read and update .git/shrub-cache
+    int use_viewer;         // built-in viewer instead of less
+    int use_pager;          // less, or stdout as when it is not a terminal
+    int collapse;           // one row per linear chain of commits
+    const char *ahead_behind;   // label local branches with their counts
+                                // against this revision, or NULL
+    ExportFormat export;    // records on stdout instead of the pager
+    RevisionRange range;
+} TreeOptions;
+
+extern CommitStore commit_store;
+extern const char* colors[];
+
+// log.c
+char* execute_command(const char* command);
+int parse_log_record(char *line, CommitStore *store);
+void parse_git_log(CommitStore *store);
+// GIT_LOG_COMMAND for part of the history; -n is left out unless asked
+// for. Returns a malloc'd string.
+char *git_log_command(const RevisionRange *range, int with_max_count);
+void detect_pull_request(Commit *commit, const char *subject);
+void determine_commit_type(Commit *commit);
+// A --since or --until date in the forms git takes; -1 if git cannot
+// parse it either
+int parse_date_arg(const char *arg, time_t *when);
+
+// A commit object as read from the object database. A lazy walk leaves
+// data NULL for commits the commit-graph file describes.
+typedef struct {
+    unsigned char oid[OID_RAWSZ];
+    unsigned char *data;
+    size_t size;
+    uint32_t cache_pos;     // position in the history cache if data is NULL
+    uint32_t graph_pos;     // otherwise, position in the commit graph
+    uint32_t generation;    // topological level, 0 if unknown
+    // What the walk still had queued when it produced this commit: the
+    // highest generation (0 if nothing, UINT32_MAX if one is unknown) and
+    // the newest commit date. Whatever it produces later descends from
+    // those, which is how --date-order knows a commit's children are in.
+    uint32_t pending_generation;
+    time_t pending_time;
+} RawCommit;
+
+// Leave subject, author and message of the commits the commit graph or
+// the cache describe for commit_text_fill(). Without it, the walk still
+// orders them from the graph and the cache, and reads their text on a
+// pool of threads.
+#define WALK_LAZY_TEXT 0x01
+// Also take parents and dates from .git/shrub-cache, and rewrite it after
+// a complete walk
+#define WALK_CACHE     0x02
+
+typedef struct CommitWalk CommitWalk;
+typedef struct CommitText CommitText;
+struct StrBuf;
+
+// walk.c
+CommitWalk *walk_open(const char *git_dir, int flags);
+// A walk of part of the history; prints an error for unknown revisions
+CommitWalk *walk_open_range(const char *git_dir, int flags,
+                            const RevisionRange *range);
+int walk_next(CommitWalk *walk, RawCommit *raw);
+int walk_fill_commit(CommitWalk *walk, const RawCommit *raw,
+                     CommitStore *store);
+void walk_close(CommitWalk *walk);
+int load_commits_native(const char *git_dir, CommitStore *store);
+// Ref tips of the walk, by commit id
+const RefTip *walk_ref_tips(const CommitWalk *walk, int *count);
+// The commit a revision names; -1 if git does not know it either
+int walk_resolve(CommitWalk *walk, const char *name, unsigned char *oid);
+CommitText *commit_text_open(const char *git_dir, ReaderMode mode);
+int commit_text_fill(CommitText *text, Commit *commit);
+void commit_text_stats(const CommitText *text, TextStats *stats);
+void commit_text_close(CommitText *text);
+const char *find_header(const char *data, const char *name);
+void parse_ident(const char *ident, struct StrBuf *name, time_t *when, int *tz);
+
+// graph.c
+void layout_reset();
+// Lanes starting at this commit take the branch's color; the first branch
+// added for a commit wins
+int layout_add_branch(const unsigned char *oid, const char *name);
+int layout_commit(int index, Row *row);
+// Place a chain of `length` commits, starting at `index` and following
+// first parents, as one row
+int layout_chain(int index, int length, Row *row);
+// --ahead-behind: show a branch's decoration as "name +ahead/-behind"
+int render_add_ahead_behind(const unsigned char *oid, const char *name,
+                            int ahead, int behind);
+void render_row(const Row *row, CommitText *text, struct StrBuf *out);
+void row_free(Row *row);
+
+// order.c
+int sort_commits(const CommitStore *store, SortOrder order, int *permutation);
+
+// --date-order as the walk reads the history: the same order as
+// sort_commits(), each commit let through as soon as that is certain
+typedef struct DateStream DateStream;
+DateStream *date_stream_open(const CommitStore *store);
+void date_stream_close(DateStream *stream);
+// Take the next commit read, with what the walk had queued then (see
+// RawCommit). Returns -1 when out of memory.
+int date_stream_add(DateStream *stream, int index, uint32_t pending_generation,
+                    time_t pending_time);
+// Nothing more will be read
+int date_stream_finish(DateStream *stream);
+// The next commit to show, -1 if it is not certain yet, -2 when out of
+// memory
+int date_stream_next(DateStream *stream);
+// Chain length of every commit for --collapse; parents must have been
+// resolved. Returns -1 when out of memory.
+int find_chains(const CommitStore *store, int *chain);
+
+// pipeline.c
+double elapsed_ms(double since_ms);
+int run_tree_pipeline(const TreeOptions *options, const char *git_dir,
+                      double start_ms, PipelineStats *stats);
+
+// commands.c
+void print_usage();
+int handle_reset_latest();
+int handle_stats(const char *git_dir, int json);
+int handle_diff(const char *git_dir, const char* commit_hash);
+int handle_files(const char *git_dir, const char *prefix, const char *filename);
+int handle_files_batch(const char *git_dir, const char *prefix, int argc,
+                       char *argv[]);
+// Every local branch ahead of and behind `base`, and whether it is merged
+int handle_branches(const char *git_dir, const char *base, int json);
+
+#endif
@@ -0,0 +1,708 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shrub.h"
+#include "pool.h"
+#include "profile.h"
+#include "stats.h"
+#include "strbuf.h"
+#include "treediff.h"
+
+#define STATS_BATCH 64          // commits a thread takes at a time
+#define COUNT_INITIAL_SIZE 1024
+
+// String -> count map, one per thread and counter
+typedef struct {
+    char *key;
+    uint32_t hash;
+    int count;
+} CountEntry;
+
+typedef struct {
+    CountEntry *slots;
+    size_t mask;
+    size_t count;
+} CountMap;
+
+typedef struct StatsEngine StatsEngine;
+
+typedef struct {
+    CountMap authors;
+    PathTable paths;
+    uint32_t *file_counts;      // commits changing each path, by path id
+    uint32_t *dir_counts;       // commits changing anything below it
+    uint32_t count_capacity;
+    int64_t *days;              // author day of each commit from HEAD
+    int day_count;
+    int day_capacity;
+    StrBuf scratch;
+    int failed;                 // an object could not be read
+} StatsWorker;
+
+struct StatsEngine {
+    const CommitStore *store;
+    Odb *odb;                   // shared by the threads, delta bases too
+    Pool *pool;
+    unsigned char *from_head;   // per commit: reachable from HEAD
+    unsigned char (*trees)[OID_RAWSZ];
+    StatsWorker workers[POOL_MAX_THREADS];
+    int threads;
+};
+
+static uint32_t hash_string(const char *s, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)s[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static int count_init(CountMap *map) {
+    map->slots = calloc(COUNT_INITIAL_SIZE, sizeof(CountEntry));
+    map->mask = COUNT_INITIAL_SIZE - 1;
+    map->count = 0;
+    return map->slots ? 0 : -1;
+}
+
+static void count_free(CountMap *map) {
+    if (map->slots) {
+        for (size_t i = 0; i <= map->mask; i++) {
+            free(map->slots[i].key);
+        }
+    }
+    free(map->slots);
+    map->slots = NULL;
+}
+
+static CountEntry *count_slot(CountEntry *slots, size_t mask, uint32_t hash,
+                              const char *key, size_t len) {
+    size_t i = hash & mask;
+    while (slots[i].key &&
+           (slots[i].hash != hash || strncmp(slots[i].key, key, len) != 0 ||
+            slots[i].key[len] != '\0')) {
+        i = (i + 1) & mask;
+    }
+    return &slots[i];
+}
+
+static int count_grow(CountMap *map) {
+    size_t size = (map->mask + 1) * 2;
+    CountEntry *slots = calloc(size, sizeof(CountEntry));
+    if (slots == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i <= map->mask; i++) {
+        CountEntry *old = &map->slots[i];
+        if (old->key) {
+            size_t j = old->hash & (size - 1);
+            while (slots[j].key) {
+                j = (j + 1) & (size - 1);
+            }
+            slots[j] = *old;
+        }
+    }
+    free(map->slots);
+    map->slots = slots;
+    map->mask = size - 1;
+    return 0;
+}
+
+// Add n to the count of a key; returns -1 when out of memory
+static int count_add(CountMap *map, const char *key, size_t len, int n) {
+    if ((map->count + 1) * 4 > (map->mask + 1) * 3 && count_grow(map) != 0) {
+        return -1;
+    }
+    uint32_t hash = hash_string(key, len);
+    CountEntry *entry = count_slot(map->slots, map->mask, hash, key, len);
+    if (entry->key == NULL) {
+        entry->key = strndup(key, len);
+        if (entry->key == NULL) {
+            return -1;
+        }
+        entry->hash = hash;
+        map->count++;
+    }
+    entry->count += n;
+    return 0;
+}
+
+// Move every entry of a thread's map into the merged one
+static int count_merge(CountMap *into, CountMap *from) {
+    for (size_t i = 0; i <= from->mask; i++) {
+        CountEntry *entry = &from->slots[i];
+        if (entry->key && count_add(into, entry->key, strlen(entry->key),
+                                    entry->count) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int by_count_then_name(const void *a, const void *b) {
+    const StatsCount *x = a, *y = b;
+    if (x->count != y->count) {
+        return x->count > y->count ? -1 : 1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+// Hand the keys over to a sorted array
+static StatsCount *count_sorted(CountMap *map, int *count_out) {
+    StatsCount *counts = malloc((map->count ? map->count : 1) * sizeof(StatsCount));
+    if (counts == NULL) {
+        return NULL;
+    }
+    int count = 0;
+    for (size_t i = 0; i <= map->mask; i++) {
+        if (map->slots[i].key) {
+            counts[count].name = map->slots[i].key;
+            counts[count].count = map->slots[i].count;
+            map->slots[i].key = NULL;
+            count++;
+        }
+    }
+    qsort(counts, count, sizeof(StatsCount), by_count_then_name);
+    *count_out = count;
+    return counts;
+}
+
+// Tree of a commit outside the walk, e.g. behind a replaced parent
+static int commit_tree(Odb *odb, const unsigned char *oid, unsigned char *tree) {
+    unsigned char *data;
+    size_t size;
+    ObjectType type;
+    if (odb_read(odb, oid, &type, &data, &size) != 0) {
+        return -1;
+    }
+    const char *hex = type == OBJ_COMMIT ? find_header((char *)data, "tree ") : NULL;
+    int ok = hex && hex_to_oid(hex, tree) == 0;
+    free(data);
+    return ok ? 0 : -1;
+}
+
+static int add_day(StatsWorker *worker, int64_t day) {
+    if (worker->day_count == worker->day_capacity) {
+        int capacity = worker->day_capacity ? worker->day_capacity * 2 : 1024;
+        int64_t *grown = realloc(worker->days, capacity * sizeof(int64_t));
+        if (grown == NULL) {
+            return -1;
+        }
+        worker->days = grown;
+        worker->day_capacity = capacity;
+    }
+    worker->days[worker->day_count++] = day;
+    return 0;
+}
+
+// First pass: author and day of every commit, and its tree for the second
+static void read_commits(void *ctx, int thread, int start, int end) {
+    StatsEngine *engine = ctx;
+    StatsWorker *worker = &engine->workers[thread];
+    for (int i = start; i < end && !worker->failed; i++) {
+        unsigned char *data;
+        size_t size;
+        ObjectType type;
+        if (odb_read(engine->odb, store_oid(engine->store, i), &type,
+                     &data, &size) != 0) {
+            worker->failed = 1;
+            break;
+        }
+        const char *tree = type == OBJ_COMMIT
+                           ? find_header((char *)data, "tree ") : NULL;
+        if (tree == NULL || hex_to_oid(tree, engine->trees[i]) != 0) {
+            free(data);
+            worker->failed = 1;
+            break;
+        }
+
+        const char *ident = find_header((char *)data, "author ");
+        time_t when = 0;
+        int tz = 0;
+        sb_reset(&worker->scratch);
+        if (ident) {
+            parse_ident(ident, &worker->scratch, &when, &tz);
+        }
+        const char *name = worker->scratch.data ? worker->scratch.data : "";
+        if (count_add(&worker->authors, name, strlen(name), 1) != 0) {
+            worker->failed = 1;
+        }
+        // --date=short prints the date in the author's zone
+        if (engine->from_head[i]) {
+            int64_t local = (int64_t)when + tz * 60;
+            int64_t day = local >= 0 ? local / 86400 : (local - 86399) / 86400;
+            if (add_day(worker, day) != 0) {
+                worker->failed = 1;
+            }
+        }
+        free(data);
+    }
+}
+
+// Make room for counts up to the table's newest path id
+static int reserve_counts(StatsWorker *worker, uint32_t count) {
+    if (count <= worker->count_capacity) {
+        return 0;
+    }
+    uint32_t capacity = worker->count_capacity ? worker->count_capacity : 1024;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    uint32_t *files = realloc(worker->file_counts, capacity * sizeof(uint32_t));
+    if (files == NULL) {
+        return -1;
+    }
+    worker->file_counts = files;
+    uint32_t *dirs = realloc(worker->dir_counts, capacity * sizeof(uint32_t));
+    if (dirs == NULL) {
+        return -1;
+    }
+    worker->dir_counts = dirs;
+    memset(files + worker->count_capacity, 0,
+           (capacity - worker->count_capacity) * sizeof(uint32_t));
+    memset(dirs + worker->count_capacity, 0,
+           (capacity - worker->count_capacity) * sizeof(uint32_t));
+    worker->count_capacity = capacity;
+    return 0;
+}
+
+static void count_change(void *ctx, uint32_t path, int is_dir) {
+    StatsWorker *worker = ctx;
+    if (reserve_counts(worker, path + 1) != 0) {
+        worker->failed = 1;
+        return;
+    }
+    if (is_dir) {
+        worker->dir_counts[path]++;
+    } else {
+        worker->file_counts[path]++;
+    }
+}
+
+// Second pass: files changed by every non-merge commit from HEAD
+static void diff_commits(void *ctx, int thread, int start, int end) {
+    StatsEngine *engine = ctx;
+    StatsWorker *worker = &engine->workers[thread];
+    const CommitStore *store = engine->store;
+    TreeDiff diff = { engine->odb, &worker->paths, count_change, worker, NULL };
+    for (int i = start; i < end && !worker->failed; i++) {
+        int parents = store_parent_count(store, i);
+        if (!engine->from_head[i] || parents > 1) {
+            continue;
+        }
+        unsigned char parent_tree[OID_RAWSZ];
+        const unsigned char *old_tree = NULL;
+        if (parents == 1) {
+            int parent = store_parent_index(store, i)[0];
+            if (parent >= 0) {
+                old_tree = engine->trees[parent];
+            } else if (commit_tree(engine->odb, store_parent_oid(store, i, 0),
+                                   parent_tree) == 0) {
+                old_tree = parent_tree;
+            } else {
+                worker->failed = 1;
+                break;
+            }
+        }
+        if (tree_diff(&diff, old_tree, engine->trees[i]) != 0) {
+            worker->failed = 1;
+        }
+    }
+}
+
+// Move a thread's path counts into the first thread's table. Ids are
+// handed out to a directory before anything in it, so each path's
+// directory is already mapped when the path is reached.
+static int merge_paths(StatsWorker *into, StatsWorker *from) {
+    PathTable *paths = &from->paths;
+    uint32_t *map = malloc(paths->count * sizeof(uint32_t));
+    if (map == NULL) {
+        return -1;
+    }
+    map[PATH_ROOT] = PATH_ROOT;
+    for (uint32_t id = 1; id < paths->count; id++) {
+        int mapped = path_intern(&into->paths, map[paths->parent[id]],
+                                 paths->names + paths->name_offset[id],
+                                 paths->name_len[id]);
+        if (mapped < 0 || reserve_counts(into, mapped + 1) != 0) {
+            free(map);
+            return -1;
+        }
+        map[id] = mapped;
+        if (id < from->count_capacity) {
+            into->file_counts[mapped] += from->file_counts[id];
+            into->dir_counts[mapped] += from->dir_counts[id];
+        }
+    }
+    free(map);
+    return 0;
+}
+
+// Ranked above: more commits, then `sort -rg` order (the path, reversed)
+static int ranks_above(const PathTable *paths, const uint32_t *counts,
+                       int is_dir, uint32_t a, uint32_t b) {
+    if (counts[a] != counts[b]) {
+        return counts[a] > counts[b];
+    }
+    return path_compare(paths, a, b, is_dir) > 0;
+}
+
+// The `limit` paths with the highest counts, through a min-heap of the
+// best seen so far instead of sorting every path
+static StatsCount *top_paths(const StatsWorker *worker, const uint32_t *counts,
+                             int is_dir, int limit, int *count_out) {
+    const PathTable *paths = &worker->paths;
+    uint32_t *heap = malloc(limit * sizeof(uint32_t));
+    StatsCount *top = malloc(limit * sizeof(StatsCount));
+    if (heap == NULL || top == NULL) {
+        free(heap);
+        free(top);
+        return NULL;
+    }
+
+    int size = 0;
+    uint32_t end = paths->count < worker->count_capacity
+                   ? paths->count : worker->count_capacity;
+    for (uint32_t id = 1; id < end; id++) {
+        if (counts[id] == 0) {
+            continue;
+        }
+        int i;
+        if (size < limit) {
+            i = size++;
+            // Sift up: the lowest ranked path stays on top
+            while (i > 0 && ranks_above(paths, counts, is_dir, heap[(i - 1) / 2], id)) {
+                heap[i] = heap[(i - 1) / 2];
+                i = (i - 1) / 2;
+            }
+            heap[i] = id;
+            continue;
+        }
+        if (!ranks_above(paths, counts, is_dir, id, heap[0])) {
+            continue;
+        }
+        i = 0;
+        while (1) {
+            int child = 2 * i + 1;
+            if (child >= size) {
+                break;
+            }
+            if (child + 1 < size &&
+                ranks_above(paths, counts, is_dir, heap[child], heap[child + 1])) {
+                child++;
+            }
+            if (ranks_above(paths, counts, is_dir, heap[child], id)) {
+                break;
+            }
+            heap[i] = heap[child];
+            i = child;
+        }
+        heap[i] = id;
+    }
+
+    // Pop from the lowest ranked up, filling the list from the back
+    int count = size;
+    while (size > 0) {
+        uint32_t id = heap[0];
+        uint32_t last = heap[--size];
+        int i = 0;
+        while (1) {
+            int child = 2 * i + 1;
+            if (child >= size) {
+                break;
+            }
+            if (child + 1 < size &&
+                ranks_above(paths, counts, is_dir, heap[child], heap[child + 1])) {
+                child++;
+            }
+            if (ranks_above(paths, counts, is_dir, heap[child], last)) {
+                break;
+            }
+            heap[i] = heap[child];
+            i = child;
+        }
+        heap[i] = last;
+
+        StrBuf name;
+        sb_init(&name);
+        path_format(paths, id, is_dir, &name);
+        top[size].name = name.data ? name.data : strdup("");
+        top[size].count = counts[id];
+    }
+    free(heap);
+    *count_out = count;
+    return top;
+}
+
+static int run_pass(StatsEngine *engine, PoolTask pass) {
+    pool_run(engine->pool, engine->store->count, STATS_BATCH, pass, engine,
+             PROFILE_STATS_WORKERS);
+    for (int t = 0; t < engine->threads; t++) {
+        if (engine->workers[t].failed) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Every commit from every ref, with parents resolved
+static int walk_history(const char *git_dir, CommitStore *store) {
+    CommitWalk *walk = walk_open(git_dir, WALK_LAZY_TEXT | WALK_CACHE);
+    if (walk == NULL) {
+        return -1;
+    }
+    RawCommit raw;
+    int status = 0;
+    while (walk_next(walk, &raw)) {
+        int index = walk_fill_commit(walk, &raw, store);
+        free(raw.data);
+        if (index < 0) {
+            status = -1;
+            break;
+        }
+    }
+    walk_close(walk);
+    return status == 0 ? store_resolve_parents(store) : -1;
+}
+
+// Mark the commits reachable from HEAD; returns how many there are
+static int mark_from_head(const CommitStore *store, unsigned char *from_head) {
+    char *head = execute_command("git rev-parse --verify -q HEAD 2>/dev/null");
+    unsigned char oid[OID_RAWSZ];
+    int start;
+    if (hex_to_oid(head, oid) != 0 || (start = store_find(store, oid)) < 0) {
+        return 0;
+    }
+
+    int *stack = malloc(store->count * sizeof(int));
+    if (stack == NULL) {
+        return -1;
+    }
+    int depth = 0, count = 0;
+    stack[depth++] = start;
+    from_head[start] = 1;
+    while (depth > 0) {
+        int index = stack[--depth];
+        count++;
+        int parents = store_parent_count(store, index);
+        int *parent_index = store_parent_index(store, index);
+        for (int p = 0; p < parents; p++) {
+            int parent = parent_index[p];
+            if (parent >= 0 && !from_head[parent]) {
+                from_head[parent] = 1;
+                stack[depth++] = parent;
+            }
+        }
+    }
+    free(stack);
+    return count;
+}
+
+// Entries in the index, read from its header. A split index keeps part of
+// them in a shared file, so ask git instead.
+static int count_index_entries(const char *git_dir) {
+    int split = 0;
+    DIR *dir = opendir(git_dir);
+    if (dir) {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (strncmp(entry->d_name, "sharedindex.", 12) == 0) {
+                split = 1;
+                break;
+            }
+        }
+        closedir(dir);
+    }
+    if (split) {
+        return atoi(execute_command("git ls-files | wc -l"));
+    }
+
+    char path[MAX_COMMAND_LENGTH];
+    snprintf(path, sizeof(path), "%s/index", git_dir);
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return 0;   // nothing staged yet
+    }
+    unsigned char header[12];
+    size_t n = fread(header, 1, sizeof(header), fp);
+    fclose(fp);
+    if (n != sizeof(header) || memcmp(header, "DIRC", 4) != 0) {
+        return -1;
+    }
+    return (int)((uint32_t)header[8] << 24 | (uint32_t)header[9] << 16 |
+                 (uint32_t)header[10] << 8 | header[11]);
+}
+
+static int compare_days(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Distinct days over every thread's list
+static int count_days(StatsEngine *engine) {
+    size_t total = 0;
+    for (int t = 0; t < engine->threads; t++) {
+        total += engine->workers[t].day_count;
+    }
+    int64_t *days = malloc((total ? total : 1) * sizeof(int64_t));
+    if (days == NULL) {
+        return -1;
+    }
+    size_t n = 0;
+    for (int t = 0; t < engine->threads; t++) {
+        // A worker that saw no commits has no list at all
+        if (engine->workers[t].day_count == 0) {
+            continue;
+        }
+        memcpy(days + n, engine->workers[t].days,
+               engine->workers[t].day_count * sizeof(int64_t));
+        n += engine->workers[t].day_count;
+    }
+
+    qsort(days, n, sizeof(int64_t), compare_days);
+    int distinct = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (i == 0 || days[i] != days[i - 1]) {
+            distinct++;
+        }
+    }
+    free(days);
+    return distinct;
+}
+
+static int stats_threads(int requested, int commits) {
+    if (requested > 0) {
+        return requested < POOL_MAX_THREADS ? requested : POOL_MAX_THREADS;
+    }
+    long cpus = pool_default_threads > 0 ? pool_default_threads
+                                         : sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus > 0 ? (int)cpus : 1;
+    if (threads > POOL_MAX_THREADS) {
+        threads = POOL_MAX_THREADS;
+    }
+    // Not worth a thread per handful of commits
+    int useful = commits / (STATS_BATCH * 4) + 1;
+    return threads < useful ? threads : useful;
+}
+
+static void engine_free(StatsEngine *engine) {
+    for (int t = 0; t < engine->threads; t++) {
+        StatsWorker *worker = &engine->workers[t];
+        count_free(&worker->authors);
+        path_table_free(&worker->paths);
+        free(worker->file_counts);
+        free(worker->dir_counts);
+        free(worker->days);
+        sb_free(&worker->scratch);
+    }
+    pool_close(engine->pool);
+    odb_close(engine->odb);
+    free(engine->from_head);
+    free(engine->trees);
+}
+
+static int collect(const char *git_dir, int threads, StatsEngine *engine,
+                   RepoStats *stats) {
+    const CommitStore *store = engine->store;
+    int count = store->count;
+
+    engine->from_head = calloc(count ? count : 1, 1);
+    engine->trees = malloc((count ? count : 1) * OID_RAWSZ);
+    if (engine->from_head == NULL || engine->trees == NULL) {
+        return -1;
+    }
+    stats->total_commits = mark_from_head(store, engine->from_head);
+    if (stats->total_commits < 0) {
+        return -1;
+    }
+
+    engine->odb = odb_open(git_dir);
+    engine->pool = pool_open(stats_threads(threads, count));
+    if (engine->odb == NULL || engine->pool == NULL) {
+        return -1;
+    }
+    engine->threads = pool_threads(engine->pool);
+    for (int t = 0; t < engine->threads; t++) {
+        StatsWorker *worker = &engine->workers[t];
+        sb_init(&worker->scratch);
+        if (count_init(&worker->authors) != 0 ||
+            path_table_init(&worker->paths) != 0) {
+            engine->threads = t + 1;
+            return -1;
+        }
+    }
+    stats->threads = engine->threads;
+
+    if (run_pass(engine, read_commits) != 0 ||
+        run_pass(engine, diff_commits) != 0) {
+        return -1;
+    }
+
+    // Merge the threads' counters into the first thread's
+    StatsWorker *first = &engine->workers[0];
+    for (int t = 1; t < engine->threads; t++) {
+        if (count_merge(&first->authors, &engine->workers[t].authors) != 0 ||
+            merge_paths(first, &engine->workers[t]) != 0) {
+            return -1;
+        }
+    }
+    stats->active_days = count_days(engine);
+    stats->authors = count_sorted(&first->authors, &stats->author_count);
+    stats->paths = top_paths(first, first->file_counts, 0, STATS_TOP_PATHS,
+                             &stats->path_count);
+    stats->dirs = top_paths(first, first->dir_counts, 1, STATS_TOP_PATHS,
+                            &stats->dir_count);
+    if (stats->active_days < 0 || stats->authors == NULL ||
+        stats->paths == NULL || stats->dirs == NULL) {
+        return -1;
+    }
+    stats->total_files = count_index_entries(git_dir);
+    return 0;
+}
+
+int stats_collect(const char *git_dir, int threads, RepoStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+
+    CommitStore store;
+    if (store_init(&store) != 0) {
+        return -1;
+    }
+    if (walk_history(git_dir, &store) != 0) {
+        store_free(&store);
+        return -1;
+    }
+
+    StatsEngine *engine = calloc(1, sizeof(StatsEngine));
+    int status = -1;
+    if (engine) {
+        engine->store = &store;
+        status = collect(git_dir, threads, engine, stats);
+        engine_free(engine);
+        free(engine);
+    }
+    store_free(&store);
+    if (status != 0) {
+        stats_free(stats);
+    }
+    return status;
+}
+
+void stats_free(RepoStats *stats) {
+    for (int i = 0; i < stats->author_count; i++) {
+        free(stats->authors[i].name);
+    }
+    for (int i = 0; i < stats->path_count; i++) {
+        free(stats->paths[i].name);
+    }
+    for (int i = 0; i < stats->dir_count; i++) {
+        free(stats->dirs[i].name);
+    }
+    free(stats->authors);
+    free(stats->paths);
+    free(stats->dirs);
+    memset(stats, 0, sizeof(*stats));
+}
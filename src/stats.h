@@ -0,0 +1,37 @@
+#ifndef SHRUB_STATS_H
+#define SHRUB_STATS_H
+
+// Repository statistics from one walk of the history. The walk only
+// collects commit ids and parents; reading the commits and diffing their
+// trees is split across a work-stealing pool of threads. They share one
+// object database, and with it the delta bases any of them inflated, but
+// each keeps its own author, day and path counters, which are merged
+// once every thread is done. Paths are counted by interned id, so memory
+// grows with the number of distinct paths, not with the history.
+
+#define STATS_TOP_PATHS 10
+
+typedef struct {
+    char *name;             // author name or path
+    int count;
+} StatsCount;
+
+typedef struct {
+    int total_commits;      // reachable from HEAD
+    StatsCount *authors;    // commits from every ref, most first
+    int author_count;
+    int active_days;        // distinct author dates reachable from HEAD
+    int total_files;        // entries in the index, -1 if unknown
+    StatsCount *paths;      // most modified files, at most STATS_TOP_PATHS
+    int path_count;
+    StatsCount *dirs;       // directories with the most commits below them
+    int dir_count;
+    int threads;
+} RepoStats;
+
+// Collect the statistics of a repository on `threads` threads, 0 for one
+// per core; returns -1 if its objects cannot be read natively
+int stats_collect(const char *git_dir, int threads, RepoStats *stats);
+void stats_free(RepoStats *stats);
+
+#endif
@@ -0,0 +1,288 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "store.h"
+
+#define ARENA_BLOCK_SIZE (256 * 1024)
+
+struct ArenaBlock {
+    ArenaBlock *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+int store_init(CommitStore *store) {
+    memset(store, 0, sizeof(*store));
+    store->chunks = calloc(STORE_MAX_CHUNKS, sizeof(CommitChunk *));
+    store->author_mask = 255;
+    store->authors = calloc(store->author_mask + 1, sizeof(const char *));
+    if (store->chunks == NULL || store->authors == NULL ||
+        oidmap_init(&store->index, 1024) != 0) {
+        store_free(store);
+        return -1;
+    }
+    return 0;
+}
+
+void store_free(CommitStore *store) {
+    if (store->chunks) {
+        for (int i = 0; i < STORE_MAX_CHUNKS && store->chunks[i]; i++) {
+            free(store->chunks[i]);
+        }
+    }
+    free(store->chunks);
+    while (store->arena) {
+        ArenaBlock *next = store->arena->next;
+        free(store->arena);
+        store->arena = next;
+    }
+    free(store->authors);
+    oidmap_free(&store->index);
+    memset(store, 0, sizeof(*store));
+}
+
+// Bump-allocate from the newest arena block; big requests get their own
+static void *arena_alloc(CommitStore *store, size_t size, size_t align) {
+    ArenaBlock *block = store->arena;
+    if (block) {
+        block->used = (block->used + align - 1) & ~(align - 1);
+    }
+    if (block == NULL || block->used > block->size ||
+        block->size - block->used < size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE / 4 ? size : ARENA_BLOCK_SIZE;
+        ArenaBlock *fresh = malloc(sizeof(ArenaBlock) + block_size);
+        if (fresh == NULL) {
+            return NULL;
+        }
+        fresh->used = 0;
+        fresh->size = block_size;
+        if (block && block_size == size) {
+            // Keep filling the current block after a one-off
+            fresh->next = block->next;
+            block->next = fresh;
+        } else {
+            fresh->next = block;
+            store->arena = fresh;
+        }
+        block = fresh;
+    }
+
+    void *p = block->data + block->used;
+    block->used += size;
+    store->arena_bytes += size;
+    return p;
+}
+
+static const char *arena_strdup(CommitStore *store, const char *s) {
+    if (s == NULL || *s == '\0') {
+        return "";
+    }
+    size_t len = strlen(s) + 1;
+    char *copy = arena_alloc(store, len, 1);
+    if (copy) {
+        memcpy(copy, s, len);
+    }
+    return copy;
+}
+
+static size_t hash_string(const char *s) {
+    uint64_t h = 1469598103934665603ULL;  // FNV-1a
+    while (*s) {
+        h = (h ^ (unsigned char)*s++) * 1099511628211ULL;
+    }
+    return (size_t)h;
+}
+
+static int grow_authors(CommitStore *store) {
+    size_t mask = store->author_mask * 2 + 1;
+    const char **authors = calloc(mask + 1, sizeof(const char *));
+    if (authors == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i <= store->author_mask; i++) {
+        const char *name = store->authors[i];
+        if (name) {
+            size_t slot = hash_string(name) & mask;
+            while (authors[slot]) {
+                slot = (slot + 1) & mask;
+            }
+            authors[slot] = name;
+        }
+    }
+    free(store->authors);
+    store->authors = authors;
+    store->author_mask = mask;
+    return 0;
+}
+
+// Most histories have few authors, so each name is kept once
+static const char *intern_author(CommitStore *store, const char *name) {
+    if (name == NULL || *name == '\0') {
+        return "";
+    }
+    if ((store->author_count + 1) * 2 > store->author_mask &&
+        grow_authors(store) != 0) {
+        return NULL;
+    }
+
+    size_t slot = hash_string(name) & store->author_mask;
+    while (store->authors[slot]) {
+        if (strcmp(store->authors[slot], name) == 0) {
+            return store->authors[slot];
+        }
+        slot = (slot + 1) & store->author_mask;
+    }
+    const char *copy = arena_strdup(store, name);
+    if (copy) {
+        store->authors[slot] = copy;
+        store->author_count++;
+    }
+    return copy;
+}
+
+int store_add(CommitStore *store, const Commit *commit) {
+    int index = store->count;
+    int chunk_index = index >> STORE_CHUNK_BITS;
+    if (chunk_index >= STORE_MAX_CHUNKS) {
+        return -1;
+    }
+    if (store->chunks[chunk_index] == NULL) {
+        store->chunks[chunk_index] = malloc(sizeof(CommitChunk));
+        if (store->chunks[chunk_index] == NULL) {
+            return -1;
+        }
+    }
+
+    CommitChunk *chunk = store->chunks[chunk_index];
+    int slot = STORE_SLOT(index);
+
+    const unsigned char *parents = NULL;
+    int *parent_index = NULL;
+    if (commit->parent_count > 0) {
+        size_t size = (size_t)commit->parent_count * OID_RAWSZ;
+        unsigned char *copy = arena_alloc(store, size, 1);
+        parent_index = arena_alloc(store, commit->parent_count * sizeof(int),
+                                   sizeof(int));
+        if (copy == NULL || parent_index == NULL) {
+            return -1;
+        }
+        memcpy(copy, commit->parents, size);
+        parents = copy;
+        for (int i = 0; i < commit->parent_count; i++) {
+            parent_index[i] = -1;
+        }
+    }
+
+    const char *author = intern_author(store, commit->author);
+    const char *subject = arena_strdup(store, commit->subject);
+    const char *message = arena_strdup(store, commit->message);
+    const char *refs = arena_strdup(store, commit->refs);
+    const char *pr_number = arena_strdup(store, commit->pr_number);
+    if (!author || !subject || !message || !refs || !pr_number) {
+        return -1;
+    }
+
+    memcpy(chunk->oid[slot], commit->oid, OID_RAWSZ);
+    chunk->author_time[slot] = commit->author_time;
+    chunk->author_tz[slot] = (short)commit->author_tz;
+    chunk->commit_time[slot] = commit->commit_time;
+    chunk->generation[slot] = commit->generation;
+    chunk->flags[slot] = (commit->is_merge ? COMMIT_MERGE : 0) |
+                         (commit->is_pr ? COMMIT_PR : 0) |
+                         (commit->is_lazy ? COMMIT_LAZY : 0) |
+                         (commit->is_body_lazy ? COMMIT_LAZY_BODY : 0);
+    chunk->lane[slot] = 0;
+    chunk->parent_count[slot] = commit->parent_count;
+    chunk->parents[slot] = parents;
+    chunk->parent_index[slot] = parent_index;
+    chunk->author[slot] = author;
+    chunk->subject[slot] = subject;
+    chunk->message[slot] = message;
+    chunk->refs[slot] = refs;
+    chunk->pr_number[slot] = pr_number;
+
+    store->count++;
+    return index;
+}
+
+void store_get(const CommitStore *store, int index, Commit *commit) {
+    const CommitChunk *chunk = store_chunk(store, index);
+    int slot = STORE_SLOT(index);
+
+    memcpy(commit->oid, chunk->oid[slot], OID_RAWSZ);
+    commit->subject = chunk->subject[slot];
+    commit->message = chunk->message[slot];
+    commit->author = chunk->author[slot];
+    commit->refs = chunk->refs[slot];
+    commit->author_time = chunk->author_time[slot];
+    commit->author_tz = chunk->author_tz[slot];
+    commit->commit_time = chunk->commit_time[slot];
+    commit->generation = chunk->generation[slot];
+    commit->is_merge = (chunk->flags[slot] & COMMIT_MERGE) != 0;
+    commit->is_pr = (chunk->flags[slot] & COMMIT_PR) != 0;
+    commit->is_lazy = (chunk->flags[slot] & COMMIT_LAZY) != 0;
+    commit->is_body_lazy = (chunk->flags[slot] & COMMIT_LAZY_BODY) != 0;
+    snprintf(commit->pr_number, sizeof(commit->pr_number), "%s",
+             chunk->pr_number[slot]);
+    commit->parent_count = chunk->parent_count[slot];
+    commit->parents = chunk->parents[slot];
+}
+
+void store_first_parent_only(CommitStore *store, int index) {
+    int *count = &store_chunk(store, index)->parent_count[STORE_SLOT(index)];
+    if (*count > 1) {
+        *count = 1;
+    }
+}
+
+int store_resolve_parents(CommitStore *store) {
+    for (; store->indexed < store->count; store->indexed++) {
+        if (oidmap_put(&store->index, store_oid(store, store->indexed),
+                       store->indexed) != 0) {
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < store->count; i++) {
+        int *parent_index = store_parent_index(store, i);
+        for (int j = 0; j < store_parent_count(store, i); j++) {
+            if (parent_index[j] < 0) {
+                parent_index[j] = store_find(store, store_parent_oid(store, i, j));
+            }
+        }
+    }
+    return 0;
+}
+
+int store_find(const CommitStore *store, const unsigned char *oid) {
+    int index;
+    return oidmap_get(&store->index, oid, &index) ? index : -1;
+}
+
+size_t store_memory(const CommitStore *store) {
+    size_t bytes = STORE_MAX_CHUNKS * sizeof(CommitChunk *) +
+                   (store->author_mask + 1) * sizeof(const char *) +
+                   store->index.size * (OID_RAWSZ + sizeof(int) + 1);
+    for (int i = 0; i < STORE_MAX_CHUNKS && store->chunks[i]; i++) {
+        bytes += sizeof(CommitChunk);
+    }
+    for (const ArenaBlock *block = store->arena; block; block = block->next) {
+        bytes += sizeof(ArenaBlock) + block->size;
+    }
+    return bytes;
+}
+
+void format_iso_date(time_t when, int tz, char *out, size_t size) {
+    time_t local = when + tz * 60L;
+    int offset = tz < 0 ? -tz : tz;
+
+    struct tm tm;
+    gmtime_r(&local, &tm);
+    char stamp[24];
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+    snprintf(out, size, "%s %c%02d%02d", stamp, tz < 0 ? '-' : '+',
+             offset / 60, offset % 60);
+}
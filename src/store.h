@@ -0,0 +1,142 @@
+#ifndef SHRUB_STORE_H
+#define SHRUB_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "odb.h"
+#include "oidmap.h"
+
+// Commits are stored column-wise in fixed-size chunks. A chunk never moves
+// once allocated, so later pipeline stages can read a commit while the
+// parser keeps appending behind it.
+#define STORE_CHUNK_BITS 12
+#define STORE_CHUNK_SIZE (1 << STORE_CHUNK_BITS)
+#define STORE_MAX_CHUNKS 65536
+
+#define COMMIT_MERGE 0x01
+#define COMMIT_PR    0x02
+#define COMMIT_LAZY  0x04   // subject, author and message not read yet
+#define COMMIT_LAZY_BODY 0x08   // message not read yet
+
+// One commit's fields. Readers fill it for store_add(), which copies
+// everything; store_get() fills it with pointers into the store.
+typedef struct {
+    unsigned char oid[OID_RAWSZ];
+    const char *subject;
+    const char *message;           // full message, subject included
+    const char *author;
+    const char *refs;              // `%D` decoration, "" if undecorated
+    time_t author_time;
+    int author_tz;                 // minutes east of UTC
+    time_t commit_time;
+    uint32_t generation;           // topological level, 0 if unknown
+    int is_merge;
+    int is_pr;
+    int is_lazy;                   // only the graph fields are filled in
+    int is_body_lazy;              // everything but the message is filled in
+    char pr_number[16];
+    int parent_count;
+    const unsigned char *parents;  // parent_count binary ids, back to back
+} Commit;
+
+typedef struct {
+    unsigned char oid[STORE_CHUNK_SIZE][OID_RAWSZ];
+    time_t author_time[STORE_CHUNK_SIZE];
+    short author_tz[STORE_CHUNK_SIZE];
+    time_t commit_time[STORE_CHUNK_SIZE];
+    uint32_t generation[STORE_CHUNK_SIZE];
+    unsigned char flags[STORE_CHUNK_SIZE];
+    int lane[STORE_CHUNK_SIZE];
+    int parent_count[STORE_CHUNK_SIZE];
+    const unsigned char *parents[STORE_CHUNK_SIZE];
+    int *parent_index[STORE_CHUNK_SIZE];      // -1 until resolved
+    const char *author[STORE_CHUNK_SIZE];    // interned
+    const char *subject[STORE_CHUNK_SIZE];
+    const char *message[STORE_CHUNK_SIZE];
+    const char *refs[STORE_CHUNK_SIZE];
+    const char *pr_number[STORE_CHUNK_SIZE];
+} CommitChunk;
+
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct {
+    CommitChunk **chunks;          // STORE_MAX_CHUNKS slots
+    int count;
+    ArenaBlock *arena;             // newest block first
+    size_t arena_bytes;            // string and parent bytes handed out
+    const char **authors;          // open-addressing intern table
+    size_t author_mask;
+    size_t author_count;
+    OidMap index;                  // commit id -> index
+    int indexed;                   // commits entered into the index
+} CommitStore;
+
+int store_init(CommitStore *store);
+void store_free(CommitStore *store);
+
+// Append a commit; returns its index, or -1 when out of memory
+int store_add(CommitStore *store, const Commit *commit);
+void store_get(const CommitStore *store, int index, Commit *commit);
+
+// Index every commit by id and turn parent ids into commit indices.
+// Parents outside the store (shallow or truncated history) stay -1.
+int store_resolve_parents(CommitStore *store);
+
+// --first-parent: drop a stored merge's other parents
+void store_first_parent_only(CommitStore *store, int index);
+
+// Index of a commit by id, or -1; valid after store_resolve_parents()
+int store_find(const CommitStore *store, const unsigned char *oid);
+
+// Bytes held by the store, chunks and arena included
+size_t store_memory(const CommitStore *store);
+
+static inline CommitChunk *store_chunk(const CommitStore *store, int index) {
+    return store->chunks[index >> STORE_CHUNK_BITS];
+}
+
+#define STORE_SLOT(index) ((index) & (STORE_CHUNK_SIZE - 1))
+
+static inline const unsigned char *store_oid(const CommitStore *store, int index) {
+    return store_chunk(store, index)->oid[STORE_SLOT(index)];
+}
+
+static inline int *store_lane(const CommitStore *store, int index) {
+    return &store_chunk(store, index)->lane[STORE_SLOT(index)];
+}
+
+static inline time_t store_author_time(const CommitStore *store, int index) {
+    return store_chunk(store, index)->author_time[STORE_SLOT(index)];
+}
+
+static inline time_t store_commit_time(const CommitStore *store, int index) {
+    return store_chunk(store, index)->commit_time[STORE_SLOT(index)];
+}
+
+static inline uint32_t store_generation(const CommitStore *store, int index) {
+    return store_chunk(store, index)->generation[STORE_SLOT(index)];
+}
+
+static inline int store_parent_count(const CommitStore *store, int index) {
+    return store_chunk(store, index)->parent_count[STORE_SLOT(index)];
+}
+
+static inline const unsigned char *store_parent_oid(const CommitStore *store,
+                                                    int index, int parent) {
+    return store_chunk(store, index)->parents[STORE_SLOT(index)] + parent * OID_RAWSZ;
+}
+
+static inline const char *store_refs(const CommitStore *store, int index) {
+    return store_chunk(store, index)->refs[STORE_SLOT(index)];
+}
+
+static inline int *store_parent_index(const CommitStore *store, int index) {
+    return store_chunk(store, index)->parent_index[STORE_SLOT(index)];
+}
+
+// Format a timestamp the way `--date=iso` does, in the given zone
+void format_iso_date(time_t when, int tz, char *out, size_t size);
+
+#endif
@@ -0,0 +1,103 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "strbuf.h"
+
+void sb_init(StrBuf *sb) {
+    sb->data = NULL;
+    sb->len = 0;
+    sb->capacity = 0;
+}
+
+void sb_free(StrBuf *sb) {
+    free(sb->data);
+    sb_init(sb);
+}
+
+void sb_reset(StrBuf *sb) {
+    sb->len = 0;
+    if (sb->data) {
+        sb->data[0] = '\0';
+    }
+}
+
+static int sb_grow(StrBuf *sb, size_t extra) {
+    if (sb->len + extra + 1 <= sb->capacity) {
+        return 0;
+    }
+
+    size_t capacity = sb->capacity ? sb->capacity : 256;
+    while (capacity < sb->len + extra + 1) {
+        capacity *= 2;
+    }
+    char *grown = realloc(sb->data, capacity);
+    if (grown == NULL) {
+        return -1;
+    }
+    sb->data = grown;
+    sb->capacity = capacity;
+    return 0;
+}
+
+void sb_append_len(StrBuf *sb, const char *s, size_t len) {
+    if (sb_grow(sb, len) != 0) {
+        return;
+    }
+    memcpy(sb->data + sb->len, s, len);
+    sb->len += len;
+    sb->data[sb->len] = '\0';
+}
+
+void sb_append(StrBuf *sb, const char *s) {
+    sb_append_len(sb, s, strlen(s));
+}
+
+void sb_append_json(StrBuf *sb, const char *s) {
+    sb_append(sb, "\"");
+    const char *run = s;
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c != '"' && c != '\\' && c >= 0x20) {
+            continue;
+        }
+        sb_append_len(sb, run, s - run);
+        if (c == '"' || c == '\\') {
+            char escaped[2] = { '\\', (char)c };
+            sb_append_len(sb, escaped, 2);
+        } else {
+            sb_appendf(sb, "\\u%04x", c);
+        }
+        run = s + 1;
+    }
+    sb_append_len(sb, run, s - run);
+    sb_append(sb, "\"");
+}
+
+void sb_append_shell(StrBuf *sb, const char *s) {
+    sb_append(sb, "'");
+    const char *quote;
+    while ((quote = strchr(s, '\'')) != NULL) {
+        sb_append_len(sb, s, quote - s);
+        sb_append(sb, "'\\''");
+        s = quote + 1;
+    }
+    sb_append(sb, s);
+    sb_append(sb, "'");
+}
+
+void sb_appendf(StrBuf *sb, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int needed = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    if (needed < 0 || sb_grow(sb, needed) != 0) {
+        return;
+    }
+
+    va_start(args, fmt);
+    vsnprintf(sb->data + sb->len, needed + 1, fmt, args);
+    va_end(args);
+    sb->len += needed;
+}
@@ -0,0 +1,25 @@
+#ifndef SHRUB_STRBUF_H
+#define SHRUB_STRBUF_H
+
+#include <stddef.h>
+
+// Growable string that tracks its own length, so appends never rescan
+typedef struct StrBuf {
+    char *data;
+    size_t len;
+    size_t capacity;
+} StrBuf;
+
+void sb_init(StrBuf *sb);
+void sb_free(StrBuf *sb);
+void sb_reset(StrBuf *sb);
+void sb_append(StrBuf *sb, const char *s);
+void sb_append_len(StrBuf *sb, const char *s, size_t len);
+// Append s as a quoted JSON string
+void sb_append_json(StrBuf *sb, const char *s);
+// Append s single-quoted for /bin/sh
+void sb_append_shell(StrBuf *sb, const char *s);
+void sb_appendf(StrBuf *sb, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+#endif
@@ -0,0 +1,310 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "strbuf.h"
+#include "treediff.h"
+
+#define PATH_INITIAL_SIZE 1024
+#define TREE_MODE_DIR 040000
+
+static uint32_t hash_component(uint32_t dir, const char *name, size_t len) {
+    uint32_t hash = 2166136261u ^ dir;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+int path_table_init(PathTable *table) {
+    memset(table, 0, sizeof(*table));
+    table->capacity = PATH_INITIAL_SIZE;
+    table->parent = malloc(PATH_INITIAL_SIZE * sizeof(uint32_t));
+    table->name_offset = malloc(PATH_INITIAL_SIZE * sizeof(uint32_t));
+    table->name_len = malloc(PATH_INITIAL_SIZE * sizeof(uint32_t));
+    table->hash = malloc(PATH_INITIAL_SIZE * sizeof(uint32_t));
+    table->slots = calloc(PATH_INITIAL_SIZE * 2, sizeof(uint32_t));
+    table->mask = PATH_INITIAL_SIZE * 2 - 1;
+    if (!table->parent || !table->name_offset || !table->name_len ||
+        !table->hash || !table->slots) {
+        path_table_free(table);
+        return -1;
+    }
+
+    // The root: no name, its own directory
+    table->parent[PATH_ROOT] = PATH_ROOT;
+    table->name_offset[PATH_ROOT] = 0;
+    table->name_len[PATH_ROOT] = 0;
+    table->hash[PATH_ROOT] = 0;
+    table->count = 1;
+    return 0;
+}
+
+void path_table_free(PathTable *table) {
+    free(table->parent);
+    free(table->name_offset);
+    free(table->name_len);
+    free(table->hash);
+    free(table->names);
+    free(table->slots);
+    memset(table, 0, sizeof(*table));
+}
+
+static int grow_ids(PathTable *table) {
+    uint32_t capacity = table->capacity * 2;
+    uint32_t **columns[] = { &table->parent, &table->name_offset,
+                             &table->name_len, &table->hash };
+    for (size_t i = 0; i < sizeof(columns) / sizeof(columns[0]); i++) {
+        uint32_t *grown = realloc(*columns[i], capacity * sizeof(uint32_t));
+        if (grown == NULL) {
+            return -1;
+        }
+        *columns[i] = grown;
+    }
+    table->capacity = capacity;
+
+    // Keep the slots at most half full
+    uint32_t size = capacity * 2;
+    uint32_t *slots = calloc(size, sizeof(uint32_t));
+    if (slots == NULL) {
+        return -1;
+    }
+    for (uint32_t id = 1; id < table->count; id++) {
+        uint32_t i = table->hash[id] & (size - 1);
+        while (slots[i]) {
+            i = (i + 1) & (size - 1);
+        }
+        slots[i] = id + 1;
+    }
+    free(table->slots);
+    table->slots = slots;
+    table->mask = size - 1;
+    return 0;
+}
+
+static int append_name(PathTable *table, const char *name, size_t len) {
+    if (table->names_len + len > table->names_capacity) {
+        size_t capacity = table->names_capacity ? table->names_capacity : 16384;
+        while (capacity < table->names_len + len) {
+            capacity *= 2;
+        }
+        char *grown = realloc(table->names, capacity);
+        if (grown == NULL) {
+            return -1;
+        }
+        table->names = grown;
+        table->names_capacity = capacity;
+    }
+    memcpy(table->names + table->names_len, name, len);
+    table->names_len += len;
+    return 0;
+}
+
+int path_intern(PathTable *table, uint32_t dir, const char *name, size_t len) {
+    uint32_t hash = hash_component(dir, name, len);
+    uint32_t i = hash & table->mask;
+    while (table->slots[i]) {
+        uint32_t id = table->slots[i] - 1;
+        if (table->hash[id] == hash && table->parent[id] == dir &&
+            table->name_len[id] == len &&
+            memcmp(table->names + table->name_offset[id], name, len) == 0) {
+            return (int)id;
+        }
+        i = (i + 1) & table->mask;
+    }
+
+    if (table->count == table->capacity) {
+        if (grow_ids(table) != 0) {
+            return -1;
+        }
+        // The slot found above moved with the table
+        i = hash & table->mask;
+        while (table->slots[i]) {
+            i = (i + 1) & table->mask;
+        }
+    }
+    if (append_name(table, name, len) != 0) {
+        return -1;
+    }
+
+    uint32_t id = table->count++;
+    table->parent[id] = dir;
+    table->name_offset[id] = (uint32_t)(table->names_len - len);
+    table->name_len[id] = (uint32_t)len;
+    table->hash[id] = hash;
+    table->slots[i] = id + 1;
+    return (int)id;
+}
+
+void path_format(const PathTable *table, uint32_t id, int is_dir, StrBuf *out) {
+    if (id == PATH_ROOT) {
+        return;
+    }
+    path_format(table, table->parent[id], 1, out);
+    sb_append_len(out, table->names + table->name_offset[id], table->name_len[id]);
+    if (is_dir) {
+        sb_append(out, "/");
+    }
+}
+
+int path_compare(const PathTable *table, uint32_t a, uint32_t b, int is_dir) {
+    StrBuf x, y;
+    sb_init(&x);
+    sb_init(&y);
+    path_format(table, a, is_dir, &x);
+    path_format(table, b, is_dir, &y);
+    int cmp = strcmp(x.data ? x.data : "", y.data ? y.data : "");
+    sb_free(&x);
+    sb_free(&y);
+    return cmp;
+}
+
+// One entry of a tree object: "<octal mode> <name>\0<binary id>"
+typedef struct {
+    unsigned mode;
+    const char *name;
+    size_t name_len;
+    const unsigned char *oid;
+} TreeEntry;
+
+static int tree_next(const unsigned char **p, const unsigned char *end,
+                     TreeEntry *entry) {
+    const unsigned char *s = *p;
+    if (s >= end) {
+        return 0;
+    }
+    entry->mode = 0;
+    while (s < end && *s >= '0' && *s <= '7') {
+        entry->mode = entry->mode * 8 + (*s++ - '0');
+    }
+    if (s >= end || *s++ != ' ') {
+        return 0;
+    }
+    const unsigned char *nul = memchr(s, '\0', end - s);
+    if (nul == NULL || nul + 1 + OID_RAWSZ > end) {
+        return 0;
+    }
+    entry->name = (const char *)s;
+    entry->name_len = nul - s;
+    entry->oid = nul + 1;
+    *p = nul + 1 + OID_RAWSZ;
+    return 1;
+}
+
+static int is_dir(const TreeEntry *entry) {
+    return (entry->mode & 0170000) == TREE_MODE_DIR;
+}
+
+// Tree order: a directory sorts as if its name ended in '/'
+static int tree_entry_compare(const TreeEntry *a, const TreeEntry *b) {
+    size_t len = a->name_len < b->name_len ? a->name_len : b->name_len;
+    int cmp = memcmp(a->name, b->name, len);
+    if (cmp != 0) {
+        return cmp;
+    }
+    unsigned char ca = a->name_len > len ? a->name[len] : is_dir(a) ? '/' : '\0';
+    unsigned char cb = b->name_len > len ? b->name[len] : is_dir(b) ? '/' : '\0';
+    return ca - cb;
+}
+
+static int read_tree(Odb *odb, const unsigned char *oid, unsigned char **data,
+                     size_t *size) {
+    *data = NULL;
+    *size = 0;
+    if (oid == NULL) {
+        return 0;
+    }
+    ObjectType type;
+    if (odb_read(odb, oid, &type, data, size) != 0) {
+        return -1;
+    }
+    if (type != OBJ_TREE) {
+        free(*data);
+        *data = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static int diff_dir(TreeDiff *diff, uint32_t dir, const unsigned char *old_oid,
+                    const unsigned char *new_oid);
+
+// An entry that changed: a file is reported, a directory is reported and
+// then diffed. old_entry or new_entry is NULL if the entry is on one side
+// only; both name the same path.
+static int diff_changed(TreeDiff *diff, uint32_t dir, const TreeEntry *old_entry,
+                        const TreeEntry *new_entry) {
+    const TreeEntry *entry = new_entry ? new_entry : old_entry;
+    int id = path_intern(diff->paths, dir, entry->name, entry->name_len);
+    if (id < 0) {
+        return -1;
+    }
+    if (!is_dir(entry)) {
+        if (diff->changed) {
+            diff->changed(diff->ctx, id, 0);
+        }
+        if (diff->file) {
+            return diff->file(diff->ctx, id, old_entry ? old_entry->mode : 0,
+                              old_entry ? old_entry->oid : NULL,
+                              new_entry ? new_entry->mode : 0,
+                              new_entry ? new_entry->oid : NULL);
+        }
+        return 0;
+    }
+    if (diff->changed) {
+        diff->changed(diff->ctx, id, 1);
+    }
+    return diff_dir(diff, id, old_entry ? old_entry->oid : NULL,
+                    new_entry ? new_entry->oid : NULL);
+}
+
+// Both trees are sorted, so one pass pairs up their entries
+static int diff_dir(TreeDiff *diff, uint32_t dir, const unsigned char *old_oid,
+                    const unsigned char *new_oid) {
+    unsigned char *old_data, *new_data;
+    size_t old_size, new_size;
+    if (read_tree(diff->odb, old_oid, &old_data, &old_size) != 0) {
+        return -1;
+    }
+    if (read_tree(diff->odb, new_oid, &new_data, &new_size) != 0) {
+        free(old_data);
+        return -1;
+    }
+
+    const unsigned char *op = old_data, *oend = old_data + old_size;
+    const unsigned char *np = new_data, *nend = new_data + new_size;
+    TreeEntry old_entry, new_entry;
+    int has_old = tree_next(&op, oend, &old_entry);
+    int has_new = tree_next(&np, nend, &new_entry);
+    int status = 0;
+
+    while (status == 0 && (has_old || has_new)) {
+        int cmp = !has_old ? 1 : !has_new ? -1
+                  : tree_entry_compare(&old_entry, &new_entry);
+        if (cmp < 0) {
+            status = diff_changed(diff, dir, &old_entry, NULL);
+            has_old = tree_next(&op, oend, &old_entry);
+        } else if (cmp > 0) {
+            status = diff_changed(diff, dir, NULL, &new_entry);
+            has_new = tree_next(&np, nend, &new_entry);
+        } else {
+            if (old_entry.mode != new_entry.mode ||
+                memcmp(old_entry.oid, new_entry.oid, OID_RAWSZ) != 0) {
+                status = diff_changed(diff, dir, &old_entry, &new_entry);
+            }
+            has_old = tree_next(&op, oend, &old_entry);
+            has_new = tree_next(&np, nend, &new_entry);
+        }
+    }
+
+    free(old_data);
+    free(new_data);
+    return status;
+}
+
+int tree_diff(TreeDiff *diff, const unsigned char *old_tree,
+              const unsigned char *new_tree) {
+    if (old_tree && new_tree && memcmp(old_tree, new_tree, OID_RAWSZ) == 0) {
+        return 0;
+    }
+    return diff_dir(diff, PATH_ROOT, old_tree, new_tree);
+}
@@ -0,0 +1,70 @@
+#ifndef SHRUB_TREEDIFF_H
+#define SHRUB_TREEDIFF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "odb.h"
+
+struct StrBuf;
+
+// Paths are interned one component at a time: a path is the id of its
+// directory plus its own name. The differ hands out ids without ever
+// building a path string, and a table holds each distinct path once
+// however many commits touch it.
+#define PATH_ROOT 0
+
+typedef struct {
+    uint32_t *parent;       // directory of each path, PATH_ROOT at the top
+    uint32_t *name_offset;  // into names
+    uint32_t *name_len;
+    uint32_t *hash;
+    uint32_t count;         // ids handed out, the root included
+    uint32_t capacity;
+    char *names;
+    size_t names_len;
+    size_t names_capacity;
+    uint32_t *slots;        // open addressing, id + 1 or 0 when free
+    uint32_t mask;
+} PathTable;
+
+int path_table_init(PathTable *table);
+void path_table_free(PathTable *table);
+
+// Id of `name` inside directory `dir`; returns -1 when out of memory
+int path_intern(PathTable *table, uint32_t dir, const char *name, size_t len);
+
+// Append the full path of an id, directories with a trailing '/'
+void path_format(const PathTable *table, uint32_t id, int is_dir,
+                 struct StrBuf *out);
+
+// Compare two paths the way strcmp() compares their formatted strings
+int path_compare(const PathTable *table, uint32_t a, uint32_t b, int is_dir);
+
+// Reports every file that differs between two trees, added and removed
+// ones included, and every directory on the way to one. Directories are
+// reported once per diff.
+typedef void (*TreeDiffFn)(void *ctx, uint32_t path, int is_dir);
+
+// Reports a file that differs with both of its sides: mode 0 and a NULL
+// id for the side it is missing from. Called in tree order, after
+// `changed` for the same path.
+typedef int (*TreeDiffFileFn)(void *ctx, uint32_t path, unsigned old_mode,
+                              const unsigned char *old_oid, unsigned new_mode,
+                              const unsigned char *new_oid);
+
+typedef struct {
+    Odb *odb;
+    PathTable *paths;
+    TreeDiffFn changed;         // may be NULL
+    void *ctx;
+    TreeDiffFileFn file;        // may be NULL; a non-zero return stops the diff
+} TreeDiff;
+
+// Diff two trees; either id may be NULL for the empty tree. Subtrees with
+// the same id on both sides are skipped without being read. Returns -1 if
+// a tree cannot be read or a path cannot be interned.
+int tree_diff(TreeDiff *diff, const unsigned char *old_tree,
+              const unsigned char *new_tree);
+
+#endif
@@ -0,0 +1,635 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "viewer.h"
+
+#define VIEW_TICK_MS 50         // status refresh while rows are arriving
+#define VIEW_TAKE_MS 10         // time spent taking rows between key checks
+
+enum {
+    KEY_NONE = -1,
+    KEY_UP = 1000,
+    KEY_DOWN,
+    KEY_PAGE_UP,
+    KEY_PAGE_DOWN,
+    KEY_HOME,
+    KEY_END
+};
+
+// The terminal the viewer runs in; there is only ever one
+typedef struct {
+    int in_fd;
+    struct termios saved;
+    StrBuf frame;
+    int filled;                 // the last frame had no empty lines
+} Screen;
+
+static Screen screen;
+
+static volatile sig_atomic_t resized = 0;
+
+static void on_resize(int signal_number) {
+    (void)signal_number;
+    resized = 1;
+}
+
+static void read_size(Viewer *view) {
+    struct winsize size;
+    view->width = 80;
+    view->height = 24;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_row > 1) {
+        view->width = size.ws_col;
+        view->height = size.ws_row;
+    }
+}
+
+static void write_all(const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+// Raw input, the alternate screen, no cursor and no line wrapping (long
+// lines are cut at the right edge)
+static int enter_screen(Viewer *view) {
+    screen.in_fd = isatty(STDIN_FILENO) ? STDIN_FILENO : open("/dev/tty", O_RDONLY);
+    if (screen.in_fd < 0 || tcgetattr(screen.in_fd, &screen.saved) != 0) {
+        if (screen.in_fd > STDIN_FILENO) {
+            close(screen.in_fd);
+        }
+        return -1;
+    }
+
+    struct termios raw = screen.saved;
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_iflag &= ~(IXON | ICRNL);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(screen.in_fd, TCSAFLUSH, &raw) != 0) {
+        if (screen.in_fd > STDIN_FILENO) {
+            close(screen.in_fd);
+        }
+        return -1;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_resize;
+    sigaction(SIGWINCH, &action, NULL);
+    read_size(view);
+    const char *setup = "\033[?1049h\033[?25l\033[?7l";
+    write_all(setup, strlen(setup));
+    return 0;
+}
+
+static void leave_screen() {
+    const char *restore = "\033[?7h\033[?25h\033[?1049l";
+    write_all(restore, strlen(restore));
+    signal(SIGWINCH, SIG_DFL);
+    tcsetattr(screen.in_fd, TCSAFLUSH, &screen.saved);
+    if (screen.in_fd > STDIN_FILENO) {
+        close(screen.in_fd);
+    }
+}
+
+void viewer_init(Viewer *view, SpscQueue *rows, CommitText *text, int width,
+                 int height) {
+    memset(view, 0, sizeof(*view));
+    view->queue = rows;
+    view->text = text;
+    view->loading = 1;
+    view->width = width;
+    view->height = height;
+    sb_init(&view->scratch);
+}
+
+void viewer_free(Viewer *view) {
+    for (int i = 0; i < view->count; i++) {
+        row_free(&view->rows[i]);
+    }
+    free(view->rows);
+    free(view->lines);
+    sb_free(&view->scratch);
+}
+
+static void add_row(Viewer *view, Row *row) {
+    if (view->count == view->capacity) {
+        int capacity = view->capacity ? view->capacity * 2 : 1024;
+        Row *grown = realloc(view->rows, capacity * sizeof(Row));
+        if (grown == NULL) {
+            row_free(row);
+            snprintf(view->message, sizeof(view->message), "Out of memory");
+            return;
+        }
+        view->rows = grown;
+        view->capacity = capacity;
+    }
+    view->rows[view->count++] = *row;
+}
+
+int viewer_take_rows(Viewer *view, double budget_ms) {
+    double start = elapsed_ms(0);
+    int before = view->count;
+    Row row;
+    while (view->loading) {
+        int status = spsc_try_pop(view->queue, &row);
+        if (status < 0) {
+            view->loading = 0;
+        } else if (status == 0) {
+            break;
+        } else {
+            add_row(view, &row);
+            if ((view->count & 255) == 0 && elapsed_ms(start) > budget_ms) {
+                break;
+            }
+        }
+    }
+    return view->count > before;
+}
+
+int viewer_wait_row(Viewer *view) {
+    Row row;
+    if (!view->loading) {
+        return 0;
+    }
+    if (!spsc_pop(view->queue, &row)) {
+        view->loading = 0;
+        return 0;
+    }
+    add_row(view, &row);
+    viewer_take_rows(view, VIEW_TAKE_MS);
+    return 1;
+}
+
+int viewer_render(Viewer *view, int index) {
+    sb_reset(&view->scratch);
+    render_row(&view->rows[index], view->text, &view->scratch);
+
+    int count = 0;
+    const char *data = view->scratch.data;
+    for (size_t pos = 0; pos < view->scratch.len; ) {
+        if (count == view->line_capacity) {
+            int capacity = view->line_capacity ? view->line_capacity * 2 : 64;
+            int *grown = realloc(view->lines, capacity * sizeof(int));
+            if (grown == NULL) {
+                break;
+            }
+            view->lines = grown;
+            view->line_capacity = capacity;
+        }
+        view->lines[count++] = pos;
+        const char *newline = memchr(data + pos, '\n', view->scratch.len - pos);
+        pos = newline ? (size_t)(newline - data) + 1 : view->scratch.len;
+    }
+    return count;
+}
+
+void viewer_scroll_up(Viewer *view, int lines) {
+    while (lines > 0) {
+        if (view->top_line >= lines) {
+            view->top_line -= lines;
+            return;
+        }
+        lines -= view->top_line;
+        view->top_line = 0;
+        if (view->top == 0) {
+            return;
+        }
+        view->top--;
+        view->top_line = viewer_render(view, view->top);
+    }
+}
+
+// Lines from the top of the window to the end of the rows, counting at
+// most `limit`
+static int lines_below(Viewer *view, int limit) {
+    int total = -view->top_line;
+    for (int i = view->top; i < view->count && total < limit; i++) {
+        total += viewer_render(view, i);
+    }
+    return total;
+}
+
+void viewer_clamp(Viewer *view) {
+    int page = view->height - 1;
+    int shown = lines_below(view, page);
+    if (shown < page) {
+        viewer_scroll_up(view, page - shown);
+    }
+}
+
+void viewer_scroll_down(Viewer *view, int lines) {
+    while (lines > 0 && view->top < view->count) {
+        int height = viewer_render(view, view->top);
+        if (view->top_line + lines < height) {
+            view->top_line += lines;
+            break;
+        }
+        lines -= height - view->top_line;
+        view->top++;
+        view->top_line = 0;
+    }
+    if (view->top >= view->count) {
+        view->top = view->count > 0 ? view->count - 1 : 0;
+        view->top_line = 0;
+    }
+    viewer_clamp(view);
+}
+
+static void show_row(Viewer *view, int index) {
+    view->top = index;
+    view->top_line = 0;
+    viewer_clamp(view);
+}
+
+static void append_status(Viewer *view, StrBuf *frame) {
+    char status[PROMPT_SIZE * 2];
+    int len = snprintf(status, sizeof(status), " %d/%d%s  %s",
+                       view->count ? view->top + 1 : 0, view->count,
+                       view->loading ? "+" : "",
+                       view->message[0] ? view->message
+                       : "q quit  / search  : commit");
+    if (len > view->width) {
+        len = view->width;
+    }
+    sb_append(frame, "\033[7m");
+    sb_append_len(frame, status, len);
+    sb_appendf(frame, "%*s" RESET_COLOR, view->width - len, "");
+}
+
+static void draw(Viewer *view) {
+    StrBuf *frame = &screen.frame;
+    sb_reset(frame);
+    sb_append(frame, "\033[H");
+
+    int page = view->height - 1;
+    int drawn = 0;
+    for (int i = view->top; i < view->count && drawn < page; i++) {
+        int count = viewer_render(view, i);
+        for (int line = i == view->top ? view->top_line : 0;
+             line < count && drawn < page; line++) {
+            size_t start = view->lines[line];
+            size_t end = line + 1 < count ? (size_t)view->lines[line + 1]
+                                          : view->scratch.len;
+            while (end > start && view->scratch.data[end - 1] == '\n') {
+                end--;
+            }
+            sb_append_len(frame, view->scratch.data + start, end - start);
+            sb_append(frame, RESET_COLOR "\033[K\r\n");
+            drawn++;
+        }
+    }
+    screen.filled = drawn == page;
+    for (; drawn < page; drawn++) {
+        sb_append(frame, "\033[K\r\n");
+    }
+    append_status(view, frame);
+    write_all(frame->data, frame->len);
+}
+
+// Only the row count changes while a full window waits for more rows
+static void draw_status(Viewer *view) {
+    StrBuf *frame = &screen.frame;
+    sb_reset(frame);
+    sb_appendf(frame, "\033[%d;1H", view->height);
+    append_status(view, frame);
+    write_all(frame->data, frame->len);
+}
+
+// Only the status line changes while a prompt is typed
+static void draw_prompt(Viewer *view, const char *label, const char *input) {
+    StrBuf *frame = &screen.frame;
+    sb_reset(frame);
+    sb_appendf(frame, "\033[%d;1H%s%s\033[K", view->height, label, input);
+    write_all(frame->data, frame->len);
+}
+
+static int read_byte(int timeout_ms, unsigned char *byte) {
+    struct pollfd fds = { .fd = screen.in_fd, .events = POLLIN };
+    if (poll(&fds, 1, timeout_ms) <= 0) {
+        return 0;
+    }
+    return read(screen.in_fd, byte, 1) == 1;
+}
+
+// Next key, or KEY_NONE if none came within the timeout (-1 waits)
+static int read_key(int timeout_ms) {
+    unsigned char c;
+    if (!read_byte(timeout_ms, &c)) {
+        return KEY_NONE;
+    }
+    if (c != '\033') {
+        return c;
+    }
+
+    // Escape sequences arrive together; a lone escape does not
+    unsigned char seq[4];
+    if (!read_byte(20, &seq[0])) {
+        return '\033';
+    }
+    if (seq[0] != '[' && seq[0] != 'O') {
+        return seq[0];
+    }
+    if (!read_byte(20, &seq[1])) {
+        return '\033';
+    }
+    switch (seq[1]) {
+    case 'A': return KEY_UP;
+    case 'B': return KEY_DOWN;
+    case 'H': return KEY_HOME;
+    case 'F': return KEY_END;
+    }
+    if (seq[1] >= '0' && seq[1] <= '9' && read_byte(20, &seq[2]) &&
+        seq[2] == '~') {
+        switch (seq[1]) {
+        case '1': case '7': return KEY_HOME;
+        case '4': case '8': return KEY_END;
+        case '5': return KEY_PAGE_UP;
+        case '6': return KEY_PAGE_DOWN;
+        }
+    }
+    return KEY_NONE;
+}
+
+// Read a line on the status line; returns 0 if cancelled with escape
+static int prompt(Viewer *view, const char *label, char *input, size_t size) {
+    size_t len = 0;
+    input[0] = '\0';
+    while (1) {
+        draw_prompt(view, label, input);
+        int key = read_key(-1);
+        if (key == '\r' || key == '\n') {
+            return len > 0;
+        }
+        if (key == '\033' || key == 3) {
+            return 0;
+        }
+        if ((key == 127 || key == 8) && len > 0) {
+            input[--len] = '\0';
+        } else if (key >= ' ' && key < 127 && len + 1 < size) {
+            input[len++] = key;
+            input[len] = '\0';
+        }
+    }
+}
+
+static int commit_matches(Viewer *view, int index, const char *pattern) {
+    Commit commit;
+    store_get(&commit_store, index, &commit);
+    if ((commit.is_lazy || commit.is_body_lazy) && view->text) {
+        commit_text_fill(view->text, &commit);
+    }
+    char hash[OID_HEXSZ + 1];
+    oid_to_hex(commit.oid, hash);
+    return strncasecmp(hash, pattern, strlen(pattern)) == 0 ||
+           strcasestr(commit.subject, pattern) != NULL ||
+           strcasestr(commit.author, pattern) != NULL ||
+           strcasestr(commit.refs, pattern) != NULL ||
+           strcasestr(commit.message, pattern) != NULL;
+}
+
+// A collapsed chain matches if any of its commits does, and is expanded
+// to show it
+static int row_matches(Viewer *view, int index, const char *pattern) {
+    Row *row = &view->rows[index];
+    int commit = row->commit;
+    for (int i = 0; i < row->chain; i++) {
+        if (commit_matches(view, commit, pattern)) {
+            row->expanded |= i > 0;
+            return 1;
+        }
+        if (i + 1 < row->chain) {
+            commit = store_parent_index(&commit_store, commit)[0];
+        }
+    }
+    return 0;
+}
+
+// Search from the row after (or before) the top of the window. Rows still
+// loading are waited for.
+void viewer_search(Viewer *view, int backward) {
+    if (view->search[0] == '\0') {
+        return;
+    }
+    int step = backward ? -1 : 1;
+    for (int i = view->top + step; i >= 0; i += step) {
+        if (i >= view->count && !viewer_wait_row(view)) {
+            break;
+        }
+        if (row_matches(view, i, view->search)) {
+            show_row(view, i);
+            return;
+        }
+    }
+    snprintf(view->message, sizeof(view->message), "Pattern not found: %.200s",
+             view->search);
+}
+
+int parse_hex_prefix(const char *hex, unsigned char *prefix, int *nibbles) {
+    int len = strlen(hex);
+    if (len == 0 || len > OID_HEXSZ) {
+        return -1;
+    }
+    memset(prefix, 0, OID_RAWSZ);
+    for (int i = 0; i < len; i++) {
+        char c = hex[i];
+        int value = c >= '0' && c <= '9' ? c - '0'
+                  : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                  : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if (value < 0) {
+            return -1;
+        }
+        prefix[i / 2] |= i % 2 ? value : value << 4;
+    }
+    *nibbles = len;
+    return 0;
+}
+
+int oid_has_prefix(const unsigned char *oid, const unsigned char *prefix,
+                          int nibbles) {
+    int bytes = nibbles / 2;
+    if (memcmp(oid, prefix, bytes) != 0) {
+        return 0;
+    }
+    return nibbles % 2 == 0 || (oid[bytes] & 0xf0) == prefix[bytes];
+}
+
+void viewer_jump_to_commit(Viewer *view, const char *hex) {
+    unsigned char prefix[OID_RAWSZ];
+    int nibbles;
+    if (parse_hex_prefix(hex, prefix, &nibbles) != 0) {
+        snprintf(view->message, sizeof(view->message), "Not a commit hash: %.200s", hex);
+        return;
+    }
+    for (int i = 0; i < view->count || viewer_wait_row(view); i++) {
+        Row *row = &view->rows[i];
+        int commit = row->commit;
+        for (int j = 0; j < row->chain; j++) {
+            if (oid_has_prefix(store_oid(&commit_store, commit), prefix, nibbles)) {
+                row->expanded |= j > 0;
+                show_row(view, i);
+                return;
+            }
+            if (j + 1 < row->chain) {
+                commit = store_parent_index(&commit_store, commit)[0];
+            }
+        }
+    }
+    snprintf(view->message, sizeof(view->message), "No commit %.200s", hex);
+}
+
+// Only the row toggled is drawn differently; the layout stays as it is
+void viewer_toggle_chain(Viewer *view) {
+    int page = view->height - 1;
+    int lines = -view->top_line;
+    for (int i = view->top; i < view->count && lines < page; i++) {
+        if (view->rows[i].chain > 1) {
+            view->rows[i].expanded = !view->rows[i].expanded;
+            if (i == view->top) {
+                view->top_line = 0;
+            }
+            viewer_clamp(view);
+            return;
+        }
+        lines += viewer_render(view, i);
+    }
+    snprintf(view->message, sizeof(view->message), "No collapsed commits in view");
+}
+
+void viewer_show_end(Viewer *view) {
+    if (view->count == 0) {
+        return;
+    }
+    view->top = view->count - 1;
+    view->top_line = viewer_render(view, view->top);
+    viewer_scroll_up(view, view->height - 1);
+}
+
+// Handle one key; returns 0 to quit
+static int handle_key(Viewer *view, int key) {
+    int page = view->height - 1;
+    char input[PROMPT_SIZE];
+
+    switch (key) {
+    case 'q': case 'Q': case 3:
+        return 0;
+    case 'j': case 'e': case '\r': case KEY_DOWN:
+        viewer_scroll_down(view, 1);
+        break;
+    case 'k': case 'y': case KEY_UP:
+        viewer_scroll_up(view, 1);
+        break;
+    case ' ': case 'f': case 6: case KEY_PAGE_DOWN:
+        viewer_scroll_down(view, page);
+        break;
+    case 'b': case 2: case KEY_PAGE_UP:
+        viewer_scroll_up(view, page);
+        break;
+    case 'd': case 4:
+        viewer_scroll_down(view, page / 2);
+        break;
+    case 'u': case 21:
+        viewer_scroll_up(view, page / 2);
+        break;
+    case 'g': case '<': case KEY_HOME:
+        view->top = view->top_line = 0;
+        break;
+    case 'G': case '>': case KEY_END:
+        viewer_show_end(view);
+        break;
+    case '/': case '?':
+        if (prompt(view, key == '/' ? "/" : "?", input, sizeof(input))) {
+            snprintf(view->search, sizeof(view->search), "%s", input);
+            view->search_backward = key == '?';
+            viewer_search(view, view->search_backward);
+        }
+        break;
+    case 'n':
+        viewer_search(view, view->search_backward);
+        break;
+    case 'N':
+        viewer_search(view, !view->search_backward);
+        break;
+    case ':':
+        if (prompt(view, "commit: ", input, sizeof(input))) {
+            viewer_jump_to_commit(view, input);
+        }
+        break;
+    case 'o': case '\t':
+        viewer_toggle_chain(view);
+        break;
+    }
+    return 1;
+}
+
+int view_tree(SpscQueue *rows, CommitText *text, double start_ms,
+              PipelineStats *stats) {
+    Viewer view;
+    viewer_init(&view, rows, text, 80, 24);
+    if (enter_screen(&view) != 0) {
+        viewer_free(&view);
+        return -1;
+    }
+    sb_init(&screen.frame);
+
+    // Show the first screen as soon as it is laid out
+    while (view.count < view.height && viewer_wait_row(&view)) {
+    }
+    draw(&view);
+    if (view.count > 0) {
+        stats->first_row_ms = elapsed_ms(start_ms);
+    }
+
+    while (1) {
+        int key = read_key(view.loading ? VIEW_TICK_MS : -1);
+        int dirty = 0;
+        if (resized) {
+            resized = 0;
+            read_size(&view);
+            viewer_clamp(&view);
+            dirty = 1;
+        }
+        if (key == KEY_NONE) {
+            // Keep taking rows while idle; the status shows the count
+            int loading = view.loading;
+            int taken = viewer_take_rows(&view, VIEW_TICK_MS / 2);
+            if (dirty || (taken && !screen.filled)) {
+                draw(&view);
+            } else if (taken || loading != view.loading) {
+                draw_status(&view);
+            }
+            continue;
+        }
+
+        view.message[0] = '\0';
+        if (!handle_key(&view, key)) {
+            break;
+        }
+        viewer_take_rows(&view, VIEW_TAKE_MS);
+        draw(&view);
+    }
+
+    leave_screen();
+    stats->rows = view.count;
+    viewer_free(&view);
+    sb_free(&screen.frame);
+    return 0;
+}
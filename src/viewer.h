@@ -0,0 +1,75 @@
+#ifndef SHRUB_VIEWER_H
+#define SHRUB_VIEWER_H
+
+#include "shrub.h"
+#include "queue.h"
+#include "strbuf.h"
+
+// Full-screen viewer for the tree view. Rows are kept as laid out and
+// only the ones in the window are rendered, so paging, searching forward
+// from the window and jumping to a commit cost the same on any history.
+//
+// Keys: j/k or arrows scroll a line, space/b or PgDn/PgUp a page, d/u half
+// a page, g/G the first and last row, / and ? search forwards and
+// backwards, n/N repeat the search, : jumps to a commit hash, o or tab
+// expands and collapses the first --collapse chain in the window, q quits.
+
+#define PROMPT_SIZE 256
+
+// The rows taken so far and the window onto them. None of it needs the
+// terminal, which only draws the window and reads the keys.
+typedef struct {
+    SpscQueue *queue;
+    CommitText *text;
+    Row *rows;                  // every row received, in display order
+    int count;
+    int capacity;
+    int loading;                // more rows may arrive
+    int top;                    // first row in the window
+    int top_line;               // lines of it scrolled off the top
+    int width;
+    int height;                 // terminal lines; the last one is the status
+    StrBuf scratch;             // the row last rendered
+    int *lines;                 // offsets of its lines in scratch
+    int line_capacity;
+    char search[PROMPT_SIZE];
+    int search_backward;
+    char message[PROMPT_SIZE];  // shown in the status line until the next key
+} Viewer;
+
+// Show rows from `rows` until the user quits. Returns -1 if the terminal
+// cannot be set up, before anything has been taken from the queue.
+int view_tree(SpscQueue *rows, CommitText *text, double start_ms,
+              PipelineStats *stats);
+
+void viewer_init(Viewer *view, SpscQueue *rows, CommitText *text, int width,
+                 int height);
+// Frees the rows taken too
+void viewer_free(Viewer *view);
+// Take the rows that have arrived, for at most `budget_ms`. Returns 1 if
+// any were taken.
+int viewer_take_rows(Viewer *view, double budget_ms);
+// Block until at least one more row arrives; returns 0 at the end
+int viewer_wait_row(Viewer *view);
+// Render a row into scratch and index its lines; returns the line count
+int viewer_render(Viewer *view, int index);
+
+void viewer_scroll_up(Viewer *view, int lines);
+void viewer_scroll_down(Viewer *view, int lines);
+// Keep the window full unless every row fits
+void viewer_clamp(Viewer *view);
+void viewer_show_end(Viewer *view);
+// Search for view->search from the row after (or before) the top of the
+// window, waiting for rows still loading; the message says if not found
+void viewer_search(Viewer *view, int backward);
+void viewer_jump_to_commit(Viewer *view, const char *hex);
+// Expand or collapse the first chain in the window
+void viewer_toggle_chain(Viewer *view);
+
+// An abbreviated commit id of any case and length, up to a full one, as
+// its bytes and length in hex digits. Returns -1 if it is not one.
+int parse_hex_prefix(const char *hex, unsigned char *prefix, int *nibbles);
+int oid_has_prefix(const unsigned char *oid, const unsigned char *prefix,
+                   int nibbles);
+
+#endif
@@ -0,0 +1,1626 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "shrub.h"
+#include "batch.h"
+#include "cache.h"
+#include "commit_graph.h"
+#include "odb.h"
+#include "oidmap.h"
+#include "pool.h"
+#include "profile.h"
+#include "refs.h"
+#include "strbuf.h"
+
+#define SEEN_INITIAL_SIZE (1 << 16)
+#define LOCAL_PARENTS 8
+// Commits a limited walk keeps popping once only excluded ones are queued,
+// when generation numbers cannot prove it done (git's SLOP)
+#define LIMIT_SLOP 5
+// Commits whose text is decoded together on the pool; the first batches
+// are small so the first rows do not wait for a full one
+#define DECODE_BATCH_FIRST 32
+#define DECODE_BATCH_MAX 1024
+#define DECODE_GRAIN 8
+
+// Commit waiting in the date-ordered walk queue
+typedef struct {
+    time_t commit_time;
+    unsigned long seq;      // insertion order, breaks date ties like git
+    RawCommit raw;
+} QueueEntry;
+
+
+// Newer commit date first, then first queued first
+static int queue_before(const QueueEntry *a, const QueueEntry *b) {
+    if (a->commit_time != b->commit_time) {
+        return a->commit_time > b->commit_time;
+    }
+    return a->seq < b->seq;
+}
+
+// Max-heap of generation numbers
+typedef struct {
+    uint32_t *values;
+    int count;
+    int capacity;
+} GenerationHeap;
+
+typedef struct {
+    QueueEntry *entries;
+    int count;
+    int capacity;
+    unsigned long next_seq;
+    // Generations of the queued commits. Popped ones are pushed onto
+    // `popped` and cancel out when both tops agree.
+    GenerationHeap queued;
+    GenerationHeap popped;
+    int unknown;            // queued commits without a generation
+} CommitQueue;
+
+struct CommitWalk {
+    Odb *odb;
+    CommitGraph *graph;         // NULL without a usable commit-graph file
+    HistoryCache *cache;        // NULL without a usable history cache
+    CacheWriter *cache_writer;  // commits walked, for the next cache
+    char *git_dir;
+    int lazy_text;              // WALK_LAZY_TEXT
+    Pool *pool;                 // decodes the text of indexed commits
+    QueueEntry *batch;          // commits to produce next, text decoded
+    int batch_count;
+    int batch_capacity;
+    int batch_next;
+    int uncached;               // commits walked that the cache lacked
+    unsigned char *next_parents;  // scratch space for walk_next()
+    int next_parent_capacity;
+    RefTip *tips;               // by id, then name
+    int tip_count;
+    OidMap tip_index;           // commit id -> its first tip
+    char head_ref[MAX_LINE_LENGTH];
+    unsigned char detached_head[OID_RAWSZ];
+    int is_detached;
+    OidMap seen;                // ids queued
+    OidMap shallow;
+    OidMap generations;         // computed for commits the cache and the
+                                // graph lack
+    CommitQueue queue;
+    RevisionRange range;        // -n, --since and --until
+    int emitted;                // commits produced so far
+    int limited;                // excluded revisions: find the window first
+    OidMap excluded;            // excluded revisions and their ancestors
+    QueueEntry *window;         // limited walk: the commits to show
+    int window_count;
+    int window_capacity;
+    int window_next;
+    int window_ready;
+    OidMap window_index;        // window commit -> its slot
+    unsigned char *mark_parents;  // scratch space for mark_excluded()
+    int mark_parent_capacity;
+    StrBuf subject;             // scratch space for walk_fill_commit()
+    StrBuf author;
+    StrBuf refs;
+    unsigned char *parents;
+    int parent_capacity;
+};
+
+static int heap_push(GenerationHeap *heap, uint32_t value) {
+    if (heap->count == heap->capacity) {
+        int capacity = heap->capacity ? heap->capacity * 2 : 256;
+        uint32_t *grown = realloc(heap->values, capacity * sizeof(uint32_t));
+        if (grown == NULL) {
+            return -1;
+        }
+        heap->values = grown;
+        heap->capacity = capacity;
+    }
+    int i = heap->count++;
+    while (i > 0 && heap->values[(i - 1) / 2] < value) {
+        heap->values[i] = heap->values[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap->values[i] = value;
+    return 0;
+}
+
+static void heap_pop(GenerationHeap *heap) {
+    uint32_t last = heap->values[--heap->count];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= heap->count) {
+            break;
+        }
+        if (child + 1 < heap->count && heap->values[child + 1] > heap->values[child]) {
+            child++;
+        }
+        if (heap->values[child] <= last) {
+            break;
+        }
+        heap->values[i] = heap->values[child];
+        i = child;
+    }
+    if (heap->count > 0) {
+        heap->values[i] = last;
+    }
+}
+
+// Highest generation number queued: 0 if nothing is, UINT32_MAX if one is
+// unknown
+static uint32_t queued_generation(CommitQueue *queue) {
+    if (queue->count == 0) {
+        return 0;
+    }
+    if (queue->unknown > 0) {
+        return UINT32_MAX;
+    }
+    while (queue->popped.count > 0 &&
+           queue->popped.values[0] == queue->queued.values[0]) {
+        heap_pop(&queue->popped);
+        heap_pop(&queue->queued);
+    }
+    return queue->queued.values[0];
+}
+
+static void queue_push(CommitQueue *queue, QueueEntry entry) {
+    if (queue->count == queue->capacity) {
+        int capacity = queue->capacity ? queue->capacity * 2 : 256;
+        QueueEntry *grown = realloc(queue->entries, capacity * sizeof(QueueEntry));
+        if (grown == NULL) {
+            free(entry.raw.data);
+            return;
+        }
+        queue->entries = grown;
+        queue->capacity = capacity;
+    }
+    if (entry.raw.generation == 0) {
+        queue->unknown++;
+    } else if (heap_push(&queue->queued, entry.raw.generation) != 0) {
+        // Counted as unknown, which only makes the answer less useful
+        entry.raw.generation = 0;
+        queue->unknown++;
+    }
+
+    // Sift up: newest commit at the root
+    entry.seq = queue->next_seq++;
+    int i = queue->count++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!queue_before(&entry, &queue->entries[parent])) {
+            break;
+        }
+        queue->entries[i] = queue->entries[parent];
+        i = parent;
+    }
+    queue->entries[i] = entry;
+}
+
+static QueueEntry queue_pop(CommitQueue *queue) {
+    QueueEntry top = queue->entries[0];
+    // Should the push fail, the generation stays counted as queued: too
+    // high, which is safe
+    if (top.raw.generation == 0) {
+        queue->unknown--;
+    } else {
+        heap_push(&queue->popped, top.raw.generation);
+    }
+    QueueEntry last = queue->entries[--queue->count];
+
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= queue->count) {
+            break;
+        }
+        if (child + 1 < queue->count &&
+            queue_before(&queue->entries[child + 1], &queue->entries[child])) {
+            child++;
+        }
+        if (!queue_before(&queue->entries[child], &last)) {
+            break;
+        }
+        queue->entries[i] = queue->entries[child];
+        i = child;
+    }
+    if (queue->count > 0) {
+        queue->entries[i] = last;
+    }
+    return top;
+}
+
+// Parent positions of a commit in the graph. Returns the count, or -1 if
+// the graph is corrupt. *out is `local` unless the commit has more than
+// LOCAL_PARENTS parents; the caller then frees it.
+static int read_graph_parents(const CommitGraph *graph, uint32_t pos,
+                              uint32_t *local, uint32_t **out) {
+    *out = local;
+    int count = commit_graph_parents(graph, pos, local, LOCAL_PARENTS);
+    if (count > LOCAL_PARENTS) {
+        *out = malloc(count * sizeof(uint32_t));
+        if (*out == NULL) {
+            *out = local;
+            return -1;
+        }
+        commit_graph_parents(graph, pos, *out, count);
+    }
+    return count;
+}
+
+// Find a header line such as "committer " in a commit object
+const char *find_header(const char *data, const char *name) {
+    size_t len = strlen(name);
+    const char *line = data;
+    while (*line && *line != '\n') {
+        if (strncmp(line, name, len) == 0) {
+            return line + len;
+        }
+        line = strchr(line, '\n');
+        if (line == NULL) {
+            return NULL;
+        }
+        line++;
+    }
+    return NULL;
+}
+
+// Parse "Name <email> 1700000000 +0100" into its parts; the zone is
+// returned in minutes east of UTC
+void parse_ident(const char *ident, StrBuf *name, time_t *when, int *tz) {
+    const char *eol = strchr(ident, '\n');
+    if (eol == NULL) {
+        eol = ident + strlen(ident);
+    }
+
+    const char *email = memchr(ident, '<', eol - ident);
+    const char *name_end = email ? email : eol;
+    while (name_end > ident && name_end[-1] == ' ') {
+        name_end--;
+    }
+    if (name) {
+        sb_reset(name);
+        sb_append_len(name, ident, name_end - ident);
+    }
+
+    const char *close = email ? memchr(email, '>', eol - email) : NULL;
+    *when = 0;
+    if (tz) {
+        *tz = 0;
+    }
+    if (close) {
+        char *end;
+        *when = (time_t)strtoll(close + 1, &end, 10);
+        while (*end == ' ') {
+            end++;
+        }
+        if (tz && (*end == '+' || *end == '-') && end + 5 <= eol) {
+            int hours = (end[1] - '0') * 10 + (end[2] - '0');
+            int minutes = (end[3] - '0') * 10 + (end[4] - '0');
+            *tz = (*end == '-' ? -1 : 1) * (hours * 60 + minutes);
+        }
+    }
+}
+
+// %s: the first paragraph of the message folded onto one line
+static void extract_subject(const char *message, StrBuf *subject) {
+    const char *line = message;
+
+    sb_reset(subject);
+    while (*line && *line != '\n') {
+        const char *eol = strchr(line, '\n');
+        size_t line_len = eol ? (size_t)(eol - line) : strlen(line);
+        while (line_len > 0 && (line[line_len - 1] == ' ' || line[line_len - 1] == '\r')) {
+            line_len--;
+        }
+        if (subject->len > 0) {
+            sb_append(subject, " ");
+        }
+        sb_append_len(subject, line, line_len);
+        if (eol == NULL) {
+            break;
+        }
+        line = eol + 1;
+    }
+}
+
+// Fill in message, subject, author and author date from a commit object.
+// The subject and author are kept in the given buffers.
+static void parse_commit_text(const char *data, Commit *commit,
+                              StrBuf *subject, StrBuf *author) {
+    const char *body = strstr(data, "\n\n");
+    commit->message = body ? body + 2 : "";
+
+    extract_subject(commit->message, subject);
+    commit->subject = subject->data ? subject->data : "";
+    detect_pull_request(commit, commit->subject);
+
+    const char *ident = find_header(data, "author ");
+    sb_reset(author);
+    if (ident) {
+        parse_ident(ident, author, &commit->author_time, &commit->author_tz);
+    }
+    commit->author = author->data ? author->data : "";
+}
+
+static int compare_ref_tips(const void *a, const void *b) {
+    const RefTip *x = a, *y = b;
+    int cmp = memcmp(x->oid, y->oid, OID_RAWSZ);
+    return cmp ? cmp : strcmp(x->name, y->name);
+}
+
+// Append one ref to a decoration in `%D` style
+static void append_decoration(StrBuf *refs, const char *name,
+                              const char *head_ref) {
+    if (head_ref && strcmp(name, head_ref) == 0) {
+        return; // already printed as "HEAD -> ..."
+    }
+    if (refs->len > 0) {
+        sb_append(refs, ", ");
+    }
+    if (strncmp(name, "refs/heads/", 11) == 0) {
+        sb_append(refs, name + 11);
+    } else if (strncmp(name, "refs/remotes/", 13) == 0) {
+        sb_append(refs, name + 13);
+    } else if (strncmp(name, "refs/tags/", 10) == 0) {
+        sb_appendf(refs, "tag: %s", name + 10);
+    } else {
+        sb_append(refs, name);
+    }
+}
+
+static void build_decoration(StrBuf *refs, const unsigned char *oid,
+                             const RefTip *tips, int tip_count,
+                             const OidMap *tip_index, const char *head_ref,
+                             const unsigned char *detached_head) {
+    sb_reset(refs);
+
+    int lo = tip_count;
+    if (tip_index->size > 0) {
+        oidmap_get(tip_index, oid, &lo);
+    }
+
+    // HEAD comes first, either detached or naming its branch
+    if (detached_head && memcmp(detached_head, oid, OID_RAWSZ) == 0) {
+        sb_append(refs, "HEAD");
+    }
+    for (int i = lo; i < tip_count && memcmp(tips[i].oid, oid, OID_RAWSZ) == 0; i++) {
+        if (head_ref && strcmp(tips[i].name, head_ref) == 0) {
+            const char *short_name = strncmp(head_ref, "refs/heads/", 11) == 0
+                                     ? head_ref + 11 : head_ref;
+            sb_appendf(refs, "HEAD -> %s", short_name);
+        }
+    }
+    // git lists the remaining refs in reverse name order
+    int end = lo;
+    while (end < tip_count && memcmp(tips[end].oid, oid, OID_RAWSZ) == 0) {
+        end++;
+    }
+    for (int i = end - 1; i >= lo; i--) {
+        append_decoration(refs, tips[i].name, head_ref);
+    }
+}
+
+// Read an object and peel tags until reaching a commit
+static int read_commit(Odb *odb, unsigned char *oid, unsigned char **data,
+                       size_t *size) {
+    for (int depth = 0; depth < 16; depth++) {
+        ObjectType type;
+        if (odb_read(odb, oid, &type, data, size) != 0) {
+            return -1;
+        }
+        if (type == OBJ_COMMIT) {
+            return 0;
+        }
+
+        const char *target = type == OBJ_TAG
+                             ? find_header((char *)*data, "object ") : NULL;
+        int ok = target && hex_to_oid(target, oid) == 0;
+        free(*data);
+        *data = NULL;
+        if (!ok) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+static int reserve_parents(unsigned char **parents, int *capacity, int count) {
+    if (count <= *capacity) {
+        return 0;
+    }
+    int grown_capacity = *capacity ? *capacity : 8;
+    while (grown_capacity < count) {
+        grown_capacity *= 2;
+    }
+    unsigned char *grown = realloc(*parents, grown_capacity * OID_RAWSZ);
+    if (grown == NULL) {
+        return -1;
+    }
+    *parents = grown;
+    *capacity = grown_capacity;
+    return 0;
+}
+
+// Parent ids from the "parent" lines of a commit object
+static int parse_parents(const char *data, unsigned char **parents,
+                         int *capacity) {
+    int count = 0;
+    const char *line = data;
+    while ((line = find_header(line, "parent ")) != NULL) {
+        if (reserve_parents(parents, capacity, count + 1) != 0) {
+            break;
+        }
+        if (hex_to_oid(line, *parents + count * OID_RAWSZ) == 0) {
+            count++;
+        }
+        line = strchr(line, '\n');
+        if (line == NULL) {
+            break;
+        }
+        line++;
+    }
+    return count;
+}
+
+// Generation number of a commit from the cache, the graph or an earlier
+// computation; 0 if none of them has it
+static uint32_t known_generation(const CommitWalk *walk, const unsigned char *oid) {
+    uint32_t pos;
+    int value;
+    if (walk->cache && cache_find(walk->cache, oid, &pos) == 0) {
+        return cache_generation(walk->cache, pos);
+    }
+    if (walk->graph && commit_graph_find(walk->graph, oid, &pos) == 0) {
+        return commit_graph_generation(walk->graph, pos);
+    }
+    return oidmap_get(&walk->generations, oid, &value) ? (uint32_t)value : 0;
+}
+
+typedef struct {
+    unsigned char oid[OID_RAWSZ];
+    unsigned char *data;        // read for this frame, or NULL
+    unsigned char *parents;
+    int parent_count;
+    int parent_capacity;
+    int next;                   // parent to look at next
+    uint32_t max;               // highest parent generation so far
+} GenerationFrame;
+
+// Generation number of a commit read from the object database: one more
+// than its highest parent's. Parents nothing knows are read in turn, so
+// this is only tried when the cache or the graph covers the history below
+// the new commits. Returns 0 if a parent cannot be read or the cache
+// holds it without a generation.
+static uint32_t object_generation(CommitWalk *walk, const unsigned char *oid,
+                                  const char *data) {
+    if (walk->cache == NULL && walk->graph == NULL) {
+        return 0;
+    }
+
+    GenerationFrame *stack = NULL;
+    int depth = 0, capacity = 0;
+    uint32_t result = 0;
+    unsigned char next_oid[OID_RAWSZ];
+    unsigned char *next_data = NULL;
+    memcpy(next_oid, oid, OID_RAWSZ);
+    for (int push = 1;;) {
+        if (push) {
+            if (depth == capacity) {
+                capacity = capacity ? capacity * 2 : 16;
+                GenerationFrame *grown = realloc(stack, capacity * sizeof(GenerationFrame));
+                if (grown == NULL) {
+                    free(next_data);
+                    break;
+                }
+                stack = grown;
+            }
+            GenerationFrame *frame = &stack[depth++];
+            memset(frame, 0, sizeof(*frame));
+            memcpy(frame->oid, next_oid, OID_RAWSZ);
+            frame->data = next_data;
+            frame->parent_count = parse_parents(next_data ? (const char *)next_data : data,
+                                                &frame->parents, &frame->parent_capacity);
+            next_data = NULL;
+            push = 0;
+        }
+
+        GenerationFrame *frame = &stack[depth - 1];
+        if (frame->next < frame->parent_count) {
+            const unsigned char *parent = frame->parents + frame->next * OID_RAWSZ;
+            uint32_t generation = known_generation(walk, parent);
+            if (generation == 0) {
+                uint32_t pos;
+                size_t size;
+                memcpy(next_oid, parent, OID_RAWSZ);
+                if ((walk->cache && cache_find(walk->cache, parent, &pos) == 0) ||
+                    read_commit(walk->odb, next_oid, &next_data, &size) != 0) {
+                    break;
+                }
+                push = 1;
+                continue;
+            }
+            if (generation > frame->max) {
+                frame->max = generation;
+            }
+            frame->next++;
+            continue;
+        }
+
+        uint32_t generation = frame->max + 1;
+        if (oidmap_put(&walk->generations, frame->oid, (int)generation) != 0) {
+            break;
+        }
+        free(frame->data);
+        free(frame->parents);
+        if (--depth == 0) {
+            result = generation;
+            break;
+        }
+        frame = &stack[depth - 1];
+        if (generation > frame->max) {
+            frame->max = generation;
+        }
+        frame->next++;
+    }
+
+    while (depth > 0) {
+        depth--;
+        free(stack[depth].data);
+        free(stack[depth].parents);
+    }
+    free(stack);
+    return result;
+}
+
+static void enqueue_commit(CommitWalk *walk, const unsigned char *oid) {
+    QueueEntry entry;
+    memcpy(entry.raw.oid, oid, OID_RAWSZ);
+    if (oidmap_add(&walk->seen, entry.raw.oid) != 1) {
+        return;
+    }
+
+    // The cache and the graph have everything the walk needs; the text of
+    // the commit is read later, by the pool or by the caller
+    entry.raw.data = NULL;
+    entry.raw.size = 0;
+    entry.raw.cache_pos = CACHE_NONE;
+    entry.raw.graph_pos = UINT32_MAX;
+    entry.raw.pending_generation = UINT32_MAX;
+    entry.raw.pending_time = 0;
+    if (walk->cache && cache_find(walk->cache, oid, &entry.raw.cache_pos) == 0) {
+        entry.commit_time = cache_commit_time(walk->cache, entry.raw.cache_pos);
+        entry.raw.generation = cache_generation(walk->cache, entry.raw.cache_pos);
+        queue_push(&walk->queue, entry);
+        return;
+    }
+    if (walk->graph && commit_graph_find(walk->graph, oid, &entry.raw.graph_pos) == 0) {
+        entry.commit_time = commit_graph_commit_time(walk->graph, entry.raw.graph_pos);
+        entry.raw.generation = commit_graph_generation(walk->graph, entry.raw.graph_pos);
+        queue_push(&walk->queue, entry);
+        return;
+    }
+
+    if (read_commit(walk->odb, entry.raw.oid, &entry.raw.data,
+                    &entry.raw.size) != 0) {
+        return;
+    }
+    // A tag may peel to a commit that is already queued; excluding the
+    // tag excludes its commit
+    if (memcmp(entry.raw.oid, oid, OID_RAWSZ) != 0) {
+        if (walk->excluded.count > 0 && oidmap_contains(&walk->excluded, oid)) {
+            oidmap_add(&walk->excluded, entry.raw.oid);
+        }
+        if (oidmap_add(&walk->seen, entry.raw.oid) != 1) {
+            free(entry.raw.data);
+            return;
+        }
+    }
+
+    const char *committer = find_header((char *)entry.raw.data, "committer ");
+    entry.commit_time = 0;
+    if (committer) {
+        parse_ident(committer, NULL, &entry.commit_time, NULL);
+    }
+    entry.raw.generation = known_generation(walk, entry.raw.oid);
+    if (entry.raw.generation == 0) {
+        entry.raw.generation = object_generation(walk, entry.raw.oid,
+                                                 (const char *)entry.raw.data);
+    }
+    queue_push(&walk->queue, entry);
+}
+
+static int add_ref_tip(RefTip **tips, int *count, int *capacity,
+                       const unsigned char *oid, const char *name) {
+    if (*count == *capacity) {
+        int grown_capacity = *capacity ? *capacity * 2 : 64;
+        RefTip *grown = realloc(*tips, grown_capacity * sizeof(RefTip));
+        if (grown == NULL) {
+            return -1;
+        }
+        *tips = grown;
+        *capacity = grown_capacity;
+    }
+    RefTip *tip = &(*tips)[*count];
+    memcpy(tip->oid, oid, OID_RAWSZ);
+    tip->name = strdup(name);
+    if (tip->name == NULL) {
+        return -1;
+    }
+    (*count)++;
+    return 0;
+}
+
+// Refs as `git for-each-ref` lists them, for ref stores refs_read()
+// does not understand
+static int run_for_each_ref(RefList *list) {
+    FILE *fp = popen("git for-each-ref --format='%(objectname) %(refname)'", "r");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    memset(list, 0, sizeof(*list));
+    char line[MAX_LINE_LENGTH];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        profile_add_bytes(strlen(line) + 1);
+        unsigned char oid[OID_RAWSZ];
+        if (strlen(line) < OID_HEXSZ + 2 || line[OID_HEXSZ] != ' ' ||
+            hex_to_oid(line, oid) != 0) {
+            continue;
+        }
+        if (list->count == list->capacity) {
+            int capacity = list->capacity ? list->capacity * 2 : 64;
+            Ref *grown = realloc(list->refs, capacity * sizeof(Ref));
+            if (grown == NULL) {
+                break;
+            }
+            list->refs = grown;
+            list->capacity = capacity;
+        }
+        Ref *ref = &list->refs[list->count];
+        memcpy(ref->oid, oid, OID_RAWSZ);
+        memcpy(ref->peeled, oid, OID_RAWSZ);
+        ref->peeled_known = 0;
+        ref->name = strdup(line + OID_HEXSZ + 1);
+        if (ref->name == NULL) {
+            break;
+        }
+        list->count++;
+    }
+    pclose(fp);
+    return 0;
+}
+
+// Ref tips in name order, each peeled to its commit; refs to anything
+// else are left out
+static int load_ref_tips(const RefList *refs, Odb *odb, const CommitGraph *graph,
+                         const HistoryCache *cache, RefTip **tips_out,
+                         int *count_out) {
+    RefTip *tips = NULL;
+    int count = 0, capacity = 0;
+    for (int i = 0; i < refs->count; i++) {
+        // Tags decorate the commit they point at; packed-refs usually
+        // says which, else the object is read
+        unsigned char oid[OID_RAWSZ];
+        memcpy(oid, refs->refs[i].peeled, OID_RAWSZ);
+        uint32_t pos;
+        if ((graph == NULL || commit_graph_find(graph, oid, &pos) != 0) &&
+            (cache == NULL || cache_find(cache, oid, &pos) != 0)) {
+            unsigned char *data;
+            size_t size;
+            if (read_commit(odb, oid, &data, &size) != 0) {
+                continue;
+            }
+            free(data);
+        }
+        if (add_ref_tip(&tips, &count, &capacity, oid, refs->refs[i].name) != 0) {
+            break;
+        }
+    }
+
+    *tips_out = tips;
+    *count_out = count;
+    return 0;
+}
+
+// Read HEAD: either "ref: refs/heads/x" or a detached commit id
+static void read_head(const char *git_dir, char *head_ref, size_t size,
+                      unsigned char *detached, int *is_detached) {
+    char path[MAX_COMMAND_LENGTH];
+    char line[MAX_LINE_LENGTH] = {0};
+
+    head_ref[0] = '\0';
+    *is_detached = 0;
+    snprintf(path, sizeof(path), "%s/HEAD", git_dir);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return;
+    }
+    if (fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (strncmp(line, "ref: ", 5) == 0) {
+            snprintf(head_ref, size, "%s", line + 5);
+        } else if (hex_to_oid(line, detached) == 0) {
+            *is_detached = 1;
+        }
+    }
+    fclose(fp);
+}
+
+// Commits listed in .git/shallow have their parents cut off
+static void load_shallow(const char *git_dir, OidMap *shallow) {
+    char *common_dir = git_common_dir(git_dir);
+    char path[MAX_COMMAND_LENGTH];
+    snprintf(path, sizeof(path), "%s/shallow", common_dir ? common_dir : git_dir);
+    free(common_dir);
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return;
+    }
+    char line[MAX_LINE_LENGTH];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        unsigned char oid[OID_RAWSZ];
+        if (hex_to_oid(line, oid) == 0) {
+            oidmap_add(shallow, oid);
+        }
+    }
+    fclose(fp);
+}
+
+// Parent ids of a commit in the graph, into a growable buffer
+static int graph_parent_oids(const CommitGraph *graph, uint32_t pos,
+                             unsigned char **parents, int *capacity) {
+    uint32_t local[LOCAL_PARENTS], *positions;
+    int count = read_graph_parents(graph, pos, local, &positions);
+    if (count > 0 && reserve_parents(parents, capacity, count) != 0) {
+        count = 0;
+    }
+    for (int j = 0; j < count; j++) {
+        memcpy(*parents + j * OID_RAWSZ, commit_graph_oid(graph, positions[j]),
+               OID_RAWSZ);
+    }
+    if (positions != local) {
+        free(positions);
+    }
+    return count < 0 ? 0 : count;
+}
+
+// Parents of a walked commit from whichever source described it; shallow
+// commits show none. Scratch space is only used if the source has no
+// contiguous list of its own.
+static int raw_parents(CommitWalk *walk, const RawCommit *raw,
+                       unsigned char **scratch, int *capacity,
+                       const unsigned char **parents) {
+    if (raw->cache_pos != CACHE_NONE) {
+        return cache_parents(walk->cache, raw->cache_pos, parents);
+    }
+
+    int count = 0;
+    if (raw->data == NULL) {
+        count = graph_parent_oids(walk->graph, raw->graph_pos, scratch, capacity);
+    } else if (!oidmap_contains(&walk->shallow, raw->oid)) {
+        count = parse_parents((const char *)raw->data, scratch, capacity);
+    }
+    *parents = *scratch;
+    return count;
+}
+
+// How many of a shown commit's parents the walk goes on to. Excluded
+// commits still pass exclusion on to all of theirs.
+static int walk_parents(const CommitWalk *walk, int count) {
+    return walk->range.first_parent && count > 1 ? 1 : count;
+}
+
+// Append a raw commit to the store; returns its index or -1
+int walk_fill_commit(CommitWalk *walk, const RawCommit *raw,
+                     CommitStore *store) {
+    Commit commit;
+    memset(&commit, 0, sizeof(commit));
+    memcpy(commit.oid, raw->oid, OID_RAWSZ);
+
+    if (raw->data == NULL) {
+        // Known from the cache or the graph alone; the text is read when
+        // it is shown
+        commit.subject = commit.message = commit.author = "";
+        commit.is_lazy = 1;
+        commit.commit_time = raw->cache_pos != CACHE_NONE
+                             ? cache_commit_time(walk->cache, raw->cache_pos)
+                             : commit_graph_commit_time(walk->graph, raw->graph_pos);
+    } else {
+        const char *data = (const char *)raw->data;
+        parse_commit_text(data, &commit, &walk->subject, &walk->author);
+
+        const char *committer = find_header(data, "committer ");
+        if (committer) {
+            parse_ident(committer, NULL, &commit.commit_time, NULL);
+        }
+    }
+    commit.generation = raw->generation;
+    commit.parent_count = raw_parents(walk, raw, &walk->parents,
+                                      &walk->parent_capacity, &commit.parents);
+    commit.is_merge = commit.parent_count > 1;
+
+    build_decoration(&walk->refs, raw->oid, walk->tips, walk->tip_count,
+                     &walk->tip_index, walk->head_ref[0] ? walk->head_ref : NULL,
+                     walk->is_detached ? walk->detached_head : NULL);
+    commit.refs = walk->refs.data;
+
+    determine_commit_type(&commit);
+    return store_add(store, &commit);
+}
+
+// Resolve a revision name the way git does for the common cases: HEAD,
+// a full id, a ref name with git's prefixes tried in order, or an
+// abbreviated id no ref is named after. Returns -1 for anything else
+// (HEAD~2, an ambiguous abbreviation, ...).
+static int resolve_name(const CommitWalk *walk, const RefList *refs,
+                        const char *name, size_t len, unsigned char *oid) {
+    static const char *const rules[] = {
+        "%.*s", "refs/%.*s", "refs/tags/%.*s", "refs/heads/%.*s",
+        "refs/remotes/%.*s", "refs/remotes/%.*s/HEAD",
+    };
+    if (len == 4 && strncmp(name, "HEAD", 4) == 0) {
+        if (walk->is_detached) {
+            memcpy(oid, walk->detached_head, OID_RAWSZ);
+            return 0;
+        }
+        name = walk->head_ref;
+        len = strlen(name);
+    } else if (len == OID_HEXSZ && hex_to_oid(name, oid) == 0) {
+        return 0;
+    }
+
+    char full[MAX_LINE_LENGTH];
+    for (size_t i = 0; i < sizeof(rules) / sizeof(rules[0]); i++) {
+        snprintf(full, sizeof(full), rules[i], (int)len, name);
+        const Ref *ref = refs_find(refs, full);
+        if (ref) {
+            memcpy(oid, ref->oid, OID_RAWSZ);
+            return 0;
+        }
+    }
+    return odb_resolve_prefix(walk->odb, name, len, oid) == 0 ? 0 : -1;
+}
+
+static int queue_revision(CommitWalk *walk, const unsigned char *oid, int exclude) {
+    if (exclude) {
+        if (oidmap_add(&walk->excluded, oid) < 0) {
+            return -1;
+        }
+        walk->limited = 1;
+    }
+    enqueue_commit(walk, oid);
+    return 0;
+}
+
+// Let git expand what resolve_name() does not know, one id per line and
+// excluded ones prefixed with ^
+static int queue_revision_from_git(CommitWalk *walk, const char *revision) {
+    StrBuf command;
+    sb_init(&command);
+    sb_append(&command, "git rev-parse --revs-only --end-of-options ");
+    sb_append_shell(&command, revision);
+    sb_append(&command, " 2>/dev/null");
+    char *output = execute_command(command.data);
+    sb_free(&command);
+
+    int queued = 0;
+    char *line, *next;
+    for (line = strtok_r(output, "\n", &next); line; line = strtok_r(NULL, "\n", &next)) {
+        int exclude = line[0] == '^';
+        unsigned char oid[OID_RAWSZ];
+        if (hex_to_oid(line + exclude, oid) != 0 ||
+            queue_revision(walk, oid, exclude) != 0) {
+            return -1;
+        }
+        queued++;
+    }
+    return queued > 0 ? 0 : -1;
+}
+
+// Queue the walk's starting points: "name", "^name" or "from..to"
+static int queue_revisions(CommitWalk *walk, const RefList *refs,
+                           const char *const *revisions, int count) {
+    for (int i = 0; i < count; i++) {
+        const char *revision = revisions[i];
+        const char *dots = strstr(revision, "..");
+        unsigned char from[OID_RAWSZ], to[OID_RAWSZ];
+        int resolved;
+        if (dots && dots[2] != '.') {
+            // An empty side of a range is HEAD
+            const char *to_name = dots[2] ? dots + 2 : "HEAD";
+            resolved = resolve_name(walk, refs, dots > revision ? revision : "HEAD",
+                                    dots > revision ? (size_t)(dots - revision) : 4,
+                                    from) == 0 &&
+                       resolve_name(walk, refs, to_name, strlen(to_name), to) == 0;
+            if (resolved && (queue_revision(walk, to, 0) != 0 ||
+                             queue_revision(walk, from, 1) != 0)) {
+                return -1;
+            }
+        } else {
+            int exclude = revision[0] == '^';
+            const char *name = revision + exclude;
+            resolved = !dots && resolve_name(walk, refs, name, strlen(name), to) == 0;
+            if (resolved && queue_revision(walk, to, exclude) != 0) {
+                return -1;
+            }
+        }
+        if (!resolved && queue_revision_from_git(walk, revision) != 0) {
+            fprintf(stderr, "Error: Unknown revision '%s'\n", revision);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+CommitWalk *walk_open(const char *git_dir, int flags) {
+    return walk_open_range(git_dir, flags, NULL);
+}
+
+CommitWalk *walk_open_range(const char *git_dir, int flags,
+                            const RevisionRange *range) {
+    CommitWalk *walk = calloc(1, sizeof(CommitWalk));
+    if (walk == NULL) {
+        return NULL;
+    }
+    walk->range.max_count = -1;
+    if (range) {
+        walk->range = *range;
+    }
+    int partial = range && (range->revision_count > 0 || range->max_count >= 0 ||
+                            range->since || range->until || range->first_parent);
+
+    walk->odb = odb_open(git_dir);
+    if (walk->odb == NULL ||
+        oidmap_init(&walk->seen, SEEN_INITIAL_SIZE) != 0 ||
+        oidmap_init(&walk->shallow, 64) != 0 ||
+        oidmap_init(&walk->excluded, 64) != 0 ||
+        oidmap_init(&walk->generations, 64) != 0) {
+        walk_close(walk);
+        return NULL;
+    }
+
+    read_head(git_dir, walk->head_ref, sizeof(walk->head_ref),
+              walk->detached_head, &walk->is_detached);
+    load_shallow(git_dir, &walk->shallow);
+
+    // git ignores the graph in shallow clones, whose parents it may list;
+    // so does the cache, whose entries would outlive a deepening fetch.
+    // Only a walk of the whole history may replace the cache.
+    walk->lazy_text = (flags & WALK_LAZY_TEXT) != 0;
+    if (walk->shallow.count == 0) {
+        walk->graph = commit_graph_open(odb_objects_dir(walk->odb));
+        if (flags & WALK_CACHE) {
+            walk->cache = cache_open(git_dir);
+            if (!partial) {
+                walk->cache_writer = cache_writer_new();
+                walk->git_dir = strdup(git_dir);
+            }
+        }
+    }
+    // Without a pool the text is read one commit at a time
+    if (!walk->lazy_text && (walk->graph || walk->cache)) {
+        walk->pool = pool_open(0);
+    }
+
+    RefList refs;
+    if ((refs_read(git_dir, &refs) != 0 && run_for_each_ref(&refs) != 0) ||
+        load_ref_tips(&refs, walk->odb, walk->graph, walk->cache, &walk->tips,
+                      &walk->tip_count) != 0) {
+        walk_close(walk);
+        return NULL;
+    }
+
+    if (range && range->revision_count > 0) {
+        if (queue_revisions(walk, &refs, range->revisions,
+                            range->revision_count) != 0) {
+            refs_free(&refs);
+            walk_close(walk);
+            return NULL;
+        }
+    } else {
+        // Queue refs in name order and HEAD last, as `git log --all` does;
+        // commits with equal dates then come out in the same order
+        for (int i = 0; i < walk->tip_count; i++) {
+            enqueue_commit(walk, walk->tips[i].oid);
+        }
+        if (walk->is_detached) {
+            enqueue_commit(walk, walk->detached_head);
+        }
+    }
+    refs_free(&refs);
+
+    // Decorations look tips up by id
+    qsort(walk->tips, walk->tip_count, sizeof(RefTip), compare_ref_tips);
+    if (oidmap_init(&walk->tip_index, walk->tip_count * 2 + 16) != 0 ||
+        oidmap_init(&walk->window_index, 64) != 0) {
+        walk_close(walk);
+        return NULL;
+    }
+    for (int i = walk->tip_count - 1; i >= 0; i--) {
+        oidmap_put(&walk->tip_index, walk->tips[i].oid, i);
+    }
+    return walk;
+}
+
+// Replace the cache once a whole walk has been seen, unless it held
+// exactly the commits walked
+static void update_cache(CommitWalk *walk) {
+    CacheWriter *writer = walk->cache_writer;
+    walk->cache_writer = NULL;
+    if (writer == NULL || walk->git_dir == NULL) {
+        cache_writer_free(writer);
+        return;
+    }
+
+    uint32_t cached = walk->cache ? cache_count(walk->cache) : 0;
+    if (walk->uncached > 0 || cache_writer_count(writer) != cached) {
+        if (cache_writer_commit(writer, walk->git_dir) != 0 && DEBUG) {
+            fprintf(stderr, "Could not write the history cache\n");
+        }
+    }
+    cache_writer_free(writer);
+}
+
+// Exclude a commit and its ancestors among the commits the window already
+// holds; queued commits are checked when they are popped
+static int mark_excluded(CommitWalk *walk, const unsigned char *oid) {
+    int depth = 0, capacity = 16, status = 0;
+    unsigned char (*stack)[OID_RAWSZ] = malloc(capacity * OID_RAWSZ);
+    if (stack == NULL) {
+        return -1;
+    }
+    memcpy(stack[depth++], oid, OID_RAWSZ);
+    while (depth > 0 && status == 0) {
+        unsigned char current[OID_RAWSZ];
+        memcpy(current, stack[--depth], OID_RAWSZ);
+        int added = oidmap_add(&walk->excluded, current);
+        if (added <= 0) {
+            status = added;
+            continue;
+        }
+
+        int slot;
+        if (oidmap_get(&walk->window_index, current, &slot)) {
+            const unsigned char *parents;
+            int count = raw_parents(walk, &walk->window[slot].raw, &walk->mark_parents,
+                                    &walk->mark_parent_capacity, &parents);
+            if (depth + count > capacity) {
+                capacity = (depth + count) * 2;
+                unsigned char (*grown)[OID_RAWSZ] = realloc(stack, capacity * OID_RAWSZ);
+                if (grown == NULL) {
+                    status = -1;
+                    break;
+                }
+                stack = grown;
+            }
+            memcpy(stack[depth], parents, count * OID_RAWSZ);
+            depth += count;
+        } else if (!oidmap_contains(&walk->seen, current)) {
+            enqueue_commit(walk, current);
+        }
+    }
+    free(stack);
+    return status;
+}
+
+static int add_to_window(CommitWalk *walk, const QueueEntry *entry) {
+    if (walk->window_count == walk->window_capacity) {
+        int capacity = walk->window_capacity ? walk->window_capacity * 2 : 256;
+        QueueEntry *grown = realloc(walk->window, capacity * sizeof(QueueEntry));
+        if (grown == NULL) {
+            return -1;
+        }
+        walk->window = grown;
+        walk->window_capacity = capacity;
+    }
+    walk->window[walk->window_count] = *entry;
+    return oidmap_put(&walk->window_index, entry->raw.oid, walk->window_count++);
+}
+
+static int only_excluded_queued(const CommitWalk *walk) {
+    for (int i = 0; i < walk->queue.count; i++) {
+        if (!oidmap_contains(&walk->excluded, walk->queue.entries[i].raw.oid)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// A walk with excluded revisions (`from..to`, `^old`) has to know which
+// commits the excluded ones reach before showing any, as git's limited
+// walks do. It collects the window in date order until only excluded
+// commits are queued and none of them can reach a commit in the window:
+// a commit only reaches commits of lower generation, so that is proven
+// once no queued generation is above the window's lowest. Without
+// generation numbers it goes on a few commits more, like git.
+static int limit_walk(CommitWalk *walk) {
+    int slop = LIMIT_SLOP;
+    uint32_t min_generation = UINT32_MAX;
+    time_t oldest = 0;
+    while (walk->queue.count > 0) {
+        QueueEntry entry = queue_pop(&walk->queue);
+        const unsigned char *parents;
+        int count = raw_parents(walk, &entry.raw, &walk->next_parents,
+                                &walk->next_parent_capacity, &parents);
+
+        // Like git, a limited walk excludes commits older than --since,
+        // and their ancestors with them
+        if (oidmap_contains(&walk->excluded, entry.raw.oid) ||
+            (walk->range.since && entry.commit_time < walk->range.since)) {
+            int status = oidmap_add(&walk->excluded, entry.raw.oid) < 0 ? -1 : 0;
+            for (int j = 0; j < count && status == 0; j++) {
+                status = mark_excluded(walk, parents + j * OID_RAWSZ);
+            }
+            free(entry.raw.data);
+            if (status != 0) {
+                return -1;
+            }
+        } else {
+            for (int j = 0; j < walk_parents(walk, count); j++) {
+                enqueue_commit(walk, parents + j * OID_RAWSZ);
+            }
+            if (add_to_window(walk, &entry) != 0) {
+                free(entry.raw.data);
+                return -1;
+            }
+            uint32_t generation = entry.raw.generation;
+            if (generation < min_generation) {
+                min_generation = generation;
+            }
+            oldest = entry.commit_time;
+        }
+
+        if (!only_excluded_queued(walk)) {
+            slop = LIMIT_SLOP;
+            continue;
+        }
+        if (walk->queue.count == 0 || walk->window_count == 0 ||
+            (min_generation > 0 && queued_generation(&walk->queue) <= min_generation)) {
+            break;
+        }
+        slop = walk->queue.entries[0].commit_time >= oldest ? LIMIT_SLOP : slop - 1;
+        if (slop == 0) {
+            break;
+        }
+    }
+    return 0;
+}
+
+// -n and --until, applied to the commits the walk would show
+static int shown_enough(const CommitWalk *walk) {
+    return walk->range.max_count >= 0 && walk->emitted >= walk->range.max_count;
+}
+
+static int too_new(const CommitWalk *walk, time_t commit_time) {
+    return walk->range.until && commit_time > walk->range.until;
+}
+
+static int next_in_window(CommitWalk *walk, QueueEntry *next) {
+    if (!walk->window_ready) {
+        walk->window_ready = 1;
+        if (limit_walk(walk) != 0) {
+            fprintf(stderr, "Error: Out of memory\n");
+            return 0;
+        }
+    }
+    while (walk->window_next < walk->window_count && !shown_enough(walk)) {
+        QueueEntry *entry = &walk->window[walk->window_next++];
+        if (oidmap_contains(&walk->excluded, entry->raw.oid) ||
+            too_new(walk, entry->commit_time)) {
+            free(entry->raw.data);
+            continue;
+        }
+        // The rest of the window is not queued; leave it unknown
+        walk->emitted++;
+        *next = *entry;
+        next->raw.pending_generation = UINT32_MAX;
+        return 1;
+    }
+    return 0;
+}
+
+// The next commit to produce, its text not necessarily read
+static int next_entry(CommitWalk *walk, QueueEntry *next) {
+    if (walk->limited) {
+        return next_in_window(walk, next);
+    }
+
+    while (!shown_enough(walk)) {
+        if (walk->queue.count == 0) {
+            update_cache(walk);
+            return 0;
+        }
+
+        // Commits older than --since end their line of history, as in git
+        QueueEntry entry = queue_pop(&walk->queue);
+        if (walk->range.since && entry.commit_time < walk->range.since) {
+            free(entry.raw.data);
+            continue;
+        }
+
+        const unsigned char *parents;
+        int count = raw_parents(walk, &entry.raw, &walk->next_parents,
+                                &walk->next_parent_capacity, &parents);
+        for (int j = 0; j < walk_parents(walk, count); j++) {
+            enqueue_commit(walk, parents + j * OID_RAWSZ);
+        }
+
+        if (walk->cache_writer) {
+            walk->uncached += entry.raw.cache_pos == CACHE_NONE;
+            if (cache_writer_add(walk->cache_writer, entry.raw.oid, entry.commit_time,
+                                 entry.raw.generation, parents, count) != 0) {
+                cache_writer_free(walk->cache_writer);
+                walk->cache_writer = NULL;
+            }
+        }
+
+        if (too_new(walk, entry.commit_time)) {
+            free(entry.raw.data);
+            continue;
+        }
+        entry.raw.pending_generation = queued_generation(&walk->queue);
+        entry.raw.pending_time = walk->queue.count > 0
+                                 ? walk->queue.entries[0].commit_time : 0;
+        walk->emitted++;
+        *next = entry;
+        return 1;
+    }
+    return 0;
+}
+
+static void decode_batch(void *ctx, int thread, int start, int end) {
+    (void)thread;
+    CommitWalk *walk = ctx;
+    for (int i = start; i < end; i++) {
+        RawCommit *raw = &walk->batch[i].raw;
+        unsigned char oid[OID_RAWSZ];
+        memcpy(oid, raw->oid, OID_RAWSZ);
+        if (raw->data == NULL &&
+            read_commit(walk->odb, oid, &raw->data, &raw->size) != 0) {
+            raw->data = NULL;
+        }
+    }
+}
+
+// Take the next commits from the walk and decode their text on the pool.
+// The walk decides their order alone, so the threads only fill slots.
+static int refill_batch(CommitWalk *walk) {
+    int capacity = walk->batch_capacity ? walk->batch_capacity * 2 : DECODE_BATCH_FIRST;
+    if (capacity > DECODE_BATCH_MAX) {
+        capacity = DECODE_BATCH_MAX;
+    }
+    if (capacity != walk->batch_capacity) {
+        QueueEntry *grown = realloc(walk->batch, capacity * sizeof(QueueEntry));
+        if (grown == NULL) {
+            return -1;
+        }
+        walk->batch = grown;
+        walk->batch_capacity = capacity;
+    }
+
+    walk->batch_count = 0;
+    walk->batch_next = 0;
+    while (walk->batch_count < walk->batch_capacity &&
+           next_entry(walk, &walk->batch[walk->batch_count])) {
+        walk->batch_count++;
+    }
+    pool_run(walk->pool, walk->batch_count, DECODE_GRAIN, decode_batch, walk,
+             PROFILE_DECODE);
+    return 0;
+}
+
+// Produce the next commit, newest commit date first (the order
+// `git log --all` uses). The caller owns raw->data.
+int walk_next(CommitWalk *walk, RawCommit *raw) {
+    QueueEntry entry;
+    for (;;) {
+        if (walk->pool) {
+            if (walk->batch_next == walk->batch_count &&
+                (refill_batch(walk) != 0 || walk->batch_count == 0)) {
+                return 0;
+            }
+            entry = walk->batch[walk->batch_next++];
+        } else if (!next_entry(walk, &entry)) {
+            return 0;
+        }
+
+        // A commit whose text cannot be read is left out, as when the
+        // walk reads it itself
+        if (entry.raw.data == NULL && !walk->lazy_text &&
+            read_commit(walk->odb, entry.raw.oid, &entry.raw.data,
+                        &entry.raw.size) != 0) {
+            continue;
+        }
+        *raw = entry.raw;
+        return 1;
+    }
+}
+
+void walk_close(CommitWalk *walk) {
+    if (walk == NULL) {
+        return;
+    }
+    if (DEBUG && walk->odb) {
+        fprintf(stderr, "Read %zu compressed bytes natively\n",
+                odb_bytes_read(walk->odb));
+    }
+
+    while (walk->queue.count > 0) {
+        QueueEntry entry = queue_pop(&walk->queue);
+        free(entry.raw.data);
+    }
+    free(walk->queue.entries);
+    free(walk->queue.queued.values);
+    free(walk->queue.popped.values);
+    oidmap_free(&walk->generations);
+    for (int i = walk->window_next; i < walk->window_count; i++) {
+        free(walk->window[i].raw.data);
+    }
+    free(walk->window);
+    for (int i = walk->batch_next; i < walk->batch_count; i++) {
+        free(walk->batch[i].raw.data);
+    }
+    free(walk->batch);
+    pool_close(walk->pool);
+    oidmap_free(&walk->window_index);
+    oidmap_free(&walk->excluded);
+    free(walk->mark_parents);
+    for (int i = 0; i < walk->tip_count; i++) {
+        free(walk->tips[i].name);
+    }
+    free(walk->tips);
+    oidmap_free(&walk->tip_index);
+    oidmap_free(&walk->seen);
+    oidmap_free(&walk->shallow);
+    sb_free(&walk->subject);
+    sb_free(&walk->author);
+    sb_free(&walk->refs);
+    free(walk->parents);
+    free(walk->next_parents);
+    free(walk->git_dir);
+    cache_writer_free(walk->cache_writer);
+    cache_close(walk->cache);
+    commit_graph_close(walk->graph);
+    odb_close(walk->odb);
+    free(walk);
+}
+
+const RefTip *walk_ref_tips(const CommitWalk *walk, int *count) {
+    *count = walk->tip_count;
+    return walk->tips;
+}
+
+// HEAD, a full or abbreviated id, or a branch, tag or remote name tried
+// with git's prefixes; other revisions are left to git
+int walk_resolve(CommitWalk *walk, const char *name, unsigned char *oid) {
+    static const char *const rules[] = {
+        "%s", "refs/%s", "refs/tags/%s", "refs/heads/%s",
+        "refs/remotes/%s", "refs/remotes/%s/HEAD",
+    };
+    if (strcmp(name, "HEAD") == 0) {
+        if (walk->is_detached) {
+            memcpy(oid, walk->detached_head, OID_RAWSZ);
+            return 0;
+        }
+        name = walk->head_ref;
+    } else if (strlen(name) == OID_HEXSZ && hex_to_oid(name, oid) == 0) {
+        return 0;
+    }
+
+    // Tips are peeled, so a tag gives the commit it points at
+    char full[MAX_LINE_LENGTH];
+    for (size_t i = 0; i < sizeof(rules) / sizeof(rules[0]); i++) {
+        snprintf(full, sizeof(full), rules[i], name);
+        for (int j = 0; j < walk->tip_count; j++) {
+            if (strcmp(walk->tips[j].name, full) == 0) {
+                memcpy(oid, walk->tips[j].oid, OID_RAWSZ);
+                return 0;
+            }
+        }
+    }
+    if (odb_resolve_prefix(walk->odb, name, strlen(name), oid) == 0) {
+        return 0;
+    }
+
+    StrBuf command;
+    sb_init(&command);
+    sb_append(&command, "git rev-parse --verify -q --end-of-options ");
+    sb_append_shell(&command, name);
+    sb_append(&command, "^{commit} 2>/dev/null");
+    char *output = execute_command(command.data);
+    sb_free(&command);
+    return hex_to_oid(output, oid);
+}
+
+// Fill the store in one go from the object database
+int load_commits_native(const char *git_dir, CommitStore *store) {
+    CommitWalk *walk = walk_open(git_dir, 0);
+    if (walk == NULL) {
+        return -1;
+    }
+
+    RawCommit raw;
+    while (walk_next(walk, &raw)) {
+        int index = walk_fill_commit(walk, &raw, store);
+        free(raw.data);
+        if (index < 0) {
+            break;
+        }
+    }
+
+    walk_close(walk);
+    return store_resolve_parents(store);
+}
+
+// Reader for the text a lazy walk or the log reader left out. It has an
+// object source of its own so it can run on a different thread than the
+// walk, and keeps the most recently drawn texts so a row drawn again is
+// not read again.
+#define TEXT_CACHE_SIZE 256
+
+typedef struct {
+    unsigned char oid[OID_RAWSZ];
+    unsigned char *data;        // the commit object
+    StrBuf subject;
+    StrBuf author;
+    Commit text;                // fields parsed from data
+    int newer, older;           // recency list, -1 at either end
+} TextEntry;
+
+struct CommitText {
+    Odb *odb;                   // native reader, or
+    CatFileBatch *batch;        // `git cat-file --batch` for the log reader
+    TextEntry entries[TEXT_CACHE_SIZE];
+    int used;
+    int newest, oldest;
+    OidMap index;               // commit id -> entry
+    TextStats stats;
+};
+
+CommitText *commit_text_open(const char *git_dir, ReaderMode mode) {
+    CommitText *text = calloc(1, sizeof(CommitText));
+    if (text == NULL) {
+        return NULL;
+    }
+    if (mode == READER_LOG) {
+        text->batch = batch_open();
+    } else {
+        text->odb = odb_open(git_dir);
+    }
+    if ((text->odb == NULL && text->batch == NULL) ||
+        oidmap_init(&text->index, TEXT_CACHE_SIZE * 2) != 0) {
+        commit_text_close(text);
+        return NULL;
+    }
+    text->newest = text->oldest = -1;
+    return text;
+}
+
+static void unlink_entry(CommitText *text, int slot) {
+    TextEntry *entry = &text->entries[slot];
+    if (entry->newer >= 0) {
+        text->entries[entry->newer].older = entry->older;
+    } else {
+        text->newest = entry->older;
+    }
+    if (entry->older >= 0) {
+        text->entries[entry->older].newer = entry->newer;
+    } else {
+        text->oldest = entry->newer;
+    }
+}
+
+static void push_newest(CommitText *text, int slot) {
+    TextEntry *entry = &text->entries[slot];
+    entry->newer = -1;
+    entry->older = text->newest;
+    if (text->newest >= 0) {
+        text->entries[text->newest].newer = slot;
+    } else {
+        text->oldest = slot;
+    }
+    text->newest = slot;
+}
+
+// Read a commit into a free or the least recently used entry
+static TextEntry *load_text(CommitText *text, const unsigned char *oid) {
+    unsigned char *data;
+    size_t size;
+    ObjectType type = OBJ_COMMIT;
+    double start = elapsed_ms(0);
+    int status;
+    if (text->batch) {
+        status = batch_read(text->batch, oid, &type, &data, &size);
+    } else {
+        unsigned char id[OID_RAWSZ];
+        memcpy(id, oid, OID_RAWSZ);
+        status = read_commit(text->odb, id, &data, &size);
+    }
+    double fetch_ms = elapsed_ms(start);
+    if (status != 0) {
+        return NULL;
+    }
+    if (type != OBJ_COMMIT) {
+        free(data);
+        return NULL;
+    }
+    text->stats.fetched++;
+    text->stats.fetch_ms += fetch_ms;
+    if (fetch_ms > text->stats.max_fetch_ms) {
+        text->stats.max_fetch_ms = fetch_ms;
+    }
+
+    int slot;
+    if (text->used < TEXT_CACHE_SIZE) {
+        slot = text->used++;
+    } else {
+        slot = text->oldest;
+        unlink_entry(text, slot);
+        oidmap_remove(&text->index, text->entries[slot].oid);
+        free(text->entries[slot].data);
+    }
+    TextEntry *entry = &text->entries[slot];
+    memcpy(entry->oid, oid, OID_RAWSZ);
+    entry->data = data;
+    memset(&entry->text, 0, sizeof(entry->text));
+    parse_commit_text((const char *)data, &entry->text, &entry->subject,
+                      &entry->author);
+    push_newest(text, slot);
+    if (oidmap_put(&text->index, oid, slot) != 0) {
+        // Still usable now, just not found again
+        memset(entry->oid, 0, OID_RAWSZ);
+    }
+    return entry;
+}
+
+// Fill in what a lazy commit is missing: subject, author and message, or
+// only the message if the log reader left out the body. The strings stay
+// valid until the next call. Returns -1 if the object cannot be read.
+int commit_text_fill(CommitText *text, Commit *commit) {
+    int slot;
+    TextEntry *entry;
+    if (oidmap_get(&text->index, commit->oid, &slot)) {
+        entry = &text->entries[slot];
+        unlink_entry(text, slot);
+        push_newest(text, slot);
+        text->stats.hits++;
+    } else if ((entry = load_text(text, commit->oid)) == NULL) {
+        return -1;
+    }
+
+    if (commit->is_lazy) {
+        commit->subject = entry->text.subject;
+        commit->author = entry->text.author;
+        commit->author_time = entry->text.author_time;
+        commit->author_tz = entry->text.author_tz;
+        detect_pull_request(commit, commit->subject);
+        determine_commit_type(commit);
+    }
+    commit->message = entry->text.message;
+    commit->is_lazy = 0;
+    commit->is_body_lazy = 0;
+    return 0;
+}
+
+void commit_text_stats(const CommitText *text, TextStats *stats) {
+    *stats = text->stats;
+    stats->bytes = text->batch ? batch_bytes_read(text->batch)
+                               : odb_bytes_read(text->odb);
+}
+
+void commit_text_close(CommitText *text) {
+    if (text == NULL) {
+        return;
+    }
+    for (int i = 0; i < text->used; i++) {
+        free(text->entries[i].data);
+        sb_free(&text->entries[i].subject);
+        sb_free(&text->entries[i].author);
+    }
+    oidmap_free(&text->index);
+    batch_close(text->batch);
+    odb_close(text->odb);
+    free(text);
+}
@@ -1,8 +1,32 @@
+#include <ctype.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
-#include "../shrub.c"
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "shrub.h"
+#include "batch.h"
+#include "bloom.h"
+#include "cache.h"
+#include "commit_graph.h"
+#include "daemon.h"
+#include "diff.h"
+#include "export.h"
+#include "filelog.h"
+#include "odb.h"
+#include "pool.h"
+#include "profile.h"
+#include "queue.h"
+#include "reach.h"
+#include "stats.h"
+#include "strbuf.h"
+#include "viewer.h"
 
 void test_execute_command() {
     char* result = execute_command("git --version");
@@ -22,24 +46,1929 @@ void test_git_repo_setup() {
 }
 
 void test_parse_git_log() {
-    commit_count = 0;
-    parse_git_log();
-    assert(commit_count > 0);
-    assert(strlen(commits[0].hash) == 40);  // Full hash length
-    assert(strlen(commits[0].subject) > 0);
+    CommitStore store;
+    assert(store_init(&store) == 0);
+    parse_git_log(&store);
+    assert(store.count > 0);
+
+    Commit commit;
+    store_get(&store, 0, &commit);
+    assert(strlen(commit.subject) > 0);
+    assert(strlen(commit.author) > 0);
+    store_free(&store);
     printf("✓ parse_git_log test passed\n");
 }
 
+// Find a commit by id in a store
+static int find_commit(const CommitStore *store, const unsigned char *oid) {
+    for (int i = 0; i < store->count; i++) {
+        if (memcmp(store_oid(store, i), oid, OID_RAWSZ) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void test_native_reader() {
+    // A merge, a tag and a multi-line message, half packed and half loose
+    system("cd test_repo && git checkout -q -b feature"
+           " && echo 'feature' > feature.txt && git add ."
+           " && git commit -q -m 'Add feature' -m 'Longer description'"
+           " && git tag -a v1.0 -m 'Release'"
+           " && git checkout -q - && echo 'main' >> test.txt"
+           " && git commit -q -am 'Update test' && git gc -q"
+           " && git merge -q --no-ff feature -m 'Merge pull request #7 from feature'");
+
+    assert(chdir("test_repo") == 0);
+    CommitStore expected, actual;
+    assert(store_init(&expected) == 0);
+    assert(store_init(&actual) == 0);
+    parse_git_log(&expected);
+    assert(expected.count == 4);
+
+    assert(load_commits_native(".git", &actual) == 0);
+    assert(chdir("..") == 0);
+    assert(actual.count == 4);
+
+    for (int i = 0; i < expected.count; i++) {
+        Commit a, b;
+        store_get(&expected, i, &a);
+        int j = find_commit(&actual, a.oid);
+        assert(j >= 0);
+        store_get(&actual, j, &b);
+        assert(strcmp(a.subject, b.subject) == 0);
+        assert(strcmp(a.author, b.author) == 0);
+        assert(a.author_time == b.author_time);
+        assert(a.author_tz == b.author_tz);
+        assert(strcmp(a.refs, b.refs) == 0);
+        assert(a.parent_count == b.parent_count);
+        assert(a.parent_count == 0 ||
+               memcmp(a.parents, b.parents, a.parent_count * OID_RAWSZ) == 0);
+        assert(a.is_pr == b.is_pr);
+    }
+    for (int i = 0; i < actual.count; i++) {
+        Commit commit;
+        store_get(&actual, i, &commit);
+        for (int j = 0; j < commit.parent_count; j++) {
+            int parent = store_parent_index(&actual, i)[j];
+            assert(parent >= 0);
+            assert(memcmp(store_oid(&actual, parent), commit.parents + j * OID_RAWSZ,
+                          OID_RAWSZ) == 0);
+        }
+        if (strcmp(commit.subject, "Add feature") == 0) {
+            // The native reader keeps the whole body
+            assert(strstr(commit.message, "Longer description") != NULL);
+            assert(strstr(commit.refs, "tag: v1.0") != NULL);
+        }
+    }
+    store_free(&expected);
+    store_free(&actual);
+    printf("✓ native reader test passed\n");
+}
+
+void test_commit_text() {
+    assert(chdir("test_repo") == 0);
+    CommitStore log, native;
+    assert(store_init(&log) == 0);
+    assert(store_init(&native) == 0);
+    parse_git_log(&log);
+    assert(load_commits_native(".git", &native) == 0);
+
+    // git log leaves the bodies to `git cat-file --batch`
+    CommitText *text = commit_text_open(".git", READER_LOG);
+    assert(text != NULL);
+
+    // A missing object leaves the child answering the next request
+    Commit missing;
+    store_get(&log, 0, &missing);
+    memset(missing.oid, 0x42, OID_RAWSZ);
+    assert(commit_text_fill(text, &missing) == -1);
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < log.count; i++) {
+            Commit a, b;
+            store_get(&log, i, &a);
+            assert(a.is_body_lazy && a.message[0] == '\0');
+            assert(commit_text_fill(text, &a) == 0);
+            assert(!a.is_body_lazy);
+            store_get(&native, find_commit(&native, a.oid), &b);
+            assert(strcmp(a.message, b.message) == 0);
+            assert(strcmp(a.subject, b.subject) == 0);
+        }
+    }
+
+    // The second pass was served from the cache
+    TextStats stats;
+    commit_text_stats(text, &stats);
+    assert(stats.fetched == log.count);
+    assert(stats.hits == log.count);
+    assert(stats.bytes > 0);
+    commit_text_close(text);
+    assert(chdir("..") == 0);
+
+    store_free(&log);
+    store_free(&native);
+
+    // SHA-256 ids are refused rather than cut down to SHA-1 length, and
+    // the longer answer from cat-file is not taken for a header
+    system("rm -rf sha256_repo && git init -q --object-format=sha256 sha256_repo"
+           " && cd sha256_repo && git commit -q --allow-empty -m one");
+    assert(chdir("sha256_repo") == 0);
+    char *hex = execute_command("git rev-parse HEAD");
+    char line[MAX_LINE_LENGTH];
+    snprintf(line, sizeof(line), "COMMIT_SEP%.64s|x|one|A|2001-01-01|||", hex);
+    CommitStore sha256;
+    assert(store_init(&sha256) == 0);
+    assert(parse_log_record(line, &sha256) == -2);
+    assert(sha256.count == 0);
+    store_free(&sha256);
+
+    unsigned char oid[OID_RAWSZ];
+    assert(hex_to_oid(hex, oid) == 0);
+    CatFileBatch *batch = batch_open();
+    assert(batch != NULL);
+    ObjectType type;
+    unsigned char *data;
+    size_t size;
+    assert(batch_read(batch, oid, &type, &data, &size) == -1);
+    batch_close(batch);
+    assert(chdir("..") == 0);
+    system("rm -rf sha256_repo");
+    printf("✓ commit text test passed\n");
+}
+
+// The default order as the pipeline streams it, straight off the walk;
+// returns how many rows were let through before the walk ended
+static int stream_date_order(int flags, int *permutation) {
+    CommitStore store;
+    assert(store_init(&store) == 0);
+    CommitWalk *walk = walk_open(".git", WALK_LAZY_TEXT | flags);
+    DateStream *stream = date_stream_open(&store);
+    assert(walk != NULL && stream != NULL);
+
+    RawCommit raw;
+    int rows = 0, next;
+    while (walk_next(walk, &raw)) {
+        int index = store.count;
+        assert(walk_fill_commit(walk, &raw, &store) >= 0);
+        free(raw.data);
+        assert(date_stream_add(stream, index, raw.pending_generation, raw.pending_time) == 0);
+        while ((next = date_stream_next(stream)) >= 0) {
+            permutation[rows++] = next;
+        }
+        assert(next == -1);
+    }
+    walk_close(walk);
+    int early = rows;
+    assert(date_stream_finish(stream) == 0);
+    while ((next = date_stream_next(stream)) >= 0) {
+        permutation[rows++] = next;
+    }
+    assert(rows == store.count);
+    date_stream_close(stream);
+    store_free(&store);
+    return early;
+}
+
+void test_sort_commits() {
+    // A skewed clock: the child claims to be older than its parent
+    system("cd test_repo && git checkout -q -b skew"
+           " && GIT_COMMITTER_DATE='2001-01-02T00:00:00' git commit -q --allow-empty -m parent"
+           " && GIT_COMMITTER_DATE='2001-01-01T00:00:00' git commit -q --allow-empty -m child"
+           " && git checkout -q -");
+
+    assert(chdir("test_repo") == 0);
+    CommitStore store;
+    assert(store_init(&store) == 0);
+    assert(load_commits_native(".git", &store) == 0);
+
+    // The default date order is streamed off the walk, from generation
+    // numbers worked out from the objects, then from the shrub-cache
+    const char *flags[] = {"--date-order", "--date-order", "--date-order",
+                           "--author-date-order", "--topo-order"};
+    SortOrder orders[] = {ORDER_DATE, ORDER_DATE, ORDER_DATE, ORDER_AUTHOR_DATE, ORDER_TOPO};
+    int streamed[] = {0, WALK_CACHE, WALK_CACHE, -1, -1};
+    int *permutation = malloc(store.count * sizeof(int));
+    for (int m = 0; m < 5; m++) {
+        // Same order as git itself
+        char command[MAX_COMMAND_LENGTH];
+        snprintf(command, sizeof(command), "git log --all %s --format=%%H", flags[m]);
+        char *expected = strdup(execute_command(command));
+        if (streamed[m] < 0) {
+            assert(sort_commits(&store, orders[m], permutation) == 0);
+        } else {
+            // Rows go out before the walk is over
+            assert(stream_date_order(streamed[m], permutation) > 0);
+        }
+
+        char *line = expected;
+        for (int i = 0; i < store.count; i++) {
+            char hex[OID_HEXSZ + 1];
+            oid_to_hex(store_oid(&store, permutation[i]), hex);
+            assert(strncmp(line, hex, OID_HEXSZ) == 0);
+            line += OID_HEXSZ + 1;
+        }
+        free(expected);
+
+        // Never a parent above its child, skewed clock or not
+        int *position = malloc(store.count * sizeof(int));
+        for (int i = 0; i < store.count; i++) {
+            position[permutation[i]] = i;
+        }
+        for (int i = 0; i < store.count; i++) {
+            for (int j = 0; j < store_parent_count(&store, i); j++) {
+                assert(position[store_parent_index(&store, i)[j]] > position[i]);
+            }
+        }
+        free(position);
+    }
+    unlink(".git/" CACHE_FILE);
+    assert(chdir("..") == 0);
+
+    free(permutation);
+    store_free(&store);
+    printf("✓ sort commits test passed\n");
+}
+
+void test_commit_graph() {
+    // An octopus merge in a split graph, with a commit newer than the graph
+    system("cd test_repo && git checkout -q -b octopus"
+           " && git commit -q --allow-empty -m 'Octopus' && git reset -q --hard"
+           " $(git commit-tree HEAD^{tree} -p HEAD -p feature -p skew -m Octopus)"
+           " && git commit-graph write --reachable --split"
+           " && git commit -q --allow-empty -m 'After octopus'"
+           " && git commit-graph write --reachable --split=no-merge"
+           " && git commit -q --allow-empty -m 'Not in the graph'"
+           " && git checkout -q -");
+
+    assert(chdir("test_repo") == 0);
+    CommitStore expected, actual;
+    assert(store_init(&expected) == 0);
+    assert(store_init(&actual) == 0);
+    assert(load_commits_native(".git", &expected) == 0);
+
+    CommitWalk *walk = walk_open(".git", WALK_LAZY_TEXT);
+    CommitText *text = commit_text_open(".git", READER_NATIVE);
+    assert(walk != NULL && text != NULL);
+    RawCommit raw;
+    int lazy = 0;
+    while (walk_next(walk, &raw)) {
+        lazy += raw.data == NULL;
+        assert(walk_fill_commit(walk, &raw, &actual) >= 0);
+        free(raw.data);
+    }
+    walk_close(walk);
+    assert(store_resolve_parents(&actual) == 0);
+
+    // Same walk, with the text read back only when asked for
+    assert(actual.count == expected.count);
+    assert(lazy == actual.count - 1);
+    int octopus = 0;
+    for (int i = 0; i < actual.count; i++) {
+        Commit a, b;
+        store_get(&expected, i, &a);
+        store_get(&actual, i, &b);
+        assert(memcmp(a.oid, b.oid, OID_RAWSZ) == 0);
+        assert(a.commit_time == b.commit_time);
+        assert(a.parent_count == b.parent_count);
+        assert(a.parent_count == 0 ||
+               memcmp(a.parents, b.parents, a.parent_count * OID_RAWSZ) == 0);
+        assert(strcmp(a.refs, b.refs) == 0);
+        octopus += b.parent_count == 3;
+
+        if (b.is_lazy) {
+            assert(b.subject[0] == '\0');
+            assert(commit_text_fill(text, &b) == 0);
+        }
+        assert(strcmp(a.subject, b.subject) == 0);
+        assert(strcmp(a.message, b.message) == 0);
+        assert(strcmp(a.author, b.author) == 0);
+        assert(a.author_time == b.author_time);
+
+        // Generation numbers grow from the roots up
+        for (int j = 0; b.generation && j < b.parent_count; j++) {
+            int parent = store_parent_index(&actual, i)[j];
+            assert(store_generation(&actual, parent) < b.generation);
+        }
+        if (b.parent_count == 0) {
+            assert(b.generation == 1);
+        }
+    }
+    assert(octopus == 1);
+    assert(chdir("..") == 0);
+
+    commit_text_close(text);
+    store_free(&expected);
+    store_free(&actual);
+    printf("✓ commit graph test passed\n");
+}
+
+// Walk with the history cache and check it against a full read; returns
+// how many commits came from the cache
+static int walk_with_cache() {
+    CommitStore expected, actual;
+    assert(store_init(&expected) == 0);
+    assert(store_init(&actual) == 0);
+    assert(load_commits_native(".git", &expected) == 0);
+
+    CommitWalk *walk = walk_open(".git", WALK_LAZY_TEXT | WALK_CACHE);
+    assert(walk != NULL);
+    RawCommit raw;
+    int cached = 0;
+    while (walk_next(walk, &raw)) {
+        cached += raw.cache_pos != CACHE_NONE;
+        assert(walk_fill_commit(walk, &raw, &actual) >= 0);
+        free(raw.data);
+    }
+    walk_close(walk);
+
+    assert(actual.count == expected.count);
+    for (int i = 0; i < actual.count; i++) {
+        Commit a, b;
+        store_get(&expected, i, &a);
+        store_get(&actual, i, &b);
+        assert(memcmp(a.oid, b.oid, OID_RAWSZ) == 0);
+        assert(a.commit_time == b.commit_time);
+        assert(a.generation == b.generation);
+        assert(a.parent_count == b.parent_count);
+        assert(a.parent_count == 0 ||
+               memcmp(a.parents, b.parents, a.parent_count * OID_RAWSZ) == 0);
+        assert(strcmp(a.refs, b.refs) == 0);
+    }
+
+    // The cache now holds exactly the reachable commits
+    HistoryCache *cache = cache_open(".git");
+    assert(cache != NULL);
+    assert((int)cache_count(cache) == expected.count);
+    cache_close(cache);
+
+    store_free(&expected);
+    store_free(&actual);
+    return cached;
+}
+
+void test_history_cache() {
+    assert(chdir("test_repo") == 0);
+    unlink(".git/" CACHE_FILE);
+    assert(walk_with_cache() == 0);
+    int total = walk_with_cache();
+    assert(total > 0);
+
+    // Only the new commit is read
+    system("git commit -q --allow-empty -m 'Cached next time'");
+    assert(walk_with_cache() == total);
+    total++;
+    assert(walk_with_cache() == total);
+
+    // A rewritten commit replaces the old one, which is pruned
+    system("git commit -q --amend --allow-empty -m 'Rewritten'");
+    assert(walk_with_cache() == total - 1);
+    assert(walk_with_cache() == total);
+
+    // A damaged cache is rebuilt
+    FILE *fp = fopen(".git/" CACHE_FILE, "r+b");
+    assert(fp != NULL);
+    fseek(fp, 100, SEEK_SET);
+    fputc(0x5a ^ fgetc(fp), fp);
+    fclose(fp);
+    assert(walk_with_cache() == 0);
+    assert(walk_with_cache() == total);
+
+    // Without the flag the cache is neither read nor written
+    unlink(".git/" CACHE_FILE);
+    CommitWalk *walk = walk_open(".git", WALK_LAZY_TEXT);
+    RawCommit raw;
+    while (walk_next(walk, &raw)) {
+        free(raw.data);
+    }
+    walk_close(walk);
+    assert(access(".git/" CACHE_FILE, F_OK) != 0);
+    assert(chdir("..") == 0);
+    printf("✓ history cache test passed\n");
+}
+
+void test_commit_store() {
+    CommitStore store;
+    assert(store_init(&store) == 0);
+
+    // Enough commits to span several chunks, with an octopus merge
+    unsigned char parents[7 * OID_RAWSZ];
+    memset(parents, 0xab, sizeof(parents));
+    int total = STORE_CHUNK_SIZE * 2 + 10;
+    for (int i = 0; i < total; i++) {
+        char name[32];
+        Commit commit;
+        memset(&commit, 0, sizeof(commit));
+        memcpy(commit.oid, &i, sizeof(i));
+        snprintf(name, sizeof(name), "Author %d", i % 3);
+        commit.author = name;
+        commit.subject = "Subject";
+        commit.message = "Subject\n\nBody\n";
+        commit.refs = "";
+        commit.author_time = 1700000000 + i;
+        // Each commit's first parent is the next one added
+        int next = i + 1;
+        memset(parents, 0, OID_RAWSZ);
+        memcpy(parents, &next, sizeof(next));
+        commit.parents = parents;
+        commit.parent_count = i == 42 ? 7 : 1;
+        assert(store_add(&store, &commit) == i);
+    }
+    assert(store_resolve_parents(&store) == 0);
+    assert(store_parent_index(&store, 0)[0] == 1);
+    assert(store_parent_index(&store, STORE_CHUNK_SIZE)[0] == STORE_CHUNK_SIZE + 1);
+    assert(store_parent_index(&store, 42)[1] == -1);
+    assert(store_parent_index(&store, total - 1)[0] == -1);
+    assert(store_find(&store, store_oid(&store, 1234)) == 1234);
+    assert(store.count == total);
+    assert(store.author_count == 3);
+
+    Commit a, b;
+    store_get(&store, 0, &a);
+    store_get(&store, STORE_CHUNK_SIZE * 2 + 1, &b);
+    assert(a.author == b.author);  // interned
+    assert(b.author_time == 1700000000 + STORE_CHUNK_SIZE * 2 + 1);
+    store_get(&store, 42, &a);
+    assert(a.parent_count == 7);
+    assert(memcmp(a.parents + OID_RAWSZ, parents + OID_RAWSZ, 6 * OID_RAWSZ) == 0);
+
+    char date[32];
+    format_iso_date(0, -90, date, sizeof(date));
+    assert(strcmp(date, "1969-12-31 22:30:00 -0130") == 0);
+
+    store_free(&store);
+    printf("✓ commit store test passed\n");
+}
+
+// Add a commit with a made-up id to the global store
+static int add_layout_commit(int id, const int *parents, int parent_count) {
+    unsigned char parent_oids[2 * OID_RAWSZ];
+    Commit commit;
+    memset(&commit, 0, sizeof(commit));
+    memset(parent_oids, 0, sizeof(parent_oids));
+    memcpy(commit.oid, &id, sizeof(id));
+    for (int j = 0; j < parent_count; j++) {
+        memcpy(parent_oids + j * OID_RAWSZ, &parents[j], sizeof(int));
+    }
+    commit.subject = commit.message = parent_count > 1 ? "Merge" : "";
+    commit.author = commit.refs = "";
+    commit.parents = parent_oids;
+    commit.parent_count = parent_count;
+    determine_commit_type(&commit);
+    return store_add(&commit_store, &commit);
+}
+
+void test_layout() {
+    assert(store_init(&commit_store) == 0);
+    layout_reset();
+    Row row;
+
+    // 150 tips with their own parents need far more lanes than colors
+    int root = 1000;
+    for (int i = 0; i < 150; i++) {
+        int parent = 500 + i;
+        int index = add_layout_commit(i, &parent, 1);
+        assert(layout_commit(index, &row) == 0);
+        assert(*store_lane(&commit_store, index) == i);
+        assert(row.width == i + 1);
+        row_free(&row);
+    }
+
+    // The parents all lead to the root, so every lane but the first ends
+    for (int i = 0; i < 150; i++) {
+        int index = add_layout_commit(500 + i, &root, 1);
+        assert(layout_commit(index, &row) == 0);
+        assert(*store_lane(&commit_store, index) == i);
+        assert(row.has_connector == (i > 0));
+        row_free(&row);
+    }
+
+    // A new tip reuses the lowest free lane. Its first parent joins the
+    // root's lane, which frees the lane again for the second parent.
+    int parents[2] = {root, 2000};
+    int index = add_layout_commit(1500, parents, 2);
+    assert(layout_commit(index, &row) == 0);
+    assert(*store_lane(&commit_store, index) == 1);
+    assert(row.has_connector);
+
+    StrBuf text;
+    sb_init(&text);
+    render_row(&row, NULL, &text);
+    assert(strstr(text.data, MERGE_SYMBOL) != NULL);
+    assert(strstr(text.data, "├─") != NULL);
+    assert(strstr(text.data, "┤") != NULL);
+    row_free(&row);
+
+    int second = add_layout_commit(2000, &root, 1);
+    assert(layout_commit(second, &row) == 0);
+    assert(*store_lane(&commit_store, second) == 1);
+    row_free(&row);
+    int last = add_layout_commit(root, NULL, 0);
+    assert(layout_commit(last, &row) == 0);
+    assert(*store_lane(&commit_store, last) == 0);
+    assert(row.has_connector == 0);
+    row_free(&row);
+
+    // Every parent was resolved as its row was laid out
+    for (int i = 0; i < commit_store.count; i++) {
+        for (int j = 0; j < store_parent_count(&commit_store, i); j++) {
+            int parent = store_parent_index(&commit_store, i)[j];
+            assert(parent >= 0);
+            assert(memcmp(store_oid(&commit_store, parent),
+                          store_parent_oid(&commit_store, i, j), OID_RAWSZ) == 0);
+        }
+    }
+    assert(store_parent_index(&commit_store, index)[1] == second);
+
+    // A branch tip opens its lane in the branch's color, whatever came before
+    layout_reset();
+    int tip_id = 3000;
+    unsigned char tip[OID_RAWSZ] = {0};
+    memcpy(tip, &tip_id, sizeof(tip_id));
+    assert(layout_add_branch(tip, "main") == 0);
+    assert(layout_add_branch(tip, "other") == 0);
+    int tip_index = add_layout_commit(tip_id, NULL, 0);
+    assert(layout_commit(tip_index, &row) == 0);
+    assert(row.color == branch_color("main"));
+    assert(branch_color("main") >= 0 && branch_color("main") < COLOR_COUNT);
+    row_free(&row);
+
+    sb_free(&text);
+    layout_reset();
+    store_free(&commit_store);
+    printf("✓ layout test passed\n");
+}
+
+void test_export() {
+    assert(store_init(&commit_store) == 0);
+    layout_reset();
+    int parents[2] = {11, 12};
+    int merge = add_layout_commit(10, parents, 2);
+    int side = add_layout_commit(12, NULL, 0);
+    Commit commit;
+    Row rows[2];
+    assert(layout_commit(merge, &rows[0]) == 0);
+    assert(layout_commit(side, &rows[1]) == 0);
+
+    FILE *out = tmpfile();
+    assert(out != NULL);
+    ExportWriter writer;
+    assert(export_writer_init(&writer, fileno(out)) == 0);
+    for (int format = EXPORT_NDJSON; format <= EXPORT_BINARY; format++) {
+        export_begin(&writer, format);
+        export_row(&writer, format, &rows[0], 0);
+        export_row(&writer, format, &rows[1], 1);
+    }
+    assert(export_flush(&writer) == 0);
+    export_writer_free(&writer);
+
+    char data[4096];
+    rewind(out);
+    size_t size = fread(data, 1, sizeof(data), out);
+    fclose(out);
+
+    // The second parent waits in a lane of its own
+    const char *second = strchr(data, '\n') + 1;
+    assert(strncmp(data, "{\"row\":0,\"commit\":\"0a000000", 27) == 0);
+    assert(strstr(data, "\"lane\":0}") != NULL && strstr(data, "\"lane\":1}]") < second);
+    assert(strstr(data, "\"merge\":true,\"pr\":null") < second);
+    assert(strncmp(second, "{\"row\":1,\"commit\":\"0c000000", 27) == 0);
+    assert(strstr(second, "\"lane\":1,\"color\":") != NULL);
+
+    // The binary records say the same, after the stream header
+    const unsigned char *p = memchr(second, '\n', data + size - second);
+    assert(p != NULL);
+    p++;
+    assert(memcmp(p, EXPORT_MAGIC, 8) == 0);
+    p += 8;
+    for (int i = 0; i < 2; i++) {
+        uint32_t length = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+        store_get(&commit_store, rows[i].commit, &commit);
+        assert(p[4] == i);                                 // row
+        assert(p[8] == *store_lane(&commit_store, rows[i].commit));
+        assert(p[12] == rows[i].color);
+        assert(p[13] == (i == 0 ? EXPORT_FLAG_MERGE : 0));
+        assert(p[14] == commit.parent_count);
+        assert(memcmp(p + 16, commit.oid, OID_RAWSZ) == 0);
+        if (i == 0) {
+            assert(memcmp(p + 56 + OID_RAWSZ + 4, commit.parents + OID_RAWSZ,
+                          OID_RAWSZ) == 0);
+            assert(p[56 + 2 * OID_RAWSZ + 4] == 1);       // second parent's lane
+        }
+        p += 4 + length;
+    }
+    assert(p == (const unsigned char *)data + size);
+
+    row_free(&rows[0]);
+    row_free(&rows[1]);
+    layout_reset();
+    store_free(&commit_store);
+    printf("✓ export test passed\n");
+}
+
+// Commits 1 -> 2 -> ... -> 20 as the viewer gets them: 2, 3 and 4 as a
+// collapsed chain, the others a row each
+#define VIEW_COMMITS 20
+#define VIEW_ROWS (VIEW_COMMITS - 2)
+
+static void *produce_view_rows(void *arg) {
+    SpscQueue *queue = arg;
+    layout_reset();
+    for (int i = 0; i < VIEW_COMMITS; i = i == 1 ? 4 : i + 1) {
+        Row row;
+        if (i == 1) {
+            assert(layout_chain(i, 3, &row) == 0);
+        } else {
+            assert(layout_commit(i, &row) == 0);
+        }
+        spsc_push(queue, &row);
+    }
+    spsc_close(queue);
+    return NULL;
+}
+
+// A viewer five lines high whose rows are still coming, two at a time
+static void open_viewer(Viewer *view, SpscQueue *queue, pthread_t *producer) {
+    assert(spsc_init(queue, 2, sizeof(Row)) == 0);
+    pthread_create(producer, NULL, produce_view_rows, queue);
+    viewer_init(view, queue, NULL, 80, 6);
+    assert(viewer_wait_row(view) == 1);
+    assert(view->count < VIEW_ROWS && view->loading);
+}
+
+static void close_viewer(Viewer *view, SpscQueue *queue, pthread_t producer) {
+    while (viewer_wait_row(view)) {
+    }
+    pthread_join(producer, NULL);
+    viewer_free(view);
+    spsc_destroy(queue);
+    layout_reset();
+}
+
+void test_viewer() {
+    assert(store_init(&commit_store) == 0);
+    for (int id = 1; id <= VIEW_COMMITS; id++) {
+        int parent = id + 1;
+        add_layout_commit(id, &parent, id < VIEW_COMMITS ? 1 : 0);
+    }
+    assert(store_resolve_parents(&commit_store) == 0);
+
+    // Commit ids of any case, whole bytes or not
+    unsigned char prefix[OID_RAWSZ];
+    int nibbles;
+    unsigned char oid[OID_RAWSZ] = { 0xab, 0xcd };
+    assert(parse_hex_prefix("ABc", prefix, &nibbles) == 0 && nibbles == 3);
+    assert(prefix[0] == 0xab && prefix[1] == 0xc0);
+    assert(oid_has_prefix(oid, prefix, nibbles));
+    assert(parse_hex_prefix("abd", prefix, &nibbles) == 0);
+    assert(!oid_has_prefix(oid, prefix, nibbles));
+    assert(parse_hex_prefix("a", prefix, &nibbles) == 0 && oid_has_prefix(oid, prefix, 1));
+    assert(parse_hex_prefix("abcd", prefix, &nibbles) == 0 && oid_has_prefix(oid, prefix, 4));
+    assert(parse_hex_prefix("", prefix, &nibbles) == -1);
+    assert(parse_hex_prefix("abg", prefix, &nibbles) == -1);
+    assert(parse_hex_prefix("00000000000000000000000000000000000000000", prefix,
+                            &nibbles) == -1);
+
+    // Searches wait for the rows they have not reached yet and bring the
+    // one found into the window, opening the chain it is in
+    Viewer view;
+    SpscQueue queue;
+    pthread_t producer;
+    open_viewer(&view, &queue, &producer);
+    snprintf(view.search, sizeof(view.search), "10000000");
+    viewer_search(&view, 0);
+    assert(view.count > 13 && view.top <= 13 && view.top + 5 > 13);
+    snprintf(view.search, sizeof(view.search), "03");
+    viewer_search(&view, 1);
+    assert(view.top == 1 && view.rows[1].expanded);
+    snprintf(view.search, sizeof(view.search), "ffff");
+    viewer_search(&view, 0);
+    assert(view.top == 1 && strstr(view.message, "not found") != NULL);
+    assert(view.count == VIEW_ROWS && !view.loading);
+
+    // Line by line through the open chain; past the end the last page
+    // stays full
+    view.top = 0;
+    viewer_scroll_down(&view, 2);
+    assert(view.top == 1 && view.top_line == 1);
+    viewer_scroll_down(&view, 2);
+    assert(view.top == 2 && view.top_line == 0);
+    viewer_scroll_up(&view, 1);
+    assert(view.top == 1 && view.top_line == 2);
+    viewer_scroll_down(&view, 100);
+    assert(view.top == VIEW_ROWS - 5 && view.top_line == 0);
+    view.top = VIEW_ROWS - 1;
+    viewer_clamp(&view);
+    assert(view.top == VIEW_ROWS - 5);
+    view.top = 0;
+    viewer_show_end(&view);
+    assert(view.top == VIEW_ROWS - 5 && view.top_line == 0);
+
+    // The first chain in the window, if there is one in it
+    view.top = 0;
+    viewer_toggle_chain(&view);
+    assert(!view.rows[1].expanded);
+    viewer_toggle_chain(&view);
+    assert(view.rows[1].expanded);
+    view.top = 2;
+    viewer_toggle_chain(&view);
+    assert(view.rows[1].expanded && strstr(view.message, "No collapsed") != NULL);
+    close_viewer(&view, &queue, producer);
+
+    // Jumps wait for rows too, and open chains
+    open_viewer(&view, &queue, &producer);
+    viewer_jump_to_commit(&view, "0A0");
+    assert(view.top <= 7 && view.top + 5 > 7 && view.message[0] == '\0');
+    viewer_jump_to_commit(&view, "040");
+    assert(view.top == 1 && view.rows[1].expanded);
+    viewer_jump_to_commit(&view, "041");
+    assert(view.top == 1 && strstr(view.message, "No commit") != NULL);
+    viewer_jump_to_commit(&view, "zz");
+    assert(strstr(view.message, "Not a commit hash") != NULL);
+    close_viewer(&view, &queue, producer);
+
+    store_free(&commit_store);
+    printf("✓ viewer test passed\n");
+}
+
+void test_oidmap() {
+    OidMap map;
+    assert(oidmap_init(&map, 4) == 0);
+
+    // Ids sharing their leading bytes collide, exercising removal
+    // from the middle of a probe run
+    unsigned char oid[OID_RAWSZ] = {0};
+    for (int i = 0; i < 1000; i++) {
+        memcpy(oid + 16, &i, sizeof(i));
+        oid[0] = i % 4;
+        assert(oidmap_put(&map, oid, i) == 0);
+    }
+    for (int i = 0; i < 1000; i += 2) {
+        memcpy(oid + 16, &i, sizeof(i));
+        oid[0] = i % 4;
+        oidmap_remove(&map, oid);
+    }
+    assert(map.count == 500);
+    for (int i = 0; i < 1000; i++) {
+        int value;
+        memcpy(oid + 16, &i, sizeof(i));
+        oid[0] = i % 4;
+        int found = oidmap_get(&map, oid, &value);
+        assert(found == (i % 2 == 1));
+        assert(!found || value == i);
+    }
+
+    // As a set, through growing
+    for (int i = 0; i < 1000; i++) {
+        memcpy(oid + 16, &i, sizeof(i));
+        oid[0] = i % 4;
+        assert(oidmap_add(&map, oid) == (i % 2 == 0));
+        assert(oidmap_add(&map, oid) == 0);
+    }
+    assert(map.count == 1000);
+    oid[0] = 9;
+    assert(!oidmap_contains(&map, oid));
+    oid[0] = 999 % 4;
+    assert(oidmap_contains(&map, oid));
+
+    oidmap_free(&map);
+    printf("✓ oid map test passed\n");
+}
+
+static void *produce_numbers(void *arg) {
+    SpscQueue *queue = arg;
+    for (int i = 0; i < 100000; i++) {
+        spsc_push(queue, &i);
+    }
+    spsc_close(queue);
+    return NULL;
+}
+
+void test_spsc_queue() {
+    SpscQueue queue;
+    assert(spsc_init(&queue, 8, sizeof(int)) == 0);
+
+    // A ring much smaller than the stream makes both sides wait
+    pthread_t producer;
+    pthread_create(&producer, NULL, produce_numbers, &queue);
+    int value, expected = 0;
+    while (spsc_pop(&queue, &value)) {
+        assert(value == expected);
+        expected++;
+    }
+    pthread_join(producer, NULL);
+    assert(expected == 100000);
+    assert(spsc_is_empty(&queue));
+    spsc_destroy(&queue);
+
+    // The viewer polls without blocking
+    assert(spsc_init(&queue, 8, sizeof(int)) == 0);
+    assert(spsc_try_pop(&queue, &value) == 0);
+    pthread_create(&producer, NULL, produce_numbers, &queue);
+    int status;
+    expected = 0;
+    while ((status = spsc_try_pop(&queue, &value)) >= 0) {
+        if (status == 1) {
+            assert(value == expected);
+            expected++;
+        }
+    }
+    pthread_join(producer, NULL);
+    assert(expected == 100000);
+    spsc_destroy(&queue);
+    printf("✓ spsc queue test passed\n");
+}
+
+// Items take longer towards the end of the range, so threads steal
+static void count_items(void *ctx, int thread, int start, int end) {
+    int *counts = ctx;
+    assert(thread >= 0 && thread < 4);
+    for (int i = start; i < end; i++) {
+        for (volatile int spin = 0; spin < i / 64; spin++) {
+        }
+        counts[i]++;
+    }
+}
+
+void test_pool() {
+    static int counts[20000];
+    Pool *pool = pool_open(4);
+    assert(pool != NULL && pool_threads(pool) == 4);
+    int sizes[] = { 0, 1, 7, 100, 20000 };
+    for (size_t n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+        memset(counts, 0, sizeof(counts));
+        pool_run(pool, sizes[n], 16, count_items, counts, PROFILE_DECODE);
+        for (int i = 0; i < 20000; i++) {
+            assert(counts[i] == (i < sizes[n]));
+        }
+    }
+    pool_close(pool);
+
+    // Commit text read on four threads comes out in the same order
+    assert(chdir("test_repo") == 0);
+    CommitStore serial, parallel;
+    assert(store_init(&serial) == 0);
+    assert(store_init(&parallel) == 0);
+    pool_default_threads = 1;
+    assert(load_commits_native(".git", &serial) == 0);
+    pool_default_threads = 4;
+    assert(load_commits_native(".git", &parallel) == 0);
+    pool_default_threads = 0;
+    assert(serial.count == parallel.count && serial.count > 10);
+    for (int i = 0; i < serial.count; i++) {
+        Commit a, b;
+        store_get(&serial, i, &a);
+        store_get(&parallel, i, &b);
+        assert(memcmp(a.oid, b.oid, OID_RAWSZ) == 0);
+        assert(!b.is_lazy);
+        assert(strcmp(a.message, b.message) == 0);
+        assert(a.author_time == b.author_time);
+    }
+    store_free(&serial);
+    store_free(&parallel);
+    assert(chdir("..") == 0);
+    printf("✓ pool test passed\n");
+}
+
 void cleanup() {
     system("rm -rf test_repo");
 }
 
+void test_stats() {
+    // Nested directories, a deleted file, a file turned into a directory
+    // and a second author on a side branch
+    system("cd test_repo && mkdir -p docs/guide && echo a > docs/guide/a.md"
+           " && echo b > docs/b.md && git add . && git commit -q -m 'Add docs'"
+           " && echo a2 >> docs/guide/a.md && git rm -q docs/b.md"
+           " && git commit -q -am 'Edit docs'"
+           " && mkdir -p notes && echo n > notes/n.txt"
+           " && git add . && git commit -q -m 'Notes'"
+           " && git rm -q -r notes && echo n > notes && git add notes"
+           " && git commit -q -m 'Notes as a file'"
+           " && git checkout -q -b other && GIT_AUTHOR_NAME='Other Author'"
+           " git commit -q --allow-empty -m 'Other' && git checkout -q -");
+
+    assert(chdir("test_repo") == 0);
+    RepoStats stats;
+    assert(stats_collect(".git", 0, &stats) == 0);
+    assert(stats.threads >= 1);
+
+    // Every section matches the git commands it replaces
+    assert(stats.total_commits == atoi(execute_command("git rev-list --count HEAD")));
+    assert(stats.active_days == atoi(execute_command(
+        "git log --format=%ad --date=short | sort -u | wc -l")));
+    assert(stats.total_files == atoi(execute_command("git ls-files | wc -l")));
+
+    StrBuf actual;
+    sb_init(&actual);
+    for (int i = 0; i < stats.author_count; i++) {
+        sb_appendf(&actual, "%6d\t%s\n", stats.authors[i].count, stats.authors[i].name);
+    }
+    assert(strcmp(actual.data, execute_command("git shortlog -sn --all")) == 0);
+
+    sb_reset(&actual);
+    for (int i = 0; i < stats.path_count; i++) {
+        sb_appendf(&actual, "%7d %s\n", stats.paths[i].count, stats.paths[i].name);
+    }
+    assert(strcmp(actual.data, execute_command(
+        "git log --no-renames --pretty=format: --name-only | grep -v '^$'"
+        " | sort | uniq -c | sort -rg | head -10")) == 0);
+
+    // A directory counts the commits that change anything below it
+    assert(stats.dir_count > 0);
+    for (int i = 0; i < stats.dir_count; i++) {
+        char command[MAX_COMMAND_LENGTH];
+        snprintf(command, sizeof(command), "git log --no-renames --no-merges"
+                 " --format=%%H -- %s | wc -l", stats.dirs[i].name);
+        assert(stats.dirs[i].count == atoi(execute_command(command)));
+        assert(i == 0 || stats.dirs[i].count <= stats.dirs[i - 1].count);
+    }
+
+    // Threads merge their counts into the same result
+    RepoStats threaded;
+    assert(stats_collect(".git", 3, &threaded) == 0);
+    assert(threaded.threads == 3);
+    assert(threaded.total_commits == stats.total_commits);
+    assert(threaded.active_days == stats.active_days);
+    assert(threaded.author_count == stats.author_count);
+    assert(threaded.path_count == stats.path_count);
+    assert(threaded.dir_count == stats.dir_count);
+    for (int i = 0; i < stats.path_count; i++) {
+        assert(strcmp(threaded.paths[i].name, stats.paths[i].name) == 0);
+        assert(threaded.paths[i].count == stats.paths[i].count);
+    }
+    for (int i = 0; i < stats.dir_count; i++) {
+        assert(strcmp(threaded.dirs[i].name, stats.dirs[i].name) == 0);
+        assert(threaded.dirs[i].count == stats.dirs[i].count);
+    }
+    stats_free(&threaded);
+    assert(chdir("..") == 0);
+
+    sb_free(&actual);
+    stats_free(&stats);
+    printf("✓ stats test passed\n");
+}
+
+// Compare file_log() with the git log --follow it replaces
+static void check_file_log(const char *path, FileLogStats *stats) {
+    char command[MAX_COMMAND_LENGTH];
+    snprintf(command, sizeof(command), "git log --follow --pretty=format:'%%h %%s"
+             " (%%an, %%ad)' --date=iso -- %s", path);
+    StrBuf expected, actual;
+    sb_init(&expected);
+    sb_init(&actual);
+    sb_append(&expected, execute_command(command));
+    sb_append(&expected, "\n");
+    assert(file_log(".git", path, &actual, stats) == 0);
+    assert(stats->shown > 0);
+    assert(strcmp(actual.data, expected.data) == 0);
+    sb_free(&expected);
+    sb_free(&actual);
+}
+
+void test_files() {
+    // A file moved into a directory as is, then renamed with an edit
+    system("cd test_repo && mkdir -p src && seq 1 50 > tracked.txt"
+           " && git add tracked.txt && git commit -q -m 'Track'"
+           " && seq 1 51 > tracked.txt && git commit -q -am 'Grow'"
+           " && git mv tracked.txt src/moved.txt && git commit -q -m 'Move'"
+           " && git mv src/moved.txt src/renamed.txt && echo 52 >> src/renamed.txt"
+           " && git add . && git commit -q -m 'Rename'"
+           " && echo 53 >> src/renamed.txt && git commit -q -am 'Edit renamed'");
+
+    assert(chdir("test_repo") == 0);
+    unlink(".git/" BLOOM_FILE);
+
+    // Without changed-path filters in the graph, shrub builds its own
+    FileLogStats stats;
+    check_file_log("src/renamed.txt", &stats);
+    assert(stats.renames == 2);
+    assert(stats.built > 0 && stats.built == stats.filtered);
+    assert(stats.skipped + stats.false_positives + stats.shown == stats.filtered);
+    assert(access(".git/" BLOOM_FILE, F_OK) == 0);
+
+    // and reads them back the next time
+    check_file_log("src", &stats);
+    assert(stats.built == 0 && stats.filtered == stats.commits - 1);
+    check_file_log("test.txt", &stats);
+
+    // Its filters are the ones git writes, bit for bit
+    system("git commit-graph write --reachable --changed-paths --split=replace");
+    BloomIndex *index = bloom_index_open(".git");
+    CommitGraph *graph = commit_graph_open(".git/objects");
+    assert(index != NULL && graph != NULL && commit_graph_has_bloom(graph));
+    for (uint32_t i = 0; i < bloom_index_count(index); i++) {
+        const unsigned char *oid;
+        BloomFilter ours, theirs;
+        uint32_t pos;
+        bloom_index_entry(index, i, &oid, &ours);
+        assert(commit_graph_find(graph, oid, &pos) == 0);
+        assert(commit_graph_bloom(graph, pos, &theirs) == 0);
+        assert(ours.len == theirs.len);
+        assert(memcmp(ours.data, theirs.data, ours.len) == 0);
+    }
+    commit_graph_close(graph);
+    bloom_index_close(index);
+
+    // The graph's filters are used first, and rule out most commits
+    unlink(".git/" BLOOM_FILE);
+    check_file_log("src/renamed.txt", &stats);
+    assert(stats.built == 0 && stats.filtered == stats.commits - 1);
+    assert(stats.skipped > stats.commits / 2);
+    assert(access(".git/" BLOOM_FILE, F_OK) != 0);
+
+    // -files prints what it printed when git log answered it, and nothing
+    // else
+    char expected[8192];
+    snprintf(expected, sizeof(expected), "\nCommit history for file: src/renamed.txt\n"
+             "===============================\n\n%s\n",
+             execute_command("git log --follow --pretty=format:'%C(yellow)%h%Creset"
+                             " %s (%an, %ad)' --date=iso -- src/renamed.txt"));
+    FILE *out = tmpfile();
+    assert(out != NULL);
+    fflush(stdout);
+    int saved_out = dup(STDOUT_FILENO);
+    dup2(fileno(out), STDOUT_FILENO);
+    assert(handle_files(".git", "", "src/renamed.txt") == EXIT_SUCCESS);
+    fflush(stdout);
+    dup2(saved_out, STDOUT_FILENO);
+    close(saved_out);
+    char listing[8192];
+    rewind(out);
+    size_t n = fread(listing, 1, sizeof(listing) - 1, out);
+    listing[n] = '\0';
+    fclose(out);
+    assert(strcmp(listing, expected) == 0);
+
+    // Paths shrub cannot place go to git log as they are, not through the
+    // shell or as options
+    int saved_err = dup(STDERR_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDERR_FILENO);
+    close(null);
+    assert(handle_files(".git", "", "x..$(touch pwned)") == EXIT_FAILURE);
+    assert(handle_files(".git", "", "--output=pwned..") == EXIT_FAILURE);
+    dup2(saved_err, STDERR_FILENO);
+    close(saved_err);
+    assert(access("pwned", F_OK) != 0);
+    assert(chdir("..") == 0);
+    printf("✓ files test passed\n");
+}
+
+void test_files_batch() {
+    // The paths test_files followed one at a time, from one walk; with
+    // the graph's filters from test_files still in place
+    const char *paths[] = { "src/renamed.txt", "src", "test.txt", "missing.txt" };
+    int count = sizeof(paths) / sizeof(paths[0]);
+    assert(chdir("test_repo") == 0);
+    FILE *out = tmpfile();
+    FileLogStats stats;
+    assert(out != NULL);
+    assert(file_log_batch(".git", paths, count, out, &stats) == 0);
+    assert(stats.renames == 2);
+    assert(stats.skipped > 0 && stats.built == 0);
+
+    StrBuf actual[4];
+    int summaries = 0;
+    for (int i = 0; i < count; i++) {
+        sb_init(&actual[i]);
+    }
+    char line[MAX_LINE_LENGTH];
+    rewind(out);
+    while (fgets(line, sizeof(line), out) != NULL) {
+        int i = 0;
+        char key[MAX_COMMAND_LENGTH];
+        for (; i < count; i++) {
+            snprintf(key, sizeof(key), "{\"path\":\"%s\",", paths[i]);
+            if (strncmp(line, key, strlen(key)) == 0) {
+                break;
+            }
+        }
+        assert(i < count);
+        const char *commit = strstr(line, "\"commit\":\"");
+        if (commit != NULL) {
+            sb_append_len(&actual[i], commit + 10, OID_HEXSZ);
+            sb_append(&actual[i], "\n");
+            continue;
+        }
+        // The summaries come last, one per path in order
+        snprintf(key, sizeof(key), "{\"path\":\"%s\",\"commits\":%d}\n", paths[i],
+                 (int)(actual[i].len / (OID_HEXSZ + 1)));
+        assert(i == summaries++ && strcmp(line, key) == 0);
+    }
+    fclose(out);
+    assert(summaries == count);
+
+    // Each history is the one git log --follow gives
+    for (int i = 0; i < count; i++) {
+        char command[MAX_COMMAND_LENGTH];
+        snprintf(command, sizeof(command), "git log --follow --format=%%H -- %s", paths[i]);
+        assert(strcmp(actual[i].len ? actual[i].data : "", execute_command(command)) == 0);
+        assert(i == count - 1 || actual[i].len > 0);
+        sb_free(&actual[i]);
+    }
+    assert(chdir("..") == 0);
+    printf("✓ files batch test passed\n");
+}
+
+void test_refs() {
+    // Packed refs with peel lines, loose refs overriding them, a loose
+    // annotated tag, symbolic refs and files git would ignore
+    system("cd test_repo && git branch -q packed-only && git tag -a v2.0 -m 'Packed tag'"
+           " && git pack-refs --all && git branch -q -f packed-only HEAD~1"
+           " && git tag -a v3.0 -m 'Loose tag' HEAD~1 && git tag light HEAD~2"
+           " && git symbolic-ref refs/remotes/origin/HEAD refs/heads/packed-only"
+           " && echo 'ref: refs/heads/nowhere' > .git/refs/heads/dangling"
+           " && git rev-parse HEAD > .git/refs/heads/locked.lock"
+           " && echo 'not an id' > .git/refs/heads/broken");
+
+    assert(chdir("test_repo") == 0);
+    RefList refs;
+    assert(refs_read(".git", &refs) == 0);
+
+    FILE *fp = popen("git for-each-ref --format='%(objectname) %(*objectname) %(refname)'"
+                     " 2>/dev/null", "r");
+    assert(fp != NULL);
+    char line[MAX_LINE_LENGTH];
+    int count = 0, peeled = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        assert(count < refs.count);
+        const Ref *ref = &refs.refs[count++];
+        unsigned char oid[OID_RAWSZ];
+        assert(hex_to_oid(line, oid) == 0);
+        assert(memcmp(ref->oid, oid, OID_RAWSZ) == 0);
+
+        // "<id>  <name>" unless the ref is an annotated tag
+        const char *name = line + OID_HEXSZ + 1;
+        if (*name == ' ') {
+            name++;
+            if (ref->peeled_known) {
+                assert(memcmp(ref->peeled, ref->oid, OID_RAWSZ) == 0);
+            }
+        } else {
+            assert(hex_to_oid(name, oid) == 0);
+            name += OID_HEXSZ + 1;
+            if (ref->peeled_known) {
+                assert(memcmp(ref->peeled, oid, OID_RAWSZ) == 0);
+                peeled++;
+            }
+        }
+        assert(strcmp(ref->name, name) == 0);
+    }
+    pclose(fp);
+    assert(count == refs.count);
+    assert(peeled >= 2);    // v1.0 and v2.0 were packed with their peel
+
+    // The symbolic ref carries its target's id under its own name
+    int found = 0;
+    for (int i = 0; i < refs.count; i++) {
+        found += strcmp(refs.refs[i].name, "refs/remotes/origin/HEAD") == 0;
+        assert(strcmp(refs.refs[i].name, "refs/heads/dangling") != 0);
+    }
+    assert(found == 1);
+    refs_free(&refs);
+    system("rm -f .git/refs/heads/dangling .git/refs/heads/locked.lock"
+           " .git/refs/heads/broken");
+
+    // Decorations match git log's with the tags peeled from packed-refs
+    CommitStore expected, actual;
+    assert(store_init(&expected) == 0);
+    assert(store_init(&actual) == 0);
+    parse_git_log(&expected);
+    assert(load_commits_native(".git", &actual) == 0);
+    assert(expected.count == actual.count);
+    for (int i = 0; i < expected.count; i++) {
+        Commit a, b;
+        store_get(&expected, i, &a);
+        store_get(&actual, find_commit(&actual, a.oid), &b);
+        assert(strcmp(a.refs, b.refs) == 0);
+    }
+    store_free(&expected);
+    store_free(&actual);
+    assert(chdir("..") == 0);
+    printf("✓ refs test passed\n");
+}
+
+// Walk a range natively and check it lists what `git log <args>` does
+static void check_range(const char *args, const RevisionRange *range) {
+    char command[MAX_COMMAND_LENGTH];
+    snprintf(command, sizeof(command), "git log --format=%%H %s", args);
+    FILE *fp = popen(command, "r");
+    assert(fp != NULL);
+
+    CommitWalk *walk = walk_open_range(".git", WALK_LAZY_TEXT, range);
+    assert(walk != NULL);
+    RawCommit raw;
+    char line[MAX_LINE_LENGTH];
+    while (walk_next(walk, &raw)) {
+        assert(fgets(line, sizeof(line), fp) != NULL);
+        unsigned char oid[OID_RAWSZ];
+        assert(hex_to_oid(line, oid) == 0);
+        assert(memcmp(raw.oid, oid, OID_RAWSZ) == 0);
+        free(raw.data);
+    }
+    assert(fgets(line, sizeof(line), fp) == NULL);
+    walk_close(walk);
+    pclose(fp);
+}
+
+void test_ranges() {
+    // Commits an hour apart, so --since and --until fall between them
+    system("cd test_repo && git checkout -q -b dated v1.0 && for i in 1 2 3 4 5 6; do"
+           " GIT_COMMITTER_DATE=\"$((1800000000 + i * 3600)) +0000\""
+           " git commit -q --allow-empty -m \"Dated $i\"; done && git checkout -q -");
+
+    assert(chdir("test_repo") == 0);
+    const char *ranges[][3] = {
+        { "dated" }, { "feature..dated" }, { "dated..feature" },
+        { "^v1.0", "dated", "feature" }, { "dated~4..dated~1" }, { "dated..." },
+        { "HEAD", "dated" }, { "refs/heads/dated" },
+    };
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i++) {
+            RevisionRange range = { ranges[i], 0, -1, 0, 0, 0 };
+            char args[MAX_COMMAND_LENGTH] = "";
+            while (range.revision_count < 3 && ranges[i][range.revision_count]) {
+                strcat(args, " ");
+                strcat(args, ranges[i][range.revision_count++]);
+            }
+            check_range(args, &range);
+            strcat(args, " -n 2");
+            range.max_count = 2;
+            check_range(args, &range);
+        }
+
+        const char *all[] = { "dated", "HEAD" };
+        RevisionRange range = { all, 2, 0, 0, 0, 0 };
+        check_range("-n 0 dated HEAD", &range);
+        range.max_count = -1;
+        assert(parse_date_arg("@1800007200", &range.since) == 0);
+        check_range("--since=@1800007200 dated HEAD", &range);
+        assert(parse_date_arg("2027-01-15 12:00:00 +0000", &range.until) == 0);
+        assert(range.until == 1800003600 + 3 * 3600);
+        check_range("--since=@1800007200 --until=@1800014400 dated HEAD", &range);
+        range.since = 0;
+        range.max_count = 3;
+        check_range("--until=@1800014400 -n 3 dated HEAD", &range);
+
+        // Again without generation numbers, on commit dates alone
+        system("rm -rf .git/objects/info/commit-graph .git/objects/info/commit-graphs");
+    }
+
+    RevisionRange range = { NULL, 0, -1, 0, 0, 0 };
+    time_t date;
+    assert(parse_date_arg("2 hours ago", &date) == 0);
+    assert(date <= time(NULL) - 7200 && date > time(NULL) - 7300);
+
+    // The log reader quotes what it passes on
+    const char *quoted[] = { "it's" };
+    range.revisions = quoted;
+    range.revision_count = 1;
+    range.max_count = 5;
+    char *command = git_log_command(&range, 0);
+    assert(strstr(command, " 'it'\\''s'") != NULL);
+    assert(strstr(command, "--max-count") == NULL);
+    free(command);
+    command = git_log_command(&range, 1);
+    assert(strstr(command, " --max-count=5") != NULL);
+    assert(strstr(command, "--all") == NULL);
+    free(command);
+
+    system("git commit-graph write --reachable 2>/dev/null");
+    assert(chdir("..") == 0);
+    printf("✓ ranges test passed\n");
+}
+
+// Check every object of the repository can be found, and each prefix
+// resolves as the object list says it should
+static void check_object_lookup(Odb *odb) {
+    FILE *fp = popen("git cat-file --batch-all-objects --batch-check='%(objectname)'", "r");
+    assert(fp != NULL);
+    char (*ids)[OID_HEXSZ + 1] = NULL;
+    int count = 0;
+    char line[MAX_LINE_LENGTH];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        ids = realloc(ids, (count + 1) * sizeof(*ids));
+        assert(ids != NULL);
+        memcpy(ids[count++], line, OID_HEXSZ + 1);
+        ids[count - 1][OID_HEXSZ] = '\0';
+    }
+    pclose(fp);
+    assert(count > 10);
+
+    int ambiguous = 0;
+    for (int i = 0; i < count; i++) {
+        unsigned char oid[OID_RAWSZ], found[OID_RAWSZ];
+        assert(hex_to_oid(ids[i], oid) == 0);
+        assert(odb_has_object(odb, oid));
+        for (size_t len = 4; len <= OID_HEXSZ; len += 3) {
+            int sharing = 0;
+            for (int j = 0; j < count; j++) {
+                sharing += strncmp(ids[i], ids[j], len) == 0;
+            }
+            int status = odb_resolve_prefix(odb, ids[i], len, found);
+            assert(status == (sharing == 1 ? 0 : -2));
+            assert(status != 0 || memcmp(found, oid, OID_RAWSZ) == 0);
+            ambiguous += status == -2;
+        }
+        // Upper case digits, and a last byte no object has
+        char upper[OID_HEXSZ + 1];
+        for (int k = 0; k <= OID_HEXSZ; k++) {
+            upper[k] = toupper((unsigned char)ids[i][k]);
+        }
+        assert(odb_resolve_prefix(odb, upper, OID_HEXSZ, found) == 0);
+        oid[OID_RAWSZ - 1] ^= 0x5a;
+        assert(!odb_has_object(odb, oid));
+    }
+    free(ids);
+
+    unsigned char oid[OID_RAWSZ];
+    assert(odb_resolve_prefix(odb, "abc", 3, oid) == -1);
+    assert(odb_resolve_prefix(odb, "not-hex", 7, oid) == -1);
+}
+
+void test_object_lookup() {
+    // A second pack and a loose object next to the one git gc wrote
+    system("cd test_repo && git checkout -q -b lookup && for i in 1 2 3; do"
+           " echo $i > lookup.txt && git add lookup.txt"
+           " && git commit -q -m \"Lookup $i\"; done && git repack -q"
+           " && echo loose | git hash-object -w --stdin > /dev/null"
+           " && git checkout -q -");
+
+    assert(chdir("test_repo") == 0);
+    Odb *odb = odb_open(".git");
+    assert(odb != NULL);
+    check_object_lookup(odb);
+    odb_close(odb);
+
+    // The multi-pack-index stands in for the packs it lists
+    system("git multi-pack-index write");
+    odb = odb_open(".git");
+    assert(odb != NULL);
+    check_object_lookup(odb);
+    odb_close(odb);
+    CommitStore expected, actual;
+    assert(store_init(&expected) == 0);
+    assert(store_init(&actual) == 0);
+    parse_git_log(&expected);
+    assert(load_commits_native(".git", &actual) == 0);
+    assert(expected.count == actual.count);
+    store_free(&expected);
+    store_free(&actual);
+
+    // Abbreviated revisions resolve without git
+    char *head = execute_command("git rev-parse --short=7 lookup~2");
+    head[strcspn(head, "\n")] = '\0';
+    char args[MAX_COMMAND_LENGTH];
+    snprintf(args, sizeof(args), "%s..lookup", head);
+    const char *revisions[] = { args };
+    RevisionRange range = { revisions, 1, -1, 0, 0, 0 };
+    check_range(args, &range);
+
+    system("rm -f .git/objects/pack/multi-pack-index");
+    assert(chdir("..") == 0);
+    printf("✓ object lookup test passed\n");
+}
+
+// Answers with the directory it was asked from, its arguments, HEAD and
+// how many requests it has run. Each runs in a worker process of its own,
+// so they are counted in a file.
+static int answer_request(const char *prefix, int argc, char **argv) {
+    char *head = strdup(execute_command("git rev-parse HEAD"));
+    system("echo >> .git/daemon-runs");
+    char *runs = execute_command("wc -l < .git/daemon-runs");
+    printf("run %d [%s]", atoi(runs), prefix);
+    for (int i = 1; i < argc; i++) {
+        printf(" %s", argv[i]);
+    }
+    printf(" %s", head);
+    free(head);
+    fprintf(stderr, "note\n");
+    if (strcmp(argv[argc - 1], "sleep") == 0) {
+        sleep(1);
+    }
+    return strcmp(argv[argc - 1], "fail") == 0 ? 3 : 0;
+}
+
+// What the daemon answers to `arg`, from stdout; a file, so not paged
+static int query_daemon(const char *arg, char *answer, size_t size) {
+    int fd = daemon_connect(".git");
+    assert(fd >= 0);
+    char *argv[] = { "-files", (char *)arg };
+    FILE *out = tmpfile();
+    assert(out != NULL);
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO), saved_err = dup(STDERR_FILENO);
+    dup2(fileno(out), STDOUT_FILENO);
+    dup2(fileno(out), STDERR_FILENO);
+    int status = daemon_query(fd, "sub/", 2, argv, 1);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    dup2(saved_err, STDERR_FILENO);
+    close(saved);
+    close(saved_err);
+    rewind(out);
+    size_t n = fread(answer, 1, size - 1, out);
+    answer[n] = '\0';
+    fclose(out);
+    return status;
+}
+
+void test_daemon() {
+    assert(chdir("test_repo") == 0);
+
+    // The repository is found from a subdirectory without git
+    system("mkdir -p sub/dir");
+    assert(chdir("sub/dir") == 0);
+    char *top, *prefix;
+    char *git_dir = discover_git_dir(&top, &prefix);
+    assert(git_dir != NULL);
+    assert(strcmp(prefix, "sub/dir/") == 0);
+    char *expected = execute_command("git rev-parse --show-toplevel");
+    expected[strcspn(expected, "\n")] = '\0';
+    assert(strcmp(top, expected) == 0);
+    free(git_dir);
+    free(top);
+    free(prefix);
+    assert(chdir("../..") == 0);
+    git_dir = discover_git_dir(&top, &prefix);
+    assert(git_dir != NULL && strcmp(git_dir, ".git") == 0 && prefix[0] == '\0');
+    free(git_dir);
+    free(top);
+    free(prefix);
+
+    // At the top of a linked worktree, whose .git is a gitfile naming a
+    // directory with a shorter path than the worktree's own
+    system("git worktree add -q --detach ../worktree-nested/well/below/the/repository/top");
+    assert(chdir("../worktree-nested/well/below/the/repository/top") == 0);
+    git_dir = discover_git_dir(&top, &prefix);
+    expected = execute_command("git rev-parse --git-dir");
+    expected[strcspn(expected, "\n")] = '\0';
+    assert(git_dir != NULL && strcmp(git_dir, expected) == 0 && prefix[0] == '\0');
+    assert(strlen(git_dir) < strlen(top));
+    free(git_dir);
+    free(top);
+    free(prefix);
+    assert(chdir("../../../../../../test_repo") == 0);
+    system("git worktree remove --force ../worktree-nested/well/below/the/repository/top"
+           " && rm -rf ../worktree-nested");
+
+    unlink(".git/daemon-runs");
+    fflush(stdout);
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        // Not left behind by a failed assertion
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        freopen("/dev/null", "w", stderr);
+        _exit(daemon_serve(".git", NULL, answer_request));
+    }
+    int fd = -1;
+    for (int tries = 0; tries < 100 && fd < 0; tries++) {
+        usleep(20000);
+        fd = daemon_connect(".git");
+    }
+    assert(fd >= 0);
+    close(fd);
+
+    // Answers that are not for a terminal never go through less, which
+    // here would say so
+    char *path = strdup(getenv("PATH"));
+    char here[1024];
+    StrBuf fake_path;
+    system("mkdir -p .git/fake-bin && printf '#!/bin/sh\\necho paged\\n' > .git/fake-bin/less"
+           " && chmod +x .git/fake-bin/less");
+    assert(getcwd(here, sizeof(here)) != NULL);
+    sb_init(&fake_path);
+    sb_appendf(&fake_path, "%s/.git/fake-bin:%s", here, path);
+    setenv("PATH", fake_path.data, 1);
+    sb_free(&fake_path);
+
+    // The second request is answered from memory, both from the first run
+    char first[4096], again[4096];
+    char *head = execute_command("git rev-parse HEAD");
+    assert(query_daemon("a.txt", first, sizeof(first)) == 0);
+    const char *expected_run = "note\nrun 1 [sub/] -files a.txt ";
+    assert(strncmp(first, expected_run, strlen(expected_run)) == 0);
+    assert(strstr(first, head) != NULL);
+    assert(strstr(first, "paged") == NULL);
+    assert(query_daemon("a.txt", again, sizeof(again)) == 0);
+    assert(strcmp(first, again) == 0);
+    assert(query_daemon("fail", again, sizeof(again)) == 3);
+    assert(strstr(again, "run 2 ") != NULL);
+
+    // After a commit the kept answer is run again when next asked for,
+    // once, however many ask at the same time. The change reaches the
+    // daemon through inotify, so it is waited for.
+    system("git commit -q --allow-empty -m 'Daemon refresh'");
+    head = strdup(execute_command("git rev-parse HEAD"));
+    double deadline = elapsed_ms(0) + 5000;
+    do {
+        assert(elapsed_ms(0) < deadline);
+        assert(query_daemon("a.txt", again, sizeof(again)) == 0);
+    } while (strstr(again, head) == NULL);
+    assert(strstr(again, "run 3 ") != NULL);
+    char refreshed[4096];
+    assert(query_daemon("a.txt", refreshed, sizeof(refreshed)) == 0);
+    assert(strcmp(again, refreshed) == 0);
+    free(head);
+
+    // A slow command does not hold up the others
+    int slow = daemon_connect(".git");
+    assert(slow >= 0);
+    char *sleep_args[] = { "-files", "sleep" };
+    StrBuf request;
+    sb_init(&request);
+    sb_append_len(&request, "sub/", 5);
+    for (int i = 0; i < 2; i++) {
+        sb_append_len(&request, sleep_args[i], strlen(sleep_args[i]) + 1);
+    }
+    assert(write(slow, request.data, request.len) == (ssize_t)request.len);
+    shutdown(slow, SHUT_WR);
+    sb_free(&request);
+    double start = elapsed_ms(0);
+    assert(query_daemon("fail", again, sizeof(again)) == 3);
+    assert(elapsed_ms(0) - start < 500);
+    char answer[64];
+    assert(read(slow, answer, sizeof(answer)) > 0);
+    close(slow);
+
+    // Stopping removes the socket
+    fd = daemon_connect(".git");
+    assert(fd >= 0);
+    char *stop[] = { "-daemon", "stop" };
+    assert(daemon_query(fd, "", 2, stop, 0) == 0);
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    assert(daemon_connect(".git") < 0);
+    struct stat st;
+    assert(stat(".git/shrub-daemon.sock", &st) != 0);
+
+    setenv("PATH", path, 1);
+    free(path);
+    system("git reset -q --hard HEAD~1 && rm -rf sub .git/daemon-runs .git/fake-bin");
+    assert(chdir("..") == 0);
+    printf("✓ daemon test passed\n");
+}
+
+void test_collapse() {
+    assert(store_init(&commit_store) == 0);
+    layout_reset();
+
+    // 1 -> 2 -> 3 -> 4 and 5 -> 3: the fork at 3 splits the history into
+    // the chains 1 2, 5 and 3 4
+    int ids[5][2] = { {1, 2}, {5, 3}, {2, 3}, {3, 4}, {4, 0} };
+    int index[5];
+    for (int i = 0; i < 5; i++) {
+        index[i] = add_layout_commit(ids[i][0], &ids[i][1], ids[i][1] ? 1 : 0);
+    }
+    assert(store_resolve_parents(&commit_store) == 0);
+    int chain[5];
+    assert(find_chains(&commit_store, chain) == 0);
+    int expected[5] = { 2, 1, 0, 2, 0 };
+    assert(memcmp(chain, expected, sizeof(chain)) == 0);
+
+    Row rows[3];
+    assert(layout_chain(index[0], 2, &rows[0]) == 0);
+    assert(layout_chain(index[1], 1, &rows[1]) == 0);
+    assert(layout_chain(index[3], 2, &rows[2]) == 0);
+    assert(rows[0].chain == 2 && rows[1].chain == 1);
+    assert(*store_lane(&commit_store, index[2]) == 0);
+    assert(*store_lane(&commit_store, index[1]) == 1);
+    assert(*store_lane(&commit_store, index[4]) == 0);
+    assert(rows[1].has_connector);          // 5 joins the chain at 3
+
+    // Collapsed, a chain is one line with its count; expanded, a line per
+    // commit in its lane, the other lane passing by, without laying it
+    // out again
+    StrBuf text;
+    sb_init(&text);
+    render_row(&rows[0], NULL, &text);
+    assert(strstr(text.data, CHAIN_SYMBOL) != NULL);
+    assert(strstr(text.data, "(2 commits)") != NULL);
+    assert(strchr(text.data, '\n') == text.data + text.len - 1);
+    sb_reset(&text);
+    rows[2].expanded = 1;
+    render_row(&rows[2], NULL, &text);
+    assert(strstr(text.data, "0300000000") != NULL);
+    assert(strstr(text.data, "0400000000") != NULL);
+    assert(strstr(text.data, CHAIN_SYMBOL) == NULL);
+    assert(strstr(text.data, "commits)") == NULL);
+    sb_reset(&text);
+    rows[0].expanded = 1;
+    render_row(&rows[0], NULL, &text);
+    const char *second = strchr(text.data, '\n') + 1;
+    assert(strstr(second, "0200000000") != NULL);
+    sb_free(&text);
+    for (int i = 0; i < 3; i++) {
+        row_free(&rows[i]);
+    }
+    layout_reset();
+    store_free(&commit_store);
+
+    // --first-parent walks the way git log does
+    assert(chdir("test_repo") == 0);
+    RevisionRange range = { NULL, 0, -1, 0, 0, 1 };
+    check_range("--all --first-parent", &range);
+    const char *head[] = { "HEAD" };
+    range.revisions = head;
+    range.revision_count = 1;
+    check_range("--first-parent HEAD", &range);
+    char *command = git_log_command(&range, 1);
+    assert(strstr(command, " --first-parent") != NULL);
+    free(command);
+    assert(chdir("..") == 0);
+    printf("✓ collapse test passed\n");
+}
+
+// The commit ids of the rows run_tree_pipeline() shows, one per line
+static char *pipeline_order(ReaderMode reader, SortOrder order,
+                            const RevisionRange *range) {
+    TreeOptions options = { reader, order, 0, 0, 0, 0, NULL, EXPORT_NDJSON, *range };
+    PipelineStats stats;
+    FILE *out = tmpfile();
+    assert(out != NULL && store_init(&commit_store) == 0);
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    dup2(fileno(out), STDOUT_FILENO);
+    assert(run_tree_pipeline(&options, ".git", elapsed_ms(0), &stats) == 0);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    store_free(&commit_store);
+
+    StrBuf ids;
+    sb_init(&ids);
+    char line[4096];
+    rewind(out);
+    while (fgets(line, sizeof(line), out)) {
+        char *id = strstr(line, "\"commit\":\"");
+        assert(id != NULL);
+        sb_append_len(&ids, id + 10, OID_HEXSZ);
+        sb_append(&ids, "\n");
+    }
+    fclose(out);
+    return ids.data;
+}
+
+void test_first_parent_order() {
+    // Two merges of the same two commits, the other way round, and older
+    // than them both: the one whose second parent is `side` has to go
+    // above it, which only its full parent list says
+    system("cd test_repo"
+           " && side=$(GIT_COMMITTER_DATE='2001-01-03T00:00:00' git commit-tree"
+           " HEAD^{tree} -p HEAD -m side)"
+           " && git branch fp-old $(GIT_COMMITTER_DATE='2001-01-01T00:00:00'"
+           " git commit-tree HEAD^{tree} -p HEAD -p $side -m old)"
+           " && git branch fp-new $(GIT_COMMITTER_DATE='2001-01-04T00:00:00'"
+           " git commit-tree HEAD^{tree} -p $side -p HEAD -m new)");
+
+    assert(chdir("test_repo") == 0);
+    const char *tips[] = { "fp-old", "fp-new" };
+    RevisionRange range = { tips, 2, -1, 0, 0, 1 };
+    const char *flags[] = { "--date-order", "--topo-order" };
+    SortOrder orders[] = { ORDER_DATE, ORDER_TOPO };
+    for (int m = 0; m < 2; m++) {
+        // Same order as git with every parent counted, which it does
+        // without a commit-graph; both readers alike
+        char command[MAX_COMMAND_LENGTH];
+        snprintf(command, sizeof(command), "git -c core.commitGraph=false log"
+                 " --first-parent %s --format=%%H fp-old fp-new", flags[m]);
+        char *expected = strdup(execute_command(command));
+        char *old = strdup(execute_command("git rev-parse fp-old"));
+        char *side = strdup(execute_command("git rev-parse fp-new^"));
+        assert(strstr(expected, old) < strstr(expected, side));
+        ReaderMode readers[] = { READER_NATIVE, READER_LOG };
+        for (int r = 0; r < 2; r++) {
+            char *ids = pipeline_order(readers[r], orders[m], &range);
+            assert(strcmp(ids, expected) == 0);
+            free(ids);
+        }
+        free(expected);
+        free(old);
+        free(side);
+    }
+    system("git branch -q -D fp-old fp-new");
+    assert(chdir("..") == 0);
+    printf("✓ first parent order test passed\n");
+}
+
+void test_reach() {
+    assert(store_init(&commit_store) == 0);
+
+    // main 6 merges topic 5 and 1; feature 7 forks at 2; old is the root
+    int ids[7][3] = { {7, 2, 0}, {6, 1, 5}, {1, 2, 0}, {5, 3, 0}, {2, 3, 0},
+                      {3, 4, 0}, {4, 0, 0} };
+    int index[8];
+    for (int i = 0; i < 7; i++) {
+        int parent_count = ids[i][1] == 0 ? 0 : ids[i][2] == 0 ? 1 : 2;
+        index[ids[i][0]] = add_layout_commit(ids[i][0], &ids[i][1], parent_count);
+    }
+    assert(store_resolve_parents(&commit_store) == 0);
+
+    enum { MAIN, TOPIC, FEATURE, OLD, TIPS };
+    int tips[TIPS] = { index[6], index[5], index[7], index[4] };
+    int counts[TIPS * TIPS];
+    ReachStats stats;
+    assert(reach_counts(&commit_store, tips, TIPS, counts, &stats) == 0);
+    assert(counts[FEATURE * TIPS + MAIN] == 1);     // 7
+    assert(counts[MAIN * TIPS + FEATURE] == 3);     // 6, 1 and 5
+    assert(counts[TOPIC * TIPS + MAIN] == 0);       // merged
+    assert(counts[MAIN * TIPS + TOPIC] == 3);       // 6, 1 and 2
+    assert(counts[TOPIC * TIPS + FEATURE] == 1);
+    assert(counts[MAIN * TIPS + OLD] == 5);
+    for (int t = 0; t < TIPS; t++) {
+        assert(counts[OLD * TIPS + t] == 0 && counts[t * TIPS + t] == 0);
+    }
+    // Every tip reaches the root; the walk stops before it
+    assert(stats.commits == 7 && stats.visited == 6);
+    store_free(&commit_store);
+
+    // Every branch against HEAD, as git rev-list counts them
+    assert(chdir("test_repo") == 0);
+    CommitStore store;
+    RefList refs;
+    assert(store_init(&store) == 0);
+    assert(load_commits_native(".git", &store) == 0);
+    assert(refs_read(".git", &refs) == 0);
+    int branch_tips[16], branches = 0;
+    const char *names[16];
+    for (int i = 0; i < refs.count && branches < 15; i++) {
+        if (strncmp(refs.refs[i].name, "refs/heads/", 11) == 0) {
+            names[branches] = refs.refs[i].name + 11;
+            branch_tips[branches++] = store_find(&store, refs.refs[i].oid);
+        }
+    }
+    assert(branches >= 2);
+    unsigned char head[OID_RAWSZ];
+    assert(hex_to_oid(execute_command("git rev-parse HEAD"), head) == 0);
+    branch_tips[branches] = store_find(&store, head);
+    int *all = malloc((branches + 1) * (branches + 1) * sizeof(int));
+    assert(reach_counts(&store, branch_tips, branches + 1, all, &stats) == 0);
+    for (int i = 0; i < branches; i++) {
+        char command[MAX_COMMAND_LENGTH];
+        snprintf(command, sizeof(command),
+                 "git rev-list --left-right --count HEAD...%s", names[i]);
+        int behind, ahead;
+        assert(sscanf(execute_command(command), "%d %d", &behind, &ahead) == 2);
+        assert(all[i * (branches + 1) + branches] == ahead);
+        assert(all[branches * (branches + 1) + i] == behind);
+    }
+    free(all);
+    refs_free(&refs);
+    store_free(&store);
+    assert(chdir("..") == 0);
+    printf("✓ reach test passed\n");
+}
+
+// What diff_show_commit writes for `rev`, or NULL if it left it to git
+static char *show_native(const char *rev, int color, DiffStats *stats) {
+    char command[MAX_COMMAND_LENGTH];
+    snprintf(command, sizeof(command), "git rev-parse %s", rev);
+    char *hex = execute_command(command);
+    unsigned char oid[20];
+    assert(hex_to_oid(hex, oid) == 0);
+    FILE *out = tmpfile();
+    assert(out != NULL);
+    int status = diff_show_commit(".git", oid, color, out, stats);
+    if (status != 0) {
+        fclose(out);
+        return NULL;
+    }
+    long size = ftell(out);
+    char *text = malloc(size + 1);
+    rewind(out);
+    assert(fread(text, 1, size, out) == (size_t)size);
+    text[size] = '\0';
+    fclose(out);
+    return text;
+}
+
+static void check_show(const char *rev, int color) {
+    char command[MAX_COMMAND_LENGTH];
+    snprintf(command, sizeof(command), "git show --color=%s %s",
+             color ? "always" : "never", rev);
+    // execute_command reuses its buffer, so keep git's answer apart
+    char *expected = strdup(execute_command(command));
+    char *actual = show_native(rev, color, NULL);
+    assert(actual != NULL);
+    assert(strcmp(expected, actual) == 0);
+    free(expected);
+    free(actual);
+}
+
+void test_diff() {
+    // Two buffers, one line changed in the middle
+    StrBuf hunks;
+    sb_init(&hunks);
+    const char *old_text = "a\nb\nc\nd\ne\nf\ng\nh\n";
+    const char *new_text = "a\nb\nc\nd\nE\nf\ng\nh\n";
+    assert(diff_buffers((const unsigned char *)old_text, strlen(old_text),
+                        (const unsigned char *)new_text, strlen(new_text), 0,
+                        &hunks) == 0);
+    assert(strcmp(hunks.data,
+                  "@@ -2,7 +2,7 @@ a\n b\n c\n d\n-e\n+E\n f\n g\n h\n") == 0);
+    sb_free(&hunks);
+
+    // An edit, a rename with an edit, an addition, a deletion, a mode
+    // change and a file without a final newline, shown as git shows them
+    system("cd test_repo && git checkout -q -b diffs"
+           " && seq 1 40 > numbers.txt && printf 'no newline' > tail.txt"
+           " && echo gone > gone.txt && echo run > run.sh"
+           " && git add . && git commit -q -m 'Diff base'"
+           " && seq 1 41 | sed 's/^20$/twenty/' > numbers2.txt"
+           " && git rm -q numbers.txt gone.txt && printf 'no newline here' > tail.txt"
+           " && echo new > 'new file.txt' && chmod +x run.sh"
+           " && git add . && git commit -q -m 'Diff changes' -m 'Body line'");
+    assert(chdir("test_repo") == 0);
+    char *branch = execute_command("git rev-parse --abbrev-ref @{-1}");
+    branch[strcspn(branch, "\n")] = '\0';
+    check_show("HEAD", 0);
+    check_show("HEAD", 1);
+    check_show("HEAD~1", 1);
+
+    DiffStats stats = { 0 };
+    char *text = show_native("HEAD", 0, &stats);
+    assert(text != NULL);
+    assert(strstr(text, "rename from numbers.txt\n") != NULL);
+    assert(stats.files == 5 && stats.renames == 1);
+    free(text);
+
+    // Merges are left to git
+    system("git checkout -q -b diff-side HEAD~1 && echo side > side.txt"
+           " && git add side.txt && git commit -q -m Side"
+           " && git checkout -q diffs && git merge -q --no-edit diff-side");
+    assert(show_native("HEAD", 1, NULL) == NULL);
+    char checkout[MAX_COMMAND_LENGTH];
+    snprintf(checkout, sizeof(checkout), "git checkout -q %s", branch);
+    system(checkout);
+    assert(chdir("..") == 0);
+    printf("✓ diff test passed\n");
+}
+
+void test_profile() {
+    // Disabled, a phase leaves nothing behind
+    ProfileMark mark;
+    profile_begin(&mark);
+    profile_end(&mark, PROFILE_FILES);
+
+    profile_enabled = 1;
+    profile_begin(&mark);
+    void *volatile block = malloc(1000);
+    profile_add_bytes(42);
+    free(block);
+    profile_end(&mark, PROFILE_PARSE);
+    profile_enabled = 0;
+
+    char report[4096];
+    FILE *fp = tmpfile();
+    assert(fp != NULL);
+    profile_report(fp);
+    rewind(fp);
+    size_t len = fread(report, 1, sizeof(report) - 1, fp);
+    report[len] = '\0';
+    fclose(fp);
+
+    assert(strstr(report, "\"phase\":\"files\"") == NULL);
+    const char *parse = strstr(report, "\"phase\":\"parse\",\"calls\":1,");
+    assert(parse != NULL);
+    assert(strstr(parse, "\"bytes_read\":42") != NULL);
+    if (strstr(report, "\"allocation_counts\":true")) {
+        assert(strstr(parse, "\"allocations\":1,\"frees\":1,") != NULL);
+    }
+    printf("✓ profile test passed\n");
+}
+
 int main() {
     printf("Running tests...\n");
     
     test_execute_command();
     test_git_repo_setup();
     test_parse_git_log();
+    test_native_reader();
+    test_commit_text();
+    test_sort_commits();
+    test_commit_graph();
+    test_history_cache();
+    test_stats();
+    test_files();
+    test_files_batch();
+    test_refs();
+    test_ranges();
+    test_object_lookup();
+    test_daemon();
+    test_collapse();
+    test_first_parent_order();
+    test_reach();
+    test_diff();
+    test_commit_store();
+    test_layout();
+    test_export();
+    test_viewer();
+    test_oidmap();
+    test_spsc_queue();
+    test_pool();
+    test_profile();
     
     cleanup();
     printf("All tests passed!\n");